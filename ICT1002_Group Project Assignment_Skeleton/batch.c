@@ -0,0 +1,385 @@
+/*
+ * ICT1002 (C Language) Group Project.
+ *
+ * This file implements batch mode: answering a file of questions, one per
+ * line, with one answer per line of output. The work is split into a
+ * three-stage pipeline:
+ *
+ *   - the reader (the calling thread) reads lines, splits them into words
+ *     and groups them into jobs of up to BATCH_JOB_LINES lines;
+ *   - a pool of workers answers every line of a job with chatbot_main();
+ *   - the writer emits the answers of each job in input order.
+ *
+ * Workers only read the knowledge base. Lines that change it (load, save and
+ * reset) are barriers: the reader waits until every earlier job has been
+ * answered and runs the line itself before reading on, so that every question
+ * is answered against the knowledge base as it stands at that point in the
+ * input.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "chat1002.h"
+
+/* the number of lines in a job */
+#define BATCH_JOB_LINES 256
+
+/* the number of jobs that may be between the reader and the writer at once */
+#define BATCH_INFLIGHT  128
+
+/* size of the output buffer */
+#define BATCH_BUFFER    (1 << 20)
+
+/*
+ * A run of input lines and, once a worker has been through it, their answers.
+ * The words of every line are stored null-terminated, back to back, in 'text';
+ * 'words' holds the offset of each word, so 'text' can grow while the job is
+ * being filled.
+ */
+typedef struct batch_job {
+	unsigned long seq;           /* position of the job in the input */
+	int nlines;
+	int line_inc[BATCH_JOB_LINES];   /* the number of words on each line */
+	char *text;
+	size_t text_len, text_size;
+	size_t *words;
+	int nwords, words_size;
+	char *out;                   /* the answers, one per line */
+	size_t out_len, out_size;
+	int answered;                /* 1 once 'out' holds every answer */
+	struct batch_job *next;      /* next job in the work queue or free list */
+} BATCH_JOB;
+
+/* state shared by the stages; everything below 'lock' is protected by it */
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t work;         /* a job was queued for the workers, or the input ended */
+	pthread_cond_t answered;     /* a job was answered */
+	pthread_cond_t written;      /* the writer emitted a job */
+	BATCH_JOB *queue_head;       /* jobs waiting for a worker */
+	BATCH_JOB *queue_tail;
+	BATCH_JOB *free_jobs;        /* jobs the writer has finished with */
+	BATCH_JOB *slots[BATCH_INFLIGHT];    /* submitted jobs not yet written, by seq % BATCH_INFLIGHT */
+	unsigned long next_seq;      /* the seq of the next job the reader submits */
+	unsigned long next_write;    /* the seq of the next job the writer emits */
+	unsigned long pending;       /* jobs submitted but not yet answered */
+	int done;                    /* the reader has submitted its last job */
+	FILE *out;
+} batch;
+
+
+/*
+ * Make room in a buffer that grows by doubling.
+ *
+ * Returns: 1 if the buffer has room for 'want' bytes, 0 on allocation failure
+ */
+static int batch_grow(char **buf, size_t *size, size_t want)
+{
+	if (want <= *size)
+		return 1;
+	size_t grown_size = *size == 0 ? 4096 : *size;
+	while (grown_size < want)
+		grown_size *= 2;
+	char *grown = (char *)realloc(*buf, grown_size);
+	if (grown == NULL)
+		return 0;
+	*buf = grown;
+	*size = grown_size;
+	return 1;
+}
+
+/*
+ * Get an empty job, reusing one the writer has finished with if possible.
+ *
+ * Returns: the job, or NULL on allocation failure
+ */
+static BATCH_JOB *batch_new_job()
+{
+	pthread_mutex_lock(&batch.lock);
+	BATCH_JOB *job = batch.free_jobs;
+	if (job != NULL)
+		batch.free_jobs = job->next;
+	pthread_mutex_unlock(&batch.lock);
+
+	if (job == NULL) {
+		job = (BATCH_JOB *)calloc(1, sizeof(BATCH_JOB));
+		if (job == NULL)
+			return NULL;
+	}
+	job->nlines = 0;
+	job->text_len = 0;
+	job->nwords = 0;
+	job->out_len = 0;
+	job->answered = 0;
+	job->next = NULL;
+	return job;
+}
+
+/*
+ * Add a line of words to a job.
+ *
+ * Returns: 1 if successful, 0 on allocation failure
+ */
+static int batch_add_line(BATCH_JOB *job, int inc, char *inv[])
+{
+	if (job->nwords + inc > job->words_size) {
+		int size = job->words_size == 0 ? 1024 : job->words_size;
+		while (size < job->nwords + inc)
+			size *= 2;
+		size_t *grown = (size_t *)realloc(job->words, size * sizeof(size_t));
+		if (grown == NULL)
+			return 0;
+		job->words = grown;
+		job->words_size = size;
+	}
+	for (int i = 0; i < inc; i++) {
+		size_t len = strlen(inv[i]) + 1;
+		if (!batch_grow(&job->text, &job->text_size, job->text_len + len))
+			return 0;
+		memcpy(job->text + job->text_len, inv[i], len);
+		job->words[job->nwords++] = job->text_len;
+		job->text_len += len;
+	}
+	job->line_inc[job->nlines++] = inc;
+	return 1;
+}
+
+/*
+ * Append an answer (and a newline) to a job's output.
+ *
+ * Returns: 1 if successful, 0 on allocation failure
+ */
+static int batch_add_answer(BATCH_JOB *job, const char *answer)
+{
+	size_t len = strlen(answer);
+	if (!batch_grow(&job->out, &job->out_size, job->out_len + len + 1))
+		return 0;
+	memcpy(job->out + job->out_len, answer, len);
+	job->out[job->out_len + len] = '\n';
+	job->out_len += len + 1;
+	return 1;
+}
+
+/*
+ * Hand a job to the pipeline, waiting for the writer if too many jobs are
+ * already in flight. A job that is already answered goes straight to the
+ * writer; any other job is queued for the workers.
+ */
+static void batch_submit(BATCH_JOB *job)
+{
+	pthread_mutex_lock(&batch.lock);
+	while (batch.next_seq - batch.next_write >= BATCH_INFLIGHT)
+		pthread_cond_wait(&batch.written, &batch.lock);
+	job->seq = batch.next_seq++;
+	batch.slots[job->seq % BATCH_INFLIGHT] = job;
+	if (job->answered) {
+		pthread_cond_broadcast(&batch.answered);
+	} else {
+		if (batch.queue_tail == NULL)
+			batch.queue_head = job;
+		else
+			batch.queue_tail->next = job;
+		batch.queue_tail = job;
+		batch.pending++;
+		pthread_cond_signal(&batch.work);
+	}
+	pthread_mutex_unlock(&batch.lock);
+}
+
+/*
+ * Worker stage: answer every line of each queued job.
+ */
+static void *batch_worker(void *arg)
+{
+	char *inv[MAX_INPUT];
+	char output[MAX_RESPONSE];
+	(void)arg;
+
+	for (;;) {
+		pthread_mutex_lock(&batch.lock);
+		while (batch.queue_head == NULL && !batch.done)
+			pthread_cond_wait(&batch.work, &batch.lock);
+		BATCH_JOB *job = batch.queue_head;
+		if (job == NULL) {
+			pthread_mutex_unlock(&batch.lock);
+			return NULL;
+		}
+		batch.queue_head = job->next;
+		if (batch.queue_head == NULL)
+			batch.queue_tail = NULL;
+		pthread_mutex_unlock(&batch.lock);
+
+		int word = 0;
+		for (int line = 0; line < job->nlines; line++) {
+			int inc = job->line_inc[line];
+			for (int i = 0; i < inc; i++)
+				inv[i] = job->text + job->words[word++];
+			inv[inc] = NULL;
+			output[0] = '\0';
+			chatbot_main(inc, inv, output, MAX_RESPONSE);
+			if (!batch_add_answer(job, output))
+				break;
+		}
+
+		pthread_mutex_lock(&batch.lock);
+		job->answered = 1;
+		batch.pending--;
+		pthread_cond_broadcast(&batch.answered);
+		pthread_mutex_unlock(&batch.lock);
+	}
+}
+
+/*
+ * Writer stage: write the answers of each job in input order.
+ */
+static void *batch_writer(void *arg)
+{
+	(void)arg;
+
+	for (;;) {
+		pthread_mutex_lock(&batch.lock);
+		BATCH_JOB *job;
+		while (((job = batch.slots[batch.next_write % BATCH_INFLIGHT]) == NULL || !job->answered)
+				&& !(batch.done && batch.next_write == batch.next_seq))
+			pthread_cond_wait(&batch.answered, &batch.lock);
+		if (job == NULL || !job->answered) {
+			pthread_mutex_unlock(&batch.lock);
+			return NULL;
+		}
+		batch.slots[batch.next_write % BATCH_INFLIGHT] = NULL;
+		batch.next_write++;
+		pthread_cond_signal(&batch.written);
+		pthread_mutex_unlock(&batch.lock);
+
+		fwrite(job->out, 1, job->out_len, batch.out);
+
+		pthread_mutex_lock(&batch.lock);
+		job->next = batch.free_jobs;
+		batch.free_jobs = job;
+		pthread_mutex_unlock(&batch.lock);
+	}
+}
+
+/*
+ * Determine whether a line changes the knowledge base, and so must not run
+ * while workers are reading it.
+ */
+static int batch_is_barrier(int inc, char *inv[])
+{
+	return inc > 0 && (chatbot_is_load(inv[0]) || chatbot_is_save(inv[0]) || chatbot_is_reset(inv[0]));
+}
+
+/*
+ * Answer the questions in a file, one per line, writing one answer per line.
+ * Every line gets exactly one answer (an empty line for an empty question), so
+ * the output lines up with the input. The caller should set a fallback answer
+ * with chatbot_set_fallback(), or unknown questions will prompt the user.
+ *
+ * Input:
+ *   in      - the questions
+ *   out     - the stream to write the answers to
+ *   workers - the number of worker threads
+ *
+ * Returns: 0 if successful, 1 if a thread or buffer could not be allocated
+ */
+int batch_run(FILE *in, FILE *out, int workers)
+{
+	pthread_t *threads = (pthread_t *)malloc((workers + 1) * sizeof(pthread_t));
+	char *input = NULL;          /* the current line, grown by getline() as needed */
+	size_t size = 0;
+	char *inv[MAX_INPUT];        /* pointers to the beginning of each word of input */
+	char output[MAX_RESPONSE];
+	int failed = 0;
+	int started = 0;
+
+	memset(&batch, 0, sizeof(batch));
+	pthread_mutex_init(&batch.lock, NULL);
+	pthread_cond_init(&batch.work, NULL);
+	pthread_cond_init(&batch.answered, NULL);
+	pthread_cond_init(&batch.written, NULL);
+	batch.out = out;
+	setvbuf(out, NULL, _IOFBF, BATCH_BUFFER);
+
+	if (threads == NULL || pthread_create(&threads[0], NULL, batch_writer, NULL) != 0) {
+		free(threads);
+		return 1;
+	}
+	for (started = 1; started <= workers; started++) {
+		if (pthread_create(&threads[started], NULL, batch_worker, NULL) != 0)
+			break;
+	}
+	if (started == 1)
+		failed = 1;
+
+	BATCH_JOB *job = failed ? NULL : batch_new_job();
+	while (job != NULL && getline(&input, &size, in) != -1) {
+		int inc = split_words(input, inv, MAX_INPUT);
+
+		if (batch_is_barrier(inc, inv)) {
+			/* let every earlier line be answered, then run this one on its own */
+			if (job->nlines > 0) {
+				batch_submit(job);
+				job = batch_new_job();
+				if (job == NULL)
+					break;
+			}
+			pthread_mutex_lock(&batch.lock);
+			while (batch.pending > 0)
+				pthread_cond_wait(&batch.answered, &batch.lock);
+			pthread_mutex_unlock(&batch.lock);
+
+			output[0] = '\0';
+			chatbot_main(inc, inv, output, MAX_RESPONSE);
+			if (!batch_add_answer(job, output))
+				break;
+			job->answered = 1;
+			batch_submit(job);
+			job = batch_new_job();
+			continue;
+		}
+
+		if (!batch_add_line(job, inc, inv))
+			break;
+		if (job->nlines == BATCH_JOB_LINES) {
+			batch_submit(job);
+			job = batch_new_job();
+		}
+	}
+	if (job == NULL || !feof(in))
+		failed = 1;
+	if (job != NULL && job->nlines > 0) {
+		batch_submit(job);
+	} else if (job != NULL) {
+		/* a reused job still has its buffers; let the loop below free them */
+		pthread_mutex_lock(&batch.lock);
+		job->next = batch.free_jobs;
+		batch.free_jobs = job;
+		pthread_mutex_unlock(&batch.lock);
+	}
+
+	/* let the workers and the writer drain the pipeline */
+	pthread_mutex_lock(&batch.lock);
+	batch.done = 1;
+	pthread_cond_broadcast(&batch.work);
+	pthread_cond_broadcast(&batch.answered);
+	pthread_mutex_unlock(&batch.lock);
+	for (int t = 0; t < started; t++)
+		pthread_join(threads[t], NULL);
+	fflush(out);
+
+	while (batch.free_jobs != NULL) {
+		BATCH_JOB *next = batch.free_jobs->next;
+		free(batch.free_jobs->text);
+		free(batch.free_jobs->words);
+		free(batch.free_jobs->out);
+		free(batch.free_jobs);
+		batch.free_jobs = next;
+	}
+	free(input);
+	free(threads);
+	return failed;
+}
@@ -0,0 +1,1198 @@
+/*
+ * ICT1002 (C Language) Group Project.
+ *
+ * This file implements the benchmarks and the generator of synthetic
+ * knowledge files used to measure the chatbot.
+ *
+ * "main --bench [name]... [option]..." runs benchmarks (all of them by
+ * default) and prints one line per result, tab-separated, after a header line
+ * starting with '#':
+ *
+ *   benchmark variant entries ops ops_per_sec p50_ns p99_ns peak_rss_kb
+ *
+ * "entries" is the size of the knowledge base the operation ran against (0 for
+ * the microbenchmarks), and peak_rss_kb is the peak resident set size of the
+ * process so far. The percentiles are of operations timed one by one, and are
+ * "-" for operations too short to time singly or that ran only once.
+ *
+ * The microbenchmarks time one function over a fixed set of inputs. Where the
+ * function has been rewritten, the old version is kept here as the "reference"
+ * variant so that the two can be compared on the same machine. The "kb"
+ * benchmark generates a knowledge file of each size given by --sizes and times
+ * the knowledge base and the chatbot against it.
+ *
+ * "main --generate entries [option]..." writes a synthetic knowledge file to
+ * standard output. The options, which --bench also accepts, are:
+ *
+ *   --sizes n,n,...       knowledge base sizes for "kb" (default 1000,10000,100000,1000000)
+ *   --mix who:w,what:w,.. the relative number of entries for each intent (default equal)
+ *   --entity-len min-max  entity lengths, uniformly distributed (default 8-40)
+ *   --duplicates ratio    the fraction of entries that repeat an earlier entity
+ *                         of the same intent with a new response (default 0)
+ *   --seed n              the seed of the generator (default 1002)
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <ctype.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include "chat1002.h"
+
+/* the number of inputs each microbenchmark cycles through */
+#define BENCH_INPUTS 4096
+
+/* the number of operations each microbenchmark variant is timed over */
+#define BENCH_OPS 4000000L
+
+/* the number of operations timed one by one against each knowledge base size */
+#define BENCH_SAMPLES 100000
+
+/* the number of distinct questions in each intent that "get_hot" asks, over and over */
+#define BENCH_HOT_QUESTIONS 64
+
+/* the number of questions whose answers a disk store must still give after it is reopened */
+#define BENCH_CHECKS 1000
+
+/* the number of entries a disk store needs to outgrow a single leaf */
+#define BENCH_SPLIT 1000
+
+/* the number of entities each completion asks for */
+#define BENCH_COMPLETIONS 10
+
+/* the number of puts timed with a journal, which each wait for a sync */
+#define BENCH_JOURNAL_PUTS 2000
+
+/* the number of threads putting at once into a journal, whose syncs they share */
+#define BENCH_WRITERS 8
+
+/* the most knowledge base sizes --sizes may give */
+#define BENCH_MAX_SIZES 16
+
+/* the shape of a synthetic knowledge file */
+typedef struct bench_kb {
+	unsigned long entries;       /* the number of entity/response lines */
+	double mix[KB_INTENTS];      /* the relative number of lines for each intent */
+	int min_entity;              /* entity lengths, uniformly distributed */
+	int max_entity;
+	double duplicates;           /* the fraction of lines that repeat an entity of the same intent */
+	uint64_t seed;
+	unsigned long unique[KB_INTENTS];   /* set by bench_generate(): the distinct entities of each intent */
+} BENCH_KB;
+
+/* the command-line options of --bench and --generate */
+typedef struct bench_options {
+	unsigned long sizes[BENCH_MAX_SIZES];
+	int nsizes;
+	BENCH_KB kb;
+} BENCH_OPTIONS;
+
+/* keeps the compiler from optimising the benchmarked calls away */
+static volatile unsigned long bench_sink;
+
+/*
+ * Get the time in nanoseconds.
+ */
+static double bench_now()
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec * 1e9 + t.tv_nsec;
+}
+
+/*
+ * Order doubles, for qsort().
+ */
+static int bench_order(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+	return x < y ? -1 : x > y;
+}
+
+/*
+ * Print the result of timing one variant.
+ *
+ * Input:
+ *   name, variant - what was timed
+ *   entries       - the size of the knowledge base it ran against
+ *   ops           - the number of operations
+ *   ns            - the time they took altogether
+ *   samples       - the time each operation took, or NULL if they were not
+ *                   timed singly; sorted in place
+ */
+static void bench_report(const char *name, const char *variant, unsigned long entries, long ops, double ns, double *samples)
+{
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	printf("%s\t%s\t%lu\t%ld\t%.0f\t", name, variant, entries, ops, ns > 0 ? ops * 1e9 / ns : 0);
+	if (samples != NULL && ops > 1) {
+		qsort(samples, ops, sizeof(double), bench_order);
+		printf("%.0f\t%.0f\t", samples[ops / 2], samples[ops * 99 / 100]);
+	} else {
+		printf("-\t-\t");
+	}
+	printf("%ld\n", usage.ru_maxrss);
+	fflush(stdout);
+}
+
+/*
+ * Get the next number from a splitmix64 generator, which gives the same
+ * sequence on every platform.
+ */
+static uint64_t bench_random(uint64_t *state)
+{
+	uint64_t z = (*state += 0x9E3779B97F4A7C15ULL);
+	z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+	return z ^ (z >> 31);
+}
+
+/*
+ * Write the entity with a given serial number in an intent. The entity
+ * starts with the serial number in base 36, followed by a space unless that is
+ * the whole entity, so different serial numbers never give the same entity;
+ * its length and the words that fill it out depend only on the serial number
+ * and intent, so the benchmarks can ask for it again without storing it.
+ *
+ * Returns: the length of the entity
+ */
+static int bench_entity(char *buf, const BENCH_KB *kb, int intent, unsigned long serial)
+{
+	uint64_t state = kb->seed ^ (serial * KB_INTENTS + intent) * 0xD1B54A32D192ED03ULL;
+	int len = kb->min_entity + (int)(bench_random(&state) % (uint64_t)(kb->max_entity - kb->min_entity + 1));
+
+	char digits[16];
+	int ndigits = 0;
+	do {
+		digits[ndigits++] = "0123456789abcdefghijklmnopqrstuvwxyz"[serial % 36];
+		serial /= 36;
+	} while (serial > 0);
+	int at = 0;
+	while (ndigits > 0)
+		buf[at++] = digits[--ndigits];
+
+	/* words of 2 to 9 letters, some of them capitalised */
+	while (at + 1 < len) {
+		uint64_t r = bench_random(&state);
+		buf[at++] = ' ';
+		int word = 2 + (int)(r % 8);
+		for (int c = 0; c < word && at < len; c++) {
+			r = r * 6364136223846793005ULL + 1442695040888963407ULL;
+			buf[at++] = (char)((c == 0 && (r >> 40) % 4 == 0 ? 'A' : 'a') + (r >> 33) % 26);
+		}
+	}
+	buf[at] = '\0';
+	return at;
+}
+
+/*
+ * Write a synthetic knowledge file: one section per intent in INTENT order,
+ * with the intent's share of kb->entries lines. Each line either introduces a
+ * new entity or, with probability kb->duplicates, gives a new response to an
+ * earlier entity of the intent. Sets kb->unique.
+ *
+ * Returns: 0 if successful, 1 if the file could not be written
+ */
+static int bench_generate(FILE *f, BENCH_KB *kb)
+{
+	static const char *words[] = {"the", "school", "of", "computing", "offers", "a", "degree", "in",
+		"software", "engineering", "and", "information", "security", "with", "classes", "on",
+		"programming", "fundamentals", "data", "structures", "systems", "is", "located", "at", "Dover"};
+	double total = 0;
+	for (int i = 0; i < KB_INTENTS; i++)
+		total += kb->mix[i];
+	uint64_t state = kb->seed;
+	unsigned long given = 0;
+	char entity[MAX_ENTITY];
+
+	for (int i = 0; i < KB_INTENTS; i++) {
+		unsigned long lines = i == KB_INTENTS - 1 ? kb->entries - given : (unsigned long)(kb->entries * (kb->mix[i] / total));
+		given += lines;
+		kb->unique[i] = 0;
+		if (lines == 0)
+			continue;
+		fprintf(f, "[%s]\n", knowledge_intent_name((INTENT)i));
+		for (unsigned long line = 0; line < lines; line++) {
+			unsigned long serial = kb->unique[i];
+			if (serial > 0 && (bench_random(&state) >> 11) * 0x1.0p-53 < kb->duplicates)
+				serial = bench_random(&state) % kb->unique[i];
+			else
+				kb->unique[i]++;
+			bench_entity(entity, kb, i, serial);
+
+			/* a response of 3 to 30 words, at most MAX_RESPONSE - 1 characters */
+			int len = fprintf(f, "%s=response %lu", entity, line);
+			int nwords = 3 + (int)(bench_random(&state) % 28);
+			int room = MAX_RESPONSE - 1 - (len - (int)strlen(entity) - 1);
+			for (int w = 0; w < nwords; w++) {
+				const char *word = words[bench_random(&state) % (sizeof(words) / sizeof(words[0]))];
+				room -= 1 + (int)strlen(word);
+				if (room < 0)
+					break;
+				fprintf(f, " %s", word);
+			}
+			fputc('\n', f);
+		}
+	}
+	return ferror(f) ? 1 : 0;
+}
+
+/*
+ * Fill an array with entity-like strings of 4 to MAX_ENTITY - 1 characters,
+ * mixing upper and lower case. Every string is a separate allocation.
+ */
+static char **bench_words(unsigned seed)
+{
+	char **words = (char **)malloc(BENCH_INPUTS * sizeof(char *));
+	if (words == NULL)
+		return NULL;
+	srand(seed);
+	for (int k = 0; k < BENCH_INPUTS; k++) {
+		int len = 4 + rand() % (MAX_ENTITY - 4);
+		words[k] = (char *)malloc(len + 1);
+		if (words[k] == NULL)
+			return NULL;
+		for (int c = 0; c < len; c++)
+			words[k][c] = (char)((rand() % 2 ? 'A' : 'a') + rand() % 26);
+		words[k][len] = '\0';
+	}
+	return words;
+}
+
+/*
+ * Copy an array from bench_words(), swapping the case of every letter.
+ */
+static char **bench_swap_case(char **words)
+{
+	char **swapped = (char **)malloc(BENCH_INPUTS * sizeof(char *));
+	if (swapped == NULL)
+		return NULL;
+	for (int k = 0; k < BENCH_INPUTS; k++) {
+		swapped[k] = strdup(words[k]);
+		if (swapped[k] == NULL)
+			return NULL;
+		for (char *c = swapped[k]; *c != '\0'; c++)
+			*c ^= 0x20;
+	}
+	return swapped;
+}
+
+/*
+ * Free an array from bench_words() or bench_swap_case().
+ */
+static void bench_free_words(char **words)
+{
+	if (words == NULL)
+		return;
+	for (int k = 0; k < BENCH_INPUTS; k++)
+		free(words[k]);
+	free(words);
+}
+
+/*
+ * The compare_token() that fold_compare() replaced.
+ */
+static int bench_compare_reference(const char *token1, const char *token2)
+{
+	int i = 0;
+	while (token1[i] != '\0' && token2[i] != '\0') {
+		if (toupper(token1[i]) < toupper(token2[i]))
+			return -1;
+		else if (toupper(token1[i]) > toupper(token2[i]))
+			return 1;
+		i++;
+	}
+
+	if (token1[i] == '\0' && token2[i] == '\0')
+		return 0;
+	else if (token1[i] == '\0')
+		return -1;
+	else
+		return 1;
+}
+
+/*
+ * The hash the knowledge base used before fold_hash(): FNV-1a over the
+ * upper-cased characters, with no folded copy.
+ */
+static uint32_t bench_hash_reference(const char *entity, size_t len)
+{
+	uint32_t h = 2166136261U;
+	for (size_t k = 0; k < len; k++) {
+		h ^= (unsigned char)toupper((unsigned char)entity[k]);
+		h *= 16777619U;
+	}
+	return h;
+}
+
+/*
+ * The split_words() that next_token() replaced: strtok(), then a second pass
+ * to trim punctuation from each word.
+ */
+static int bench_split_reference(char *input, char *inv[], int max)
+{
+	int inc = 0;
+	int len;
+	inv[inc] = strtok(input, " ?\t\n");
+	while (inv[inc] != NULL && inc < max - 1) {
+		len = strlen(inv[inc]);
+		while (len > 0 && ispunct((unsigned char)inv[inc][len - 1])) {
+			inv[inc][len - 1] = '\0';
+			len--;
+		}
+		inc++;
+		inv[inc] = strtok(NULL, " ?\t\n");
+	}
+	inv[inc] = NULL;
+	return inc;
+}
+
+/*
+ * Time case-insensitive comparisons of strings that are equal apart from
+ * case, so every character is examined.
+ */
+static int bench_compare(const BENCH_OPTIONS *options)
+{
+	(void)options;
+	char **a = bench_words(1002);
+	char **b = a != NULL ? bench_swap_case(a) : NULL;
+	if (b == NULL) {
+		bench_free_words(a);
+		return 1;
+	}
+
+	unsigned long sink = 0;
+	double start = bench_now();
+	for (long k = 0; k < BENCH_OPS; k++)
+		sink += bench_compare_reference(a[k % BENCH_INPUTS], b[k % BENCH_INPUTS]) == 0;
+	bench_report("compare", "reference", 0, BENCH_OPS, bench_now() - start, NULL);
+
+	start = bench_now();
+	for (long k = 0; k < BENCH_OPS; k++)
+		sink += fold_compare(a[k % BENCH_INPUTS], b[k % BENCH_INPUTS]) == 0;
+	bench_report("compare", "fold_compare", 0, BENCH_OPS, bench_now() - start, NULL);
+
+	/* the knowledge base compares keys folded in advance */
+	for (int k = 0; k < BENCH_INPUTS; k++) {
+		size_t len = strlen(a[k]);
+		fold_hash(a[k], a[k], len);
+		fold_hash(b[k], b[k], len);
+	}
+	start = bench_now();
+	for (long k = 0; k < BENCH_OPS; k++) {
+		const char *x = a[k % BENCH_INPUTS];
+		sink += memcmp(x, b[k % BENCH_INPUTS], strlen(x)) == 0;
+	}
+	bench_report("compare", "folded_memcmp", 0, BENCH_OPS, bench_now() - start, NULL);
+
+	bench_sink = sink;
+	bench_free_words(a);
+	bench_free_words(b);
+	return 0;
+}
+
+/*
+ * Time hashing entities for the knowledge base's index.
+ */
+static int bench_hash(const BENCH_OPTIONS *options)
+{
+	(void)options;
+	char **a = bench_words(1002);
+	if (a == NULL)
+		return 1;
+	size_t len[BENCH_INPUTS];
+	for (int k = 0; k < BENCH_INPUTS; k++)
+		len[k] = strlen(a[k]);
+
+	unsigned long sink = 0;
+	double start = bench_now();
+	for (long k = 0; k < BENCH_OPS; k++)
+		sink += bench_hash_reference(a[k % BENCH_INPUTS], len[k % BENCH_INPUTS]);
+	bench_report("hash", "reference", 0, BENCH_OPS, bench_now() - start, NULL);
+
+	char key[MAX_ENTITY];
+	start = bench_now();
+	for (long k = 0; k < BENCH_OPS; k++)
+		sink += fold_hash(key, a[k % BENCH_INPUTS], len[k % BENCH_INPUTS]);
+	bench_report("hash", "fold_hash", 0, BENCH_OPS, bench_now() - start, NULL);
+
+	bench_sink = sink;
+	bench_free_words(a);
+	return 0;
+}
+
+/*
+ * Time splitting questions into words.
+ */
+static int bench_tokenize(const BENCH_OPTIONS *options)
+{
+	(void)options;
+	char **entities = bench_words(1002);
+	char **lines = (char **)malloc(BENCH_INPUTS * sizeof(char *));
+	char *copy = (char *)malloc(MAX_INPUT + MAX_ENTITY);
+	if (entities == NULL || lines == NULL || copy == NULL) {
+		bench_free_words(entities);
+		free(lines);
+		free(copy);
+		return 1;
+	}
+	static const char *starts[] = {"what is ", "Who  is ", "where are the ", "how\tdo I get to "};
+	for (int k = 0; k < BENCH_INPUTS; k++) {
+		lines[k] = (char *)malloc(MAX_INPUT + MAX_ENTITY);
+		if (lines[k] == NULL) {
+			bench_free_words(entities);
+			for (int j = 0; j < k; j++)
+				free(lines[j]);
+			free(lines);
+			free(copy);
+			return 1;
+		}
+		snprintf(lines[k], MAX_INPUT + MAX_ENTITY, "%s%.*s %s?\n", starts[k % 4], 8, entities[k], entities[k] + 8);
+	}
+
+	unsigned long sink = 0;
+	char *inv[MAX_INPUT];
+	TOKEN tokens[MAX_INPUT];
+	long ops = BENCH_OPS / 4;
+
+	/* the splitting functions change the line, so every variant times a copy of it */
+	double start = bench_now();
+	for (long k = 0; k < ops; k++) {
+		strcpy(copy, lines[k % BENCH_INPUTS]);
+		sink += bench_split_reference(copy, inv, MAX_INPUT);
+	}
+	bench_report("tokenize", "reference", 0, ops, bench_now() - start, NULL);
+
+	start = bench_now();
+	for (long k = 0; k < ops; k++) {
+		strcpy(copy, lines[k % BENCH_INPUTS]);
+		sink += split_words(copy, inv, MAX_INPUT);
+	}
+	bench_report("tokenize", "split_words", 0, ops, bench_now() - start, NULL);
+
+	start = bench_now();
+	for (long k = 0; k < ops; k++) {
+		strcpy(copy, lines[k % BENCH_INPUTS]);
+		sink += tokenize(copy, tokens, MAX_INPUT);
+	}
+	bench_report("tokenize", "tokenize", 0, ops, bench_now() - start, NULL);
+
+	bench_sink = sink;
+	bench_free_words(entities);
+	for (int k = 0; k < BENCH_INPUTS; k++)
+		free(lines[k]);
+	free(lines);
+	free(copy);
+	return 0;
+}
+
+/* a run of puts for one thread */
+typedef struct bench_puts {
+	char (*questions)[MAX_INPUT];
+	int *intents;
+	double *ns;                  /* receives the time each put took */
+	long count;
+} BENCH_PUTS;
+
+/*
+ * Put a run of new entities, timing each put.
+ */
+static void *bench_put(void *arg)
+{
+	BENCH_PUTS *run = (BENCH_PUTS *)arg;
+	for (long k = 0; k < run->count; k++) {
+		double start = bench_now();
+		knowledge_put((char *)knowledge_intent_name((INTENT)run->intents[k]), run->questions[k], (char *)"a new response");
+		run->ns[k] = bench_now() - start;
+	}
+	return NULL;
+}
+
+/*
+ * Put a run of new entities from a number of threads at once, each putting an
+ * equal share of them.
+ *
+ * Returns: the time they took, or -1 if a thread could not be started
+ */
+static double bench_put_shared(const BENCH_PUTS *all, int threads)
+{
+	pthread_t writers[BENCH_WRITERS];
+	BENCH_PUTS runs[BENCH_WRITERS];
+	int started = 0;
+	double start = bench_now();
+	for (; started < threads; started++) {
+		long from = all->count * started / threads;
+		long to = all->count * (started + 1) / threads;
+		runs[started] = (BENCH_PUTS){all->questions + from, all->intents + from, all->ns + from, to - from};
+		if (pthread_create(&writers[started], NULL, bench_put, &runs[started]) != 0)
+			break;
+	}
+	for (int t = 0; t < started; t++)
+		pthread_join(writers[t], NULL);
+	return started == threads ? bench_now() - start : -1;
+}
+
+/*
+ * Create an empty temporary file in $TMPDIR (or /tmp).
+ *
+ * Output:
+ *   path - receives the file's name
+ *   size - the size of path
+ *
+ * Returns: the file, open for reading and writing, or NULL on failure
+ */
+static FILE *bench_temp(char *path, size_t size)
+{
+	const char *dir = getenv("TMPDIR");
+	if ((size_t)snprintf(path, size, "%s/chat1002-bench-XXXXXX", dir != NULL ? dir : "/tmp") >= size)
+		return NULL;
+	int fd = mkstemp(path);
+	if (fd < 0)
+		return NULL;
+	FILE *f = fdopen(fd, "w+");
+	if (f == NULL)
+		close(fd);
+	return f;
+}
+
+/* the kinds of question bench_question() picks */
+#define BENCH_MISS 0                 /* an entity that is not in the knowledge base */
+#define BENCH_HIT  1                 /* any entity in the knowledge base */
+#define BENCH_HOT  2                 /* one of the first BENCH_HOT entities of its intent */
+
+/*
+ * Pick the intent and serial number of a question of a kind.
+ */
+static void bench_question(const BENCH_KB *kb, uint64_t *state, int kind, int *intent, unsigned long *serial)
+{
+	do {
+		*intent = (int)(bench_random(state) % KB_INTENTS);
+	} while (kb->unique[*intent] == 0);
+	unsigned long unique = kb->unique[*intent];
+	if (kind == BENCH_HOT && unique > BENCH_HOT_QUESTIONS)
+		unique = BENCH_HOT_QUESTIONS;
+	*serial = kind != BENCH_MISS ? bench_random(state) % unique : unique + bench_random(state) % (unique + 1);
+}
+
+/*
+ * Sum up the answers a knowledge base gives to some questions, so that two
+ * knowledge bases can be checked to answer them alike.
+ */
+static uint32_t bench_answers(char (*questions)[MAX_INPUT], const int *intents, long n)
+{
+	char response[MAX_RESPONSE];
+	uint32_t sum = 0;
+	for (long k = 0; k < n; k++) {
+		int result = knowledge_get(knowledge_intent_name((INTENT)intents[k]), questions[k], response, MAX_RESPONSE);
+		sum = sum * 31 + (uint32_t)result;
+		if (result == KB_OK)
+			sum ^= bench_hash_reference(response, strlen(response));
+	}
+	return sum;
+}
+
+/*
+ * Check that a disk store holding a knowledge base split its nodes, gives the
+ * same answers after it is closed and opened again, and is empty after it is
+ * reset; and time opening it again.
+ *
+ * Input:
+ *   kb        - the knowledge base the store holds
+ *   store     - the path of the store, which is open
+ *   questions - questions to ask it
+ *   intents   - the intent of each question
+ *
+ * Returns: 0 if the store passed, 1 if not
+ */
+static int bench_disk_check(const BENCH_KB *kb, const char *store, char (*questions)[MAX_INPUT], const int *intents)
+{
+	long n = BENCH_SAMPLES < BENCH_CHECKS ? BENCH_SAMPLES : BENCH_CHECKS;
+	unsigned long entries, again, bytes;
+	knowledge_usage(&entries, &bytes);
+	uint32_t answers = bench_answers(questions, intents, n);
+	knowledge_close();
+	struct stat loaded, reset;
+	if (stat(store, &loaded) != 0)
+		return 1;
+
+	double start = bench_now();
+	if (knowledge_open(store) < 0) {
+		fprintf(stderr, "%s: the disk store %s could not be opened again\n", chatbot_botname(), store);
+		return 1;
+	}
+	bench_report("kb", "reopen_disk", kb->entries, 1, bench_now() - start, NULL);
+	knowledge_usage(&again, &bytes);
+	if (again != entries || bench_answers(questions, intents, n) != answers) {
+		fprintf(stderr, "%s: the disk store gave other answers after it was opened again\n", chatbot_botname());
+		return 1;
+	}
+
+	/* a reset store is a single page, so one that held a split tree was at least three */
+	knowledge_reset();
+	knowledge_usage(&again, &bytes);
+	char response[MAX_RESPONSE];
+	if (again != 0 || stat(store, &reset) != 0
+		|| knowledge_get(knowledge_intent_name((INTENT)intents[0]), questions[0], response, MAX_RESPONSE) != KB_NOTFOUND) {
+		fprintf(stderr, "%s: the disk store was not empty after it was reset\n", chatbot_botname());
+		return 1;
+	}
+	if (kb->entries >= BENCH_SPLIT && loaded.st_size < 3 * reset.st_size) {
+		fprintf(stderr, "%s: the disk store did not split its root\n", chatbot_botname());
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * Time the knowledge base and the chatbot against a knowledge base of one
+ * size: loading it (also in parallel and into a disk store, which is checked
+ * and opened again), questions that hit and miss,
+ * questions with typing mistakes and keyword questions, completing entities,
+ * splitting and dispatching questions, adding entries (also from several
+ * threads and with a journal), writing and saving it (also as a snapshot),
+ * loading it back up to its first answer and resetting it.
+ *
+ * Returns: 0 if successful, 1 if a temporary file or buffer could not be made
+ *          or the disk store failed its check
+ */
+static int bench_kb_size(BENCH_KB *kb)
+{
+	char path[256];
+	int failed = 1;
+	long samples = BENCH_SAMPLES;
+	double *ns = (double *)malloc(samples * sizeof(double));
+	char (*questions)[MAX_INPUT] = malloc(samples * sizeof(*questions));
+	int *intents = (int *)malloc(samples * sizeof(int));
+	char source[256];            /* the knowledge file, unlinked once it has been read both ways */
+	FILE *f = bench_temp(source, sizeof(source));
+	if (ns == NULL || questions == NULL || intents == NULL || f == NULL)
+		goto done;
+
+	knowledge_reset();
+	if (bench_generate(f, kb) != 0 || fflush(f) != 0 || fseek(f, 0, SEEK_SET) != 0)
+		goto done;
+	double start = bench_now();
+	int read = knowledge_read(f);
+	double took = bench_now() - start;
+	if (read < 0)
+		goto done;
+	bench_report("kb", "read", kb->entries, (long)kb->entries, took, NULL);
+
+	/* the same file again with its responses left on disk, and questions that hit, which read them from it */
+	knowledge_reset();
+	knowledge_set_lazy(1);
+	if (fseek(f, 0, SEEK_SET) != 0)
+		goto done;
+	start = bench_now();
+	read = knowledge_read(f);
+	took = bench_now() - start;
+	knowledge_set_lazy(0);
+	if (read < 0)
+		goto done;
+	bench_report("kb", "read_lazy", kb->entries, (long)kb->entries, took, NULL);
+	char response[MAX_RESPONSE];
+	uint64_t state = kb->seed + kb->entries;
+	for (long k = 0; k < samples; k++) {
+		unsigned long serial;
+		bench_question(kb, &state, BENCH_HIT, &intents[k], &serial);
+		bench_entity(questions[k], kb, intents[k], serial);
+	}
+	double all = bench_now();
+	for (long k = 0; k < samples; k++) {
+		start = bench_now();
+		bench_sink += knowledge_get(knowledge_intent_name((INTENT)intents[k]), questions[k], response, MAX_RESPONSE);
+		ns[k] = bench_now() - start;
+	}
+	bench_report("kb", "get_lazy", kb->entries, samples, bench_now() - all, ns);
+
+	/* the same file again into a disk store with a small buffer pool, and the same questions, which read its pages */
+	char store[256];
+	FILE *empty = bench_temp(store, sizeof(store));
+	if (empty == NULL)
+		goto done;
+	fclose(empty);
+	knowledge_reset();
+	disk_set_pool(1);
+	if (knowledge_open(store) < 0 || fseek(f, 0, SEEK_SET) != 0) {
+		unlink(store);
+		goto done;
+	}
+	start = bench_now();
+	read = knowledge_read(f);
+	took = bench_now() - start;
+	if (read >= 0) {
+		bench_report("kb", "read_disk", kb->entries, (long)kb->entries, took, NULL);
+		all = bench_now();
+		for (long k = 0; k < samples; k++) {
+			start = bench_now();
+			bench_sink += knowledge_get(knowledge_intent_name((INTENT)intents[k]), questions[k], response, MAX_RESPONSE);
+			ns[k] = bench_now() - start;
+		}
+		bench_report("kb", "get_disk", kb->entries, samples, bench_now() - all, ns);
+		if (bench_disk_check(kb, store, questions, intents) != 0)
+			read = KB_INVALID;
+	}
+	knowledge_close();
+	unlink(store);
+	if (read < 0)
+		goto done;
+
+	/* the same file again, split into pieces parsed by a thread per processor */
+	knowledge_reset();
+	KB_FILE load = {source, 0, 0};
+	start = bench_now();
+	read = knowledge_read_files(&load, 1);
+	took = bench_now() - start;
+	unlink(source);
+	source[0] = '\0';
+	if (read < 0)
+		goto done;
+	bench_report("kb", "read_files", kb->entries, (long)kb->entries, took, NULL);
+
+	/* questions that hit, questions that miss, and a few popular questions asked again and again */
+	static const char *gets[] = {"get_miss", "get_hit", "get_hot"};
+	char entity[MAX_ENTITY];
+	state = kb->seed + kb->entries;
+	for (int kind = BENCH_MISS; kind <= BENCH_HOT; kind++) {
+		for (long k = 0; k < samples; k++) {
+			unsigned long serial;
+			bench_question(kb, &state, kind, &intents[k], &serial);
+			bench_entity(questions[k], kb, intents[k], serial);
+		}
+		all = bench_now();
+		for (long k = 0; k < samples; k++) {
+			start = bench_now();
+			bench_sink += knowledge_get(knowledge_intent_name((INTENT)intents[k]), questions[k], response, MAX_RESPONSE);
+			ns[k] = bench_now() - start;
+		}
+		bench_report("kb", gets[kind], kb->entries, samples, bench_now() - all, ns);
+	}
+
+	/* questions with a typing mistake, fewer of them as they are slower; the first indexes the knowledge base */
+	long similar = samples / 10;
+	char copy[MAX_INPUT];
+	char *words[MAX_INPUT];
+	for (long k = 0; k < similar; k++) {
+		unsigned long serial;
+		bench_question(kb, &state, BENCH_HIT, &intents[k], &serial);
+		int len = bench_entity(questions[k], kb, intents[k], serial);
+		questions[k][bench_random(&state) % len] = (char)('a' + bench_random(&state) % 26);
+	}
+	all = 0;
+	for (long k = 0; k < similar; k++) {
+		strcpy(copy, questions[k]);
+		int count = split_words(copy, words, MAX_INPUT);
+		start = bench_now();
+		bench_sink += knowledge_get_similar(knowledge_intent_name((INTENT)intents[k]), words, count, entity, MAX_ENTITY, response, MAX_RESPONSE);
+		ns[k] = bench_now() - start;
+		if (k == 0)
+			bench_report("kb", "similar_index", kb->entries, 1, ns[0], NULL);
+		else
+			all += ns[k];
+	}
+	bench_report("kb", "get_similar", kb->entries, similar - 1, all, ns + 1);
+
+	/* keyword questions: the words of an entity after its serial number, backwards */
+	const char *found;
+	for (long k = 0; k < similar; k++) {
+		unsigned long serial;
+		bench_question(kb, &state, BENCH_HIT, &intents[k], &serial);
+		bench_entity(copy, kb, intents[k], serial);
+		int count = split_words(copy, words, MAX_INPUT);
+		questions[k][0] = '\0';
+		for (int w = count - 1; w > 0; w--)
+			snprintf(questions[k] + strlen(questions[k]), MAX_INPUT - strlen(questions[k]), w < count - 1 ? " %s" : "%s", words[w]);
+	}
+	all = 0;
+	for (long k = 0; k < similar; k++) {
+		strcpy(copy, questions[k]);
+		int count = split_words(copy, words, MAX_INPUT);
+		start = bench_now();
+		bench_sink += knowledge_search(words, count, &found, entity, MAX_ENTITY, response, MAX_RESPONSE);
+		ns[k] = bench_now() - start;
+		all += ns[k];
+	}
+	bench_report("kb", "search", kb->entries, similar, all, ns);
+
+	/* the first few characters of an entity, completed to BENCH_COMPLETIONS entities */
+	char (*completions)[MAX_ENTITY] = malloc(BENCH_COMPLETIONS * sizeof(*completions));
+	if (completions == NULL)
+		goto done;
+	for (long k = 0; k < samples; k++) {
+		unsigned long serial;
+		bench_question(kb, &state, BENCH_HIT, &intents[k], &serial);
+		int len = bench_entity(questions[k], kb, intents[k], serial);
+		questions[k][1 + bench_random(&state) % (len < 6 ? len : 6)] = '\0';
+	}
+	all = bench_now();
+	for (long k = 0; k < samples; k++) {
+		start = bench_now();
+		bench_sink += knowledge_complete(knowledge_intent_name((INTENT)intents[k]), questions[k], completions, BENCH_COMPLETIONS);
+		ns[k] = bench_now() - start;
+	}
+	bench_report("kb", "complete", kb->entries, samples, bench_now() - all, ns);
+	free(completions);
+
+	/* whole questions, half of them hits */
+	for (long k = 0; k < samples; k++) {
+		int intent;
+		unsigned long serial;
+		bench_question(kb, &state, k % 2, &intent, &serial);
+		bench_entity(entity, kb, intent, serial);
+		snprintf(questions[k], MAX_INPUT, "%s is %s?\n", knowledge_intent_name((INTENT)intent), entity);
+	}
+	char line[MAX_INPUT];
+	char *inv[MAX_INPUT];
+	TOKEN tokens[MAX_INPUT];
+	all = bench_now();
+	for (long k = 0; k < samples; k++) {
+		start = bench_now();
+		bench_sink += tokenize(questions[k], tokens, MAX_INPUT);
+		ns[k] = bench_now() - start;
+	}
+	bench_report("kb", "tokenize", kb->entries, samples, bench_now() - all, ns);
+
+	chatbot_set_fallback("-");
+	all = 0;
+	for (long k = 0; k < samples; k++) {
+		strcpy(line, questions[k]);
+		int inc = split_words(line, inv, MAX_INPUT);
+		start = bench_now();
+		bench_sink += chatbot_main(inc, inv, response, MAX_RESPONSE);
+		ns[k] = bench_now() - start;
+		all += ns[k];
+	}
+	chatbot_set_fallback(NULL);
+	bench_report("kb", "dispatch", kb->entries, samples, all, ns);
+
+	/* new entities, as many as the knowledge base had (up to BENCH_SAMPLES) */
+	long puts = kb->entries < (unsigned long)samples ? (long)kb->entries : samples;
+	for (long k = 0; k < puts; k++) {
+		intents[k] = k % KB_INTENTS;
+		bench_entity(questions[k], kb, intents[k], kb->entries + kb->unique[intents[k]] + k);
+	}
+	all = bench_now();
+	for (long k = 0; k < puts; k++) {
+		start = bench_now();
+		bench_sink += knowledge_put((char *)knowledge_intent_name((INTENT)intents[k]), questions[k], (char *)"a new response");
+		ns[k] = bench_now() - start;
+	}
+	bench_report("kb", "put", kb->entries, puts, bench_now() - all, ns);
+
+	/* as many again from 2, 4 and so on up to BENCH_WRITERS threads, which only wait for each other within a shard */
+	for (int threads = 2; threads <= BENCH_WRITERS; threads *= 2) {
+		for (long k = 0; k < puts; k++) {
+			intents[k] = k % KB_INTENTS;
+			bench_entity(questions[k], kb, intents[k], kb->entries + kb->unique[intents[k]] + threads * puts + k);
+		}
+		BENCH_PUTS run = {questions, intents, ns, puts};
+		double took = bench_put_shared(&run, threads);
+		if (took < 0)
+			goto done;
+		char variant[32];
+		snprintf(variant, sizeof(variant), "put_%d", threads);
+		bench_report("kb", variant, kb->entries, puts, took, ns);
+	}
+
+	/* more new entities, kept in a journal: from one thread, then from BENCH_WRITERS sharing the syncs */
+	FILE *snapshot = bench_temp(path, sizeof(path));
+	if (snapshot == NULL)
+		goto done;
+	fclose(snapshot);
+	unlink(path);
+	if (journal_open(path) < 0)
+		goto done;
+	long journalled = BENCH_JOURNAL_PUTS < samples / 2 ? BENCH_JOURNAL_PUTS : samples / 2;
+	for (long k = 0; k < 2 * journalled; k++) {
+		intents[k] = k % KB_INTENTS;
+		bench_entity(questions[k], kb, intents[k], kb->entries + kb->unique[intents[k]] + puts + k);
+	}
+	BENCH_PUTS run = {questions, intents, ns, journalled};
+	all = bench_now();
+	bench_put(&run);
+	bench_report("kb", "put_journal", kb->entries, journalled, bench_now() - all, ns);
+
+	BENCH_PUTS runs = {questions + journalled, intents + journalled, ns, journalled};
+	double shared = bench_put_shared(&runs, BENCH_WRITERS);
+	journal_close();
+	char file[sizeof(path) + 16];
+	static const char *suffixes[] = {".journal", ".journal.old", ".tmp", ""};
+	for (int k = 0; k < 4; k++) {
+		snprintf(file, sizeof(file), "%s%s", path, suffixes[k]);
+		unlink(file);
+	}
+	if (shared < 0)
+		goto done;
+	bench_report("kb", "put_journal_shared", kb->entries, journalled, shared, ns);
+
+	FILE *out = bench_temp(path, sizeof(path));
+	if (out == NULL)
+		goto done;
+	unlink(path);
+	unsigned long entries, bytes;
+	knowledge_usage(&entries, &bytes);
+	start = bench_now();
+	knowledge_write(out);
+	fflush(out);
+	bench_report("kb", "write", kb->entries, (long)entries, bench_now() - start, NULL);
+	fclose(out);
+
+	/* the same, into a new file synced to disk and renamed over the old one */
+	start = bench_now();
+	if (knowledge_save(path, 0) != KB_OK)
+		goto done;
+	bench_report("kb", "save", kb->entries, (long)entries, bench_now() - start, NULL);
+
+	/* a binary snapshot of it, then each file loaded into an empty knowledge base, and the time to the first answer */
+	char image[256];
+	FILE *made = bench_temp(image, sizeof(image));
+	if (made == NULL) {
+		unlink(path);
+		goto done;
+	}
+	fclose(made);
+	start = bench_now();
+	int saved = knowledge_save(image, 1);
+	bench_report("kb", "save_snapshot", kb->entries, (long)entries, bench_now() - start, NULL);
+	int intent;
+	unsigned long serial;
+	bench_question(kb, &state, BENCH_HIT, &intent, &serial);
+	bench_entity(entity, kb, intent, serial);
+	static const char *firsts[] = {"first_answer_text", "first_answer"};
+	for (int binary = 0; binary <= 1 && saved == KB_OK; binary++) {
+		knowledge_reset();
+		start = bench_now();
+		FILE *in = fopen(binary ? image : path, "r");
+		read = in != NULL ? knowledge_read(in) : KB_NOTFOUND;
+		took = bench_now() - start;
+		if (read >= 0)
+			bench_sink += knowledge_get(knowledge_intent_name((INTENT)intent), entity, response, MAX_RESPONSE);
+		all = bench_now() - start;
+		if (in != NULL)
+			fclose(in);
+		if (read < 0) {
+			saved = read;
+			break;
+		}
+		if (binary)
+			bench_report("kb", "read_snapshot", kb->entries, read, took, NULL);
+		bench_report("kb", firsts[binary], kb->entries, 1, all, NULL);
+	}
+	unlink(image);
+	unlink(path);
+	if (saved != KB_OK)
+		goto done;
+
+	start = bench_now();
+	knowledge_reset();
+	bench_report("kb", "reset", kb->entries, 1, bench_now() - start, NULL);
+	failed = 0;
+
+done:
+	if (f != NULL) {
+		fclose(f);
+		if (source[0] != '\0')
+			unlink(source);
+	}
+	free(ns);
+	free(questions);
+	free(intents);
+	return failed;
+}
+
+/*
+ * Run bench_kb_size() for every size in the options.
+ */
+static int bench_kb(const BENCH_OPTIONS *options)
+{
+	BENCH_KB kb = options->kb;
+	for (int k = 0; k < options->nsizes; k++) {
+		kb.entries = options->sizes[k];
+		if (bench_kb_size(&kb) != 0)
+			return 1;
+	}
+	return 0;
+}
+
+/* the benchmarks, by name */
+static const struct {
+	const char *name;
+	int (*run)(const BENCH_OPTIONS *options);
+} bench_all[] = {
+	{"compare", bench_compare},
+	{"hash", bench_hash},
+	{"tokenize", bench_tokenize},
+	{"kb", bench_kb},
+};
+
+#define BENCH_COUNT ((int)(sizeof(bench_all) / sizeof(bench_all[0])))
+
+/*
+ * Parse a list of numbers separated by commas.
+ *
+ * Returns: the number of numbers, or -1 if the list is not valid
+ */
+static int bench_parse_sizes(const char *list, unsigned long sizes[], int max)
+{
+	int count = 0;
+	while (*list != '\0' && count < max) {
+		char *end;
+		sizes[count++] = strtoul(list, &end, 10);
+		if (end == list || (*end != ',' && *end != '\0') || sizes[count - 1] == 0)
+			return -1;
+		list = *end == ',' ? end + 1 : end;
+	}
+	return *list == '\0' && count > 0 ? count : -1;
+}
+
+/*
+ * Parse a --mix list such as "who:1,what:3".
+ *
+ * Returns: 0 if successful, -1 if the list is not valid
+ */
+static int bench_parse_mix(const char *list, double mix[KB_INTENTS])
+{
+	double total = 0;
+	for (int i = 0; i < KB_INTENTS; i++)
+		mix[i] = 0;
+	while (*list != '\0') {
+		const char *colon = strchr(list, ':');
+		if (colon == NULL)
+			return -1;
+		char name[MAX_INTENT];
+		snprintf(name, sizeof(name), "%.*s", (int)(colon - list), list);
+		INTENT i = knowledge_intent(name);
+		char *end;
+		double weight = strtod(colon + 1, &end);
+		if (i == INTENT_NONE || end == colon + 1 || weight < 0 || (*end != ',' && *end != '\0'))
+			return -1;
+		mix[i] = weight;
+		total += weight;
+		list = *end == ',' ? end + 1 : end;
+	}
+	return total > 0 ? 0 : -1;
+}
+
+/*
+ * Parse the options of --bench and --generate. Other arguments are left in
+ * argv, in order.
+ *
+ * Returns: the number of other arguments, or -1 if an option is not valid (a
+ *   message is printed to stderr)
+ */
+static int bench_options(int argc, char *argv[], BENCH_OPTIONS *options)
+{
+	static const unsigned long sizes[] = {1000, 10000, 100000, 1000000};
+	memset(options, 0, sizeof(*options));
+	memcpy(options->sizes, sizes, sizeof(sizes));
+	options->nsizes = sizeof(sizes) / sizeof(sizes[0]);
+	for (int i = 0; i < KB_INTENTS; i++)
+		options->kb.mix[i] = 1;
+	options->kb.min_entity = 8;
+	options->kb.max_entity = 40;
+	options->kb.seed = 1002;
+
+	int rest = 0;
+	for (int a = 0; a < argc; a++) {
+		const char *value = a + 1 < argc ? argv[a + 1] : NULL;
+		int valid = 1;
+		if (strncmp(argv[a], "--", 2) != 0) {
+			argv[rest++] = argv[a];
+			continue;
+		} else if (value == NULL) {
+			valid = 0;
+		} else if (strcmp(argv[a], "--sizes") == 0) {
+			options->nsizes = bench_parse_sizes(value, options->sizes, BENCH_MAX_SIZES);
+			valid = options->nsizes > 0;
+		} else if (strcmp(argv[a], "--mix") == 0) {
+			valid = bench_parse_mix(value, options->kb.mix) == 0;
+		} else if (strcmp(argv[a], "--entity-len") == 0) {
+			valid = sscanf(value, "%d-%d", &options->kb.min_entity, &options->kb.max_entity) == 2
+				&& options->kb.min_entity >= 8 && options->kb.max_entity >= options->kb.min_entity
+				&& options->kb.max_entity < MAX_ENTITY;
+		} else if (strcmp(argv[a], "--duplicates") == 0) {
+			options->kb.duplicates = strtod(value, NULL);
+			valid = options->kb.duplicates >= 0 && options->kb.duplicates < 1;
+		} else if (strcmp(argv[a], "--seed") == 0) {
+			options->kb.seed = strtoull(value, NULL, 10);
+		} else {
+			valid = 0;
+		}
+		if (!valid) {
+			fprintf(stderr, "%s: invalid option %s%s%s\n", chatbot_botname(), argv[a], value != NULL ? " " : "", value != NULL ? value : "");
+			return -1;
+		}
+		a++;
+	}
+	return rest;
+}
+
+/*
+ * Run benchmarks.
+ *
+ * Input:
+ *   argc - the number of arguments
+ *   argv - the names of the benchmarks to run (all of them if there are
+ *          none), and options
+ *
+ * Returns: 0 if every benchmark ran, 1 otherwise
+ */
+int bench_main(int argc, char *argv[])
+{
+	BENCH_OPTIONS options;
+	argc = bench_options(argc, argv, &options);
+	if (argc < 0)
+		return 1;
+
+	int failed = 0;
+	for (int a = 0; a < argc; a++) {
+		int known = 0;
+		for (int k = 0; k < BENCH_COUNT; k++)
+			known |= strcmp(argv[a], bench_all[k].name) == 0;
+		if (!known) {
+			fprintf(stderr, "%s: no benchmark named %s\n", chatbot_botname(), argv[a]);
+			return 1;
+		}
+	}
+
+	printf("# benchmark\tvariant\tentries\tops\tops_per_sec\tp50_ns\tp99_ns\tpeak_rss_kb\n");
+	for (int k = 0; k < BENCH_COUNT; k++) {
+		int wanted = argc == 0;
+		for (int a = 0; a < argc; a++)
+			wanted |= strcmp(argv[a], bench_all[k].name) == 0;
+		if (wanted && bench_all[k].run(&options) != 0) {
+			fprintf(stderr, "%s: benchmark %s failed\n", chatbot_botname(), bench_all[k].name);
+			failed = 1;
+		}
+	}
+	return failed;
+}
+
+/*
+ * Write a synthetic knowledge file to standard output.
+ *
+ * Input:
+ *   argc - the number of arguments
+ *   argv - the number of entries, and options
+ *
+ * Returns: 0 if successful, 1 otherwise
+ */
+int bench_generate_main(int argc, char *argv[])
+{
+	BENCH_OPTIONS options;
+	argc = bench_options(argc, argv, &options);
+	char *end = NULL;
+	if (argc == 1)
+		options.kb.entries = strtoul(argv[0], &end, 10);
+	if (argc != 1 || *end != '\0') {
+		fprintf(stderr, "%s: --generate needs the number of entries\n", chatbot_botname());
+		return 1;
+	}
+	return bench_generate(stdout, &options.kb) != 0 || fflush(stdout) != 0;
+}
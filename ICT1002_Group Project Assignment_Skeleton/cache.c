@@ -0,0 +1,351 @@
+/*
+ * ICT1002 (C Language) Group Project.
+ *
+ * This file implements the answer cache: a bounded cache of the responses to
+ * recent questions, which knowledge_get() consults before the knowledge base.
+ * A question is cached by its intent and its entity folded to lower case, which
+ * is all that is left of it once chatbot_do_question() has taken it apart, so
+ * "What is SIT?" and "what SIT" share an entry.
+ *
+ * The cache is set-associative: a question can only be in the CACHE_WAYS
+ * entries of the set its hash picks, and when the set is full the entry to
+ * replace is picked by the CLOCK algorithm (a hand sweeps the set, sparing
+ * entries that have been used since it last passed them). Once a set is full,
+ * a question is only admitted if it missed the set recently as well, so a
+ * stream of questions that are asked once does not flush the popular ones.
+ *
+ * Like the knowledge base, the cache is read without locks. Each set has a
+ * sequence number, which a thread changing the set makes odd while it does so;
+ * a reader copies the response out and tries again if the sequence number
+ * changed meanwhile.
+ *
+ * Entries are invalidated precisely: kb_insert() removes the entry for an
+ * entity whose response it replaces (only responses that were found are
+ * cached, so a new entity has no entry), and knowledge_reset() empties the
+ * cache. A response looked up in the knowledge base is only cached if nothing
+ * was invalidated since the lookup started (see cache_generation()), so a
+ * lookup that raced with a change cannot put the old response back.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include "chat1002.h"
+
+/* the number of entries in each set */
+#define CACHE_WAYS 8
+
+/* the number of recent misses each set remembers, to admit questions on their second miss */
+#define CACHE_SEEN 6
+
+/* the number of entries if cache_set_size() is not called */
+#define CACHE_DEFAULT_ENTRIES 8192
+
+/* a cached response; the key is the folded entity */
+typedef struct cache_entry {
+	uint8_t intent;
+	uint8_t key_len;
+	uint16_t response_len;
+	char key[MAX_ENTITY - 1];
+	char response[MAX_RESPONSE - 1];
+} CACHE_ENTRY;
+
+/* the bookkeeping of one set, on a cache line of its own; the entries are kept apart */
+typedef struct cache_set {
+	unsigned seq;                /* odd while the set is being changed */
+	uint8_t used;                /* a bit per way: the way holds an entry */
+	uint8_t referenced;          /* a bit per way: the entry has been used since the hand passed it */
+	uint8_t hand;                /* the next way the CLOCK hand looks at */
+	uint8_t next_seen;           /* the next of seen[] to overwrite */
+	uint32_t hash[CACHE_WAYS];
+	uint32_t seen[CACHE_SEEN];   /* the hashes of recent questions that were not admitted */
+} __attribute__((aligned(64))) CACHE_SET;
+
+static unsigned long cache_entries = CACHE_DEFAULT_ENTRIES;
+static unsigned long cache_nsets = 0;
+static CACHE_SET *cache_sets = NULL;
+static CACHE_ENTRY *cache_slots = NULL;
+static pthread_once_t cache_made = PTHREAD_ONCE_INIT;
+
+/* counts invalidations; see cache_generation() */
+static unsigned long cache_invalidations = 0;
+
+/*
+ * Set the number of entries in the cache. Only has an effect before the cache
+ * is first used.
+ *
+ * Input:
+ *   entries - the number of entries, rounded down to a power of two times
+ *             CACHE_WAYS; 0 turns the cache off
+ */
+void cache_set_size(unsigned long entries)
+{
+	cache_entries = entries;
+}
+
+/*
+ * Allocate the cache. If it cannot be allocated, it stays off. The number of
+ * sets is published last, so a thread that sees it also sees the sets.
+ */
+static void cache_make()
+{
+	unsigned long nsets = 1;
+	if (cache_entries < CACHE_WAYS)
+		return;
+	while (nsets * 2 * CACHE_WAYS <= cache_entries)
+		nsets *= 2;
+	CACHE_SET *sets = NULL;
+	if (posix_memalign((void **)&sets, 64, nsets * sizeof(CACHE_SET)) != 0)
+		return;
+	cache_slots = (CACHE_ENTRY *)malloc(nsets * CACHE_WAYS * sizeof(CACHE_ENTRY));
+	if (cache_slots == NULL) {
+		free(sets);
+		return;
+	}
+	memset(sets, 0, nsets * sizeof(CACHE_SET));
+	cache_sets = sets;
+	__atomic_store_n(&cache_nsets, nsets, __ATOMIC_SEQ_CST);
+}
+
+/*
+ * Get the number of sets, allocating the cache when it is first used.
+ *
+ * Returns: the number of sets, or 0 if the cache is off
+ */
+static unsigned long cache_ready()
+{
+	pthread_once(&cache_made, cache_make);
+	return cache_nsets;
+}
+
+/*
+ * Get the set a hash belongs to.
+ *
+ * Returns: the set, or NULL if the cache is off
+ */
+static CACHE_SET *cache_set(uint32_t h)
+{
+	return cache_ready() == 0 ? NULL : &cache_sets[h & (cache_nsets - 1)];
+}
+
+/*
+ * Start changing a set, waiting for any other thread that is changing it.
+ */
+static void cache_lock(CACHE_SET *set)
+{
+	for (;;) {
+		unsigned seq = __atomic_load_n(&set->seq, __ATOMIC_RELAXED);
+		if ((seq & 1) == 0 && __atomic_compare_exchange_n(&set->seq, &seq, seq + 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+			return;
+		sched_yield();
+	}
+}
+
+/*
+ * Finish changing a set.
+ */
+static void cache_unlock(CACHE_SET *set)
+{
+	__atomic_fetch_add(&set->seq, 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Find the way of a set holding a key.
+ *
+ * Returns: the way, or -1 if the key is not in the set
+ */
+static int cache_find(const CACHE_SET *set, const CACHE_ENTRY *ways, INTENT intent, const char *key, size_t len, uint32_t h)
+{
+	unsigned used = __atomic_load_n(&set->used, __ATOMIC_RELAXED);
+	for (int w = 0; w < CACHE_WAYS; w++) {
+		if ((used & (1U << w)) && set->hash[w] == h && ways[w].intent == intent && ways[w].key_len == len
+				&& memcmp(ways[w].key, key, len) == 0)
+			return w;
+	}
+	return -1;
+}
+
+/*
+ * Get the number of invalidations so far. Take it before looking a response up
+ * in the knowledge base, and pass it to cache_put() to cache the response.
+ */
+unsigned long cache_generation()
+{
+	return __atomic_load_n(&cache_invalidations, __ATOMIC_SEQ_CST);
+}
+
+/*
+ * Look a question up in the cache.
+ *
+ * Input:
+ *   intent   - the question word
+ *   key      - the entity, folded by fold_hash()
+ *   len      - the length of the entity
+ *   h        - the hash of the entity, from fold_hash()
+ *   response - a buffer to receive the response
+ *   n        - the size of the buffer
+ *
+ * Returns:
+ *   KB_OK, if the response was in the cache and has been copied to the buffer
+ *   KB_NOTFOUND, if the response was not in the cache
+ */
+int cache_get(INTENT intent, const char *key, size_t len, uint32_t h, char *response, int n)
+{
+	CACHE_SET *set = cache_set(h);
+	if (set == NULL)
+		return KB_NOTFOUND;
+	const CACHE_ENTRY *ways = &cache_slots[(set - cache_sets) * CACHE_WAYS];
+
+	int found = -1;
+	unsigned seq;
+	do {
+		seq = __atomic_load_n(&set->seq, __ATOMIC_ACQUIRE);
+		if (seq & 1) {
+			sched_yield();
+			continue;
+		}
+		found = cache_find(set, ways, intent, key, len, h);
+		if (found >= 0) {
+			/* the length may be torn by a writer; if so, the copy is thrown away below */
+			size_t copy = ways[found].response_len;
+			if (copy > sizeof(ways[found].response))
+				copy = sizeof(ways[found].response);
+			if (copy > (size_t)n - 1)
+				copy = (size_t)n - 1;
+			memcpy(response, ways[found].response, copy);
+			response[copy] = '\0';
+		}
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	} while ((seq & 1) || __atomic_load_n(&set->seq, __ATOMIC_RELAXED) != seq);
+
+	if (found < 0) {
+		stats_cache(0);
+		return KB_NOTFOUND;
+	}
+	/* only write the shared reference bits when they change */
+	if (!(__atomic_load_n(&set->referenced, __ATOMIC_RELAXED) & (1U << found)))
+		__atomic_fetch_or(&set->referenced, (uint8_t)(1U << found), __ATOMIC_RELAXED);
+	stats_cache(1);
+	return KB_OK;
+}
+
+/*
+ * Cache the response to a question.
+ *
+ * Input:
+ *   intent     - the question word
+ *   key        - the entity, folded by fold_hash()
+ *   len        - the length of the entity
+ *   h          - the hash of the entity
+ *   response   - the whole response
+ *   generation - cache_generation() from before the response was looked up;
+ *                if anything has been invalidated since, nothing is cached
+ */
+void cache_put(INTENT intent, const char *key, size_t len, uint32_t h, const char *response, unsigned long generation)
+{
+	size_t response_len = strlen(response);
+	CACHE_SET *set = cache_set(h);
+	if (set == NULL || len > MAX_ENTITY - 1 || response_len > MAX_RESPONSE - 1)
+		return;
+	CACHE_ENTRY *ways = &cache_slots[(set - cache_sets) * CACHE_WAYS];
+
+	/* remembering a miss needs no lock, as nothing else depends on seen[]; a lost update just costs a miss */
+	if (__atomic_load_n(&set->used, __ATOMIC_RELAXED) == (1U << CACHE_WAYS) - 1) {
+		int seen = 0;
+		for (int s = 0; s < CACHE_SEEN; s++)
+			seen |= __atomic_load_n(&set->seen[s], __ATOMIC_RELAXED) == h;
+		if (!seen) {
+			unsigned s = __atomic_fetch_add(&set->next_seen, 1, __ATOMIC_RELAXED) % CACHE_SEEN;
+			__atomic_store_n(&set->seen[s], h, __ATOMIC_RELAXED);
+			return;
+		}
+	}
+
+	cache_lock(set);
+	if (__atomic_load_n(&cache_invalidations, __ATOMIC_SEQ_CST) == generation && cache_find(set, ways, intent, key, len, h) < 0) {
+		/* an empty way, or the first one the CLOCK hand finds unreferenced */
+		int w;
+		if (set->used != (1U << CACHE_WAYS) - 1) {
+			w = __builtin_ctz(~set->used);
+		} else {
+			uint8_t referenced = __atomic_load_n(&set->referenced, __ATOMIC_RELAXED);
+			while (referenced & (1U << set->hand)) {
+				referenced &= (uint8_t)~(1U << set->hand);
+				set->hand = (set->hand + 1) % CACHE_WAYS;
+			}
+			__atomic_store_n(&set->referenced, referenced, __ATOMIC_RELAXED);
+			w = set->hand;
+			set->hand = (set->hand + 1) % CACHE_WAYS;
+		}
+		ways[w].intent = (uint8_t)intent;
+		ways[w].key_len = (uint8_t)len;
+		ways[w].response_len = (uint16_t)response_len;
+		memcpy(ways[w].key, key, len);
+		memcpy(ways[w].response, response, response_len);
+		set->hash[w] = h;
+		__atomic_fetch_and(&set->referenced, (uint8_t)~(1U << w), __ATOMIC_RELAXED);
+		__atomic_store_n(&set->used, (uint8_t)(set->used | (1U << w)), __ATOMIC_RELAXED);
+	}
+	cache_unlock(set);
+}
+
+/*
+ * Remove a question from the cache, once its response in the knowledge base
+ * has changed.
+ *
+ * Input:
+ *   intent - the question word
+ *   key    - the entity, folded by fold_hash()
+ *   len    - the length of the entity
+ *   h      - the hash of the entity
+ */
+void cache_invalidate(INTENT intent, const char *key, size_t len, uint32_t h)
+{
+	/* count the invalidation first: a lookup that starts after it sees the change */
+	__atomic_fetch_add(&cache_invalidations, 1, __ATOMIC_SEQ_CST);
+	unsigned long nsets = __atomic_load_n(&cache_nsets, __ATOMIC_SEQ_CST);
+	if (nsets == 0)
+		return;
+	CACHE_SET *set = &cache_sets[h & (nsets - 1)];
+	CACHE_ENTRY *ways = &cache_slots[(set - cache_sets) * CACHE_WAYS];
+
+	cache_lock(set);
+	int w = cache_find(set, ways, intent, key, len, h);
+	if (w >= 0)
+		__atomic_store_n(&set->used, (uint8_t)(set->used & ~(1U << w)), __ATOMIC_RELAXED);
+	cache_unlock(set);
+}
+
+/*
+ * Empty the cache, once the whole knowledge base has changed.
+ */
+void cache_clear()
+{
+	__atomic_fetch_add(&cache_invalidations, 1, __ATOMIC_SEQ_CST);
+	unsigned long nsets = __atomic_load_n(&cache_nsets, __ATOMIC_SEQ_CST);
+	for (unsigned long s = 0; s < nsets; s++) {
+		cache_lock(&cache_sets[s]);
+		__atomic_store_n(&cache_sets[s].used, 0, __ATOMIC_RELAXED);
+		cache_unlock(&cache_sets[s]);
+	}
+}
+
+/*
+ * Report how many responses the cache holds and how much memory it uses.
+ *
+ * Output:
+ *   entries - the number of cached responses
+ *   bytes   - the size of the cache, which is allocated in full when a
+ *             question is first looked up
+ */
+void cache_usage(unsigned long *entries, unsigned long *bytes)
+{
+	unsigned long nsets = __atomic_load_n(&cache_nsets, __ATOMIC_SEQ_CST);
+	*entries = 0;
+	for (unsigned long s = 0; s < nsets; s++)
+		*entries += __builtin_popcount(__atomic_load_n(&cache_sets[s].used, __ATOMIC_RELAXED));
+	*bytes = nsets * (sizeof(CACHE_SET) + CACHE_WAYS * sizeof(CACHE_ENTRY));
+}
@@ -8,11 +8,22 @@
 #ifndef _CHAT1002_H
 #define _CHAT1002_H
 
+#include <stdint.h>
 #include <stdio.h>
 
-/* the maximum number of characters we expect in a line of input (including the terminating null)  */
+/*
+ * the size of the buffers a line of input is put back together in, and the
+ * maximum number of words taken from a line (including the terminating NULL);
+ * lines themselves may be any length
+ */
 #define MAX_INPUT    256
 
+/*
+ * The MAX_* limits below are validation limits: knowledge_put() rejects longer
+ * entities and responses, but the knowledge base stores each string in only as
+ * many bytes as it needs.
+ */
+
 /* the maximum number of characters allowed in the name of an intent (including the terminating null)  */
 #define MAX_INTENT   32
 
@@ -34,22 +45,194 @@
 #define WHY "why"
 #define HOW "how"
 
+/* the question words (intents) known to the knowledge base */
+typedef enum intent {
+  INTENT_WHO,
+  INTENT_WHAT,
+  INTENT_WHERE,
+  INTENT_WHEN,
+  INTENT_WHY,
+  INTENT_HOW,
+  KB_INTENTS,                  /* the number of intents */
+  INTENT_NONE = -1             /* not a question word */
+} INTENT;
+
+/*
+ * An entity in the knowledge base. The text is kept out of line: the entity
+ * (the lookup key) in the knowledge base's key pool and the response in its
+ * response pool, so that the hash chains only touch the small hot fields.
+ * Entities are referred to by id; id 0 is never used and means "none". An
+ * entity never changes once it is in the knowledge base: a new response is
+ * stored as a new entity that takes the old one's place.
+ */
 typedef struct entity {
-  char intent[MAX_INTENT];
-  char entity[MAX_ENTITY];
-  char response[MAX_RESPONSE];
-  struct entity *next;
+  uint32_t hash;               /* fold_hash() of the entity */
+  uint32_t pos;                /* position of the entity in its intent, in insertion order */
+  uint32_t key;                /* offset of the entity, folded to lower case, in the key pool */
+  uint16_t response_len;       /* length of the response */
+  uint8_t key_len;             /* length of the entity */
+  uint8_t intent;              /* the INTENT of the entity */
+  uint64_t response;           /* offset of the response in the response pool */
 } ENTITY;
 
 typedef ENTITY *ENTITY_PTR;
+
+/* what stats_time() records: the intent handlers, then loading and saving the knowledge base */
+typedef enum stats_timer {
+  STATS_EXIT,
+  STATS_LOAD,
+  STATS_SAVE,
+  STATS_RESET,
+  STATS_QUESTION,
+  STATS_SMALLTALK,
+  STATS_STATS,
+  STATS_COMPLETE,
+  STATS_UNKNOWN,               /* input whose first word is not an intent */
+  STATS_KB_READ,               /* knowledge_read() */
+  STATS_KB_WRITE,              /* knowledge_write() and knowledge_write_binary() */
+  STATS_TIMERS                 /* the number of timers */
+} STATS_TIMER;
+
+/* a word of input: a slice of the line it came from, which is not null-terminated */
+typedef struct token {
+  const char *start;
+  size_t len;
+} TOKEN;
+
+/* an entity/response pair waiting in a KB_BATCH */
+typedef struct kb_batch_entry {
+  INTENT intent;
+  uint32_t entity_len;
+  uint32_t response_len;
+  const char *entity;
+  const char *response;
+} KB_BATCH_ENTRY;
+
+/*
+ * A set of entries collected by knowledge_batch_add() and inserted together by
+ * knowledge_batch_commit(). Strings added with knowledge_batch_add() are copied
+ * into the batch's text blocks; strings added with knowledge_batch_add_ref()
+ * are not copied, and if they lie inside 'map' the knowledge base keeps
+ * referring to them there after the commit.
+ */
+typedef struct kb_batch {
+  KB_BATCH_ENTRY *entries;
+  int count;
+  int size;
+  char **blocks;               /* text copied by knowledge_batch_add() */
+  int nblocks;
+  unsigned long block_used;    /* bytes used in the last block */
+  const char *map;             /* a mapped file, owned by the batch until it is committed */
+  size_t map_len;
+  int map_fd;                  /* a descriptor of it to keep in lazy mode, likewise, or -1 */
+} KB_BATCH;
+
+/* a file to read with knowledge_read_files(), and how reading it went */
+typedef struct kb_file {
+  char *path;
+  int result;                  /* the number of entries read, or KB_NOTFOUND, KB_NOMEM or KB_INVALID */
+  uint64_t ns;                 /* the time spent parsing and inserting them */
+} KB_FILE;
+ 
+/* a conversation with one user, for serving several users at once */
+typedef struct chatbot_session {
+  int learning;                /* 1 if the next line from the user answers the question below */
+  char intent[MAX_INTENT];
+  char entity[MAX_ENTITY];
+} CHATBOT_SESSION;
  
 /* functions defined in main.c */
 int compare_token(const char *token1, const char *token2);
 void prompt_user(char *buf, int n, const char *format, ...);
+const char *next_token(const char *p, TOKEN *token);
+int tokenize(const char *line, TOKEN tokens[], int max);
+int split_words(char *input, char *inv[], int max);
+
+/* functions defined in fold.c */
+int fold_compare(const char *a, const char *b);
+uint32_t fold_hash(char *dst, const char *src, size_t len);
+
+/* functions defined in bench.c */
+int bench_main(int argc, char *argv[]);
+int bench_generate_main(int argc, char *argv[]);
+
+/* functions defined in stats.c */
+uint64_t stats_now();
+void stats_time(STATS_TIMER timer, uint64_t start);
+void stats_lookup(INTENT intent, int hit);
+void stats_cache(int hit);
+void stats_summary(char *response, int n);
+void stats_write(FILE *f);
+int stats_start(FILE *f, unsigned seconds);
+
+/* functions defined in cache.c */
+void cache_set_size(unsigned long entries);
+unsigned long cache_generation();
+int cache_get(INTENT intent, const char *key, size_t len, uint32_t h, char *response, int n);
+void cache_put(INTENT intent, const char *key, size_t len, uint32_t h, const char *response, unsigned long generation);
+void cache_invalidate(INTENT intent, const char *key, size_t len, uint32_t h);
+void cache_clear();
+void cache_usage(unsigned long *entries, unsigned long *bytes);
+
+/* functions defined in fuzzy.c */
+void fuzzy_set_cutoff(double cutoff, int distance);
+unsigned long fuzzy_indexed(INTENT intent);
+int fuzzy_update(INTENT intent, unsigned long count, const char *(*key_of)(void *arg, unsigned long pos, size_t *len), void *arg);
+void fuzzy_reset();
+long fuzzy_find(INTENT intent, const char *key, size_t len, const char *(*key_of)(void *arg, unsigned long pos, size_t *len), void *arg);
+
+/* functions defined in search.c */
+uint32_t search_indexed();
+int search_update(uint32_t end, int (*doc_of)(void *arg, uint32_t doc, const char **entity, size_t *entity_len,
+  const char **response, size_t *response_len), void *arg);
+void search_remove(uint32_t doc, const char *entity, size_t entity_len, const char *response, size_t response_len);
+void search_reset();
+void search_usage(unsigned long *terms, unsigned long *bytes);
+uint32_t search_find(char *words[], int count);
+
+/* functions defined in trie.c */
+unsigned long trie_indexed(INTENT intent);
+int trie_update(INTENT intent, unsigned long count, const char *(*key_of)(void *arg, unsigned long pos, size_t *len), void *arg);
+void trie_reset();
+void trie_usage(unsigned long *nodes, unsigned long *bytes);
+int trie_complete(INTENT intent, const char *prefix, size_t len, uint32_t positions[], int k);
+
+/* functions defined in journal.c */
+long journal_open(const char *path);
+void journal_close();
+uint64_t journal_put(INTENT intent, const char *entity, size_t entity_len, const char *response, size_t response_len);
+uint64_t journal_reset();
+uint64_t journal_sequence();
+int journal_wait(uint64_t sequence);
+void journal_compact();
+void journal_usage(unsigned long *records, unsigned long *syncs, unsigned long *bytes, unsigned long *compactions);
+
+/* functions defined in disk.c */
+void disk_set_pool(unsigned long megabytes);
+long disk_open(const char *path);
+void disk_close();
+int disk_active();
+int disk_get(INTENT intent, const char *key, size_t len, char *response, int n);
+int disk_put(INTENT intent, const char *key, const char *entity, size_t len, const char *response, size_t response_len);
+int disk_flush(int all);
+int disk_reset();
+int disk_scan(INTENT intent, const char *prefix, size_t len,
+  int (*visit)(void *arg, const char *entity, size_t entity_len, const char *response, size_t response_len), void *arg);
+int disk_intents(int order[KB_INTENTS]);
+void disk_usage(unsigned long *entries, unsigned long *bytes, unsigned long *reads, unsigned long *writes);
+
+/* functions defined in batch.c */
+int batch_run(FILE *in, FILE *out, int workers);
+
+/* functions defined in server.c */
+int server_run(const char *path);
 
 /* functions defined in chatbot.c */
 const char *chatbot_botname();
 const char *chatbot_username();
+void chatbot_set_fallback(const char *fallback);
+void chatbot_set_session(CHATBOT_SESSION *session);
+int chatbot_learn(const char *intent, const char *entity, const char *answer, char *response, int n);
 int chatbot_main(int inc, char *inv[], char *response, int n);
 int chatbot_is_exit(const char *intent);
 int chatbot_do_exit(int inc, char *inv[], char *response, int n);
@@ -63,12 +246,38 @@ int chatbot_is_save(const char *intent);
 int chatbot_do_save(int inc, char *inv[], char *response, int n);
 int chatbot_is_smalltalk(const char *intent);
 int chatbot_do_smalltalk(int inc, char *inv[], char *resonse, int n);
+int chatbot_is_stats(const char *intent);
+int chatbot_do_stats(int inc, char *inv[], char *response, int n);
+int chatbot_is_complete(const char *intent);
+int chatbot_do_complete(int inc, char *inv[], char *response, int n);
 
 /* functions defined in knowledge.c */
+INTENT knowledge_intent(const char *intent);
+const char *knowledge_intent_name(INTENT intent);
 int knowledge_get(const char *intent, const char *entity, char *response, int n);
+int knowledge_get_words(const char *intent, char *words[], int count, char *response, int n);
+int knowledge_get_similar(const char *intent, char *words[], int count, char *entity, int m, char *response, int n);
+int knowledge_search(char *words[], int count, const char **intent, char *entity, int m, char *response, int n);
+int knowledge_complete(const char *intent, const char *prefix, char entities[][MAX_ENTITY], int k);
 int knowledge_put( char *intent,  char *entity,  char *response);
 void knowledge_reset();
 int knowledge_read(FILE *f);
-void knowledge_write(FILE *f);
+int knowledge_read_files(KB_FILE files[], int count);
+int knowledge_list_files(char *names[], int count, KB_FILE **files);
+void knowledge_free_files(KB_FILE *files, int count);
+void knowledge_batch_init(KB_BATCH *batch);
+int knowledge_batch_add(KB_BATCH *batch, const char *intent, const char *entity, const char *response);
+int knowledge_batch_add_ref(KB_BATCH *batch, INTENT intent, const char *entity, size_t entity_len, const char *response, size_t response_len);
+int knowledge_batch_commit(KB_BATCH *batch);
+void knowledge_batch_free(KB_BATCH *batch);
+int knowledge_write(FILE *f);
+int knowledge_write_binary(FILE *f);
+int knowledge_sync_dir(const char *path);
+int knowledge_save(const char *path, int binary);
+uint64_t knowledge_sequence();
+void knowledge_set_lazy(int lazy);
+void knowledge_usage(unsigned long *entries, unsigned long *bytes);
+long knowledge_open(const char *path);
+void knowledge_close();
 
 #endif
\ No newline at end of file
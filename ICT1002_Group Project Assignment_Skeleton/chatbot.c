@@ -3,8 +3,8 @@
  *
  * This file implements the behaviour of the chatbot. The main entry point to
  * this module is the chatbot_main() function, which identifies the intent
- * using the chatbot_is_*() functions then invokes the matching chatbot_do_*()
- * function to carry out the intent.
+ * by looking its first word up in the intent table (chatbot_intents[]) then
+ * invokes the matching chatbot_do_*() function to carry out the intent.
  *
  * chatbot_main() and chatbot_do_*() have the same method signature, which
  * works as described here.
@@ -22,7 +22,9 @@
  * If the second word may be a part of speech that makes sense for the intent.
  *    - for WHAT, WHERE and WHO, it may be "is" or "are".
  *    - for SAVE, it may be "as" or "to".
- *    - for LOAD, it may be "from".
+ *    - for LOAD, it may be "from", and it may be followed by several files.
+ *    - for COMPLETE, it is the question word, which may be followed by "is"
+ *      or "are".
  * The word is otherwise ignored and may be omitted.
  *
  * The remainder of the input (including the second word, if it is not one of the
@@ -40,6 +42,8 @@
  * returned by these functions at the start of each line.
  */
 
+#include <errno.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -66,6 +70,201 @@ const char *chatbot_username()
 	return "User";
 }
 
+/* the answer to unknown questions, or NULL to ask the user for the answer */
+static const char *chatbot_fallback = NULL;
+
+/*
+ * Set the answer given to questions that are not in the knowledge base.
+ *
+ * Input:
+ *   fallback - the answer, or NULL to ask the user for the answer and learn it
+ *              (the default); must stay valid while it is in use
+ */
+void chatbot_set_fallback(const char *fallback)
+{
+	chatbot_fallback = fallback;
+}
+
+/* the conversation this thread is serving, or NULL to prompt the user with prompt_user() */
+static __thread CHATBOT_SESSION *chatbot_session = NULL;
+
+/*
+ * Set the conversation that the calling thread's next calls to chatbot_main()
+ * belong to. While a session is set, a question that is not in the knowledge
+ * base is asked without waiting for the answer: the session records the
+ * question, and the caller passes the next line from the same user to
+ * chatbot_learn().
+ *
+ * Input:
+ *   session - the session, or NULL to prompt the user with prompt_user()
+ */
+void chatbot_set_session(CHATBOT_SESSION *session)
+{
+	chatbot_session = session;
+}
+
+/*
+ * Join words into a buffer, separated by single spaces.
+ *
+ * Input:
+ *   buf   - the buffer
+ *   n     - the size of the buffer
+ *   count - the number of words
+ *   words - the words
+ *
+ * Returns:
+ *   1, if all of the words fit into the buffer
+ *   0, if the result was truncated
+ */
+static int chatbot_join(char *buf, int n, int count, char *words[])
+{
+	int len = 0;
+	buf[0] = '\0';
+	for (int i = 0; i < count; i++) {
+		int added = snprintf(buf + len, n - len, i == 0 ? "%s" : " %s", words[i]);
+		if (added < 0 || added >= n - len)
+			return 0;
+		len += added;
+	}
+	return 1;
+}
+
+/* the most entities the complete intent lists */
+#define CHATBOT_COMPLETIONS 10
+
+/* the reply to smalltalk that has no reply of its own */
+#define CHATBOT_GREETING "Hello! What would you like to chat about?"
+
+/*
+ * The intents the chatbot understands, by keyword. To add an intent, add its
+ * keywords here with the chatbot_do_*() function that carries it out; keywords
+ * must be distinct, in lower case and shorter than CHATBOT_MAX_WORD.
+ */
+typedef struct chatbot_intent {
+	const char *word;            /* the keyword, in lower case */
+	int (*handler)(int inc, char *inv[], char *response, int n);
+	const char *reply;           /* for smalltalk, the reply */
+	int stop;                    /* for smalltalk, 1 if the chatbot should stop chatting */
+	STATS_TIMER timer;           /* what the time the handler takes counts towards */
+} CHATBOT_INTENT;
+
+static const CHATBOT_INTENT chatbot_intents[] = {
+	{"exit", chatbot_do_exit, NULL, 0, STATS_EXIT},
+	{"quit", chatbot_do_exit, NULL, 0, STATS_EXIT},
+	{"load", chatbot_do_load, NULL, 0, STATS_LOAD},
+	{"save", chatbot_do_save, NULL, 0, STATS_SAVE},
+	{"reset", chatbot_do_reset, NULL, 0, STATS_RESET},
+	{"what", chatbot_do_question, NULL, 0, STATS_QUESTION},
+	{"where", chatbot_do_question, NULL, 0, STATS_QUESTION},
+	{"who", chatbot_do_question, NULL, 0, STATS_QUESTION},
+	{"when", chatbot_do_question, NULL, 0, STATS_QUESTION},
+	{"why", chatbot_do_question, NULL, 0, STATS_QUESTION},
+	{"how", chatbot_do_question, NULL, 0, STATS_QUESTION},
+	{"hello", chatbot_do_smalltalk, CHATBOT_GREETING, 0, STATS_SMALLTALK},
+	{"hey", chatbot_do_smalltalk, CHATBOT_GREETING, 0, STATS_SMALLTALK},
+	{"hi", chatbot_do_smalltalk, CHATBOT_GREETING, 0, STATS_SMALLTALK},
+	{"wassup", chatbot_do_smalltalk, CHATBOT_GREETING, 0, STATS_SMALLTALK},
+	{"greetings", chatbot_do_smalltalk, CHATBOT_GREETING, 0, STATS_SMALLTALK},
+	{"like", chatbot_do_smalltalk, CHATBOT_GREETING, 0, STATS_SMALLTALK},
+	{"it's", chatbot_do_smalltalk, "Indeed it is.", 0, STATS_SMALLTALK},
+	{"goodbye", chatbot_do_smalltalk, "Goodbye!", 1, STATS_SMALLTALK},
+	{"bye", chatbot_do_smalltalk, "Goodbye!", 1, STATS_SMALLTALK},
+	{"school", chatbot_do_smalltalk, "School is a great place to learn new things!", 0, STATS_SMALLTALK},
+	{"i", chatbot_do_smalltalk, "I like it too!", 0, STATS_SMALLTALK},
+	{"are", chatbot_do_smalltalk, "Of course I am!", 0, STATS_SMALLTALK},
+	{"stats", chatbot_do_stats, NULL, 0, STATS_STATS},
+	{"complete", chatbot_do_complete, NULL, 0, STATS_COMPLETE},
+};
+
+#define CHATBOT_NINTENTS ((int)(sizeof(chatbot_intents) / sizeof(chatbot_intents[0])))
+
+/* one more than the length of the longest keyword */
+#define CHATBOT_MAX_WORD 16
+
+/*
+ * Keywords are found through a perfect hash: chatbot_build() picks a seed for
+ * which every keyword hashes to a slot of its own, so a lookup hashes the word
+ * once and compares it with at most one keyword.
+ */
+#define CHATBOT_SLOTS 128            /* a power of two, at least 4 times CHATBOT_NINTENTS */
+
+static unsigned char chatbot_slots[CHATBOT_SLOTS];   /* 1 + the index of the keyword in each slot, or 0 */
+static uint32_t chatbot_seed;
+static pthread_once_t chatbot_built = PTHREAD_ONCE_INIT;
+
+/*
+ * Hash a word that has been folded to lower case (FNV-1a, starting from a seed).
+ */
+static uint32_t chatbot_hash(uint32_t seed, const char *word, size_t len)
+{
+	uint32_t h = 2166136261U ^ seed;
+	for (size_t k = 0; k < len; k++) {
+		h ^= (unsigned char)word[k];
+		h *= 16777619U;
+	}
+	return h;
+}
+
+/*
+ * Find a seed that gives every keyword a slot of its own, and fill the slots.
+ */
+static void chatbot_build()
+{
+	for (uint32_t seed = 1; seed < 65536; seed++) {
+		int k;
+		memset(chatbot_slots, 0, sizeof(chatbot_slots));
+		for (k = 0; k < CHATBOT_NINTENTS; k++) {
+			const char *word = chatbot_intents[k].word;
+			uint32_t slot = chatbot_hash(seed, word, strlen(word)) & (CHATBOT_SLOTS - 1);
+			if (chatbot_slots[slot] != 0)
+				break;
+			chatbot_slots[slot] = (unsigned char)(k + 1);
+		}
+		if (k == CHATBOT_NINTENTS) {
+			chatbot_seed = seed;
+			return;
+		}
+	}
+	fprintf(stderr, "%s: the intent keywords are not distinct.\n", chatbot_botname());
+}
+
+/*
+ * Find the intent of a word, ignoring case.
+ *
+ * Returns: the intent, or NULL if the word is not a keyword
+ */
+static const CHATBOT_INTENT *chatbot_intent(const char *word)
+{
+	char folded[CHATBOT_MAX_WORD];
+	size_t len = 0;
+	for (; word[len] != '\0'; len++) {
+		if (len == CHATBOT_MAX_WORD)
+			return NULL;
+		folded[len] = (char)tolower((unsigned char)word[len]);
+	}
+
+	pthread_once(&chatbot_built, chatbot_build);
+	int k = chatbot_slots[chatbot_hash(chatbot_seed, folded, len) & (CHATBOT_SLOTS - 1)];
+	if (k == 0)
+		return NULL;
+	const CHATBOT_INTENT *intent = &chatbot_intents[k - 1];
+	return strncmp(intent->word, folded, len) == 0 && intent->word[len] == '\0' ? intent : NULL;
+}
+
+/*
+ * Determine whether a word is a keyword of the intent carried out by a
+ * chatbot_do_*() function.
+ *
+ * Returns:
+ *   1, if it is
+ *   0, otherwise
+ */
+static int chatbot_is(const char *word, int (*handler)(int inc, char *inv[], char *response, int n))
+{
+	const CHATBOT_INTENT *intent = chatbot_intent(word);
+	return intent != NULL && intent->handler == handler;
+}
+
 /*
  * Get a response to user input.
  *
@@ -85,23 +284,17 @@ int chatbot_main(int inc, char *inv[], char *response, int n)
 	}
 
 	/* look for an intent and invoke the corresponding do_* function */
-	if (chatbot_is_exit(inv[0]))
-		return chatbot_do_exit(inc, inv, response, n);
-	else if (chatbot_is_smalltalk(inv[0]))
-		return chatbot_do_smalltalk(inc, inv, response, n);
-	else if (chatbot_is_load(inv[0]))
-		return chatbot_do_load(inc, inv, response, n);
-	else if (chatbot_is_question(inv[0]))
-		return chatbot_do_question(inc, inv, response, n);
-	else if (chatbot_is_reset(inv[0]))
-		return chatbot_do_reset(inc, inv, response, n);
-	else if (chatbot_is_save(inv[0]))
-		return chatbot_do_save(inc, inv, response, n);
-	else
+	uint64_t start = stats_now();
+	const CHATBOT_INTENT *intent = chatbot_intent(inv[0]);
+	if (intent == NULL)
 	{
 		snprintf(response, n, "I don't understand \"%s\".", inv[0]);
+		stats_time(STATS_UNKNOWN, start);
 		return 0;
 	}
+	int stop = intent->handler(inc, inv, response, n);
+	stats_time(intent->timer, start);
+	return stop;
 }
 
 /*
@@ -116,7 +309,7 @@ int chatbot_main(int inc, char *inv[], char *response, int n)
  */
 int chatbot_is_exit(const char *intent)
 {
-	return compare_token(intent, "exit") == 0 || compare_token(intent, "quit") == 0;
+	return chatbot_is(intent, chatbot_do_exit);
 }
 
 /*
@@ -148,11 +341,33 @@ int chatbot_do_exit(int inc, char *inv[], char *response, int n)
  */
 int chatbot_is_load(const char *intent)
 {
-	return compare_token(intent, "load") == 0;
+	return chatbot_is(intent, chatbot_do_load);
 }
 
 /*
- * Load a chatbot's knowledge base from a file.
+ * Describe how reading one file of a load went, for chatbot_do_load().
+ *
+ * Returns: the number of characters written, as snprintf() counts them
+ */
+static int chatbot_load_result(char *response, int n, const KB_FILE *file)
+{
+	switch (file->result) {
+	case KB_NOTFOUND:
+		return snprintf(response, n, "%s not found", file->path);
+	case KB_INVALID:
+		return snprintf(response, n, "%s not valid", file->path);
+	case KB_NOMEM:
+		return snprintf(response, n, "%s out of memory", file->path);
+	default:
+		return snprintf(response, n, "%s %d (%.1f ms)", file->path, file->result, file->ns / 1e6);
+	}
+}
+
+/*
+ * Load a chatbot's knowledge base from one or more files, or the files in
+ * one or more directories, which are read in parallel (see
+ * knowledge_read_files()). Loads are not journalled, so with a journal open
+ * the knowledge base is folded into a new snapshot instead.
  *
  * See the comment at the top of the file for a description of how this
  * function is used.
@@ -162,27 +377,69 @@ int chatbot_is_load(const char *intent)
  */
 int chatbot_do_load(int inc, char *inv[], char *response, int n)
 {
-	
-	FILE* f;
-	
-	if (inc >= 1)
-	{
-		f = fopen(inv[1], "r");
-		int checkRead = knowledge_read(f);
-		if (checkRead == 0)
-		{
-			fclose(f);
-			snprintf(response, n, "%s has been loaded successfully.", inv[1]);
-		}
+	/* the second word may be "from"; the rest name files or directories */
+	int first = inc >= 3 && compare_token(inv[1], "from") == 0 ? 2 : 1;
+	if (inc <= first) {
+		snprintf(response, n, "Sorry, file is not loaded. Please ensure that the file name or file exist.");
+		return 0;
+	}
+
+	KB_FILE *files;
+	int nfiles = knowledge_list_files(inv + first, inc - first, &files);
+	if (nfiles < 0) {
+		snprintf(response, n, "Sorry, there was not enough memory to load %s.", inv[first]);
+		return 0;
+	}
+	if (nfiles == 0) {
+		snprintf(response, n, "Sorry, there are no files to load in %s.", inv[first]);
+		knowledge_free_files(files, nfiles);
+		return 0;
+	}
+
+	uint64_t start = stats_now();
+	int loaded = 0, failed = 0;
+	knowledge_read_files(files, nfiles);
+	double ms = (stats_now() - start) / 1e6;
+	for (int i = 0; i < nfiles; i++) {
+		if (files[i].result >= 0)
+			loaded += files[i].result;
 		else
-		{
-			fclose(f);
+			failed++;
+	}
+	if (failed < nfiles)
+		journal_compact();
+	unsigned long entries, bytes;
+	knowledge_usage(&entries, &bytes);
+
+	if (nfiles == 1 && inc - first == 1 && strcmp(files[0].path, inv[first]) == 0) {
+		/* a single file */
+		const char *fileName = files[0].path;
+		if (files[0].result >= 0)
+			snprintf(response, n, "%s has been loaded successfully (%d entries in %.1f ms; %lu in total, %lu bytes per entry).",
+				fileName, files[0].result, ms, entries, entries > 0 ? bytes / entries : 0);
+		else if (files[0].result == KB_NOTFOUND)
 			snprintf(response, n, "Sorry, file is not loaded. Please ensure that the file name or file exist.");
+		else if (files[0].result == KB_INVALID)
+			snprintf(response, n, "Sorry, %s is not a valid knowledge file.", fileName);
+		else
+			snprintf(response, n, "Sorry, there was not enough memory to load %s.", fileName);
+	} else {
+		/* a summary, then as many of the files as there is room for */
+		int len = snprintf(response, n, "Loaded %d entries from %d of %d files in %.1f ms (%lu in total, %lu bytes per entry):",
+			loaded, nfiles - failed, nfiles, ms, entries, entries > 0 ? bytes / entries : 0);
+		for (int i = 0; i < nfiles && len < n; i++) {
+			char item[MAX_RESPONSE];
+			int more = nfiles - i - 1;
+			int item_len = chatbot_load_result(item, sizeof(item), &files[i]);
+			/* leave room to say how many files there are after this one */
+			if (len + item_len + (more > 0 ? 24 : 2) >= n) {
+				snprintf(response + len, n - len, " and %d more.", more + 1);
+				break;
+			}
+			len += snprintf(response + len, n - len, " %s%s", item, more > 0 ? "," : ".");
 		}
-	}else if (inc == 0){
-		fclose(f);
-		snprintf(response, n, "Sorry, file is not loaded. Please ensure that the file name or file exist.");
 	}
+	knowledge_free_files(files, nfiles);
 	return 0;
 }
 
@@ -198,15 +455,7 @@ int chatbot_do_load(int inc, char *inv[], char *response, int n)
  */
 int chatbot_is_question(const char *intent)
 {
-	char intentqns[6][6] = {WHAT, WHERE, WHO, WHEN, WHY, HOW};
-	for (int i = 0; i < 6; i++)
-	{
-		if (compare_token(intentqns[i], intent) == 0)
-		{
-			return 1;
-		}
-	}
-	return 0;
+	return chatbot_is(intent, chatbot_do_question);
 }
 
 /*
@@ -223,97 +472,117 @@ int chatbot_is_question(const char *intent)
  *   0 (the chatbot always continues chatting after a question)
  */
 int chatbot_do_question(int inc, char *inv[], char *response, int n) {
-	int index, find_entity, success = 0;
-	// char *user_entity;
-	// char *answer;
-	// char *question;
-	// user_entity = (char *)malloc(MAX_ENTITY);
-	// answer = (char *)malloc(MAX_RESPONSE);
-	// question = (char *)malloc(MAX_RESPONSE);
+	int index, find_entity;
 	char user_entity[MAX_ENTITY] = "";
 	char answer[MAX_RESPONSE] = "";
-	char question[MAX_RESPONSE] = "";
-	int try_put_knowledge;
-	// Check if the two char pointer were allocated space
-	// if (user_entity == NULL || answer == NULL) {
-	// 	snprintf(response, n, "Insufficient memory space");
-	// 	return 1;
-	// }
+	char question[MAX_INPUT] = "";
+	const char *found_intent;
 	/* 
 	Check if the sentence is more than a word. If yes, 
 	set the index to 2 (3rd word) to skip "is/are" which is the 2nd word.
 	Set the index to 1 (2nd word) if the words are neither "is" nor "are".
 	*/
-	if (inc > 1) {																												
-		if (!compare_token(inv[1], "is") || !compare_token(inv[1], "are")) {
-			index = 2;
-		} else {
-			index = 1;
-		}
-		if (inv[index] != NULL) {
-			for (int i = index; i < inc; i++) {
-				strcat(user_entity, inv[i]);
-				// If current word is not the last word, add a space
-				if (i != inc - 1) {
-					strcat(user_entity, " ");
-				}
-			}
-		} else {
-			snprintf(response, n, "No entity was found.");
-		}
-		// Try to find entity from the linked list, a number will be returned from the function
-		find_entity = knowledge_get(inv[0], user_entity, response, n);
+	if (inc > 1 && (!compare_token(inv[1], "is") || !compare_token(inv[1], "are"))) {
+		index = 2;
 	} else {
+		index = 1;
+	}
+	if (index >= inc) {
 		snprintf(response, n, "No entity was found.");
+		return 0;
 	}
-	
-	// If there was no record of that entity in the linked list
-	if (find_entity == KB_NOTFOUND) {
-		// Loop through the words in the original user prompt and add it to question variable to make a whole sentence. 				
-		for (int i = 0; i < index; i++) {
-			strcat(question, inv[i]);
-				// If current word is not the last word, add a space
-				if (i != inc - 1) {
-					strcat(question, " ");
-				}
-		}
-		// Concatenate entity word to the back of the question variable from above
-		strcat(question, user_entity);
-		// Ask user what is the answer
-		prompt_user(answer, MAX_RESPONSE, "I don't know. %s?", question);
-		// Check if the user has input an empty string or SPACE
-		for (int i = 0; i < strlen(answer); i++) {
-			if (isspace(answer[i]) != 0) {
-				success = 0;
-			} else {
-				success = 1;
-				break;
-			}
-		}
-		// If the user input is invalid, then reply to the user with a sad face
-		if (strcmp(answer, "") == 0 || success != 1) {
-			snprintf(response, n, ":-(");
-			return 0;
+	// Try to find entity from the knowledge base, a number will be returned from the function
+	find_entity = knowledge_get_words(inv[0], inv + index, inc - index, response, n);
+	if (find_entity != KB_NOTFOUND) {
+		return 0;
+	}
+
+	// A question close to one in the knowledge base (e.g. with a typing mistake) gets that one's answer
+	if (knowledge_get_similar(inv[0], inv + index, inc - index, user_entity, MAX_ENTITY, answer, MAX_RESPONSE) == KB_OK) {
+		snprintf(response, n, "Did you mean \"%s\"? %s", user_entity, answer);
+		return 0;
+	}
+
+	// Otherwise the entry whose entity and answer have the most words in common with the question, if any
+	if (knowledge_search(inv + index, inc - index, &found_intent, user_entity, MAX_ENTITY, answer, MAX_RESPONSE) == KB_OK) {
+		snprintf(response, n, "Did you mean \"%s is %s\"? %s", found_intent, user_entity, answer);
+		return 0;
+	}
+
+	// If there is a fallback answer (e.g. in batch mode), give it instead of asking the user
+	if (chatbot_fallback != NULL) {
+		snprintf(response, n, "%s", chatbot_fallback);
+		return 0;
+	}
+
+	// The entity is only put together to learn it; one too long for the knowledge base cannot be learnt
+	if (!chatbot_join(user_entity, MAX_ENTITY, inc - index, inv + index)) {
+		snprintf(response, n, "Sorry, that is too long for me to remember.");
+		return 0;
+	}
+
+	// Put the question back together to ask the user for the answer
+	chatbot_join(question, MAX_INPUT, inc, inv);
+
+	// In a session (e.g. server mode), ask the question and let the next line answer it
+	if (chatbot_session != NULL) {
+		snprintf(chatbot_session->intent, MAX_INTENT, "%s", inv[0]);
+		snprintf(chatbot_session->entity, MAX_ENTITY, "%s", user_entity);
+		chatbot_session->learning = 1;
+		snprintf(response, n, "I don't know. %s?", question);
+		return 0;
+	}
+
+	prompt_user(answer, MAX_RESPONSE, "I don't know. %s?", question);
+	return chatbot_learn(inv[0], user_entity, answer, response, n);
+}
+
+/*
+ * Learn the answer the user gave to a question that was not in the knowledge
+ * base.
+ *
+ * Input:
+ *   intent   - the question word
+ *   entity   - the entity
+ *   answer   - the user's answer; an empty or blank answer is not learnt
+ *   response - a buffer to receive the chatbot's reply
+ *   n        - the size of the response buffer
+ *
+ * Returns:
+ *   0 (the chatbot should continue chatting)
+ */
+int chatbot_learn(const char *intent, const char *entity, const char *answer, char *response, int n) {
+	int success = 0;
+	int try_put_knowledge;
+	// Check if the user has input an empty string or SPACE
+	for (int i = 0; answer[i] != '\0'; i++) {
+		if (isspace((unsigned char)answer[i]) != 0) {
+			success = 0;
 		} else {
-			// If the user response is valid, proceed to add it into the linked list
-			try_put_knowledge = knowledge_put(inv[0], user_entity, answer);
-		}
-		/*
-		If adding a node into the list was successful, say thank you ;)
-		Else if funciton returns with KB_NOMEM, the program cannot allocate memory for the variables
-		else if KB_INVALID, means the user has input an intent that the chatbor doesn't understand
-		*/
-		if (try_put_knowledge == KB_OK) {
-			snprintf(response, n, "Thank you.");
-		} else if (try_put_knowledge == KB_NOMEM) {
-			snprintf(response, n, "Insufficient memory space");
-		} else if (try_put_knowledge == KB_INVALID) {
-			snprintf(response, n, "Invalid intent specified");
+			success = 1;
+			break;
 		}
 	}
-	// free(question);
-	// free(user_entity);
-	// free(answer);
+	// If the user input is invalid, then reply to the user with a sad face
+	if (strcmp(answer, "") == 0 || success != 1) {
+		snprintf(response, n, ":-(");
+		return 0;
+	} else {
+		// If the user response is valid, proceed to add it into the knowledge base
+		try_put_knowledge = knowledge_put((char *)intent, (char *)entity, (char *)answer);
+	}
+	/*
+	If adding a node into the list was successful, say thank you ;)
+	Else if funciton returns with KB_NOMEM, the program cannot allocate memory for the variables
+	else if KB_INVALID, means the entity was too long or the intent was not understood
+	*/
+	if (try_put_knowledge == KB_OK) {
+		snprintf(response, n, "Thank you.");
+	} else if (try_put_knowledge == KB_NOMEM) {
+		snprintf(response, n, "Insufficient memory space");
+	} else if (try_put_knowledge == KB_INVALID) {
+		snprintf(response, n, "Sorry, I cannot remember that.");
+	}
 	return 0;
 }
 
@@ -329,10 +598,7 @@ int chatbot_do_question(int inc, char *inv[], char *response, int n) {
  */
 int chatbot_is_reset(const char *intent)
 {
-	if (!compare_token("Reset", intent)) {
-		return 1;
-	}
-	return 0;
+	return chatbot_is(intent, chatbot_do_reset);
 }
 
 /*
@@ -363,12 +629,17 @@ int chatbot_do_reset(int inc, char *inv[], char *response, int n)
  */
 int chatbot_is_save(const char *intent)
 {
-	return compare_token(intent, "save") == 0;
+	return chatbot_is(intent, chatbot_do_save);
 }
 
 /*
  * Save the chatbot's knowledge to a file.
  *
+ * "save [as|to] <file>" writes the text format; "save [as|to] <file> as binary"
+ * writes a binary snapshot, which "load" recognises and loads much faster.
+ * The file is replaced atomically (see knowledge_save()), so a save that fails
+ * part of the way through leaves it as it was.
+ *
  * See the comment at the top of the file for a description of how this
  * function is used.
  *
@@ -377,16 +648,37 @@ int chatbot_is_save(const char *intent)
  */
 int chatbot_do_save(int inc, char *inv[], char *response, int n)
 {
-	FILE* f;
-	char *fileName;
-	if (compare_token(inv[1], "as") == 0) {
-		fileName = inv[2];
-	} else if (inc == 2) {
-		fileName = inv[1];
+	char *fileName = NULL;
+	int binary = 0;
+	int i = 1;
+
+	/* the second word may be "as" or "to" */
+	if (i < inc && (compare_token(inv[i], "as") == 0 || compare_token(inv[i], "to") == 0))
+		i++;
+	if (i < inc)
+		fileName = inv[i++];
+	if (i < inc && compare_token(inv[i], "as") == 0)
+		i++;
+	if (i < inc && compare_token(inv[i], "binary") == 0)
+		binary = 1;
+
+	if (fileName == NULL) {
+		snprintf(response, n, "Please tell me which file to save to.");
+		return 0;
+	}
+
+	int checkWrite = knowledge_save(fileName, binary);
+	if (checkWrite == KB_NOMEM) {
+		snprintf(response, n, "Sorry, there was not enough memory to save to %s.", fileName);
+		return 0;
+	} else if (checkWrite != KB_OK) {
+		/* errno is 0 when the failure did not come from a system call */
+		if (errno != 0)
+			snprintf(response, n, "Sorry, I could not save to %s (%s).", fileName, strerror(errno));
+		else
+			snprintf(response, n, "Sorry, I could not save to %s.", fileName);
+		return 0;
 	}
-	f = fopen(fileName, "w");
-	knowledge_write(f);
-	fclose(f);
 	snprintf(response, n, "Saved!");
 	return 0;
 }
@@ -404,20 +696,7 @@ int chatbot_do_save(int inc, char *inv[], char *response, int n)
  */
 int chatbot_is_smalltalk(const char *intent)
 {
-	/* to be implemented */
-	return compare_token(intent, "hello") == 0 ||
-      compare_token(intent, "hey") == 0 ||
-      compare_token(intent, "hi") == 0 ||
-      compare_token(intent, "wassup") == 0 ||
-      compare_token(intent, "it's") == 0 ||
-      compare_token(intent, "greetings") == 0 ||
-      compare_token(intent, "goodbye") == 0 ||
-      compare_token(intent, "bye") == 0 ||
-      compare_token(intent, "school") == 0 ||
-      compare_token(intent, "like") == 0 ||
-      compare_token(intent, "i") == 0 ||
-      compare_token(intent, "are") == 0 ||
-      compare_token(intent, "bye") == 0;
+	return chatbot_is(intent, chatbot_do_smalltalk);
 }
 
 /*
@@ -432,26 +711,112 @@ int chatbot_is_smalltalk(const char *intent)
  */
 int chatbot_do_smalltalk(int inc, char *inv[], char *response, int n)
 {
-	/* to be implemented */
-	if (compare_token(inv[0], "goodbye") == 0 || compare_token(inv[0], "bye") == 0)
+	const CHATBOT_INTENT *intent = chatbot_intent(inv[0]);
+
+	/* "i" is only understood as "i like ..." */
+	if (intent == NULL || intent->reply == NULL ||
+		(strcmp(intent->word, "i") == 0 && (inc < 2 || compare_token(inv[1], "like") != 0)))
 	{
-		snprintf(response, n, "Goodbye!");
-		return 1;
-	} else if (compare_token(inv[0], "it's") == 0) {
-		snprintf(response, n, "Indeed it is.");
+		snprintf(response, n, CHATBOT_GREETING);
 		return 0;
 	}
-  else if (compare_token(inv[0], "school") == 0) {
-		snprintf(response, n, "School is a great place to learn new things!");
-		return 0;
-	} else if (compare_token(inv[0], "i") == 0 && compare_token(inv[1], "like") == 0) {
-		snprintf(response, n, "I like it too!");
+
+	snprintf(response, n, "%s", intent->reply);
+	return intent->stop;
+}
+
+/*
+ * Determine whether an intent is STATS.
+ *
+ * Input:
+ *  intent - the intent
+ *
+ * Returns:
+ *  1, if the intent is "stats"
+ *  0, otherwise
+ */
+int chatbot_is_stats(const char *intent)
+{
+	return chatbot_is(intent, chatbot_do_stats);
+}
+
+/*
+ * Report how much the chatbot has been used: the questions it has answered,
+ * how many of them it knew the answer to and how long they took, and how big
+ * the knowledge base is.
+ *
+ * See the comment at the top of the file for a description of how this
+ * function is used.
+ *
+ * Returns:
+ *   0 (the chatbot always continues chatting after reporting)
+ */
+int chatbot_do_stats(int inc, char *inv[], char *response, int n)
+{
+	(void)inc;
+	(void)inv;
+	stats_summary(response, n);
+	return 0;
+}
+
+
+/*
+ * Determine whether an intent is COMPLETE.
+ *
+ * Input:
+ *  intent - the intent
+ *
+ * Returns:
+ *  1, if the intent is "complete"
+ *  0, otherwise
+ */
+int chatbot_is_complete(const char *intent)
+{
+	return chatbot_is(intent, chatbot_do_complete);
+}
+
+/*
+ * List the entities that complete a question as it is being typed, e.g.
+ * "complete what is ICT10" lists ICT1001 to ICT1005, up to
+ * CHATBOT_COMPLETIONS of them in alphabetical order, separated by commas.
+ * "complete what" lists the first of all of them.
+ *
+ * See the comment at the top of the file for a description of how this
+ * function is used.
+ *
+ * Returns:
+ *   0 (the chatbot always continues chatting after completing)
+ */
+int chatbot_do_complete(int inc, char *inv[], char *response, int n)
+{
+	if (inc < 2 || knowledge_intent(inv[1]) == INTENT_NONE) {
+		snprintf(response, n, "Please tell me which question to complete, e.g. \"complete what is ICT10\".");
 		return 0;
-	}else if (compare_token(inv[0], "are") == 0){
-		snprintf(response, n, "Of course I am!");
+	}
+	int index = 2;
+	if (inc > 2 && (!compare_token(inv[2], "is") || !compare_token(inv[2], "are")))
+		index = 3;
+
+	char prefix[MAX_ENTITY];
+	char entities[CHATBOT_COMPLETIONS][MAX_ENTITY];
+	int found = 0;
+	if (chatbot_join(prefix, MAX_ENTITY, inc - index, inv + index))
+		found = knowledge_complete(inv[1], prefix, entities, CHATBOT_COMPLETIONS);
+	if (found <= 0) {
+		snprintf(response, n, "I don't know anything that starts with \"%s\".", prefix);
 		return 0;
 	}
 
-	snprintf(response, n, "Hello! What would you like to chat about?");
+	/* as many as fit */
+	int len = 0;
+	response[0] = '\0';
+	for (int k = 0; k < found; k++) {
+		int added = snprintf(response + len, n - len, k == 0 ? "%s" : ", %s", entities[k]);
+		if (added < 0 || added >= n - len) {
+			response[len] = '\0';
+			break;
+		}
+		len += added;
+	}
 	return 0;
 }
\ No newline at end of file
@@ -0,0 +1,1430 @@
+/*
+ * ICT1002 (C Language) Group Project.
+ *
+ * This file implements the disk store, which keeps the knowledge base in a
+ * B+tree in a local file instead of in memory, for knowledge bases larger
+ * than memory. "main --disk file" opens it at startup, and from then on the
+ * knowledge base (see knowledge.c) gets, puts, resets, loads and saves through
+ * it; without it the knowledge base stays in memory.
+ *
+ * The file is an array of DISK_PAGE-byte pages. Page 0 holds the header; the
+ * others are nodes of the tree. The key of an entry is its intent, as a byte,
+ * followed by its entity folded to lower case, so the entries of an intent
+ * are together and in alphabetical order. The leaves hold whole entries: the
+ * key, the entity as it was given and the response, which together are at
+ * most a few hundred bytes, so a page holds ten or more and no entry ever
+ * spans pages. The branches hold keys and the pages of the children, dozens to
+ * a page, so a tree of millions of entries is three or four levels deep. A
+ * range of keys is scanned in order by going back up the way down to a leaf
+ * to find the next one, as leaves do not link to each other.
+ *
+ * Inside a node, the records are packed from the end of the page towards its
+ * start, and an array of slots after the node's header gives their offsets in
+ * key order, so a record is found by a binary search of the slots, and
+ * inserting one moves two bytes per record after it rather than the records
+ * themselves. A record that is replaced is left behind as garbage until the
+ * node needs the room, when it is compacted. A node with no room even then is
+ * split in two by bytes, and the first key of the new right half (or, for a
+ * branch, the key between the halves) goes up into the parent. Entries are
+ * never removed one by one, only all at once by disk_reset(), so nodes never
+ * need merging.
+ *
+ * Pages are read into a buffer pool of a fixed number of frames (see
+ * disk_set_pool()), found by a hash of the page number and replaced by CLOCK.
+ * Every lookup passes through the same few branches, which therefore stay in
+ * the pool, so a lookup costs at most a read of its leaf, and one of a branch
+ * now and then.
+ *
+ * Changes are written out in batches (see disk_flush()), after every load and
+ * every DISK_FLUSH_PUTS puts, and a page of the tree as of the last batch is
+ * never written over (shadow paging). The first change to such a page since
+ * the last batch moves it to a free page, changing the page its parent points
+ * to, and so on up to the root, and the old page is only freed once the next
+ * batch is written; a changed page may then be written out whenever it leaves
+ * the pool. A batch writes the changed pages, in page order, syncs them, and
+ * then writes and syncs a new header, which is what makes the new tree the
+ * one in the file. The header has two places in page 0 that batches take in
+ * turn, each with an epoch and a checksum, and disk_open() takes the valid one
+ * with the later epoch, so a crash, even part of the way through writing a
+ * header, loses at most the puts since the last batch, and never the file.
+ * Which pages are free is not kept in the file: disk_open() finds them by
+ * going through the branches.
+ *
+ * One lock covers the tree and the pool. The answer cache (see cache.c) in
+ * front of knowledge_get() takes most of the load off it.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "chat1002.h"
+
+/* the size of a page, in the file and in the pool */
+#define DISK_PAGE 4096
+
+#define DISK_MAGIC   "C1002BT"
+#define DISK_VERSION 2
+
+/* the header is written to one of two places in page 0, this far apart */
+#define DISK_HEADER_SLOT (DISK_PAGE / 2)
+
+/* the size of the pool if disk_set_pool() is not called, in megabytes, and the least it may be */
+#define DISK_DEFAULT_POOL 16
+#define DISK_MIN_FRAMES   64
+
+/* the number of puts after which their pages are written out together */
+#define DISK_FLUSH_PUTS 256
+
+/* the deepest the tree may grow; each level multiplies its size by dozens */
+#define DISK_MAX_DEPTH 16
+
+/* the kinds of node */
+#define DISK_LEAF   1
+#define DISK_BRANCH 2
+
+/* the bytes before the key of a leaf record (key length, response length) and of a branch record (key length, child) */
+#define DISK_LEAF_HEAD   3
+#define DISK_BRANCH_HEAD 5
+
+/* the longest key: the intent and the entity */
+#define DISK_MAX_KEY MAX_ENTITY
+
+/* the header, at the start of one of the halves of page 0 */
+typedef struct disk_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t page_size;
+	uint64_t epoch;              /* the number of batches written; the header with the later one is current */
+	uint32_t root;               /* the page of the root node, or 0 if the tree is empty */
+	uint32_t depth;              /* the number of levels of branches above the leaves */
+	uint32_t npages;             /* the pages of the file that are in use or free, including this one */
+	uint32_t check;              /* FNV-1a of the header, with this field 0 */
+	uint64_t count[KB_INTENTS];  /* the number of entities of each intent */
+	uint8_t order[KB_INTENTS];   /* the intents in the order their first entity was added */
+	uint8_t norder;
+} DISK_HEADER;
+
+/*
+ * The start of every node. A leaf record is the key length (one byte), the
+ * response length (two), the key, the entity as given (one byte shorter than
+ * the key, which starts with the intent) and the response. A branch record is
+ * the key length, the page of the child holding the keys from that key up to
+ * the next record's, and the key.
+ */
+typedef struct disk_node {
+	uint8_t type;                /* DISK_LEAF or DISK_BRANCH */
+	uint8_t unused;
+	uint16_t count;              /* the number of records */
+	uint16_t top;                /* the records are packed from here to the end of the page */
+	uint16_t garbage;            /* bytes of records that no slot refers to any more */
+	uint32_t link;               /* a branch's child below its first key; 0 in a leaf */
+} DISK_NODE;
+
+/* the way down from the root to a leaf */
+typedef struct disk_path {
+	uint32_t page[DISK_MAX_DEPTH + 1];  /* the page at each level, the leaf last */
+	int slot[DISK_MAX_DEPTH];           /* the record of each branch that leads down, or -1 for its link */
+} DISK_PATH;
+
+/* a frame of the buffer pool */
+typedef struct disk_frame {
+	uint32_t page;               /* the page it holds, or 0 if it is free */
+	uint32_t next;               /* the next frame in the same hash chain, plus one, or 0 */
+	uint16_t pins;               /* the number of users of the page, which may not be replaced meanwhile */
+	uint8_t dirty;               /* 1 if the page has changed since it was read or written */
+	uint8_t used;                /* 1 if the page has been used since the CLOCK hand passed */
+} DISK_FRAME;
+
+static struct {
+	pthread_mutex_t lock;
+	int fd;                      /* the file, or -1 if there is no disk store */
+	DISK_HEADER header;
+	unsigned long frames_wanted; /* the size of the pool to allocate, in frames */
+	DISK_FRAME *frames;
+	char *data;                  /* the pages held by the frames */
+	uint32_t *chains;            /* the first frame of each hash chain, plus one, or 0 */
+	unsigned long nframes;
+	unsigned long nchains;       /* a power of two */
+	unsigned long hand;          /* where the CLOCK hand is */
+	unsigned long filled;        /* the number of frames holding a page */
+	unsigned long puts;          /* puts since the last batch was written */
+	int changed;                 /* 1 if the tree has changed since the last batch was written */
+	uint64_t *fresh;             /* a bit for each page allocated since the last batch, which may be changed in place */
+	uint64_t *dropped;           /* a bit for each page of the last batch's tree that has been moved since */
+	uint64_t *free;              /* a bit for each page that may be allocated */
+	unsigned long nbits;         /* the number of pages the bit maps have room for, a multiple of 64 */
+	unsigned long free_from;     /* no page before this one is free */
+	unsigned long reads, writes; /* pages read and written since the store was opened */
+} disk = {.lock = PTHREAD_MUTEX_INITIALIZER, .fd = -1, .frames_wanted = DISK_DEFAULT_POOL * ((1UL << 20) / DISK_PAGE)};
+
+
+/*
+ * Set the memory the buffer pool takes. Only has an effect before disk_open().
+ *
+ * Input:
+ *   megabytes - the size of the pool; it is never less than DISK_MIN_FRAMES pages
+ */
+void disk_set_pool(unsigned long megabytes)
+{
+	disk.frames_wanted = megabytes * ((1UL << 20) / DISK_PAGE);
+}
+
+/*
+ * Determine whether the knowledge base is kept in a disk store.
+ *
+ * Returns: 1 if a disk store is open, 0 otherwise
+ */
+int disk_active()
+{
+	return disk.fd >= 0;
+}
+
+/*
+ * Get the slots of a node.
+ */
+static uint16_t *disk_slots(char *page)
+{
+	return (uint16_t *)(page + sizeof(DISK_NODE));
+}
+
+/*
+ * Get the k'th record of a node, in key order.
+ */
+static const char *disk_record(char *page, int k)
+{
+	return page + disk_slots(page)[k];
+}
+
+/*
+ * Get the length of the response of a leaf record.
+ */
+static size_t disk_response_len(const char *r)
+{
+	uint16_t len;
+	memcpy(&len, r + 1, sizeof(len));
+	return len;
+}
+
+/*
+ * Get the child page of a branch record.
+ */
+static uint32_t disk_child(const char *r)
+{
+	uint32_t child;
+	memcpy(&child, r + 1, sizeof(child));
+	return child;
+}
+
+/*
+ * Get the key of a record.
+ */
+static const char *disk_key(int type, const char *r)
+{
+	return r + (type == DISK_LEAF ? DISK_LEAF_HEAD : DISK_BRANCH_HEAD);
+}
+
+/*
+ * Get the size of a record.
+ */
+static size_t disk_record_size(int type, const char *r)
+{
+	size_t key_len = (uint8_t)r[0];
+	if (type == DISK_BRANCH)
+		return DISK_BRANCH_HEAD + key_len;
+	return DISK_LEAF_HEAD + 2 * key_len - 1 + disk_response_len(r);
+}
+
+/*
+ * Compare two keys, as memcmp() and then by length.
+ */
+static int disk_compare(const char *a, size_t alen, const char *b, size_t blen)
+{
+	int c = memcmp(a, b, alen < blen ? alen : blen);
+	return c != 0 ? c : (alen > blen) - (alen < blen);
+}
+
+/*
+ * Find where a key belongs in a node.
+ *
+ * Output:
+ *   exact - set to 1 if the record found has the key, 0 otherwise
+ *
+ * Returns: the first record whose key is not less than the key, or the number
+ *   of records if there is none
+ */
+static int disk_search(char *page, const char *key, size_t len, int *exact)
+{
+	const DISK_NODE *node = (const DISK_NODE *)page;
+	int lo = 0, hi = node->count;
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+		const char *r = disk_record(page, mid);
+		if (disk_compare(disk_key(node->type, r), (uint8_t)r[0], key, len) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	*exact = 0;
+	if (lo < node->count) {
+		const char *r = disk_record(page, lo);
+		*exact = disk_compare(disk_key(node->type, r), (uint8_t)r[0], key, len) == 0;
+	}
+	return lo;
+}
+
+/*
+ * Find the child of a branch that covers a key.
+ *
+ * Output:
+ *   slot - receives the record that leads to the child, or -1 for the link
+ */
+static uint32_t disk_descend(char *page, const char *key, size_t len, int *slot)
+{
+	int exact;
+	int k = disk_search(page, key, len, &exact);
+	*slot = exact ? k : k - 1;
+	return *slot < 0 ? ((DISK_NODE *)page)->link : disk_child(disk_record(page, *slot));
+}
+
+/*
+ * Start an empty node.
+ */
+static void disk_node_init(char *page, int type, uint32_t link)
+{
+	DISK_NODE *node = (DISK_NODE *)page;
+	node->type = (uint8_t)type;
+	node->unused = 0;
+	node->count = 0;
+	node->top = DISK_PAGE;
+	node->garbage = 0;
+	node->link = link;
+}
+
+/*
+ * Get the free bytes of a node between its slots and its records.
+ */
+static size_t disk_node_room(char *page)
+{
+	const DISK_NODE *node = (const DISK_NODE *)page;
+	return node->top - sizeof(DISK_NODE) - node->count * sizeof(uint16_t);
+}
+
+/*
+ * Add a record to a node as its k'th, which must have the room.
+ */
+static void disk_node_insert(char *page, int k, const char *r, size_t size)
+{
+	DISK_NODE *node = (DISK_NODE *)page;
+	uint16_t *slots = disk_slots(page);
+	node->top = (uint16_t)(node->top - size);
+	memcpy(page + node->top, r, size);
+	memmove(slots + k + 1, slots + k, (node->count - k) * sizeof(uint16_t));
+	slots[k] = node->top;
+	node->count++;
+}
+
+/*
+ * Pack the records of a node together again, leaving out the garbage.
+ */
+static void disk_node_compact(char *page)
+{
+	char copy[DISK_PAGE];
+	memcpy(copy, page, DISK_PAGE);
+	const DISK_NODE *from = (const DISK_NODE *)copy;
+	disk_node_init(page, from->type, from->link);
+	for (int k = 0; k < from->count; k++) {
+		const char *r = disk_record(copy, k);
+		disk_node_insert(page, k, r, disk_record_size(from->type, r));
+	}
+}
+
+/*
+ * Put a record into a node as its k'th, in place of the record there if
+ * 'replace' is 1, compacting the node if that makes room.
+ *
+ * Returns: 1 if the record fits, 0 (with the node unchanged) if the node must
+ *   be split
+ */
+static int disk_node_put(char *page, int k, int replace, const char *r, size_t size)
+{
+	DISK_NODE *node = (DISK_NODE *)page;
+	size_t old = replace ? disk_record_size(node->type, disk_record(page, k)) : 0;
+	size_t room = disk_node_room(page) + (replace ? sizeof(uint16_t) : 0);
+	if (size + sizeof(uint16_t) > room + node->garbage + old)
+		return 0;
+
+	if (replace) {
+		uint16_t *slots = disk_slots(page);
+		memmove(slots + k, slots + k + 1, (node->count - k - 1) * sizeof(uint16_t));
+		node->count--;
+		node->garbage = (uint16_t)(node->garbage + old);
+	}
+	if (size + sizeof(uint16_t) > disk_node_room(page))
+		disk_node_compact(page);
+	disk_node_insert(page, k, r, size);
+	return 1;
+}
+
+/*
+ * Split a node that a record does not fit into in two by bytes, keeping the
+ * lower half in its page and moving the upper half to a new one, with the
+ * record put where it belongs in either.
+ *
+ * Input:
+ *   page, k, replace, r, size - as for disk_node_put()
+ *   right                     - the new page, for the upper half
+ *
+ * Output:
+ *   sep, sep_len - the key that goes up into the parent, with the new page:
+ *                  the first key of a leaf's upper half, or the key between a
+ *                  branch's halves, which neither keeps
+ */
+static void disk_node_split(char *page, int k, int replace, const char *r, size_t size,
+	char *right, char *sep, size_t *sep_len)
+{
+	char copy[DISK_PAGE];
+	memcpy(copy, page, DISK_PAGE);
+	const DISK_NODE *from = (const DISK_NODE *)copy;
+	int type = from->type;
+
+	/* every record in order, with the new one in its place */
+	const char *records[DISK_PAGE / DISK_LEAF_HEAD + 1];
+	size_t sizes[DISK_PAGE / DISK_LEAF_HEAD + 1];
+	int n = 0;
+	size_t total = 0;
+	for (int j = 0; j <= from->count; j++) {
+		if (j == k) {
+			records[n] = r;
+			sizes[n] = size;
+			total += sizes[n++];
+		}
+		if (j < from->count && !(replace && j == k)) {
+			records[n] = disk_record(copy, j);
+			sizes[n] = disk_record_size(type, records[n]);
+			total += sizes[n++];
+		}
+	}
+
+	/*
+	 * The first record of the upper half; a branch needs one key left on each
+	 * side of the one that goes up. A record added at the end, as when loading
+	 * a sorted file, leaves the lower half full rather than half empty.
+	 */
+	int last = n - (type == DISK_BRANCH ? 2 : 1);
+	int m = 1;
+	size_t below = sizes[0];
+	if (k == from->count && !replace)
+		m = last;
+	while (m < last && below + sizes[m] <= total / 2)
+		below += sizes[m++];
+
+	*sep_len = (uint8_t)records[m][0];
+	memcpy(sep, disk_key(type, records[m]), *sep_len);
+	if (type == DISK_LEAF) {
+		disk_node_init(right, DISK_LEAF, 0);
+		disk_node_init(page, DISK_LEAF, 0);
+		for (int j = m; j < n; j++)
+			disk_node_insert(right, j - m, records[j], sizes[j]);
+	} else {
+		disk_node_init(right, DISK_BRANCH, disk_child(records[m]));
+		disk_node_init(page, DISK_BRANCH, from->link);
+		for (int j = m + 1; j < n; j++)
+			disk_node_insert(right, j - m - 1, records[j], sizes[j]);
+	}
+	for (int j = 0; j < m; j++)
+		disk_node_insert(page, j, records[j], sizes[j]);
+}
+
+/*
+ * Compute the checksum of a header: FNV-1a over it, without the checksum.
+ */
+static uint32_t disk_check(const DISK_HEADER *header)
+{
+	DISK_HEADER copy = *header;
+	copy.check = 0;
+	uint32_t h = 2166136261U;
+	for (size_t k = 0; k < sizeof(copy); k++)
+		h = (h ^ ((const unsigned char *)&copy)[k]) * 16777619U;
+	return h;
+}
+
+/*
+ * Write the header to its place in page 0 for its epoch, the one the header
+ * of the batch before is not in.
+ *
+ * Returns: 1 if successful, 0 otherwise
+ */
+static int disk_write_header()
+{
+	char slot[DISK_HEADER_SLOT];
+	memset(slot, 0, sizeof(slot));
+	disk.header.check = disk_check(&disk.header);
+	memcpy(slot, &disk.header, sizeof(DISK_HEADER));
+	return pwrite(disk.fd, slot, sizeof(slot), (off_t)(disk.header.epoch % 2) * DISK_HEADER_SLOT) == (ssize_t)sizeof(slot);
+}
+
+/*
+ * Read the header from one of its places in page 0, and check it.
+ *
+ * Input:
+ *   fd   - the file
+ *   slot - 0 or 1
+ *   size - the size of the file
+ *
+ * Output:
+ *   header - receives the header
+ *
+ * Returns: 1 if it is a valid header, 0 otherwise
+ */
+static int disk_read_header(int fd, int slot, off_t size, DISK_HEADER *header)
+{
+	if (pread(fd, header, sizeof(DISK_HEADER), (off_t)slot * DISK_HEADER_SLOT) != sizeof(DISK_HEADER))
+		return 0;
+	for (int k = 0; k < header->norder && k < KB_INTENTS; k++) {
+		if (header->order[k] >= KB_INTENTS)
+			return 0;
+	}
+	return memcmp(header->magic, DISK_MAGIC, sizeof(DISK_MAGIC)) == 0 && header->version == DISK_VERSION
+		&& header->page_size == DISK_PAGE && header->check == disk_check(header)
+		&& header->depth <= DISK_MAX_DEPTH && header->norder <= KB_INTENTS && header->npages > 0
+		&& header->root < header->npages && (header->root != 0 || header->depth == 0)
+		&& (uint64_t)size >= (uint64_t)header->npages * DISK_PAGE;
+}
+
+/*
+ * Write a frame's page to the file.
+ *
+ * Returns: 1 if successful, 0 otherwise
+ */
+static int disk_write_frame(unsigned long f)
+{
+	if (pwrite(disk.fd, disk.data + f * DISK_PAGE, DISK_PAGE, (off_t)disk.frames[f].page * DISK_PAGE) != DISK_PAGE)
+		return 0;
+	disk.frames[f].dirty = 0;
+	disk.writes++;
+	return 1;
+}
+
+/*
+ * Find the hash chain of a page.
+ */
+static uint32_t *disk_chain(uint32_t page)
+{
+	return &disk.chains[(page * 2654435761U) & (disk.nchains - 1)];
+}
+
+/*
+ * Take a frame out of the hash chain of its page.
+ */
+static void disk_unchain(unsigned long f)
+{
+	uint32_t *at = disk_chain(disk.frames[f].page);
+	while (*at != f + 1)
+		at = &disk.frames[*at - 1].next;
+	*at = disk.frames[f].next;
+}
+
+/*
+ * Get, set and clear the bit of a page in one of the bit maps.
+ */
+static int disk_bit(const uint64_t *bits, uint32_t page)
+{
+	return (int)(bits[page / 64] >> (page % 64) & 1);
+}
+
+static void disk_set_bit(uint64_t *bits, uint32_t page)
+{
+	bits[page / 64] |= 1ULL << (page % 64);
+}
+
+static void disk_clear_bit(uint64_t *bits, uint32_t page)
+{
+	bits[page / 64] &= ~(1ULL << (page % 64));
+}
+
+/*
+ * Make room in the bit maps for a number of pages.
+ *
+ * Returns: 1 if successful, 0 if they could not grow
+ */
+static int disk_grow_bits(unsigned long pages)
+{
+	if (pages <= disk.nbits)
+		return 1;
+	unsigned long n = disk.nbits == 0 ? 1024 : disk.nbits;
+	while (n < pages)
+		n *= 2;
+	uint64_t **maps[3] = {&disk.fresh, &disk.dropped, &disk.free};
+	for (int m = 0; m < 3; m++) {
+		uint64_t *grown = (uint64_t *)realloc(*maps[m], n / 64 * sizeof(uint64_t));
+		if (grown == NULL)
+			return 0;
+		memset(grown + disk.nbits / 64, 0, (n - disk.nbits) / 64 * sizeof(uint64_t));
+		*maps[m] = grown;
+	}
+	disk.nbits = n;
+	return 1;
+}
+
+/*
+ * Get a page into the pool and pin it. The lock must be held.
+ *
+ * Input:
+ *   page  - the page number
+ *   fresh - 1 for a new page, which is not read from the file
+ *
+ * Output:
+ *   frame - receives the frame, for disk_unpin()
+ *
+ * Returns: the page, or NULL if it could not be read or every frame is pinned
+ */
+static char *disk_pin(uint32_t page, int fresh, unsigned long *frame)
+{
+	uint32_t *chain = disk_chain(page);
+	for (uint32_t f = *chain; f != 0; f = disk.frames[f - 1].next) {
+		if (disk.frames[f - 1].page == page) {
+			*frame = f - 1;
+			disk.frames[f - 1].pins++;
+			disk.frames[f - 1].used = 1;
+			if (fresh) {
+				memset(disk.data + (f - 1) * DISK_PAGE, 0, DISK_PAGE);
+				disk.frames[f - 1].dirty = 1;
+			}
+			return disk.data + (f - 1) * DISK_PAGE;
+		}
+	}
+
+	/* CLOCK: pass over pinned frames, and used ones once, clearing their bit */
+	unsigned long f = disk.hand, looked = 0;
+	for (;;) {
+		if (looked++ == 2 * disk.nframes)
+			return NULL;
+		f = disk.hand;
+		disk.hand = (disk.hand + 1) % disk.nframes;
+		if (disk.frames[f].pins > 0)
+			continue;
+		if (disk.frames[f].page == 0 || !disk.frames[f].used)
+			break;
+		disk.frames[f].used = 0;
+	}
+
+	/* only pages allocated since the last batch are ever changed, so this one is not in its tree */
+	DISK_FRAME *victim = &disk.frames[f];
+	if (victim->page != 0) {
+		if (victim->dirty && !disk_write_frame(f))
+			return NULL;
+		disk_unchain(f);
+		disk.filled--;
+	}
+	victim->page = 0;
+
+	char *data = disk.data + f * DISK_PAGE;
+	if (fresh) {
+		memset(data, 0, DISK_PAGE);
+	} else {
+		if (pread(disk.fd, data, DISK_PAGE, (off_t)page * DISK_PAGE) != DISK_PAGE)
+			return NULL;
+		disk.reads++;
+	}
+	victim->page = page;
+	victim->next = *chain;
+	victim->pins = 1;
+	victim->dirty = (uint8_t)fresh;
+	victim->used = 1;
+	*chain = (uint32_t)(f + 1);
+	disk.filled++;
+	*frame = f;
+	return data;
+}
+
+/*
+ * Unpin a page got with disk_pin().
+ *
+ * Input:
+ *   changed - 1 if the page has been changed
+ */
+static void disk_unpin(unsigned long frame, int changed)
+{
+	disk.frames[frame].pins--;
+	if (changed)
+		disk.frames[frame].dirty = 1;
+}
+
+/*
+ * Allocate a page: the first free one, or else a new one at the end of the
+ * file. It may be changed in place until the next batch is written.
+ *
+ * Returns: 1 if successful, 0 if the bit maps could not grow
+ */
+static int disk_alloc(uint32_t *page)
+{
+	unsigned long words = (disk.header.npages + 63) / 64;
+	for (unsigned long w = disk.free_from / 64; w < words && w < disk.nbits / 64; w++) {
+		if (disk.free[w] != 0) {
+			uint32_t found = (uint32_t)(w * 64 + __builtin_ctzll(disk.free[w]));
+			disk_clear_bit(disk.free, found);
+			disk_set_bit(disk.fresh, found);
+			disk.free_from = found + 1;
+			*page = found;
+			return 1;
+		}
+	}
+	disk.free_from = disk.header.npages;
+	if (!disk_grow_bits((unsigned long)disk.header.npages + 1))
+		return 0;
+	*page = disk.header.npages++;
+	disk_set_bit(disk.fresh, *page);
+	return 1;
+}
+
+/*
+ * Give back a page got with disk_alloc() that was never used.
+ */
+static void disk_unalloc(uint32_t page)
+{
+	disk_clear_bit(disk.fresh, page);
+	if (page + 1 == disk.header.npages) {
+		disk.header.npages--;
+	} else {
+		disk_set_bit(disk.free, page);
+		if (page < disk.free_from)
+			disk.free_from = page;
+	}
+}
+
+/*
+ * Start a new page, pinned.
+ *
+ * Returns: the page, or NULL if no page or frame could be had
+ */
+static char *disk_new_page(uint32_t *page, unsigned long *frame)
+{
+	uint32_t allocated;
+	if (!disk_alloc(&allocated))
+		return NULL;
+	char *data = disk_pin(allocated, 1, frame);
+	if (data == NULL) {
+		disk_unalloc(allocated);
+		return NULL;
+	}
+	*page = allocated;
+	return data;
+}
+
+/*
+ * Pin a page in order to change it. A page of the tree of the last batch
+ * written may not be written over, so it is moved to a newly allocated page
+ * first; the frame holding it simply takes the new page's number, as a free
+ * page is never in the pool. The old page is freed by the next batch.
+ *
+ * Input:
+ *   page - the page number; receives the page it has moved to
+ *
+ * Output:
+ *   frame - receives the frame, for disk_unpin()
+ *
+ * Returns: the page, or NULL if it could not be read, or no page or frame could
+ *   be had
+ */
+static char *disk_pin_writable(uint32_t *page, unsigned long *frame)
+{
+	char *data = disk_pin(*page, 0, frame);
+	if (data == NULL || disk_bit(disk.fresh, *page))
+		return data;
+	uint32_t moved;
+	if (!disk_alloc(&moved)) {
+		disk_unpin(*frame, 0);
+		return NULL;
+	}
+	disk_unchain(*frame);
+	uint32_t *chain = disk_chain(moved);
+	disk.frames[*frame].page = moved;
+	disk.frames[*frame].next = *chain;
+	disk.frames[*frame].dirty = 1;
+	*chain = (uint32_t)(*frame + 1);
+	disk_set_bit(disk.dropped, *page);
+	*page = moved;
+	return data;
+}
+
+/*
+ * Order frames by page, for disk_flush().
+ */
+static int disk_compare_frames(const void *a, const void *b)
+{
+	uint32_t x = disk.frames[*(const uint32_t *)a].page, y = disk.frames[*(const uint32_t *)b].page;
+	return (x > y) - (x < y);
+}
+
+/*
+ * Write a batch: every changed page, in page order, then a sync, and then the
+ * header of the new tree and another sync. The pages of the old tree are free
+ * from then on. The lock must be held.
+ *
+ * Returns: KB_OK, or KB_NOMEM if the file could not be written
+ */
+static int disk_flush_locked()
+{
+	disk.puts = 0;
+	if (!disk.changed)
+		return KB_OK;
+	uint32_t *dirty = (uint32_t *)malloc(disk.nframes * sizeof(uint32_t));
+	if (dirty == NULL)
+		return KB_NOMEM;
+	unsigned long n = 0;
+	for (unsigned long f = 0; f < disk.nframes; f++) {
+		if (disk.frames[f].page != 0 && disk.frames[f].dirty)
+			dirty[n++] = (uint32_t)f;
+	}
+	qsort(dirty, n, sizeof(uint32_t), disk_compare_frames);
+	int ok = 1;
+	for (unsigned long k = 0; k < n && ok; k++)
+		ok = disk_write_frame(dirty[k]);
+	free(dirty);
+
+	if (ok && fdatasync(disk.fd) == 0) {
+		disk.header.epoch++;
+		ok = disk_write_header() && fdatasync(disk.fd) == 0;
+		if (!ok)
+			disk.header.epoch--;
+	} else {
+		ok = 0;
+	}
+	if (ok) {
+		for (unsigned long w = 0; w < disk.nbits / 64; w++) {
+			disk.free[w] |= disk.dropped[w];
+			disk.dropped[w] = 0;
+			disk.fresh[w] = 0;
+		}
+		disk.free_from = 0;
+		disk.changed = 0;
+	}
+	return ok ? KB_OK : KB_NOMEM;
+}
+
+/*
+ * Write out the changes made since the last batch, if there have been enough
+ * of them.
+ *
+ * Input:
+ *   all - 1 to write out every change now, 0 to wait for DISK_FLUSH_PUTS puts
+ *
+ * Returns: KB_OK, or KB_NOMEM if the file could not be written
+ */
+int disk_flush(int all)
+{
+	int result = KB_OK;
+	pthread_mutex_lock(&disk.lock);
+	if (disk.fd >= 0 && (all || disk.puts >= DISK_FLUSH_PUTS))
+		result = disk_flush_locked();
+	pthread_mutex_unlock(&disk.lock);
+	return result;
+}
+
+/*
+ * Forget every page in the pool, changed or not. The lock must be held.
+ */
+static void disk_drop_pool()
+{
+	for (unsigned long f = 0; f < disk.nframes; f++)
+		disk.frames[f].page = 0;
+	memset(disk.chains, 0, disk.nchains * sizeof(uint32_t));
+	disk.filled = 0;
+}
+
+/*
+ * Take the pages of a subtree out of the free map, checking that each is in
+ * the file and reached only once. Leaves are not read. The lock must be held.
+ *
+ * Input:
+ *   page  - the root of the subtree
+ *   level - its level, 0 for the root of the tree
+ *
+ * Returns: 1 if successful, 0 if the tree is not valid or could not be read
+ */
+static int disk_mark_tree(uint32_t page, uint32_t level)
+{
+	if (page == 0 || page >= disk.header.npages || !disk_bit(disk.free, page))
+		return 0;
+	disk_clear_bit(disk.free, page);
+	if (level == disk.header.depth)
+		return 1;
+
+	unsigned long frame;
+	char *branch = disk_pin(page, 0, &frame);
+	if (branch == NULL)
+		return 0;
+	const DISK_NODE *node = (const DISK_NODE *)branch;
+	int ok = node->type == DISK_BRANCH && node->count <= (DISK_PAGE - sizeof(DISK_NODE)) / sizeof(uint16_t)
+		&& disk_mark_tree(node->link, level + 1);
+	for (int k = 0; ok && k < node->count; k++) {
+		ok = disk_slots(branch)[k] <= DISK_PAGE - DISK_BRANCH_HEAD
+			&& disk_mark_tree(disk_child(disk_record(branch, k)), level + 1);
+	}
+	disk_unpin(frame, 0);
+	return ok;
+}
+
+/*
+ * Open a disk store, creating it if the file is empty or does not exist. The
+ * knowledge base is kept in it from then on. A store whose writer stopped
+ * part of the way through a batch opens as of the batch before.
+ *
+ * Input:
+ *   path - the file
+ *
+ * Returns:
+ *   the number of entities in the store, if successful
+ *   KB_NOTFOUND, if the file could not be opened
+ *   KB_INVALID, if it is not a disk store
+ *   KB_NOMEM, if the buffer pool could not be allocated
+ *   (a message is printed to stderr if not)
+ */
+long disk_open(const char *path)
+{
+	int fd = open(path, O_RDWR | O_CREAT, 0644);
+	struct stat st;
+	if (fd < 0 || fstat(fd, &st) != 0) {
+		if (fd >= 0)
+			close(fd);
+		fprintf(stderr, "%s: cannot open %s\n", chatbot_botname(), path);
+		return KB_NOTFOUND;
+	}
+
+	/* the header of the last batch written in full */
+	DISK_HEADER header;
+	int found = 0;
+	memset(&header, 0, sizeof(header));
+	for (int slot = 0; slot < 2 && st.st_size > 0; slot++) {
+		DISK_HEADER candidate;
+		if (disk_read_header(fd, slot, st.st_size, &candidate) && (!found || candidate.epoch > header.epoch)) {
+			header = candidate;
+			found = 1;
+		}
+	}
+	if (st.st_size > 0 && !found) {
+		close(fd);
+		fprintf(stderr, "%s: %s is not a disk store\n", chatbot_botname(), path);
+		return KB_INVALID;
+	}
+
+	unsigned long nframes = disk.frames_wanted < DISK_MIN_FRAMES ? DISK_MIN_FRAMES : disk.frames_wanted;
+	unsigned long nchains = 1;
+	while (nchains < 2 * nframes)
+		nchains *= 2;
+	DISK_FRAME *frames = (DISK_FRAME *)calloc(nframes, sizeof(DISK_FRAME));
+	char *data = (char *)malloc(nframes * DISK_PAGE);
+	uint32_t *chains = (uint32_t *)calloc(nchains, sizeof(uint32_t));
+	if (frames == NULL || data == NULL || chains == NULL) {
+		free(frames);
+		free(data);
+		free(chains);
+		close(fd);
+		fprintf(stderr, "%s: cannot allocate the buffer pool of %s\n", chatbot_botname(), path);
+		return KB_NOMEM;
+	}
+
+	pthread_mutex_lock(&disk.lock);
+	disk.fd = fd;
+	disk.frames = frames;
+	disk.data = data;
+	disk.chains = chains;
+	disk.nframes = nframes;
+	disk.nchains = nchains;
+	disk.hand = 0;
+	disk.filled = 0;
+	disk.puts = 0;
+	disk.changed = 0;
+	disk.free_from = 0;
+	disk.reads = disk.writes = 0;
+	long result = 0;
+	if (found) {
+		/* every page is free but those of the tree */
+		disk.header = header;
+		if (!disk_grow_bits(header.npages)) {
+			fprintf(stderr, "%s: cannot allocate the buffer pool of %s\n", chatbot_botname(), path);
+			result = KB_NOMEM;
+		} else {
+			for (uint32_t page = 1; page < header.npages; page++)
+				disk_set_bit(disk.free, page);
+			if (header.root != 0 && !disk_mark_tree(header.root, 0)) {
+				fprintf(stderr, "%s: %s is not a disk store\n", chatbot_botname(), path);
+				result = KB_INVALID;
+			}
+		}
+		if (result == 0) {
+			for (int i = 0; i < KB_INTENTS; i++)
+				result += (long)header.count[i];
+		}
+	} else {
+		/* an empty tree has no pages but the header's */
+		memset(&disk.header, 0, sizeof(disk.header));
+		memcpy(disk.header.magic, DISK_MAGIC, sizeof(DISK_MAGIC));
+		disk.header.version = DISK_VERSION;
+		disk.header.page_size = DISK_PAGE;
+		disk.header.npages = 1;
+		disk.changed = 1;
+		if (disk_flush_locked() != KB_OK) {
+			fprintf(stderr, "%s: cannot write %s\n", chatbot_botname(), path);
+			disk.changed = 0;
+			result = KB_NOMEM;
+		}
+	}
+	pthread_mutex_unlock(&disk.lock);
+	if (result < 0)
+		disk_close();
+	return result;
+}
+
+/*
+ * Write out every change and close the disk store. The knowledge base is
+ * empty, in memory, afterwards.
+ */
+void disk_close()
+{
+	pthread_mutex_lock(&disk.lock);
+	if (disk.fd >= 0) {
+		if (disk_flush_locked() != KB_OK)
+			fprintf(stderr, "%s: cannot write the disk store\n", chatbot_botname());
+		close(disk.fd);
+		disk.fd = -1;
+		free(disk.frames);
+		free(disk.data);
+		free(disk.chains);
+		free(disk.fresh);
+		free(disk.dropped);
+		free(disk.free);
+		disk.frames = NULL;
+		disk.data = NULL;
+		disk.chains = NULL;
+		disk.fresh = disk.dropped = disk.free = NULL;
+		disk.nbits = 0;
+	}
+	pthread_mutex_unlock(&disk.lock);
+}
+
+/*
+ * Make the key of an entry: its intent, then its entity folded to lower case.
+ *
+ * Returns: the length of the key
+ */
+static size_t disk_make_key(char *key, INTENT intent, const char *folded, size_t len)
+{
+	key[0] = (char)intent;
+	memcpy(key + 1, folded, len);
+	return len + 1;
+}
+
+/*
+ * Find the leaf that would hold a key, pinned. The tree must not be empty, and
+ * the lock must be held.
+ *
+ * Output:
+ *   frame - receives the frame, for disk_unpin()
+ *   path  - if not NULL, receives the way down
+ *
+ * Returns: the leaf, or NULL if a page could not be read
+ */
+static char *disk_find_leaf(const char *key, size_t len, unsigned long *frame, DISK_PATH *path)
+{
+	uint32_t page = disk.header.root;
+	for (uint32_t level = 0; level < disk.header.depth; level++) {
+		char *branch = disk_pin(page, 0, frame);
+		if (branch == NULL)
+			return NULL;
+		int slot;
+		uint32_t child = disk_descend(branch, key, len, &slot);
+		disk_unpin(*frame, 0);
+		if (path != NULL) {
+			path->page[level] = page;
+			path->slot[level] = slot;
+		}
+		page = child;
+	}
+	if (path != NULL)
+		path->page[disk.header.depth] = page;
+	return disk_pin(page, 0, frame);
+}
+
+/*
+ * Go on from the leaf at the end of a way down to the next leaf, by going back
+ * up to the first branch with a child after the one taken, and down the first
+ * children from there. The lock must be held.
+ *
+ * Input:
+ *   path - the way down, which is changed to lead to the next leaf
+ *
+ * Output:
+ *   frame - receives the frame, for disk_unpin()
+ *   error - set to 1 if a page could not be read
+ *
+ * Returns: the next leaf, pinned, or NULL if there is none or it could not be
+ *   read
+ */
+static char *disk_next_leaf(DISK_PATH *path, unsigned long *frame, int *error)
+{
+	int level = (int)disk.header.depth;
+	uint32_t page = 0;
+	while (page == 0) {
+		if (--level < 0)
+			return NULL;
+		char *branch = disk_pin(path->page[level], 0, frame);
+		if (branch == NULL) {
+			*error = 1;
+			return NULL;
+		}
+		if (path->slot[level] + 1 < ((DISK_NODE *)branch)->count)
+			page = disk_child(disk_record(branch, ++path->slot[level]));
+		disk_unpin(*frame, 0);
+	}
+	for (level++; level < (int)disk.header.depth; level++) {
+		path->page[level] = page;
+		path->slot[level] = -1;
+		char *branch = disk_pin(page, 0, frame);
+		if (branch == NULL) {
+			*error = 1;
+			return NULL;
+		}
+		page = ((DISK_NODE *)branch)->link;
+		disk_unpin(*frame, 0);
+	}
+	path->page[level] = page;
+	char *leaf = disk_pin(page, 0, frame);
+	if (leaf == NULL)
+		*error = 1;
+	return leaf;
+}
+
+/*
+ * Look up the response to a question.
+ *
+ * Input:
+ *   intent   - the intent
+ *   key      - the entity, folded to lower case by fold_hash()
+ *   len      - its length
+ *   response - a buffer to receive the response
+ *   n        - the size of the buffer
+ *
+ * Returns: KB_OK, or KB_NOTFOUND if the entity is not in the store (or could
+ *   not be read)
+ */
+int disk_get(INTENT intent, const char *key, size_t len, char *response, int n)
+{
+	char full[DISK_MAX_KEY];
+	size_t full_len = disk_make_key(full, intent, key, len);
+	int result = KB_NOTFOUND;
+
+	pthread_mutex_lock(&disk.lock);
+	unsigned long frame;
+	char *leaf = disk.fd >= 0 && disk.header.root != 0 ? disk_find_leaf(full, full_len, &frame, NULL) : NULL;
+	if (leaf != NULL) {
+		int exact;
+		int k = disk_search(leaf, full, full_len, &exact);
+		if (exact) {
+			const char *r = disk_record(leaf, k);
+			snprintf(response, n, "%.*s", (int)disk_response_len(r), r + DISK_LEAF_HEAD + 2 * full_len - 1);
+			result = KB_OK;
+		}
+		disk_unpin(frame, 0);
+	}
+	pthread_mutex_unlock(&disk.lock);
+	return result;
+}
+
+/*
+ * Make the pages on the way down to a leaf changeable (see
+ * disk_pin_writable()), pointing the parent of each page that moves, or the
+ * header, at where it has gone. The lock must be held.
+ *
+ * Input:
+ *   path - the way down, which is changed to the pages moved to
+ *
+ * Returns: KB_OK, or KB_NOMEM if a page could not be read, or no page or frame
+ *   could be had
+ */
+static int disk_shadow_path(DISK_PATH *path)
+{
+	char *parent = NULL;
+	unsigned long parent_frame = 0;
+	for (uint32_t level = 0; level <= disk.header.depth; level++) {
+		uint32_t page = path->page[level];
+		unsigned long frame;
+		char *data = disk_pin_writable(&page, &frame);
+		if (data == NULL) {
+			if (parent != NULL)
+				disk_unpin(parent_frame, 1);
+			return KB_NOMEM;
+		}
+		if (page != path->page[level]) {
+			if (parent == NULL)
+				disk.header.root = page;
+			else if (path->slot[level - 1] < 0)
+				((DISK_NODE *)parent)->link = page;
+			else
+				memcpy(parent + disk_slots(parent)[path->slot[level - 1]] + 1, &page, sizeof(page));
+			path->page[level] = page;
+		}
+		if (parent != NULL)
+			disk_unpin(parent_frame, 1);
+		parent = data;
+		parent_frame = frame;
+	}
+	disk_unpin(parent_frame, 1);
+	return KB_OK;
+}
+
+/*
+ * Insert a record into the tree, splitting nodes as far up as needed. The
+ * lock must be held.
+ *
+ * Output:
+ *   added - set to 1 if the key is new, 0 if its record was replaced
+ *
+ * Returns: KB_OK, or KB_NOMEM if a page could not be read or written
+ */
+static int disk_insert(const char *key, size_t len, const char *r, size_t size, int *added)
+{
+	DISK_PATH path;
+	unsigned long frame, right_frame;
+	if (disk.header.root == 0) {
+		/* the first entry of an empty tree: a leaf, as root */
+		char *leaf = disk_new_page(&disk.header.root, &frame);
+		if (leaf == NULL)
+			return KB_NOMEM;
+		disk_node_init(leaf, DISK_LEAF, 0);
+		disk_unpin(frame, 1);
+		disk.header.depth = 0;
+		disk.changed = 1;
+	}
+	char *page = disk_find_leaf(key, len, &frame, &path);
+	if (page == NULL)
+		return KB_NOMEM;
+	int exact;
+	int k = disk_search(page, key, len, &exact);
+	*added = !exact;
+	disk_unpin(frame, 0);
+
+	if (disk_shadow_path(&path) != KB_OK)
+		return KB_NOMEM;
+	disk.changed = 1;
+	int level = (int)disk.header.depth;
+	page = disk_pin(path.page[level], 0, &frame);
+	if (page == NULL)
+		return KB_NOMEM;
+
+	/* put the record in the leaf, and the separator of each split into the level above */
+	char sep[DISK_MAX_KEY];
+	size_t sep_len;
+	char branch_record[DISK_BRANCH_HEAD + DISK_MAX_KEY];
+	for (;;) {
+		if (disk_node_put(page, k, exact, r, size)) {
+			disk_unpin(frame, 1);
+			return KB_OK;
+		}
+
+		uint32_t right_no;
+		char *right = disk_new_page(&right_no, &right_frame);
+		if (right == NULL) {
+			disk_unpin(frame, 0);
+			return KB_NOMEM;
+		}
+		disk_node_split(page, k, exact, r, size, right, sep, &sep_len);
+		disk_unpin(right_frame, 1);
+		disk_unpin(frame, 1);
+
+		branch_record[0] = (char)sep_len;
+		memcpy(branch_record + 1, &right_no, sizeof(right_no));
+		memcpy(branch_record + DISK_BRANCH_HEAD, sep, sep_len);
+		r = branch_record;
+		size = DISK_BRANCH_HEAD + sep_len;
+		exact = 0;
+
+		if (--level < 0) {
+			/* the root split: a new root over the two halves */
+			if (disk.header.depth == DISK_MAX_DEPTH)
+				return KB_NOMEM;
+			uint32_t old_root = disk.header.root;
+			char *root = disk_new_page(&disk.header.root, &frame);
+			if (root == NULL)
+				return KB_NOMEM;
+			disk_node_init(root, DISK_BRANCH, old_root);
+			disk_node_insert(root, 0, r, size);
+			disk_unpin(frame, 1);
+			disk.header.depth++;
+			return KB_OK;
+		}
+		page = disk_pin(path.page[level], 0, &frame);
+		if (page == NULL)
+			return KB_NOMEM;
+		k = disk_search(page, sep, sep_len, &exact);
+	}
+}
+
+/*
+ * Add or replace an entry. The change is written out with the next batch
+ * (see disk_flush()).
+ *
+ * Input:
+ *   intent       - the intent
+ *   key          - the entity, folded to lower case by fold_hash()
+ *   entity       - the entity as given
+ *   len          - the length of both
+ *   response     - the response
+ *   response_len - its length
+ *
+ * Returns: KB_OK, or KB_NOMEM if the store could not be read or written
+ */
+int disk_put(INTENT intent, const char *key, const char *entity, size_t len, const char *response, size_t response_len)
+{
+	char record[DISK_LEAF_HEAD + 2 * DISK_MAX_KEY + MAX_RESPONSE];
+	size_t key_len = disk_make_key(record + DISK_LEAF_HEAD, intent, key, len);
+	uint16_t rlen = (uint16_t)response_len;
+	record[0] = (char)key_len;
+	memcpy(record + 1, &rlen, sizeof(rlen));
+	memcpy(record + DISK_LEAF_HEAD + key_len, entity, len);
+	memcpy(record + DISK_LEAF_HEAD + key_len + len, response, response_len);
+
+	int result = KB_NOMEM;
+	pthread_mutex_lock(&disk.lock);
+	if (disk.fd >= 0) {
+		int added;
+		result = disk_insert(record + DISK_LEAF_HEAD, key_len, record, DISK_LEAF_HEAD + key_len + len + response_len, &added);
+		if (result == KB_OK && added) {
+			if (disk.header.count[intent]++ == 0)
+				disk.header.order[disk.header.norder++] = (uint8_t)intent;
+		}
+		disk.puts++;
+	}
+	pthread_mutex_unlock(&disk.lock);
+	return result;
+}
+
+/*
+ * Go through the entries of an intent whose entities start with a prefix, in
+ * alphabetical order.
+ *
+ * Input:
+ *   intent - the intent
+ *   prefix - the prefix, folded to lower case by fold_hash(); empty for every entity
+ *   len    - its length
+ *   visit  - called with each entity (as given) and response until it returns non-zero
+ *   arg    - passed to visit
+ *
+ * Returns: KB_OK, or KB_NOMEM if the store could not be read
+ */
+int disk_scan(INTENT intent, const char *prefix, size_t len,
+	int (*visit)(void *arg, const char *entity, size_t entity_len, const char *response, size_t response_len), void *arg)
+{
+	char full[DISK_MAX_KEY];
+	size_t full_len = disk_make_key(full, intent, prefix, len);
+
+	pthread_mutex_lock(&disk.lock);
+	int result = disk.fd >= 0 && disk.header.root == 0 ? KB_OK : KB_NOMEM;
+	DISK_PATH path;
+	unsigned long frame;
+	char *leaf = disk.fd >= 0 && disk.header.root != 0 ? disk_find_leaf(full, full_len, &frame, &path) : NULL;
+	if (leaf != NULL) {
+		int exact;
+		int k = disk_search(leaf, full, full_len, &exact);
+		result = KB_OK;
+		for (;;) {
+			if (k == ((DISK_NODE *)leaf)->count) {
+				disk_unpin(frame, 0);
+				int error = 0;
+				leaf = disk_next_leaf(&path, &frame, &error);
+				if (leaf == NULL) {
+					if (error)
+						result = KB_NOMEM;
+					break;
+				}
+				k = 0;
+				continue;
+			}
+			const char *r = disk_record(leaf, k++);
+			size_t key_len = (uint8_t)r[0];
+			if (key_len < full_len || memcmp(r + DISK_LEAF_HEAD, full, full_len) != 0
+					|| visit(arg, r + DISK_LEAF_HEAD + key_len, key_len - 1, r + DISK_LEAF_HEAD + 2 * key_len - 1, disk_response_len(r))) {
+				disk_unpin(frame, 0);
+				break;
+			}
+		}
+	}
+	pthread_mutex_unlock(&disk.lock);
+	return result;
+}
+
+/*
+ * Get the intents that have entries, in the order their first entry was added.
+ *
+ * Output:
+ *   order - receives the intents
+ *
+ * Returns: the number of intents
+ */
+int disk_intents(int order[KB_INTENTS])
+{
+	pthread_mutex_lock(&disk.lock);
+	int n = disk.header.norder;
+	for (int k = 0; k < n; k++)
+		order[k] = disk.header.order[k];
+	pthread_mutex_unlock(&disk.lock);
+	return n;
+}
+
+/*
+ * Remove every entry, and shrink the file to an empty tree. The header of the
+ * empty tree is written before the file is cut short, so a crash meanwhile
+ * leaves either the old tree or the empty one.
+ *
+ * Returns: KB_OK, or KB_NOMEM if the file could not be written
+ */
+int disk_reset()
+{
+	int result = KB_NOMEM;
+	pthread_mutex_lock(&disk.lock);
+	if (disk.fd >= 0) {
+		disk_drop_pool();
+		for (unsigned long w = 0; w < disk.nbits / 64; w++)
+			disk.fresh[w] = disk.dropped[w] = disk.free[w] = 0;
+		disk.free_from = 0;
+		memset(disk.header.count, 0, sizeof(disk.header.count));
+		disk.header.norder = 0;
+		disk.header.depth = 0;
+		disk.header.root = 0;
+		disk.header.npages = 1;
+		disk.changed = 1;
+		result = disk_flush_locked();
+		if (result == KB_OK && ftruncate(disk.fd, DISK_PAGE) != 0)
+			result = KB_NOMEM;
+	}
+	pthread_mutex_unlock(&disk.lock);
+	return result;
+}
+
+/*
+ * Measure the disk store.
+ *
+ * Output:
+ *   entries - the number of entities in it
+ *   bytes   - the bytes of the buffer pool holding pages
+ *   reads   - the number of pages read since it was opened
+ *   writes  - the number of pages written since it was opened
+ */
+void disk_usage(unsigned long *entries, unsigned long *bytes, unsigned long *reads, unsigned long *writes)
+{
+	pthread_mutex_lock(&disk.lock);
+	*entries = 0;
+	for (int i = 0; i < KB_INTENTS; i++)
+		*entries += (unsigned long)disk.header.count[i];
+	*bytes = disk.filled * DISK_PAGE;
+	*reads = disk.reads;
+	*writes = disk.writes;
+	pthread_mutex_unlock(&disk.lock);
+}
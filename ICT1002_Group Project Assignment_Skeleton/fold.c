@@ -0,0 +1,155 @@
+/*
+ * ICT1002 (C Language) Group Project.
+ *
+ * This file implements ASCII case folding, which every lookup in the chatbot
+ * goes through.
+ *
+ * fold_compare() compares two strings case-insensitively, as compare_token().
+ * fold_hash() folds a string to lower case and hashes it in the same pass.
+ *
+ * On processors with SSE2 (every x86-64 processor) both work on 16 bytes at a
+ * time; elsewhere they fall back to a byte at a time. Only the ASCII letters
+ * are folded, as toupper() and tolower() do in the "C" locale.
+ */
+
+#include <ctype.h>
+#include <stdint.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "chat1002.h"
+
+#ifdef __SSE2__
+/*
+ * Fold the upper-case ASCII letters of 16 bytes to lower case. Bytes 0x80 and
+ * above are negative as signed bytes, so they are never taken for letters.
+ */
+static inline __m128i fold_16(__m128i v)
+{
+	__m128i upper = _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8('A' - 1)), _mm_cmplt_epi8(v, _mm_set1_epi8('Z' + 1)));
+	return _mm_or_si128(v, _mm_and_si128(upper, _mm_set1_epi8(0x20)));
+}
+
+/*
+ * Determine whether 16 bytes can be read from p without crossing into the
+ * next page, which might not be mapped. Reading past the end of a string is
+ * otherwise harmless, though AddressSanitizer cannot tell, so the functions
+ * that do it are not instrumented.
+ */
+static inline int fold_can_load(const char *p)
+{
+	return ((uintptr_t)p & 4095) <= 4096 - 16;
+}
+#endif
+
+#ifdef __SANITIZE_ADDRESS__
+#define FOLD_READS_PAST_END __attribute__((no_sanitize_address))
+#else
+#define FOLD_READS_PAST_END
+#endif
+
+/*
+ * Fold one ASCII letter to lower case.
+ */
+static inline unsigned char fold_1(unsigned char c)
+{
+	return (unsigned)(c - 'A') < 26U ? c | 0x20 : c;
+}
+
+/*
+ * Compare two strings case-insensitively.
+ *
+ * Input:
+ *   a - the first string
+ *   b - the second string
+ *
+ * Returns:
+ *   as strcmp(), comparing the upper-cased characters
+ */
+FOLD_READS_PAST_END int fold_compare(const char *a, const char *b)
+{
+	size_t k = 0;
+
+#ifdef __SSE2__
+	/* skip the part where the two agree, 16 bytes at a time */
+	while (fold_can_load(a + k) && fold_can_load(b + k)) {
+		__m128i x = fold_16(_mm_loadu_si128((const __m128i *)(a + k)));
+		__m128i y = fold_16(_mm_loadu_si128((const __m128i *)(b + k)));
+		unsigned same = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(x, y));
+		unsigned end = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(x, _mm_setzero_si128()));
+		unsigned stop = (~same | end) & 0xFFFF;
+		if (stop != 0) {
+			k += __builtin_ctz(stop);
+			goto found;
+		}
+		k += 16;
+	}
+#endif
+
+	while (a[k] != '\0' && fold_1((unsigned char)a[k]) == fold_1((unsigned char)b[k]))
+		k++;
+
+#ifdef __SSE2__
+found:
+#endif
+	{
+		int x = toupper((unsigned char)a[k]);
+		int y = toupper((unsigned char)b[k]);
+		return x < y ? -1 : x > y;
+	}
+}
+
+/*
+ * Mix eight bytes into a hash.
+ */
+static inline uint64_t fold_mix(uint64_t h, uint64_t w)
+{
+	h = (h ^ w) * 0x9E3779B97F4A7C15ULL;
+	return h ^ (h >> 32);
+}
+
+/*
+ * Fold a string to lower case and hash the result, in one pass. Strings that
+ * fold_compare() considers equal fold to the same bytes and get the same hash.
+ *
+ * The hash takes the folded string eight bytes at a time, as little-endian
+ * words, the last one padded with zeroes.
+ *
+ * Input:
+ *   src - the string; it need not be null-terminated
+ *   len - the length of the string
+ *
+ * Output:
+ *   dst - receives the len folded bytes (not null-terminated); may be src
+ *
+ * Returns: the hash
+ */
+uint32_t fold_hash(char *dst, const char *src, size_t len)
+{
+	uint64_t h = 0x1002 ^ ((uint64_t)len * 0x9E3779B97F4A7C15ULL);
+	size_t k = 0;
+
+#ifdef __SSE2__
+	/* x86 is little-endian, so the two halves of a block are the words */
+	for (; k + 16 <= len; k += 16) {
+		uint64_t w[2];
+		_mm_storeu_si128((__m128i *)(dst + k), fold_16(_mm_loadu_si128((const __m128i *)(src + k))));
+		memcpy(w, dst + k, 16);
+		h = fold_mix(fold_mix(h, w[0]), w[1]);
+	}
+#endif
+
+	while (k < len) {
+		uint64_t w = 0;
+		for (int b = 0; b < 8 && k < len; b++, k++) {
+			unsigned char c = fold_1((unsigned char)src[k]);
+			dst[k] = (char)c;
+			w |= (uint64_t)c << (8 * b);
+		}
+		h = fold_mix(h, w);
+	}
+
+	h *= 0xBF58476D1CE4E5B9ULL;
+	return (uint32_t)(h ^ (h >> 29));
+}
@@ -0,0 +1,391 @@
+/*
+ * ICT1002 (C Language) Group Project.
+ *
+ * This file implements the index that finds the entity closest to one that is
+ * not in the knowledge base, so that the chatbot can answer "did you mean"
+ * rather than give up on a typing mistake.
+ *
+ * Closeness is the edit distance (the number of characters inserted, deleted
+ * or changed to turn one entity into the other), scored as
+ *
+ *   similarity = 1 - distance / length of the longer entity
+ *
+ * and only entities at most a number of edits away that score at least the
+ * cut-off (see fuzzy_set_cutoff()) are offered. Computing the distance to
+ * every entity would take far too long, so the index lists, for each trigram
+ * (three consecutive characters, with the entity padded by two nulls at each
+ * end), the positions of the entities of each intent that contain it. An
+ * entity within distance k of a question that has t trigrams shares at
+ * least t - 3k of them with it, since each edit touches at most three trigrams;
+ * fuzzy_find() counts the shared trigrams from the lists, and only computes
+ * the distance to the entities that have enough of them and a length within k
+ * of the question's. The longest lists, which are the trigrams most entities
+ * have, are only searched, not read.
+ *
+ * Trigrams are hashed to FUZZY_BUCKETS lists, so two trigrams may share a
+ * list. That only ever makes an entity look closer than it is, which the
+ * distance then sorts out.
+ *
+ * The index is keyed by an entity's position in its intent, which never
+ * changes (a new response keeps the entity's position), so it only grows as
+ * entities are added. The knowledge base brings it up to date with
+ * fuzzy_update(), a chunk of positions at a time, before a search rather than
+ * on every insert, and empties it with fuzzy_reset(). A read-write lock lets any number of threads search at
+ * once.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include "chat1002.h"
+
+/* the number of trigram lists per intent */
+#define FUZZY_BUCKETS_SHIFT 16
+#define FUZZY_BUCKETS (1 << FUZZY_BUCKETS_SHIFT)
+
+/* the most trigrams an entity can have: its length plus two */
+#define FUZZY_MAX_TRIGRAMS (MAX_ENTITY + 2)
+
+/* the cut-off and largest distance if fuzzy_set_cutoff() is not called */
+#define FUZZY_DEFAULT_CUTOFF 0.8
+#define FUZZY_DEFAULT_DISTANCE 2
+
+/* the positions of the entities containing the trigrams that hash to one list */
+typedef struct fuzzy_list {
+	uint32_t *pos;
+	uint32_t count;
+	uint32_t size;
+} FUZZY_LIST;
+
+/* the index of one intent */
+typedef struct fuzzy_intent {
+	FUZZY_LIST *lists;           /* FUZZY_BUCKETS lists, or NULL while the intent is empty */
+	uint8_t *lens;               /* the length of the entity at each position */
+	unsigned long count;         /* the number of positions indexed */
+	unsigned long size;          /* the number of positions lens[] has room for */
+} FUZZY_INTENT;
+
+static FUZZY_INTENT fuzzy_intents[KB_INTENTS];
+static pthread_rwlock_t fuzzy_lock = PTHREAD_RWLOCK_INITIALIZER;
+static double fuzzy_cutoff = FUZZY_DEFAULT_CUTOFF;
+static int fuzzy_max_distance = FUZZY_DEFAULT_DISTANCE;
+
+/*
+ * Scratch space for fuzzy_find(), one per thread: the number of trigrams each
+ * position shares with the question (always zero between searches), and the
+ * positions that share enough of them.
+ */
+static __thread uint8_t *fuzzy_shared = NULL;
+static __thread unsigned long fuzzy_nshared = 0;
+static __thread uint32_t *fuzzy_candidates = NULL;
+
+/*
+ * Set how close an entity must be to be offered for one that is not in the
+ * knowledge base.
+ *
+ * Input:
+ *   cutoff   - the similarity it must have, from 0 to 1; 1 turns matching off
+ *   distance - the most edits it may be away; 0 turns matching off
+ */
+void fuzzy_set_cutoff(double cutoff, int distance)
+{
+	fuzzy_cutoff = cutoff < 0 ? 0 : cutoff > 1 ? 1 : cutoff;
+	fuzzy_max_distance = distance < 0 ? 0 : distance;
+}
+
+/*
+ * Hash the trigrams of a folded entity to list numbers, without repeats.
+ *
+ * Output:
+ *   lists - receives the list numbers; at least FUZZY_MAX_TRIGRAMS long
+ *
+ * Returns: the number of distinct list numbers
+ */
+static int fuzzy_trigrams(const char *key, size_t len, uint32_t lists[])
+{
+	int count = 0;
+	uint32_t t = 0;
+	for (size_t k = 0; k < len + 2; k++) {
+		t = (t << 8 | (k < len ? (unsigned char)key[k] : 0)) & 0xFFFFFF;
+		uint32_t list = (t * 0x9E3779B1U) >> (32 - FUZZY_BUCKETS_SHIFT);
+		int seen = 0;
+		for (int j = 0; j < count && !seen; j++)
+			seen = lists[j] == list;
+		if (!seen)
+			lists[count++] = list;
+	}
+	return count;
+}
+
+/*
+ * Get the number of positions of an intent that have been indexed.
+ */
+unsigned long fuzzy_indexed(INTENT intent)
+{
+	return __atomic_load_n(&fuzzy_intents[intent].count, __ATOMIC_ACQUIRE);
+}
+
+/*
+ * Bring the index of an intent up to date. The caller must hold every lock of
+ * the knowledge base, so that no entity is being added meanwhile.
+ *
+ * Input:
+ *   intent - the intent
+ *   count  - the position to index up to (but not including)
+ *   key_of - gets the folded entity at a position, and its length
+ *   arg    - passed to key_of
+ *
+ * Returns: KB_OK, or KB_NOMEM if the index could not grow (it stays as far as
+ *   it got)
+ */
+int fuzzy_update(INTENT intent, unsigned long count, const char *(*key_of)(void *arg, unsigned long pos, size_t *len), void *arg)
+{
+	FUZZY_INTENT *index = &fuzzy_intents[intent];
+	int result = KB_OK;
+	pthread_rwlock_wrlock(&fuzzy_lock);
+	if (index->lists == NULL && count > 0) {
+		index->lists = (FUZZY_LIST *)calloc(FUZZY_BUCKETS, sizeof(FUZZY_LIST));
+		if (index->lists == NULL)
+			result = KB_NOMEM;
+	}
+	if (result == KB_OK && count > index->size) {
+		uint8_t *lens = (uint8_t *)realloc(index->lens, count);
+		if (lens == NULL)
+			result = KB_NOMEM;
+		else {
+			index->lens = lens;
+			index->size = count;
+		}
+	}
+
+	unsigned long pos = index->count;
+	for (; result == KB_OK && pos < count; pos++) {
+		size_t len;
+		const char *key = key_of(arg, pos, &len);
+		uint32_t lists[FUZZY_MAX_TRIGRAMS];
+		int n = fuzzy_trigrams(key, len, lists);
+		for (int k = 0; k < n; k++) {
+			FUZZY_LIST *list = &index->lists[lists[k]];
+			if (list->count == list->size) {
+				uint32_t size = list->size == 0 ? 4 : list->size * 2;
+				uint32_t *grown = (uint32_t *)realloc(list->pos, size * sizeof(uint32_t));
+				if (grown == NULL) {
+					result = KB_NOMEM;
+					break;
+				}
+				list->pos = grown;
+				list->size = size;
+			}
+			list->pos[list->count++] = (uint32_t)pos;
+		}
+		if (result != KB_OK) {
+			/* take the entity back out of the lists it got into */
+			for (int j = 0; j < n; j++) {
+				FUZZY_LIST *list = &index->lists[lists[j]];
+				if (list->count > 0 && list->pos[list->count - 1] == (uint32_t)pos)
+					list->count--;
+			}
+			break;
+		}
+		index->lens[pos] = (uint8_t)len;
+	}
+	__atomic_store_n(&index->count, pos, __ATOMIC_RELEASE);
+	pthread_rwlock_unlock(&fuzzy_lock);
+	return result;
+}
+
+/*
+ * Empty the index, once the knowledge base has been reset.
+ */
+void fuzzy_reset()
+{
+	pthread_rwlock_wrlock(&fuzzy_lock);
+	for (int i = 0; i < KB_INTENTS; i++) {
+		FUZZY_INTENT *index = &fuzzy_intents[i];
+		if (index->lists != NULL) {
+			for (int b = 0; b < FUZZY_BUCKETS; b++)
+				free(index->lists[b].pos);
+		}
+		free(index->lists);
+		free(index->lens);
+		memset(index, 0, sizeof(*index));
+	}
+	pthread_rwlock_unlock(&fuzzy_lock);
+}
+
+/*
+ * Compute the edit distance between two strings, giving up once it is sure to
+ * be more than a limit.
+ *
+ * Returns: the distance, or max + 1 if it is more than max
+ */
+static int fuzzy_distance(const char *a, size_t alen, const char *b, size_t blen, int max)
+{
+	int rows[2][MAX_ENTITY + 1];
+	int *prev = rows[0], *cur = rows[1];
+	for (size_t j = 0; j <= blen; j++)
+		prev[j] = (int)j;
+	for (size_t i = 1; i <= alen; i++) {
+		cur[0] = (int)i;
+		int best = cur[0];
+		for (size_t j = 1; j <= blen; j++) {
+			int d = prev[j - 1] + (a[i - 1] != b[j - 1]);
+			if (prev[j] + 1 < d)
+				d = prev[j] + 1;
+			if (cur[j - 1] + 1 < d)
+				d = cur[j - 1] + 1;
+			cur[j] = d;
+			if (d < best)
+				best = d;
+		}
+		if (best > max)
+			return max + 1;
+		int *swap = prev;
+		prev = cur;
+		cur = swap;
+	}
+	return prev[blen] > max ? max + 1 : prev[blen];
+}
+
+/*
+ * Determine whether a list contains a position, by binary search.
+ *
+ * Returns:
+ *   1, if it does
+ *   0, otherwise
+ */
+static int fuzzy_contains(const FUZZY_LIST *list, uint32_t pos)
+{
+	uint32_t low = 0, high = list->count;
+	while (low < high) {
+		uint32_t mid = low + (high - low) / 2;
+		if (list->pos[mid] < pos)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+	return low < list->count && list->pos[low] == pos;
+}
+
+/*
+ * Make sure the scratch space of the calling thread covers a number of
+ * positions.
+ *
+ * Returns: 1 if it does, 0 on allocation failure
+ */
+static int fuzzy_scratch(unsigned long count)
+{
+	if (count <= fuzzy_nshared)
+		return 1;
+	uint8_t *shared = (uint8_t *)calloc(count, 1);
+	uint32_t *candidates = (uint32_t *)malloc(count * sizeof(uint32_t));
+	if (shared == NULL || candidates == NULL) {
+		free(shared);
+		free(candidates);
+		return 0;
+	}
+	free(fuzzy_shared);
+	free(fuzzy_candidates);
+	fuzzy_shared = shared;
+	fuzzy_candidates = candidates;
+	fuzzy_nshared = count;
+	return 1;
+}
+
+/*
+ * Find the indexed entity of an intent closest to a folded entity that is not
+ * in the knowledge base.
+ *
+ * Input:
+ *   intent - the intent
+ *   key    - the entity, folded by fold_hash()
+ *   len    - the length of the entity
+ *   key_of - gets the folded entity at a position, and its length, or NULL
+ *            if there is none
+ *   arg    - passed to key_of
+ *
+ * Returns: the position of the closest entity scoring at least the cut-off
+ *   (the first in the index if several are as close), or -1 if there is none
+ */
+long fuzzy_find(INTENT intent, const char *key, size_t len, const char *(*key_of)(void *arg, unsigned long pos, size_t *len), void *arg)
+{
+	/* the largest distance that can score at least the cut-off, and that the trigram count can still rule out */
+	double cutoff = fuzzy_cutoff;
+	int max = cutoff > 0 ? (int)((1 - cutoff) * len / cutoff + 1e-9) : (int)len;
+	if (max > fuzzy_max_distance)
+		max = fuzzy_max_distance;
+	if (max > ((int)len + 1) / 3)
+		max = ((int)len + 1) / 3;
+	if (max == 0)
+		return -1;
+
+	uint32_t lists[FUZZY_MAX_TRIGRAMS];
+	int n = fuzzy_trigrams(key, len, lists);
+	int need = n - 3 * max;
+	if (need < 1)
+		need = 1;   /* a question of repeated trigrams, which the bound says little about */
+	long best = -1;
+	int best_distance = max + 1;
+
+	pthread_rwlock_rdlock(&fuzzy_lock);
+	const FUZZY_INTENT *index = &fuzzy_intents[intent];
+	if (index->lists == NULL || !fuzzy_scratch(index->count)) {
+		pthread_rwlock_unlock(&fuzzy_lock);
+		return -1;
+	}
+
+	/*
+	 * An entity that shares need of the n lists is in at least one of any
+	 * n - need + 1 of them, so only that many of the shortest lists are
+	 * scanned; the entities found there are then looked for in the longer
+	 * lists, which are in order of position as positions are added in order.
+	 */
+	const FUZZY_LIST *sorted[FUZZY_MAX_TRIGRAMS];
+	for (int k = 0; k < n; k++) {
+		const FUZZY_LIST *list = &index->lists[lists[k]];
+		int j = k;
+		for (; j > 0 && sorted[j - 1]->count > list->count; j--)
+			sorted[j] = sorted[j - 1];
+		sorted[j] = list;
+	}
+	int scan = n - need + 1;
+	unsigned long ntouched = 0;
+	for (int k = 0; k < scan; k++) {
+		for (uint32_t p = 0; p < sorted[k]->count; p++) {
+			uint32_t pos = sorted[k]->pos[p];
+			if (fuzzy_shared[pos]++ == 0)
+				fuzzy_candidates[ntouched++] = pos;
+		}
+	}
+	unsigned long ncandidates = 0;
+	for (unsigned long t = 0; t < ntouched; t++) {
+		uint32_t pos = fuzzy_candidates[t];
+		int shared = fuzzy_shared[pos];
+		fuzzy_shared[pos] = 0;
+		int diff = (int)index->lens[pos] - (int)len;
+		if (diff < -max || diff > max)
+			continue;
+		for (int k = scan; k < n && shared < need && shared + (n - k) >= need; k++)
+			shared += fuzzy_contains(sorted[k], pos);
+		if (shared >= need)
+			fuzzy_candidates[ncandidates++] = pos;
+	}
+	pthread_rwlock_unlock(&fuzzy_lock);
+
+	for (unsigned long c = 0; c < ncandidates; c++) {
+		size_t other_len;
+		const char *other = key_of(arg, fuzzy_candidates[c], &other_len);
+		if (other == NULL)
+			continue;
+		int d = fuzzy_distance(key, len, other, other_len, best_distance);
+		size_t longer = other_len > len ? other_len : len;
+		if ((d < best_distance || (d == best_distance && fuzzy_candidates[c] < best)) && d <= max
+				&& 1 - (double)d / longer >= cutoff) {
+			best = fuzzy_candidates[c];
+			best_distance = d;
+		}
+	}
+	return best;
+}
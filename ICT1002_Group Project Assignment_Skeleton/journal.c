@@ -0,0 +1,606 @@
+/*
+ * ICT1002 (C Language) Group Project.
+ *
+ * This file implements the journal that keeps what the chatbot learns across
+ * restarts without saving the whole knowledge base after every change.
+ *
+ * "main --journal file" keeps the knowledge base in two files: 'file', a
+ * binary snapshot (see knowledge_write_binary()), and 'file.journal', which
+ * gets a small record appended for every knowledge_put() and
+ * knowledge_reset(). At startup journal_open() loads the snapshot and replays
+ * the journal over it.
+ *
+ * Records are appended to a buffer in memory, with the lock of the changed
+ * entity's shard held (every lock, for a reset) so that the records of each
+ * entity are in the order its changes were made, and a flusher thread writes
+ * the buffer and syncs it to disk. The thread that made
+ * the change waits in journal_wait() until its record is on disk; while one
+ * sync is under way the records of other threads pile up in the buffer and go
+ * out together with the next, so one sync covers every change that arrived in
+ * the meantime (group commit).
+ *
+ * Every record has a sequence number, and a snapshot records the number of the
+ * last change it includes. Once the journal outgrows the snapshot, a compactor
+ * thread folds it into a new one: the flusher renames the journal to
+ * 'file.journal.old' and starts a new one, the compactor replaces 'file' with
+ * a new snapshot (see knowledge_save()), and only then removes the old
+ * journal. Replaying both journals and skipping the records the snapshot
+ * already has gives the same knowledge base whenever the process stops. A
+ * record that is cut short or fails its checksum ends the journal, as it can
+ * only be the last one, caught part-written.
+ *
+ * Loading a knowledge file is not journalled: "load" asks for a compaction
+ * instead, with journal_compact().
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "chat1002.h"
+
+/* the journal is folded into a new snapshot once it is bigger than the snapshot, and at least this big */
+#define JOURNAL_COMPACT_BYTES (4UL << 20)
+
+/* the intent of a record that resets the knowledge base */
+#define JOURNAL_RESET 0xFF
+
+/* the header of a record, followed by the entity and the response of a put */
+typedef struct journal_record {
+	uint64_t sequence;           /* 1 for the first change, and so on */
+	uint32_t check;              /* journal_check() of the rest of the record */
+	uint16_t response_len;
+	uint8_t entity_len;
+	uint8_t intent;              /* the INTENT of a put, or JOURNAL_RESET */
+} JOURNAL_RECORD;
+
+/* state shared with the flusher and the compactor; everything below 'lock' is protected by it */
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t work;         /* records were buffered, a rotation was asked for, or the journal is closing */
+	pthread_cond_t synced;       /* the flusher synced some records, or rotated the journal */
+	pthread_cond_t compact;      /* a compaction was asked for, or the journal is closing */
+	int active;                  /* 1 between journal_open() and journal_close() */
+	int failed;                  /* 1 once writing the journal has failed; changes are no longer saved */
+	int closing;
+	int rotate;                  /* 1 while the compactor waits for the flusher to start a new journal */
+	int compacting;              /* 1 if a compaction has been asked for and not finished */
+	int old;                     /* 1 if file.journal.old exists */
+	char *buffer;                /* records not yet handed to the flusher */
+	size_t used, size;
+	uint64_t sequence;           /* the last sequence number given out */
+	uint64_t durable;            /* the last sequence number synced to disk */
+	unsigned long bytes;         /* the size of the journal */
+	unsigned long old_bytes;     /* the size of the old journal, if there is one */
+	unsigned long snapshot_bytes;
+	unsigned long records;       /* counters for journal_usage() */
+	unsigned long syncs;
+	unsigned long compactions;
+	int fd;                      /* file.journal, written only by the flusher */
+	char *path;                  /* file, file.journal and file.journal.old */
+	char *journal_path;
+	char *old_path;
+	pthread_t flusher;
+	pthread_t compactor;
+} journal = {.lock = PTHREAD_MUTEX_INITIALIZER, .work = PTHREAD_COND_INITIALIZER, .synced = PTHREAD_COND_INITIALIZER, .compact = PTHREAD_COND_INITIALIZER, .fd = -1};
+
+/*
+ * Compute the checksum of a record: FNV-1a over its header, without the
+ * checksum, and its strings.
+ */
+static uint32_t journal_check(const JOURNAL_RECORD *record, const char *entity, const char *response)
+{
+	JOURNAL_RECORD copy = *record;
+	copy.check = 0;
+	uint32_t h = 2166136261U;
+	for (size_t k = 0; k < sizeof(copy); k++)
+		h = (h ^ ((const unsigned char *)&copy)[k]) * 16777619U;
+	for (size_t k = 0; k < record->entity_len; k++)
+		h = (h ^ (unsigned char)entity[k]) * 16777619U;
+	for (size_t k = 0; k < record->response_len; k++)
+		h = (h ^ (unsigned char)response[k]) * 16777619U;
+	return h;
+}
+
+/*
+ * Give a record the next sequence number and add it to the buffer for the
+ * flusher, unless the journal is not in use.
+ *
+ * Input:
+ *   record   - the header, with the intent and the lengths filled in
+ *   entity   - the entity, if any
+ *   response - the response, if any
+ *
+ * Returns: the record's sequence number, or 0 if the journal is not in use
+ *   (or cannot grow, which stops it)
+ */
+static uint64_t journal_append(JOURNAL_RECORD *record, const char *entity, const char *response)
+{
+	if (!__atomic_load_n(&journal.active, __ATOMIC_ACQUIRE))
+		return 0;
+	pthread_mutex_lock(&journal.lock);
+	size_t want = journal.used + sizeof(JOURNAL_RECORD) + record->entity_len + record->response_len;
+	if (journal.failed || journal.closing) {
+		pthread_mutex_unlock(&journal.lock);
+		return 0;
+	}
+	if (want > journal.size) {
+		size_t size = journal.size == 0 ? 65536 : journal.size * 2;
+		while (size < want)
+			size *= 2;
+		char *buffer = (char *)realloc(journal.buffer, size);
+		if (buffer == NULL) {
+			fprintf(stderr, "%s: the journal ran out of memory; changes are no longer saved\n", chatbot_botname());
+			journal.failed = 1;
+			pthread_cond_broadcast(&journal.synced);
+			pthread_mutex_unlock(&journal.lock);
+			return 0;
+		}
+		journal.buffer = buffer;
+		journal.size = size;
+	}
+
+	record->sequence = ++journal.sequence;
+	record->check = journal_check(record, entity, response);
+	char *at = journal.buffer + journal.used;
+	memcpy(at, record, sizeof(JOURNAL_RECORD));
+	memcpy(at + sizeof(JOURNAL_RECORD), entity, record->entity_len);
+	memcpy(at + sizeof(JOURNAL_RECORD) + record->entity_len, response, record->response_len);
+	journal.used = want;
+	journal.records++;
+	pthread_cond_signal(&journal.work);
+	pthread_mutex_unlock(&journal.lock);
+	return record->sequence;
+}
+
+/*
+ * Journal a knowledge_put(). The caller must hold the lock of the entity's
+ * shard, and should call journal_wait() once it has let go of it.
+ *
+ * Returns: the sequence number of the record, or 0 if the journal is not in use
+ */
+uint64_t journal_put(INTENT intent, const char *entity, size_t entity_len, const char *response, size_t response_len)
+{
+	JOURNAL_RECORD record;
+	memset(&record, 0, sizeof(record));
+	record.intent = (uint8_t)intent;
+	record.entity_len = (uint8_t)entity_len;
+	record.response_len = (uint16_t)response_len;
+	return journal_append(&record, entity, response);
+}
+
+/*
+ * Journal a knowledge_reset(), as journal_put() but with every lock of the
+ * knowledge base held.
+ *
+ * Returns: the sequence number of the record, or 0 if the journal is not in use
+ */
+uint64_t journal_reset()
+{
+	JOURNAL_RECORD record;
+	memset(&record, 0, sizeof(record));
+	record.intent = JOURNAL_RESET;
+	return journal_append(&record, "", "");
+}
+
+/*
+ * Get the sequence number of the last change journalled, which a snapshot
+ * written now includes. The caller must hold every lock of the knowledge base,
+ * so that no change is journalled meanwhile.
+ */
+uint64_t journal_sequence()
+{
+	pthread_mutex_lock(&journal.lock);
+	uint64_t sequence = journal.sequence;
+	pthread_mutex_unlock(&journal.lock);
+	return sequence;
+}
+
+/*
+ * Wait until a change is on disk.
+ *
+ * Input:
+ *   sequence - the sequence number from journal_put() or journal_reset(), or 0
+ *
+ * Returns: KB_OK, or KB_INVALID if the journal could not be written
+ */
+int journal_wait(uint64_t sequence)
+{
+	if (sequence == 0)
+		return KB_OK;
+	pthread_mutex_lock(&journal.lock);
+	while (journal.durable < sequence && !journal.failed)
+		pthread_cond_wait(&journal.synced, &journal.lock);
+	int result = journal.durable >= sequence ? KB_OK : KB_INVALID;
+	pthread_mutex_unlock(&journal.lock);
+	return result;
+}
+
+/*
+ * Ask the compactor to fold the journal into a new snapshot, in the
+ * background. Does nothing if the journal is not in use.
+ */
+void journal_compact()
+{
+	pthread_mutex_lock(&journal.lock);
+	if (journal.active && !journal.compacting) {
+		journal.compacting = 1;
+		pthread_cond_signal(&journal.compact);
+	}
+	pthread_mutex_unlock(&journal.lock);
+}
+
+/*
+ * Write all of a buffer to a file descriptor.
+ *
+ * Returns: 1 if successful, 0 otherwise
+ */
+static int journal_write_all(int fd, const char *data, size_t len)
+{
+	while (len > 0) {
+		ssize_t n = write(fd, data, len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return 0;
+		data += n;
+		len -= (size_t)n;
+	}
+	return 1;
+}
+
+/*
+ * Rename the journal to file.journal.old and start a new one. Called by the
+ * flusher, which alone writes the journal.
+ *
+ * Returns: 1 if successful, 0 otherwise
+ */
+static int journal_rotate()
+{
+	if (rename(journal.journal_path, journal.old_path) != 0)
+		return 0;
+	int fd = open(journal.journal_path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+	if (fd < 0)
+		return 0;
+	if (!knowledge_sync_dir(journal.journal_path)) {
+		close(fd);
+		return 0;
+	}
+	close(journal.fd);
+	journal.fd = fd;
+	return 1;
+}
+
+/*
+ * The flusher: write whatever records have been buffered and sync them, as
+ * one write and one sync however many there are.
+ */
+static void *journal_flush(void *arg)
+{
+	(void)arg;
+	char *spare = NULL;
+	size_t spare_size = 0;
+
+	pthread_mutex_lock(&journal.lock);
+	for (;;) {
+		while (journal.used == 0 && !journal.rotate && !journal.closing)
+			pthread_cond_wait(&journal.work, &journal.lock);
+		if (journal.used == 0 && !journal.rotate)
+			break;
+
+		/* take the buffer, leaving the empty spare for the next records */
+		char *buffer = journal.buffer;
+		size_t size = journal.size;
+		size_t used = journal.used;
+		journal.buffer = spare;
+		journal.size = spare_size;
+		journal.used = 0;
+		spare = buffer;
+		spare_size = size;
+		uint64_t last = journal.sequence;
+		int rotate = journal.rotate;
+		pthread_mutex_unlock(&journal.lock);
+
+		int ok = journal_write_all(journal.fd, buffer, used) && fdatasync(journal.fd) == 0;
+		if (ok && rotate)
+			ok = journal_rotate();
+
+		pthread_mutex_lock(&journal.lock);
+		if (!ok && !journal.failed) {
+			fprintf(stderr, "%s: cannot write %s (%s); changes are no longer saved\n", chatbot_botname(), journal.journal_path, strerror(errno));
+			journal.failed = 1;
+		}
+		if (ok) {
+			journal.durable = last;
+			journal.syncs += used > 0;
+			journal.bytes += used;
+		}
+		if (ok && rotate) {
+			journal.old = 1;
+			journal.old_bytes = journal.bytes;
+			journal.bytes = 0;
+		}
+		journal.rotate = 0;
+		pthread_cond_broadcast(&journal.synced);
+		unsigned long bytes = journal.bytes + journal.old_bytes;
+		if (!journal.compacting && bytes > JOURNAL_COMPACT_BYTES && bytes > journal.snapshot_bytes) {
+			journal.compacting = 1;
+			pthread_cond_signal(&journal.compact);
+		}
+	}
+	pthread_mutex_unlock(&journal.lock);
+	free(spare);
+	return NULL;
+}
+
+/*
+ * The compactor: fold the journal into a new snapshot whenever asked.
+ */
+static void *journal_compactor(void *arg)
+{
+	(void)arg;
+	pthread_mutex_lock(&journal.lock);
+	for (;;) {
+		while (!journal.compacting && !journal.closing)
+			pthread_cond_wait(&journal.compact, &journal.lock);
+		if (!journal.compacting)
+			break;
+
+		/* start a new journal, unless an earlier compaction failed after doing so */
+		if (!journal.old) {
+			journal.rotate = 1;
+			pthread_cond_signal(&journal.work);
+			while (journal.rotate)
+				pthread_cond_wait(&journal.synced, &journal.lock);
+		}
+		if (journal.failed)
+			break;
+		pthread_mutex_unlock(&journal.lock);
+
+		/* everything in the old journal is in the snapshot, which may only then replace it */
+		struct stat st;
+		long size = knowledge_save(journal.path, 1) == KB_OK && stat(journal.path, &st) == 0 ? (long)st.st_size : -1;
+		int error = errno;
+		if (size >= 0)
+			unlink(journal.old_path);
+
+		pthread_mutex_lock(&journal.lock);
+		if (size >= 0) {
+			journal.old = 0;
+			journal.old_bytes = 0;
+			journal.snapshot_bytes = (unsigned long)size;
+			journal.compactions++;
+		} else if (error != 0) {
+			fprintf(stderr, "%s: cannot save %s (%s)\n", chatbot_botname(), journal.path, strerror(error));
+		} else {
+			fprintf(stderr, "%s: cannot save %s\n", chatbot_botname(), journal.path);
+		}
+		journal.compacting = 0;
+	}
+	pthread_mutex_unlock(&journal.lock);
+	return NULL;
+}
+
+/*
+ * Replay a journal over the knowledge base.
+ *
+ * Input:
+ *   path - the journal
+ *   last - the sequence number of the last change already made; updated
+ *
+ * Output:
+ *   valid - receives the length of the journal up to the first record that is
+ *           cut short or damaged (may be NULL)
+ *
+ * Returns: the number of changes replayed (0 if there is no such journal),
+ *   KB_NOMEM if there was a memory allocation failure, or KB_INVALID if the
+ *   journal could not be read
+ */
+static long journal_replay(const char *path, uint64_t *last, off_t *valid)
+{
+	char entity[MAX_ENTITY], response[MAX_RESPONSE];
+	char intent[MAX_INTENT];
+	if (valid != NULL)
+		*valid = 0;
+	FILE *f = fopen(path, "rb");
+	if (f == NULL)
+		return errno == ENOENT ? 0 : KB_INVALID;
+
+	long count = 0;
+	off_t at = 0;
+	JOURNAL_RECORD record;
+	char data[MAX_ENTITY + MAX_RESPONSE];
+	while (fread(&record, sizeof(record), 1, f) == 1) {
+		size_t len = (size_t)record.entity_len + record.response_len;
+		if (record.entity_len >= MAX_ENTITY || record.response_len >= MAX_RESPONSE || fread(data, 1, len, f) != len)
+			break;
+		if (record.check != journal_check(&record, data, data + record.entity_len) || (record.intent >= KB_INTENTS && record.intent != JOURNAL_RESET))
+			break;
+		at += (off_t)(sizeof(record) + len);
+
+		/* changes the snapshot (or the old journal) already has */
+		if (record.sequence <= *last)
+			continue;
+		*last = record.sequence;
+		count++;
+		if (record.intent == JOURNAL_RESET) {
+			knowledge_reset();
+			continue;
+		}
+		memcpy(entity, data, record.entity_len);
+		entity[record.entity_len] = '\0';
+		memcpy(response, data + record.entity_len, record.response_len);
+		response[record.response_len] = '\0';
+		snprintf(intent, sizeof(intent), "%s", knowledge_intent_name((INTENT)record.intent));
+		int result = knowledge_put(intent, entity, response);
+		if (result == KB_NOMEM) {
+			fclose(f);
+			return KB_NOMEM;
+		}
+	}
+	fclose(f);
+	if (valid != NULL)
+		*valid = at;
+	return count;
+}
+
+/*
+ * Make a copy of a path with a suffix.
+ *
+ * Returns: the copy, or NULL on allocation failure
+ */
+static char *journal_path_with(const char *path, const char *suffix)
+{
+	char *copy = (char *)malloc(strlen(path) + strlen(suffix) + 1);
+	if (copy != NULL)
+		sprintf(copy, "%s%s", path, suffix);
+	return copy;
+}
+
+/*
+ * Start keeping the knowledge base in a snapshot and a journal: load the
+ * snapshot, if there is one, replay the journal over it and start journalling
+ * every change from then on.
+ *
+ * Input:
+ *   path - the snapshot; the journal is path.journal
+ *
+ * Returns: the number of changes replayed, KB_NOMEM if there was a memory
+ *   allocation failure, or KB_INVALID if the files could not be read or the
+ *   journal could not be started (a message is printed to stderr)
+ */
+long journal_open(const char *path)
+{
+	if (journal.active)
+		return KB_INVALID;
+	journal.fd = -1;
+	journal.path = journal_path_with(path, "");
+	journal.journal_path = journal_path_with(path, ".journal");
+	journal.old_path = journal_path_with(path, ".journal.old");
+	if (journal.path == NULL || journal.journal_path == NULL || journal.old_path == NULL) {
+		journal_close();
+		return KB_NOMEM;
+	}
+
+	/* the snapshot, then the old journal if a compaction was cut short, then the journal */
+	uint64_t last = 0;
+	struct stat st;
+	FILE *f = fopen(path, "rb");
+	if (f != NULL) {
+		int read = knowledge_read(f);
+		fstat(fileno(f), &st);
+		fclose(f);
+		if (read < 0) {
+			fprintf(stderr, "%s: cannot load %s\n", chatbot_botname(), path);
+			journal_close();
+			return read;
+		}
+		last = knowledge_sequence();
+		journal.snapshot_bytes = (unsigned long)st.st_size;
+	} else if (errno != ENOENT) {
+		fprintf(stderr, "%s: cannot open %s\n", chatbot_botname(), path);
+		journal_close();
+		return KB_INVALID;
+	}
+	off_t valid;
+	long replayed = journal_replay(journal.old_path, &last, NULL);
+	long more = replayed < 0 ? 0 : journal_replay(journal.journal_path, &last, &valid);
+	if (replayed < 0 || more < 0) {
+		fprintf(stderr, "%s: cannot replay %s\n", chatbot_botname(), replayed < 0 ? journal.old_path : journal.journal_path);
+		journal_close();
+		return replayed < 0 ? replayed : more;
+	}
+	replayed += more;
+	journal.old = access(journal.old_path, F_OK) == 0;
+
+	/* drop a record caught part-written, so that new ones follow the last good one */
+	journal.fd = open(journal.journal_path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+	if (journal.fd < 0 || ftruncate(journal.fd, valid) != 0 || fdatasync(journal.fd) != 0 || !knowledge_sync_dir(journal.journal_path)) {
+		fprintf(stderr, "%s: cannot write %s\n", chatbot_botname(), journal.journal_path);
+		journal_close();
+		return KB_INVALID;
+	}
+	journal.bytes = (unsigned long)valid;
+	if (journal.old && stat(journal.old_path, &st) == 0)
+		journal.old_bytes = (unsigned long)st.st_size;
+	journal.sequence = last;
+	journal.durable = last;
+	journal.failed = 0;
+	journal.closing = 0;
+	journal.compacting = 0;
+
+	if (pthread_create(&journal.flusher, NULL, journal_flush, NULL) != 0) {
+		journal_close();
+		return KB_INVALID;
+	}
+	if (pthread_create(&journal.compactor, NULL, journal_compactor, NULL) != 0) {
+		journal.closing = 1;
+		pthread_cond_signal(&journal.work);
+		pthread_join(journal.flusher, NULL);
+		journal_close();
+		return KB_INVALID;
+	}
+	__atomic_store_n(&journal.active, 1, __ATOMIC_RELEASE);
+
+	/* finish a compaction that was cut short */
+	if (journal.old)
+		journal_compact();
+	return replayed;
+}
+
+/*
+ * Stop journalling: finish any compaction asked for, write and sync any
+ * records still buffered and stop the flusher and the compactor.
+ */
+void journal_close()
+{
+	if (journal.active) {
+		pthread_mutex_lock(&journal.lock);
+		journal.closing = 1;
+		pthread_cond_broadcast(&journal.work);
+		pthread_cond_broadcast(&journal.compact);
+		pthread_mutex_unlock(&journal.lock);
+		pthread_join(journal.compactor, NULL);
+		pthread_join(journal.flusher, NULL);
+		__atomic_store_n(&journal.active, 0, __ATOMIC_RELEASE);
+	}
+	if (journal.fd >= 0)
+		close(journal.fd);
+	free(journal.buffer);
+	free(journal.path);
+	free(journal.journal_path);
+	free(journal.old_path);
+	journal.fd = -1;
+	journal.buffer = NULL;
+	journal.used = journal.size = 0;
+	journal.path = journal.journal_path = journal.old_path = NULL;
+	journal.bytes = journal.old_bytes = journal.snapshot_bytes = 0;
+	journal.sequence = journal.durable = 0;
+	journal.old = 0;
+}
+
+/*
+ * Measure the journal.
+ *
+ * Output:
+ *   records     - the number of changes journalled since it was opened
+ *   syncs       - the number of times it was synced to disk; records / syncs
+ *                 is the number of changes each sync covered
+ *   bytes       - the size of the journal on disk
+ *   compactions - the number of snapshots written since it was opened
+ */
+void journal_usage(unsigned long *records, unsigned long *syncs, unsigned long *bytes, unsigned long *compactions)
+{
+	pthread_mutex_lock(&journal.lock);
+	*records = journal.records;
+	*syncs = journal.syncs;
+	*bytes = journal.bytes + journal.old_bytes;
+	*compactions = journal.compactions;
+	pthread_mutex_unlock(&journal.lock);
+}
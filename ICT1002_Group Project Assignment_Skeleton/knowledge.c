@@ -3,303 +3,3452 @@
  *
  * This file implements the chatbot's knowledge base.
  *
- * knowledge_get() retrieves the response to a question.
+ * knowledge_get() retrieves the response to a question, from the answer cache
+ * (see cache.c) if it is there.
+ * knowledge_get_similar() answers the question closest to one that is not there.
+ * knowledge_search() answers the entry whose words best match a question.
+ * knowledge_complete() lists the entities that start with a prefix.
  * knowledge_put() inserts a new response to a question.
  * knowledge_read() reads the knowledge base from a file.
+ * knowledge_read_files() reads several files at once, parsing them in parallel.
+ * knowledge_batch_*() insert many entries at once.
  * knowledge_reset() erases all of the knowledge.
- * knowledge_write() saves the knowledge base in a file.
+ * knowledge_write() writes the knowledge base to a file.
+ * knowledge_save() saves the knowledge base in a file, replacing it atomically.
+ * knowledge_write_binary() saves the knowledge base as a binary snapshot.
+ * knowledge_sequence() gives the journal position of the last snapshot read.
+ * knowledge_usage() reports how much memory the knowledge base is using.
+ * knowledge_set_lazy() leaves the responses of loaded files on disk.
+ * knowledge_open() and knowledge_close() keep the knowledge base in a disk store.
+ *
+ * If a disk store is open (see disk.c), the knowledge base is kept there
+ * instead of in memory: knowledge_get(), knowledge_put(), knowledge_reset(),
+ * knowledge_complete(), the loads and the text saves all go to the B+tree in
+ * its file, through the KB_STORAGE table below, and the in-memory structures
+ * stay empty.
+ *
+ * Any number of threads may call knowledge_get() while another thread changes
+ * the knowledge base, and knowledge_get() never waits for a lock. The scheme
+ * is read-copy-update:
+ *
+ *   - the knowledge base is reached through a single pointer to a KB_VERSION,
+ *     which knowledge_get() reads once and uses throughout;
+ *   - entities and strings never change once they are in the knowledge base,
+ *     and a changed response is a new entity;
+ *   - an insert or overwrite fills in the new entity first and then makes it
+ *     reachable with a single atomic store of its id into the hash index;
+ *   - anything bigger (growing a hash index, a reset, adopting a snapshot) is
+ *     built on the side as a new KB_VERSION and published by swapping the
+ *     pointer; the old version, and anything only it refers to, is freed once
+ *     every knowledge_get() that might still be using it has finished.
+ *
+ * Changes are made under locks that shard the knowledge base by intent and by
+ * the hash of the entity, so that knowledge_put() calls for different entities
+ * go ahead at once (see kb_lock_shard()); anything bigger takes every lock.
  *
  * You may add helper functions as necessary.
  */
 
-#include <stdlib.h>
-#include <stdio.h>
-#include <string.h>
-#include <ctype.h>
-#include "chat1002.h"
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "chat1002.h"
+
+/* the question words, indexed by INTENT */
+static const char *kb_intent_names[KB_INTENTS] = {WHO, WHAT, WHERE, WHEN, WHY, HOW};
+
+/* the size of the buffer knowledge_write() formats lines into, and of its writes */
+#define KB_WRITE_BUFFER (1 << 20)
+
+/* the most a line (or a section header) of a knowledge file can take */
+#define KB_WRITE_LINE (MAX_ENTITY + MAX_RESPONSE + MAX_INTENT + 4)
+
+/* initial number of hash buckets per intent; the table doubles when the load factor exceeds 1 */
+#define KB_MIN_BUCKETS 64
+
+/*
+ * The entities of each intent are split into KB_HASH_SHARDS shards by the low
+ * bits of their hash, each with a lock of its own. The same bits pick the
+ * entity's hash bucket, and an index never has fewer buckets than there are
+ * shards, so a hash chain only ever changes under the lock of one shard.
+ */
+#define KB_HASH_SHARDS 8
+#define KB_SHARDS (KB_INTENTS * KB_HASH_SHARDS)
+
+/*
+ * The entities of one intent. Each entity has a position, in the order the
+ * entities were added (for knowledge_write()); ids[] gives the current entity
+ * at each position. The hash index, keyed on the folded entity (for
+ * knowledge_get() and knowledge_put()), chains entities through links[], which
+ * is also indexed by position, so an entity that replaces another takes over
+ * its place in the chain without any entity changing.
+ */
+typedef struct kb_index {
+	uint32_t *ids;               /* the entity at each position */
+	uint32_t *links;             /* the next entity in the same bucket as the entity at each position */
+	uint32_t *buckets;           /* the first entity in each bucket */
+	unsigned long count;         /* number of entities */
+	unsigned long capacity;      /* number of positions ids[] and links[] have room for */
+	unsigned long nbuckets;      /* number of buckets (a power of two, or 0) */
+	int mapped;                  /* 1 if the arrays live in a mapped snapshot rather than the heap */
+} KB_INDEX;
+
+/* the intents in the order their first entity was added, so that files are written back in the order they were read */
+static int kb_order[KB_INTENTS];
+static int kb_norder = 0;
+
+/*
+ * Entities are allocated from slabs owned by the knowledge base rather than
+ * one malloc() each. Slab k holds KB_MIN_SLAB << k entities, so the slabs
+ * double in size and an entity id maps to its slab with one bit scan.
+ * Entities are never removed individually, so knowledge_reset() frees whole
+ * slabs.
+ */
+#define KB_MIN_SLAB_SHIFT 8
+#define KB_MIN_SLAB  (1UL << KB_MIN_SLAB_SHIFT)
+#define KB_MAX_SLABS 24
+
+/*
+ * The text of the knowledge base lives in three string pools: one for the
+ * entities folded to lower case, which every lookup reads and compares with
+ * memcmp(); one for the entities as they were given, which only
+ * knowledge_write() reads; and one for the responses, which are only read once
+ * an entity has been found. Strings are packed back to back without
+ * terminators and never straddle a chunk, so an offset is the chunk number
+ * times KB_POOL_CHUNK plus the position in the chunk. The key and name pools
+ * are filled in step (see kb_key_add()), so an entity's name is at the same
+ * offset as its key.
+ *
+ * Each shard fills a chunk of its own, so that shards never wait for each
+ * other to add a string; only handing out a chunk number is shared, and takes
+ * one atomic operation.
+ *
+ * A pool can also borrow part of a memory-mapped file. The region takes up
+ * as many consecutive chunk numbers as it spans, each pointing at the matching
+ * part of the region, so text inside the file is referenced where it lies
+ * instead of being copied. Such strings may run across chunk numbers, which is
+ * fine because the region is contiguous.
+ */
+#define KB_POOL_CHUNK_SHIFT 20
+#define KB_POOL_CHUNK  (1UL << KB_POOL_CHUNK_SHIFT)
+#define KB_POOL_CHUNKS 65536
+
+/* the chunk a shard is filling in a pool */
+typedef struct kb_cursor {
+	unsigned long chunk;         /* the chunk number */
+	unsigned long used;          /* bytes used in it; KB_POOL_CHUNK until the shard has a chunk */
+} KB_CURSOR;
+
+typedef struct kb_pool {
+	char *chunks[KB_POOL_CHUNKS];
+	uint8_t borrowed[KB_POOL_CHUNKS]; /* 1 if the chunk points into a mapping rather than the heap */
+	unsigned long nchunks;       /* number of chunk numbers handed out */
+	unsigned long bytes;         /* bytes of text referenced from the pool */
+	unsigned long cold;          /* of which, bytes left on disk in lazy mode (see kb_release()) */
+	KB_CURSOR at[KB_SHARDS];     /* where each shard adds strings */
+} KB_POOL;
+
+/* a file mapped by knowledge_read() that the knowledge base still refers to */
+typedef struct kb_map {
+	void *addr;
+	size_t len;
+	size_t cold;                 /* where the responses start; only they are left on disk in lazy mode */
+	int fd;                      /* the file, kept open to map them again in lazy mode, or -1 */
+} KB_MAP;
+
+/*
+ * Everything the entities are stored in. Storage only grows until a reset,
+ * which starts a new store and frees the old one once no reader can be using
+ * it, along with the mappings it holds.
+ */
+typedef struct kb_store {
+	ENTITY *slabs[KB_MAX_SLABS];
+	uint32_t mapped_slabs;       /* bit k is set if slab k lives in a mapped snapshot */
+	uint32_t mapped_ids;         /* the ids of the entities in the mapped slabs are 1 to mapped_ids */
+	uint32_t next_id;            /* id 0 means "none" and is never handed out */
+	KB_POOL keys;                /* the entities, folded to lower case */
+	KB_POOL names;               /* the entities as given, at the same offsets as in keys */
+	KB_POOL text;
+	KB_MAP *maps;
+	int nmaps;
+	int saving;                  /* saves writing from the store (see kb_freeze()) */
+	int retired;                 /* 1 once a new store has replaced it; the last save frees it */
+} KB_STORE;
+
+/* the knowledge base as knowledge_get() sees it */
+typedef struct kb_version {
+	KB_STORE *store;
+	KB_INDEX index[KB_INTENTS];
+} KB_VERSION;
+
+/* the current version; only changed with every lock held */
+static KB_VERSION *kb_current = NULL;
+
+/* the lock of each shard, by intent and then by hash (see kb_shard()); padded to a cache line each */
+typedef struct kb_shard {
+	pthread_mutex_t lock;
+	char pad[64 - sizeof(pthread_mutex_t) % 64];
+} KB_SHARD;
+
+static KB_SHARD kb_shards[KB_SHARDS] __attribute__((aligned(64)));
+static pthread_once_t kb_shards_made = PTHREAD_ONCE_INIT;
+
+/* held while a slab is allocated, which entities of any shard may be waiting for */
+static pthread_mutex_t kb_slab_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* 1 if the responses of mapped files are left on disk; see knowledge_set_lazy() */
+static int kb_lazy = 0;
+
+/*
+ * Where the entries are kept: in memory (kb_memory), or in a disk store
+ * (kb_disk, see disk.c) once knowledge_open() has opened one. The public
+ * functions check and fold their arguments and leave the rest to the storage.
+ * A storage without the index or the format an operation needs has NULL for
+ * it, and the operation answers that nothing was found, or fails.
+ */
+typedef struct kb_storage {
+	int (*get)(INTENT i, const char *key, size_t len, uint32_t h, char *response, int n);
+	int (*get_similar)(INTENT i, const char *key, size_t len, char *entity, int m, char *response, int n);
+	int (*search)(char *words[], int count, const char **intent, char *entity, int m, char *response, int n);
+	int (*complete)(INTENT i, const char *key, size_t len, char entities[][MAX_ENTITY], int k);
+	int (*put)(INTENT i, const char *key, const char *entity, size_t entity_len, uint32_t h, const char *response, size_t response_len);
+	int (*commit)(KB_BATCH *batch);
+	void (*reset)(void);
+	void (*usage)(unsigned long *entries, unsigned long *bytes);
+	int (*write)(FILE *f, char *buffer);
+	int (*write_binary)(FILE *f);
+	int adopts_snapshots;        /* 1 if a snapshot may become the knowledge base as it is (see kb_read_snapshot()) */
+} KB_STORAGE;
+
+static const KB_STORAGE kb_memory;
+static const KB_STORAGE kb_disk;
+
+/* the storage in use, chosen at startup */
+static const KB_STORAGE *kb_storage = &kb_memory;
+
+/*
+ * Readers announce themselves in per-thread counters rather than in one shared
+ * count, so that concurrent knowledge_get() calls do not contend for a cache
+ * line. Threads are spread over KB_READER_SLOTS slots, each counting the
+ * readers that started in each of two epochs; a writer waits for a grace
+ * period by flipping the epoch and waiting for the old epoch's counts to drain
+ * (see kb_synchronize()).
+ */
+#define KB_READER_SLOTS 64
+
+typedef struct kb_reader {
+	unsigned long active[2];     /* readers in progress that started in each epoch */
+	char pad[64 - 2 * sizeof(unsigned long)];
+} KB_READER;
+
+static KB_READER kb_readers[KB_READER_SLOTS] __attribute__((aligned(64)));
+static unsigned long kb_epoch = 0;
+static unsigned long kb_nreaders = 0;
+static __thread KB_READER *kb_self = NULL;
+
+
+/*
+ * Start reading the knowledge base. Every kb_pin() must be followed by a
+ * kb_unpin() with the same epoch, and nothing may wait for a writer in
+ * between.
+ *
+ * Output:
+ *   epoch - the epoch to pass to kb_unpin()
+ *
+ * Returns: the current version, which stays valid until kb_unpin(), or NULL if
+ *   the knowledge base has never been initialised
+ */
+static const KB_VERSION *kb_pin(int *epoch)
+{
+	if (kb_self == NULL)
+		kb_self = &kb_readers[__atomic_fetch_add(&kb_nreaders, 1, __ATOMIC_RELAXED) % KB_READER_SLOTS];
+	*epoch = (int)(__atomic_load_n(&kb_epoch, __ATOMIC_RELAXED) & 1);
+	__atomic_fetch_add(&kb_self->active[*epoch], 1, __ATOMIC_SEQ_CST);
+	return __atomic_load_n(&kb_current, __ATOMIC_SEQ_CST);
+}
+
+/*
+ * Finish reading the knowledge base.
+ */
+static void kb_unpin(int epoch)
+{
+	__atomic_fetch_sub(&kb_self->active[epoch], 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Wait until every reader that might have seen a version before the last
+ * kb_publish() has finished. The epoch is flipped twice, because a reader may
+ * have read the epoch just before one flip and only count itself after it.
+ */
+static void kb_synchronize()
+{
+	for (int flip = 0; flip < 2; flip++) {
+		unsigned long old = __atomic_fetch_add(&kb_epoch, 1, __ATOMIC_SEQ_CST) & 1;
+		for (int r = 0; r < KB_READER_SLOTS; r++) {
+			while (__atomic_load_n(&kb_readers[r].active[old], __ATOMIC_SEQ_CST) != 0)
+				sched_yield();
+		}
+	}
+}
+
+/*
+ * Look up an entity by id.
+ */
+static ENTITY *kb_entity(const KB_STORE *store, uint32_t id)
+{
+	/* slab k covers ids [KB_MIN_SLAB * (2^k - 1), KB_MIN_SLAB * (2^(k+1) - 1)) */
+	unsigned long slot = (unsigned long)id + KB_MIN_SLAB;
+	int top = 63 - __builtin_clzll(slot);
+	return &store->slabs[top - KB_MIN_SLAB_SHIFT][slot - (1UL << top)];
+}
+
+/*
+ * Allocate a new entity id, starting a new slab when it is the first id of
+ * one. Any shard may call this.
+ *
+ * Returns: the id, or 0 if a new slab could not be allocated
+ */
+static uint32_t kb_alloc(KB_STORE *store)
+{
+	uint32_t id = __atomic_fetch_add(&store->next_id, 1, __ATOMIC_RELAXED);
+	unsigned long slot = (unsigned long)id + KB_MIN_SLAB;
+	int top = 63 - __builtin_clzll(slot);
+	int k = top - KB_MIN_SLAB_SHIFT;
+	if (k >= KB_MAX_SLABS)
+		return 0;
+	if (__atomic_load_n(&store->slabs[k], __ATOMIC_ACQUIRE) == NULL) {
+		pthread_mutex_lock(&kb_slab_lock);
+		if (store->slabs[k] == NULL)
+			__atomic_store_n(&store->slabs[k], (ENTITY *)malloc((KB_MIN_SLAB << k) * sizeof(ENTITY)), __ATOMIC_RELEASE);
+		pthread_mutex_unlock(&kb_slab_lock);
+		if (store->slabs[k] == NULL)
+			return 0;
+	}
+	return id;
+}
+
+/*
+ * Determine whether a string of len bytes needs a new chunk at a cursor.
+ */
+static int kb_pool_full(const KB_CURSOR *at, size_t len)
+{
+	return at->used == KB_POOL_CHUNK || at->used + len > KB_POOL_CHUNK;
+}
+
+/*
+ * Hand out the next chunk number of a pool.
+ *
+ * Returns: the chunk number, or KB_POOL_CHUNKS if the pool has none left
+ */
+static unsigned long kb_pool_number(KB_POOL *pool)
+{
+	unsigned long c = __atomic_load_n(&pool->nchunks, __ATOMIC_RELAXED);
+	do {
+		if (c == KB_POOL_CHUNKS)
+			return KB_POOL_CHUNKS;
+	} while (!__atomic_compare_exchange_n(&pool->nchunks, &c, c + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+	return c;
+}
+
+/*
+ * Copy a string into a pool, in the chunk a shard is filling.
+ *
+ * Returns: the offset of the copy, or (uint64_t)-1 if a new chunk could not be allocated
+ */
+static uint64_t kb_pool_add(KB_POOL *pool, int shard, const char *s, size_t len)
+{
+	KB_CURSOR *at = &pool->at[shard];
+	if (kb_pool_full(at, len)) {
+		if (len > KB_POOL_CHUNK)
+			return (uint64_t)-1;
+		char *chunk = (char *)malloc(KB_POOL_CHUNK);
+		unsigned long c = chunk != NULL ? kb_pool_number(pool) : KB_POOL_CHUNKS;
+		if (c == KB_POOL_CHUNKS) {
+			free(chunk);
+			return (uint64_t)-1;
+		}
+		pool->chunks[c] = chunk;
+		at->chunk = c;
+		at->used = 0;
+	}
+	memcpy(pool->chunks[at->chunk] + at->used, s, len);
+	at->used += len;
+	__atomic_fetch_add(&pool->bytes, len, __ATOMIC_RELAXED);
+	return ((uint64_t)at->chunk << KB_POOL_CHUNK_SHIFT) + at->used - len;
+}
+
+/*
+ * Borrow a memory-mapped region into a pool. The mapping must outlive the
+ * pool's use of it (see kb_keep_map()). Every lock must be held.
+ *
+ * Returns: the offset of the first byte of the region, or (uint64_t)-1 if the pool is full
+ */
+static uint64_t kb_pool_map(KB_POOL *pool, const char *map, size_t len)
+{
+	unsigned long span = (len + KB_POOL_CHUNK - 1) / KB_POOL_CHUNK;
+	if (span == 0 || pool->nchunks + span > KB_POOL_CHUNKS)
+		return (uint64_t)-1;
+
+	unsigned long first = pool->nchunks;
+	for (unsigned long c = 0; c < span; c++) {
+		pool->chunks[first + c] = (char *)map + c * KB_POOL_CHUNK;
+		pool->borrowed[first + c] = 1;
+	}
+	pool->nchunks += span;
+	return (uint64_t)first << KB_POOL_CHUNK_SHIFT;
+}
+
+/*
+ * Get a pointer to a string in a pool.
+ */
+static const char *kb_pool_get(const KB_POOL *pool, uint64_t off)
+{
+	return pool->chunks[off >> KB_POOL_CHUNK_SHIFT] + (off & (KB_POOL_CHUNK - 1));
+}
+
+/*
+ * Free every chunk of a pool.
+ */
+static void kb_pool_free(KB_POOL *pool)
+{
+	for (unsigned long c = 0; c < pool->nchunks; c++) {
+		if (!pool->borrowed[c])
+			free(pool->chunks[c]);
+	}
+}
+
+/*
+ * Add an entity to the key pool, folded, and to the name pool, as given, for a
+ * shard. The name pool has no cursors or chunk numbers of its own: each chunk
+ * of names gets the number of the chunk of keys it is allocated with, and is
+ * filled in step with it, so the two offsets always agree.
+ *
+ * Returns: the offset of the entity in both pools, or (uint64_t)-1 if a new
+ *   chunk could not be allocated
+ */
+static uint64_t kb_key_add(KB_STORE *store, int shard, const char *key, const char *name, size_t len)
+{
+	KB_CURSOR *at = &store->keys.at[shard];
+	if (kb_pool_full(at, len)) {
+		if (len > KB_POOL_CHUNK)
+			return (uint64_t)-1;
+		char *keys = (char *)malloc(KB_POOL_CHUNK);
+		char *names = (char *)malloc(KB_POOL_CHUNK);
+		unsigned long c = keys != NULL && names != NULL ? kb_pool_number(&store->keys) : KB_POOL_CHUNKS;
+		if (c == KB_POOL_CHUNKS) {
+			free(keys);
+			free(names);
+			return (uint64_t)-1;
+		}
+		store->keys.chunks[c] = keys;
+		store->names.chunks[c] = names;
+		__atomic_fetch_add(&store->names.nchunks, 1, __ATOMIC_RELAXED);
+		at->chunk = c;
+		at->used = 0;
+	}
+	memcpy(store->names.chunks[at->chunk] + at->used, name, len);
+	__atomic_fetch_add(&store->names.bytes, len, __ATOMIC_RELAXED);
+	return kb_pool_add(&store->keys, shard, key, len);
+}
+
+/*
+ * Take ownership of a mapped file, which will be unmapped with the store, and
+ * of a descriptor of it, which will be closed.
+ *
+ * Input:
+ *   cold - the offset in the file from which on it holds nothing but
+ *          responses
+ *   fd   - the file, to map the responses again in lazy mode (see
+ *          kb_release()), or -1
+ *
+ * Returns: KB_OK, or KB_NOMEM if the list of mappings could not grow
+ */
+static int kb_keep_map(KB_STORE *store, const char *addr, size_t len, size_t cold, int fd)
+{
+	KB_MAP *maps = (KB_MAP *)realloc(store->maps, (store->nmaps + 1) * sizeof(KB_MAP));
+	if (maps == NULL)
+		return KB_NOMEM;
+	store->maps = maps;
+	store->maps[store->nmaps].addr = (void *)addr;
+	store->maps[store->nmaps].len = len;
+	store->maps[store->nmaps].cold = cold;
+	store->maps[store->nmaps].fd = fd;
+	store->nmaps++;
+	return KB_OK;
+}
+
+/*
+ * Get a descriptor of a file being loaded for the knowledge base to keep, if
+ * it is to be loaded lazily (see knowledge_set_lazy()).
+ *
+ * Returns: a new descriptor, or -1 if the file is not loaded lazily
+ */
+static int kb_lazy_fd(FILE *f)
+{
+	return kb_lazy ? dup(fileno(f)) : -1;
+}
+
+/*
+ * Unmap a mapped file, and close the descriptor kept with it, if any.
+ */
+static void kb_unmap(const char *map, size_t len, int fd)
+{
+	munmap((void *)map, len);
+	if (fd >= 0)
+		close(fd);
+}
+
+/*
+ * Drop the pages of responses that have been read from the lazily loaded
+ * files, such as by loading or saving the knowledge base, so that only the
+ * entities and indexes stay resident. The responses are mapped afresh over
+ * themselves, which swaps in pages that have not been read yet without the
+ * addresses changing; a reader in the middle of a response sees the same
+ * bytes either way, as the files are never written where the responses are.
+ * A dropped page is read from the file again when a response on it is next
+ * asked for, and only that page, as its neighbours are most likely never
+ * asked for.
+ */
+static void kb_release(const KB_STORE *store)
+{
+	uintptr_t page = (uintptr_t)sysconf(_SC_PAGESIZE);
+	for (int k = 0; k < store->nmaps; k++) {
+		const KB_MAP *m = &store->maps[k];
+		uintptr_t from = ((uintptr_t)m->addr + m->cold + page - 1) & ~(page - 1);
+		uintptr_t to = (uintptr_t)m->addr + m->len;
+		if (m->fd < 0 || from >= to)
+			continue;
+		if (mmap((void *)from, to - from, PROT_READ, MAP_PRIVATE | MAP_FIXED, m->fd, (off_t)(from - (uintptr_t)m->addr)) != MAP_FAILED)
+			posix_madvise((void *)from, to - from, POSIX_MADV_RANDOM);
+	}
+}
+
+/*
+ * Create an empty store.
+ *
+ * Returns: the store, or NULL on allocation failure
+ */
+static KB_STORE *kb_store_new()
+{
+	KB_STORE *store = (KB_STORE *)calloc(1, sizeof(KB_STORE));
+	if (store == NULL)
+		return NULL;
+	store->next_id = 1;
+	for (int s = 0; s < KB_SHARDS; s++) {
+		store->keys.at[s].used = KB_POOL_CHUNK;
+		store->text.at[s].used = KB_POOL_CHUNK;
+	}
+	return store;
+}
+
+/*
+ * Free a store, its slabs and pools, and unmap the files it holds.
+ */
+static void kb_store_free(KB_STORE *store)
+{
+	for (int k = 0; k < KB_MAX_SLABS; k++) {
+		if (!(store->mapped_slabs & (1U << k)))
+			free(store->slabs[k]);
+	}
+	kb_pool_free(&store->keys);
+	kb_pool_free(&store->names);
+	kb_pool_free(&store->text);
+	for (int k = 0; k < store->nmaps; k++)
+		kb_unmap((const char *)store->maps[k].addr, store->maps[k].len, store->maps[k].fd);
+	free(store->maps);
+	free(store);
+}
+
+/*
+ * Free the arrays of an index, unless they live in a mapped snapshot.
+ */
+static void kb_index_free(KB_INDEX *index)
+{
+	if (index->mapped)
+		return;
+	free(index->ids);
+	free(index->links);
+	free(index->buckets);
+}
+
+/*
+ * Make a version current, then wait for the readers of the old one and free
+ * whatever the new version no longer refers to. Every lock must be held.
+ */
+static void kb_publish(KB_VERSION *version)
+{
+	KB_VERSION *old = kb_current;
+	__atomic_store_n(&kb_current, version, __ATOMIC_SEQ_CST);
+	if (old == NULL)
+		return;
+
+	kb_synchronize();
+	for (int i = 0; i < KB_INTENTS; i++) {
+		if (old->index[i].ids != version->index[i].ids)
+			kb_index_free(&old->index[i]);
+	}
+	if (old->store != version->store) {
+		if (old->store->saving > 0)
+			old->store->retired = 1;
+		else
+			kb_store_free(old->store);
+	}
+	free(old);
+}
+
+/*
+ * Initialise the locks of the shards, once.
+ */
+static void kb_make_shards()
+{
+	for (int s = 0; s < KB_SHARDS; s++)
+		pthread_mutex_init(&kb_shards[s].lock, NULL);
+}
+
+/*
+ * Find the shard of an entity.
+ *
+ * Input:
+ *   i - the intent
+ *   h - the fold_hash() of the entity
+ */
+static int kb_shard(INTENT i, uint32_t h)
+{
+	return (int)i * KB_HASH_SHARDS + (int)(h & (KB_HASH_SHARDS - 1));
+}
+
+/*
+ * Take the lock of every shard, in order.
+ */
+static void kb_lock_all()
+{
+	pthread_once(&kb_shards_made, kb_make_shards);
+	for (int s = 0; s < KB_SHARDS; s++)
+		pthread_mutex_lock(&kb_shards[s].lock);
+}
+
+/*
+ * Release every lock.
+ */
+static void kb_unlock()
+{
+	for (int s = KB_SHARDS - 1; s >= 0; s--)
+		pthread_mutex_unlock(&kb_shards[s].lock);
+}
+
+/*
+ * Take every lock, creating an empty knowledge base if there is none yet.
+ * Nothing else changes the knowledge base until kb_unlock().
+ *
+ * Returns: the current version, or NULL (with the locks released) if an empty
+ *   knowledge base could not be allocated
+ */
+static KB_VERSION *kb_lock()
+{
+	kb_lock_all();
+	if (kb_current == NULL) {
+		KB_VERSION *version = (KB_VERSION *)calloc(1, sizeof(KB_VERSION));
+		if (version != NULL)
+			version->store = kb_store_new();
+		if (version == NULL || version->store == NULL) {
+			free(version);
+			kb_unlock();
+			return NULL;
+		}
+		kb_publish(version);
+	}
+	return kb_current;
+}
+
+/*
+ * Take the lock of one shard, which allows changing the entities of that
+ * shard: their hash chains, the positions they take up in the index of their
+ * intent and the chunks the shard fills in the pools. Versions are only
+ * published with every lock held, so the current one stays current until
+ * kb_unlock_shard().
+ *
+ * Returns: the current version, or NULL (with the lock released) if an empty
+ *   knowledge base could not be allocated
+ */
+static KB_VERSION *kb_lock_shard(int shard)
+{
+	pthread_once(&kb_shards_made, kb_make_shards);
+	pthread_mutex_lock(&kb_shards[shard].lock);
+	if (kb_current == NULL) {
+		pthread_mutex_unlock(&kb_shards[shard].lock);
+		if (kb_lock() == NULL)
+			return NULL;
+		kb_unlock();
+		pthread_mutex_lock(&kb_shards[shard].lock);
+	}
+	return kb_current;
+}
+
+/*
+ * Release the lock of one shard.
+ */
+static void kb_unlock_shard(int shard)
+{
+	pthread_mutex_unlock(&kb_shards[shard].lock);
+}
+
+/*
+ * Find an entity in the hash index of an intent. This is safe while a writer
+ * is changing the index: each link is read once, atomically.
+ *
+ * Input:
+ *   key - the entity, folded to lower case by fold_hash()
+ *   h   - the fold_hash() of the entity
+ *
+ * Output:
+ *   link - if not NULL, receives the link (a bucket, or an entry of links[])
+ *          that holds the entity's id; only a writer may use it
+ *
+ * Returns: the id of the entity, or 0 if it is not in the knowledge base
+ */
+static uint32_t kb_find(const KB_STORE *store, const KB_INDEX *index, const char *key, size_t len, uint32_t h, uint32_t **link)
+{
+	if (index->nbuckets == 0)
+		return 0;
+	uint32_t *at = &index->buckets[h & (index->nbuckets - 1)];
+	for (;;) {
+		uint32_t id = __atomic_load_n(at, __ATOMIC_ACQUIRE);
+		if (id == 0)
+			return 0;
+		const ENTITY *e = kb_entity(store, id);
+		if (e->hash == h && e->key_len == len && memcmp(kb_pool_get(&store->keys, e->key), key, len) == 0) {
+			if (link != NULL)
+				*link = at;
+			return id;
+		}
+		at = &index->links[e->pos];
+	}
+}
+
+/*
+ * Make sure the hash index of each intent has room for want[intent] entities,
+ * doubling the number of positions and buckets as many times as needed. The
+ * grown indexes are built on the side and published together as a new
+ * version. Every lock must be held. Positions not yet taken hold id 0.
+ *
+ * Returns: KB_OK, or KB_NOMEM if the new tables could not be allocated
+ */
+static int kb_reserve(const unsigned long want[KB_INTENTS])
+{
+	KB_VERSION *old = kb_current;
+	KB_VERSION *version = NULL;
+
+	for (int i = 0; i < KB_INTENTS; i++) {
+		const KB_INDEX *from = &old->index[i];
+		if (want[i] <= from->capacity && want[i] <= from->nbuckets)
+			continue;
+		if (version == NULL) {
+			version = (KB_VERSION *)malloc(sizeof(KB_VERSION));
+			if (version == NULL)
+				return KB_NOMEM;
+			*version = *old;
+		}
+
+		unsigned long size = from->nbuckets == 0 ? KB_MIN_BUCKETS : from->nbuckets;
+		while (size < want[i])
+			size *= 2;
+		KB_INDEX *to = &version->index[i];
+		to->ids = (uint32_t *)calloc(size, sizeof(uint32_t));
+		to->links = (uint32_t *)malloc(size * sizeof(uint32_t));
+		to->buckets = (uint32_t *)calloc(size, sizeof(uint32_t));
+		to->capacity = size;
+		to->nbuckets = size;
+		to->mapped = 0;
+		if (to->ids == NULL || to->links == NULL || to->buckets == NULL) {
+			for (int j = 0; j <= i; j++) {
+				if (version->index[j].ids != old->index[j].ids || j == i)
+					kb_index_free(&version->index[j]);
+			}
+			free(version);
+			return KB_NOMEM;
+		}
+
+		/* re-link every entity into the new table */
+		for (unsigned long pos = 0; pos < from->count; pos++) {
+			uint32_t id = from->ids[pos];
+			uint32_t b = kb_entity(old->store, id)->hash & (size - 1);
+			to->ids[pos] = id;
+			to->links[pos] = to->buckets[b];
+			to->buckets[b] = id;
+		}
+	}
+
+	if (version != NULL)
+		kb_publish(version);
+	return KB_OK;
+}
+
+/* kb_insert() found no room in the index for a new entity */
+#define KB_FULL 1
+
+/*
+ * Add or overwrite an entity of intent i. The lengths must already have been
+ * checked against MAX_ENTITY and MAX_RESPONSE, key and h must be the entity
+ * folded by fold_hash() and its hash, and the response must already be in the
+ * response pool at offset 'text'. The lock of the entity's shard must be held.
+ *
+ * An overwrite stores a new entity that shares the old one's key and position
+ * and takes its place in the hash chain; the old entity and response are left
+ * behind as garbage, since readers may still be looking at them.
+ *
+ * A new entity takes the next position of its intent. Other shards of the
+ * intent take positions at the same time, so a position is claimed first and
+ * filled in afterwards, and the index may briefly have a position holding id
+ * 0 below its count; only the kb_lock() holders that read every position ever
+ * look there. If the index has no room left, nothing is added and the caller
+ * must grow it (see kb_reserve()) and try again.
+ *
+ * The keyword, prefix and fuzzy indexes catch up with new entities when they
+ * are next searched, or in the background after a load (see kb_catch_up());
+ * a replaced entity is taken out of the keyword index here.
+ *
+ * Returns: KB_OK, KB_FULL if the index of the intent has no room, or KB_NOMEM
+ *   if the entity or its key could not be allocated
+ */
+static int kb_insert(INTENT i, const char *key, const char *entity, size_t entity_len, uint32_t h, uint64_t text, size_t response_len)
+{
+	KB_STORE *store = kb_current->store;
+	KB_INDEX *index = &kb_current->index[i];
+	int shard = kb_shard(i, h);
+
+	/* an existing entity keeps its place in the list and only has its response replaced */
+	uint32_t *link;
+	uint32_t found = kb_find(store, index, key, entity_len, h, &link);
+	if (found != 0) {
+		uint32_t id = kb_alloc(store);
+		if (id == 0)
+			return KB_NOMEM;
+		ENTITY *replace = kb_entity(store, id);
+		*replace = *kb_entity(store, found);
+		replace->response = text;
+		replace->response_len = (uint16_t)response_len;
+		__atomic_store_n(&index->ids[replace->pos], id, __ATOMIC_RELEASE);
+		__atomic_store_n(link, id, __ATOMIC_RELEASE);
+		cache_invalidate(i, key, entity_len, h);
+		const ENTITY *old = kb_entity(store, found);
+		search_remove(found, key, entity_len, kb_pool_get(&store->text, old->response), kb_lazy ? 0 : old->response_len);
+		return KB_OK;
+	}
+
+	if (__atomic_load_n(&index->count, __ATOMIC_RELAXED) >= index->capacity)
+		return KB_FULL;
+	uint64_t off = kb_key_add(store, shard, key, entity, entity_len);
+	if (off == (uint64_t)-1 || off > UINT32_MAX)
+		return KB_NOMEM;
+	uint32_t id = kb_alloc(store);
+	if (id == 0)
+		return KB_NOMEM;
+	ENTITY *insert = kb_entity(store, id);
+	insert->hash = h;
+	insert->pos = UINT32_MAX;    /* not in the index, unless the position below is claimed */
+	insert->key = (uint32_t)off;
+	insert->key_len = (uint8_t)entity_len;
+	insert->response = text;
+	insert->response_len = (uint16_t)response_len;
+	insert->intent = (uint8_t)i;
+
+	unsigned long pos = __atomic_load_n(&index->count, __ATOMIC_RELAXED);
+	do {
+		if (pos >= index->capacity)
+			return KB_FULL;
+	} while (!__atomic_compare_exchange_n(&index->count, &pos, pos + 1, 1, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+	insert->pos = (uint32_t)pos;
+
+	/* fill in its position, then make it reachable from the hash index */
+	uint32_t *bucket = &index->buckets[h & (index->nbuckets - 1)];
+	index->links[pos] = *bucket;
+	__atomic_store_n(&index->ids[pos], id, __ATOMIC_RELEASE);
+	__atomic_store_n(bucket, id, __ATOMIC_RELEASE);
+	if (pos == 0)
+		kb_order[__atomic_fetch_add(&kb_norder, 1, __ATOMIC_RELAXED)] = i;
+	return KB_OK;
+}
+
+/*
+ * Check an entity and response against MAX_ENTITY and MAX_RESPONSE.
+ *
+ * Returns: 1 if they are valid, 0 otherwise
+ */
+static int kb_valid(size_t entity_len, size_t response_len)
+{
+	return entity_len > 0 && entity_len < MAX_ENTITY && response_len < MAX_RESPONSE;
+}
+
+/*
+ * Find the intent of a question word.
+ *
+ * Input:
+ *   intent - the question word
+ *
+ * Returns:
+ *   the INTENT, if it is a question word
+ *   INTENT_NONE, otherwise
+ */
+INTENT knowledge_intent(const char *intent)
+{
+	for (int i = 0; i < KB_INTENTS; i++) {
+		if (compare_token(kb_intent_names[i], intent) == 0)
+			return (INTENT)i;
+	}
+	return INTENT_NONE;
+}
+
+/*
+ * Get the question word of an intent.
+ *
+ * Input:
+ *   intent - the intent
+ *
+ * Returns: the question word, in lower case
+ */
+const char *knowledge_intent_name(INTENT intent)
+{
+	return kb_intent_names[intent];
+}
+
+/*
+ * Look up an entity that has been folded and hashed by fold_hash() in memory,
+ * and copy its response. This never waits for a lock.
+ *
+ * Returns: KB_OK, or KB_NOTFOUND if the entity is not in the knowledge base
+ */
+static int kb_memory_get(INTENT i, const char *key, size_t len, uint32_t h, char *response, int n)
+{
+	int result = KB_NOTFOUND;
+	int epoch;
+	const KB_VERSION *version = kb_pin(&epoch);
+	if (version != NULL) {
+		uint32_t id = kb_find(version->store, &version->index[i], key, len, h, NULL);
+		if (id != 0) {
+			const ENTITY *found = kb_entity(version->store, id);
+			snprintf(response, n, "%.*s", (int)found->response_len, kb_pool_get(&version->store->text, found->response));
+			result = KB_OK;
+		}
+	}
+	kb_unpin(epoch);
+	return result;
+}
+
+/*
+ * Look up an entity in the disk store, as kb_memory_get().
+ */
+static int kb_disk_get(INTENT i, const char *key, size_t len, uint32_t h, char *response, int n)
+{
+	(void)h;
+	return disk_get(i, key, len, response, n);
+}
+
+/*
+ * Look up an entity that has been folded and hashed by fold_hash(), and copy
+ * its response.
+ *
+ * Returns: KB_OK, or KB_NOTFOUND if the entity is not in the knowledge base
+ */
+static int kb_get(INTENT i, const char *key, size_t len, uint32_t h, char *response, int n)
+{
+	int result = kb_storage->get(i, key, len, h, response, n);
+	stats_lookup(i, result == KB_OK);
+	return result;
+}
+
+/*
+ * Answer a question whose entity has been folded and hashed by fold_hash():
+ * from the answer cache if it is there, otherwise from the knowledge base,
+ * caching the response.
+ *
+ * Returns: KB_OK, or KB_NOTFOUND if the entity is not in the knowledge base
+ */
+static int kb_answer(INTENT i, const char *key, size_t len, uint32_t h, char *response, int n)
+{
+	if (cache_get(i, key, len, h, response, n) == KB_OK)
+		return KB_OK;
+	unsigned long generation = cache_generation();
+	int result = kb_get(i, key, len, h, response, n);
+
+	/* a shorter buffer may hold only part of the response */
+	if (result == KB_OK && n >= MAX_RESPONSE)
+		cache_put(i, key, len, h, response, generation);
+	return result;
+}
+
+/*
+ * Get the response to a question. Any number of threads may call this at
+ * once, including while another thread changes the knowledge base; it never
+ * waits for a lock, and sees either all or none of each change.
+ *
+ * Input:
+ *   intent   - the question word
+ *   entity   - the entity
+ *   response - a buffer to receive the response
+ *   n        - the maximum number of characters to write to the response buffer
+ *
+ * Returns:
+ *   KB_OK, if a response was found for the intent and entity (the response is copied to the response buffer)
+ *   KB_NOTFOUND, if no response could be found
+ *   KB_INVALID, if 'intent' is not a recognised question word
+ */
+int knowledge_get(const char *intent, const char *entity, char *response, int n)
+{
+	INTENT i = knowledge_intent(intent);
+	if (i == INTENT_NONE)
+		return KB_INVALID;
+
+	/* nothing that long can be in the knowledge base */
+	size_t len = strlen(entity);
+	if (len >= MAX_ENTITY)
+		return KB_NOTFOUND;
+	char key[MAX_ENTITY];
+	uint32_t h = fold_hash(key, entity, len);
+
+	return kb_answer(i, key, len, h, response, n);
+}
+
+/*
+ * Join words with single spaces into a buffer of MAX_ENTITY characters.
+ *
+ * Returns: the length of the result, or -1 if it would not fit in an entity
+ */
+static long kb_join_words(char *key, char *words[], int count)
+{
+	size_t len = 0;
+	for (int k = 0; k < count; k++) {
+		size_t word_len = strlen(words[k]);
+		if (len + (k > 0) + word_len >= MAX_ENTITY)
+			return -1;
+		if (k > 0)
+			key[len++] = ' ';
+		memcpy(key + len, words[k], word_len);
+		len += word_len;
+	}
+	return (long)len;
+}
+
+/*
+ * Get the response to a question whose entity is given as separate words, as
+ * knowledge_get() does for the words joined by single spaces. The words are
+ * never joined into a string of their own: they go straight into the buffer
+ * that the key is folded in, and only if they fit in an entity.
+ *
+ * Input:
+ *   intent   - the question word
+ *   words    - the words of the entity
+ *   count    - the number of words
+ *   response - a buffer to receive the response
+ *   n        - the maximum number of characters to write to the response buffer
+ *
+ * Returns: as knowledge_get()
+ */
+int knowledge_get_words(const char *intent, char *words[], int count, char *response, int n)
+{
+	INTENT i = knowledge_intent(intent);
+	if (i == INTENT_NONE)
+		return KB_INVALID;
+
+	char key[MAX_ENTITY];
+	long len = kb_join_words(key, words, count);
+	if (len < 0)
+		return KB_NOTFOUND;
+	uint32_t h = fold_hash(key, key, (size_t)len);
+
+	return kb_answer(i, key, (size_t)len, h, response, n);
+}
+
+/* what kb_fuzzy_key() looks entities up in */
+typedef struct kb_fuzzy {
+	const KB_VERSION *version;
+	INTENT intent;
+	unsigned long count;         /* the number of entities the intent has in the version */
+} KB_FUZZY;
+
+/*
+ * Get the folded entity at a position, for fuzzy_update(), fuzzy_find() and
+ * trie_update().
+ *
+ * Returns: the entity, or NULL if there is none at that position (yet)
+ */
+static const char *kb_fuzzy_key(void *arg, unsigned long pos, size_t *len)
+{
+	const KB_FUZZY *fuzzy = (const KB_FUZZY *)arg;
+	if (pos >= fuzzy->count)
+		return NULL;
+	const KB_STORE *store = fuzzy->version->store;
+	uint32_t id = __atomic_load_n(&fuzzy->version->index[fuzzy->intent].ids[pos], __ATOMIC_ACQUIRE);
+	if (id == 0)
+		return NULL;
+	const ENTITY *e = kb_entity(store, id);
+	*len = e->key_len;
+	return kb_pool_get(&store->keys, e->key);
+}
+
+/*
+ * Get the entity and response of an entity id for search_update(), if it is
+ * the current entity at its position. Every lock must be held.
+ *
+ * Returns: 1 if it is, 0 if it has been replaced or was never filled in
+ */
+static int kb_search_doc(void *arg, uint32_t id, const char **entity, size_t *entity_len, const char **response, size_t *response_len)
+{
+	const KB_VERSION *version = (const KB_VERSION *)arg;
+	const KB_STORE *store = version->store;
+
+	/* an id whose slab could not be allocated, or past the end of a snapshot's entities */
+	unsigned long slot = (unsigned long)id + KB_MIN_SLAB;
+	int k = 63 - __builtin_clzll(slot) - KB_MIN_SLAB_SHIFT;
+	if (id == 0 || k >= KB_MAX_SLABS || store->slabs[k] == NULL || ((store->mapped_slabs >> k & 1) && id > store->mapped_ids))
+		return 0;
+
+	/* an entity that lost the race for a position, or whose response has been replaced */
+	const ENTITY *e = kb_entity(store, id);
+	if (e->pos == UINT32_MAX || e->pos >= version->index[e->intent].count || version->index[e->intent].ids[e->pos] != id)
+		return 0;
+	*entity = kb_pool_get(&store->keys, e->key);
+	*entity_len = e->key_len;
+	*response = kb_pool_get(&store->text, e->response);
+	*response_len = kb_lazy ? 0 : e->response_len;
+	return 1;
+}
+
+/* the indexes kb_catch_up() brings up to date */
+#define KB_KEYWORDS 0   /* the keyword index (see search.c) */
+#define KB_PREFIXES 1   /* the prefix index of an intent (see trie.c) */
+#define KB_TRIGRAMS 2   /* the fuzzy index of an intent (see fuzzy.c) */
+
+/* the most ids or positions kb_catch_up() indexes while holding every lock */
+#define KB_CATCH_UP_CHUNK 4096
+
+/* the entities that may wait for the keyword index before knowledge_put() wakes the indexer */
+#define KB_CATCH_UP_BACKLOG 1024
+
+/* wakes the background indexer; see kb_wake_indexer() */
+static pthread_mutex_t kb_indexer_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t kb_indexer_work = PTHREAD_COND_INITIALIZER;
+static int kb_indexer_started = 0;
+static int kb_indexer_pending = 0;
+
+/*
+ * Get how far an index has got: the first id the keyword index has not
+ * considered, or the number of positions of an intent a prefix or fuzzy index
+ * has.
+ */
+static unsigned long kb_indexed(int index, INTENT intent)
+{
+	if (index == KB_KEYWORDS)
+		return search_indexed();
+	return index == KB_PREFIXES ? trie_indexed(intent) : fuzzy_indexed(intent);
+}
+
+/*
+ * Get how far an index has to go to be up to date with a version, as
+ * kb_indexed().
+ */
+static unsigned long kb_to_index(const KB_VERSION *version, int index, INTENT intent)
+{
+	if (index == KB_KEYWORDS)
+		return __atomic_load_n(&version->store->next_id, __ATOMIC_ACQUIRE);
+	return __atomic_load_n(&version->index[intent].count, __ATOMIC_ACQUIRE);
+}
+
+/*
+ * Bring an index up to date with the entities added since it was last used.
+ * The indexes are not updated on every insert, as entities of different shards
+ * are added at once and the keyword index needs them in order of id; an index
+ * may only go through ids or positions while no insert is under way, so this
+ * takes every lock. It indexes at most KB_CATCH_UP_CHUNK ids or positions at a
+ * time and lets go of the locks in between, so that writers wait for one chunk
+ * rather than for the whole backlog (a few milliseconds rather than most of a
+ * second after a large load). The caller must hold no lock, nor be pinned.
+ *
+ * Input:
+ *   index  - KB_KEYWORDS, KB_PREFIXES or KB_TRIGRAMS
+ *   intent - the intent whose prefix or fuzzy index to update (ignored for
+ *            KB_KEYWORDS)
+ */
+static void kb_catch_up(int index, INTENT intent)
+{
+	/* only the entities there are now, so that a stream of puts cannot keep the caller here */
+	int epoch;
+	const KB_VERSION *version = kb_pin(&epoch);
+	unsigned long target = version == NULL ? 0 : kb_to_index(version, index, intent);
+	kb_unpin(epoch);
+
+	int result = KB_OK;
+	while (result == KB_OK && kb_indexed(index, intent) < target) {
+		KB_VERSION *current = kb_lock();
+		if (current == NULL)
+			return;
+
+		/* a reset meanwhile leaves less to do */
+		unsigned long end = kb_indexed(index, intent) + KB_CATCH_UP_CHUNK;
+		if (end > kb_to_index(current, index, intent))
+			end = kb_to_index(current, index, intent);
+		if (end <= kb_indexed(index, intent)) {
+			kb_unlock();
+			return;
+		}
+		if (index == KB_KEYWORDS) {
+			result = search_update((uint32_t)end, kb_search_doc, current);
+		} else {
+			KB_FUZZY fuzzy;
+			fuzzy.version = current;
+			fuzzy.intent = intent;
+			fuzzy.count = end;
+			if (index == KB_PREFIXES)
+				result = trie_update(intent, end, kb_fuzzy_key, &fuzzy);
+			else
+				result = fuzzy_update(intent, end, kb_fuzzy_key, &fuzzy);
+		}
+		kb_unlock();
+	}
+}
+
+/*
+ * The background indexer: catches the keyword and prefix indexes up whenever
+ * it is woken, so that the first question after a load does not have to. The
+ * fuzzy index is left to knowledge_get_similar(), as most knowledge bases are
+ * never asked a question it is needed for.
+ */
+static void *kb_indexer(void *arg)
+{
+	(void)arg;
+	pthread_mutex_lock(&kb_indexer_lock);
+	for (;;) {
+		while (!kb_indexer_pending)
+			pthread_cond_wait(&kb_indexer_work, &kb_indexer_lock);
+		kb_indexer_pending = 0;
+		pthread_mutex_unlock(&kb_indexer_lock);
+
+		kb_catch_up(KB_KEYWORDS, INTENT_NONE);
+		for (int i = 0; i < KB_INTENTS; i++)
+			kb_catch_up(KB_PREFIXES, (INTENT)i);
+
+		pthread_mutex_lock(&kb_indexer_lock);
+	}
+	return NULL;
+}
+
+/*
+ * Wake the background indexer, starting it the first time. If it cannot be
+ * started, the indexes are caught up by the next question that needs them,
+ * as they would be anyway.
+ */
+static void kb_wake_indexer()
+{
+	pthread_mutex_lock(&kb_indexer_lock);
+	if (!kb_indexer_started) {
+		pthread_t thread;
+		if (pthread_create(&thread, NULL, kb_indexer, NULL) == 0) {
+			pthread_detach(thread);
+			kb_indexer_started = 1;
+		}
+	}
+	kb_indexer_pending = 1;
+	pthread_cond_signal(&kb_indexer_work);
+	pthread_mutex_unlock(&kb_indexer_lock);
+}
+
+/*
+ * Answer the question closest to one that is not in memory, for
+ * knowledge_get_similar(), given the entity folded by fold_hash().
+ */
+static int kb_memory_get_similar(INTENT i, const char *key, size_t len, char *entity, int m, char *response, int n)
+{
+	/* index any new entities first; the locks may not be waited for while pinned */
+	kb_catch_up(KB_TRIGRAMS, i);
+
+	int result = KB_NOTFOUND;
+	int epoch;
+	KB_FUZZY fuzzy;
+	fuzzy.version = kb_pin(&epoch);
+	if (fuzzy.version != NULL) {
+		fuzzy.intent = i;
+		fuzzy.count = __atomic_load_n(&fuzzy.version->index[i].count, __ATOMIC_ACQUIRE);
+		long pos = fuzzy_find(i, key, len, kb_fuzzy_key, &fuzzy);
+		if (pos >= 0) {
+			const KB_STORE *store = fuzzy.version->store;
+			const ENTITY *e = kb_entity(store, fuzzy.version->index[i].ids[pos]);
+			snprintf(entity, m, "%.*s", (int)e->key_len, kb_pool_get(&store->names, e->key));
+			snprintf(response, n, "%.*s", (int)e->response_len, kb_pool_get(&store->text, e->response));
+			result = KB_OK;
+		}
+	}
+	kb_unpin(epoch);
+	return result;
+}
+
+/*
+ * Answer the question closest to one that is not in the knowledge base: the
+ * entity of the same intent that is the fewest edits away, if it is close
+ * enough (see fuzzy.c). This is much slower than knowledge_get(), so ask it
+ * only once that has failed. The first call after entities have been added
+ * indexes them, a chunk at a time with every lock held (see kb_catch_up()).
+ *
+ * Input:
+ *   intent   - the question word
+ *   words    - the words of the entity, as for knowledge_get_words()
+ *   count    - the number of words
+ *   entity   - a buffer to receive the entity that was answered, as it was
+ *              given to the knowledge base
+ *   m        - the size of the entity buffer
+ *   response - a buffer to receive the response
+ *   n        - the size of the response buffer
+ *
+ * Returns:
+ *   KB_OK, if an entity close enough was found (its name and response are
+ *     copied to the buffers)
+ *   KB_NOTFOUND, if none was, or the knowledge base is kept in a disk store
+ *   KB_INVALID, if 'intent' is not a recognised question word
+ */
+int knowledge_get_similar(const char *intent, char *words[], int count, char *entity, int m, char *response, int n)
+{
+	INTENT i = knowledge_intent(intent);
+	if (i == INTENT_NONE)
+		return KB_INVALID;
+	char key[MAX_ENTITY];
+	long len = kb_join_words(key, words, count);
+	if (len < 0)
+		return KB_NOTFOUND;
+	fold_hash(key, key, (size_t)len);
+
+	/* the fuzzy index would need memory for every entity of a disk store */
+	if (kb_storage->get_similar == NULL)
+		return KB_NOTFOUND;
+	return kb_storage->get_similar(i, key, (size_t)len, entity, m, response, n);
+}
+
+/*
+ * Answer the entry of memory that best matches the words of a question, for
+ * knowledge_search().
+ */
+static int kb_memory_search(char *words[], int count, const char **intent, char *entity, int m, char *response, int n)
+{
+	kb_catch_up(KB_KEYWORDS, INTENT_NONE);
+
+	int result = KB_NOTFOUND;
+	int epoch;
+	const KB_VERSION *version = kb_pin(&epoch);
+	uint32_t id = version != NULL ? search_find(words, count) : 0;
+	if (id != 0 && id < __atomic_load_n(&version->store->next_id, __ATOMIC_ACQUIRE)) {
+		const KB_STORE *store = version->store;
+		const ENTITY *e = kb_entity(store, id);
+		*intent = kb_intent_names[e->intent];
+		snprintf(entity, m, "%.*s", (int)e->key_len, kb_pool_get(&store->names, e->key));
+		snprintf(response, n, "%.*s", (int)e->response_len, kb_pool_get(&store->text, e->response));
+		result = KB_OK;
+	}
+	kb_unpin(epoch);
+	return result;
+}
+
+/*
+ * Answer the entry whose entity and response best match the words of a
+ * question that is not in the knowledge base, of any intent (see search.c).
+ * Like knowledge_get_similar(), ask this only once knowledge_get() has failed;
+ * the first call after entities have been added indexes any the background
+ * indexer has not got to yet, as knowledge_get_similar() does.
+ *
+ * Input:
+ *   words    - the words of the question
+ *   count    - the number of words
+ *   intent   - receives the question word of the entry
+ *   entity   - a buffer to receive the entity, as it was given to the
+ *              knowledge base
+ *   m        - the size of the entity buffer
+ *   response - a buffer to receive the response
+ *   n        - the size of the response buffer
+ *
+ * Returns:
+ *   KB_OK, if an entry matched (its question word, entity and response are
+ *     copied to the buffers)
+ *   KB_NOTFOUND, if none did, or the knowledge base is kept in a disk store
+ */
+int knowledge_search(char *words[], int count, const char **intent, char *entity, int m, char *response, int n)
+{
+	/* as for knowledge_get_similar(), the keyword index would not fit */
+	if (kb_storage->search == NULL)
+		return KB_NOTFOUND;
+	return kb_storage->search(words, count, intent, entity, m, response, n);
+}
+
+/* what knowledge_complete() is listing from a disk store */
+typedef struct kb_complete {
+	char (*entities)[MAX_ENTITY];
+	int k;
+	int found;
+} KB_COMPLETE;
+
+/*
+ * List an entity of a disk store for knowledge_complete().
+ *
+ * Returns: 1 once the list is full, 0 otherwise
+ */
+static int kb_complete_visit(void *arg, const char *entity, size_t entity_len, const char *response, size_t response_len)
+{
+	KB_COMPLETE *complete = (KB_COMPLETE *)arg;
+	(void)response;
+	(void)response_len;
+	snprintf(complete->entities[complete->found++], MAX_ENTITY, "%.*s", (int)entity_len, entity);
+	return complete->found == complete->k;
+}
+
+/*
+ * List the entities of an intent in memory that start with a prefix folded by
+ * fold_hash(), for knowledge_complete().
+ */
+static int kb_memory_complete(INTENT i, const char *key, size_t len, char entities[][MAX_ENTITY], int k)
+{
+	uint32_t *positions = (uint32_t *)malloc(k * sizeof(uint32_t));
+	if (positions == NULL)
+		return KB_NOMEM;
+	kb_catch_up(KB_PREFIXES, i);
+
+	int found = 0;
+	int epoch;
+	const KB_VERSION *version = kb_pin(&epoch);
+	if (version != NULL) {
+		const KB_STORE *store = version->store;
+		const KB_INDEX *index = &version->index[i];
+		unsigned long count = __atomic_load_n(&index->count, __ATOMIC_ACQUIRE);
+		int n = trie_complete(i, key, len, positions, k);
+		for (int c = 0; c < n; c++) {
+			/* the trie may already have entities added since this version */
+			if (positions[c] >= count)
+				continue;
+			const ENTITY *e = kb_entity(store, __atomic_load_n(&index->ids[positions[c]], __ATOMIC_ACQUIRE));
+			snprintf(entities[found++], MAX_ENTITY, "%.*s", (int)e->key_len, kb_pool_get(&store->names, e->key));
+		}
+	}
+	kb_unpin(epoch);
+	free(positions);
+	return found;
+}
+
+/*
+ * List the entities of an intent in the disk store that start with a prefix,
+ * from its leaves, which are in the same order, as kb_memory_complete().
+ */
+static int kb_disk_complete(INTENT i, const char *key, size_t len, char entities[][MAX_ENTITY], int k)
+{
+	KB_COMPLETE complete = {entities, k, 0};
+	if (disk_scan(i, key, len, kb_complete_visit, &complete) != KB_OK)
+		return KB_NOMEM;
+	return complete.found;
+}
+
+/*
+ * List the entities of an intent that start with a prefix, ignoring case, in
+ * alphabetical order, for completing a question as it is typed. This takes
+ * time proportional to the length of the prefix plus k (see trie.c), once the
+ * first call after entities have been added has indexed them. A disk store
+ * lists them from its leaves instead, which are in the same order.
+ *
+ * Input:
+ *   intent   - the question word
+ *   prefix   - the prefix; an empty prefix lists every entity
+ *   entities - an array to receive the entities, as they were given to the
+ *              knowledge base
+ *   k        - the most entities to list; the length of the array
+ *
+ * Returns:
+ *   the number of entities listed, if successful
+ *   KB_INVALID, if 'intent' is not a recognised question word
+ *   KB_NOMEM, if there was a memory allocation failure
+ */
+int knowledge_complete(const char *intent, const char *prefix, char entities[][MAX_ENTITY], int k)
+{
+	INTENT i = knowledge_intent(intent);
+	if (i == INTENT_NONE)
+		return KB_INVALID;
+
+	/* nothing that long can be in the knowledge base */
+	size_t len = strlen(prefix);
+	if (len >= MAX_ENTITY || k <= 0)
+		return 0;
+	char key[MAX_ENTITY];
+	fold_hash(key, prefix, len);
+	return kb_storage->complete(i, key, len, entities, k);
+}
+
+/*
+ * Insert a response in memory, for knowledge_put(), given the entity folded
+ * and hashed by fold_hash().
+ */
+static int kb_memory_put(INTENT i, const char *key, const char *entity, size_t entity_len, uint32_t h, const char *response, size_t response_len)
+{
+	int shard = kb_shard(i, h);
+
+	int result;
+	uint64_t sequence = 0;
+	for (;;) {
+		KB_VERSION *current = kb_lock_shard(shard);
+		if (current == NULL)
+			return KB_NOMEM;
+		uint64_t text = kb_pool_add(&current->store->text, shard, response, response_len);
+		result = text == (uint64_t)-1 ? KB_NOMEM : kb_insert(i, key, entity, entity_len, h, text, response_len);
+
+		/* journalled in the order of the changes to the entity, but waited for after letting other writers in */
+		if (result != KB_FULL) {
+			if (result == KB_OK)
+				sequence = journal_put(i, entity, entity_len, response, response_len);
+			int backlog = __atomic_load_n(&current->store->next_id, __ATOMIC_ACQUIRE) - search_indexed() > KB_CATCH_UP_BACKLOG;
+			kb_unlock_shard(shard);
+			if (backlog)
+				kb_wake_indexer();
+			break;
+		}
+
+		/* the index of the intent is full: grow it, which takes every lock, and try again */
+		kb_unlock_shard(shard);
+		if (kb_lock() == NULL)
+			return KB_NOMEM;
+		unsigned long want[KB_INTENTS] = {0};
+		want[i] = kb_current->index[i].count + 1;
+		result = kb_reserve(want);
+		kb_unlock();
+		if (result != KB_OK)
+			return result;
+	}
+	journal_wait(sequence);
+	return result;
+}
+
+/*
+ * Insert a response in the disk store, as kb_memory_put().
+ */
+static int kb_disk_put(INTENT i, const char *key, const char *entity, size_t entity_len, uint32_t h, const char *response, size_t response_len)
+{
+	int result = disk_put(i, key, entity, entity_len, response, response_len);
+	cache_invalidate(i, key, entity_len, h);
+	return result == KB_OK ? disk_flush(0) : result;
+}
+
+/*
+ * Insert a new response to a question. If a response already exists for the
+ * given intent and entity, it will be overwritten. Otherwise, it will be added
+ * to the knowledge base. If a journal is open (see journal.c), this returns
+ * once the change is on disk. Puts of entities in different shards (see
+ * kb_shard()) do not wait for each other. A disk store writes the change out
+ * with the next batch of puts (see disk_flush()).
+ *
+ * Input:
+ *   intent    - the question word
+ *   entity    - the entity
+ *   response  - the response for this question and entity
+ *
+ * Returns:
+ *   KB_OK, if successful
+ *   KB_NOMEM, if there was a memory allocation failure
+ *   KB_INVALID, if the intent is not a valid question word, or the entity or
+ *     response is empty or longer than MAX_ENTITY or MAX_RESPONSE allow
+ */
+int knowledge_put(char *intent, char *entity, char *response)
+{
+	INTENT i = knowledge_intent(intent);
+	if (i == INTENT_NONE)
+		return KB_INVALID;
+	size_t entity_len = strlen(entity);
+	size_t response_len = strlen(response);
+	if (!kb_valid(entity_len, response_len))
+		return KB_INVALID;
+	char key[MAX_ENTITY];
+	uint32_t h = fold_hash(key, entity, entity_len);
+	return kb_storage->put(i, key, entity, entity_len, h, response, response_len);
+}
+
+/*
+ * Find the intent named by the first len characters of a section header.
+ *
+ * Returns: the INTENT, or INTENT_NONE if it is not a question word
+ */
+static INTENT kb_intent_n(const char *name, size_t len)
+{
+	for (int i = 0; i < KB_INTENTS; i++) {
+		const char *known = kb_intent_names[i];
+		size_t k = 0;
+		while (k < len && known[k] != '\0' && toupper((unsigned char)name[k]) == toupper((unsigned char)known[k]))
+			k++;
+		if (k == len && known[k] == '\0')
+			return (INTENT)i;
+	}
+	return INTENT_NONE;
+}
+
+/*
+ * Find the intent of an "[intent]" line, which ends at line_end.
+ *
+ * Returns: the INTENT, or INTENT_NONE if it is not a question word
+ */
+static INTENT kb_section(const char *p, const char *line_end)
+{
+	const char *close = (const char *)memchr(p + 1, ']', line_end - p - 1);
+	return kb_intent_n(p + 1, (close != NULL ? close : line_end) - p - 1);
+}
+
+/*
+ * Parse a knowledge file, or a piece of one, that is entirely in memory,
+ * adding its entries to a batch without copying them. Each line is scanned
+ * once, front to back: a memchr() for the end of the line and, on entry
+ * lines, one for the '='.
+ *
+ * Input:
+ *   intent - the section the text starts in (INTENT_NONE at the start of a file)
+ *
+ * Returns: KB_OK, or KB_NOMEM if the batch could not grow
+ */
+static int kb_parse(KB_BATCH *batch, INTENT intent, const char *p, const char *end)
+{
+	while (p < end) {
+		const char *eol = (const char *)memchr(p, '\n', end - p);
+		if (eol == NULL)
+			eol = end;
+		const char *line_end = eol;
+		if (line_end > p && line_end[-1] == '\r')
+			line_end--;
+
+		if (p < line_end && *p == '[') {
+			/* an "[intent]" line starts a new section; unknown intents skip the section */
+			intent = kb_section(p, line_end);
+		} else if (intent != INTENT_NONE) {
+			/* an "entity=response" line; the response may itself contain '=' */
+			const char *equals = (const char *)memchr(p, '=', line_end - p);
+			if (equals != NULL && knowledge_batch_add_ref(batch, intent, p, equals - p,
+					equals + 1, line_end - equals - 1) == KB_NOMEM)
+				return KB_NOMEM;
+		}
+		p = eol + 1;
+	}
+	return KB_OK;
+}
+
+/*
+ * Read a knowledge file line by line with fgets(), for files that cannot be
+ * mapped (such as pipes). The entries are copied into the batch.
+ *
+ * Returns: KB_OK, or KB_NOMEM if the batch could not grow
+ */
+static int kb_read_stream(KB_BATCH *batch, FILE *f)
+{
+	char readline[MAX_ENTITY + MAX_RESPONSE + 2];  /* entity, '=', response, '\n' and null */
+	INTENT intent = INTENT_NONE;
+
+	while (fgets(readline, sizeof(readline), f)) {
+		size_t len = strcspn(readline, "\r\n");
+		if (readline[len] == '\0' && !feof(f)) {
+			/* the line is too long to be a valid entry; skip the rest of it */
+			int c;
+			while ((c = fgetc(f)) != EOF && c != '\n')
+				;
+			continue;
+		}
+		readline[len] = '\0';
+
+		if (readline[0] == '[') {
+			char *close = strchr(readline, ']');
+			if (close != NULL)
+				*close = '\0';
+			intent = knowledge_intent(readline + 1);
+		} else if (intent != INTENT_NONE) {
+			char *equals = strchr(readline, '=');
+			if (equals == NULL)
+				continue;
+			*equals = '\0';
+			if (knowledge_batch_add(batch, kb_intent_names[intent], readline, equals + 1) == KB_NOMEM)
+				return KB_NOMEM;
+		}
+	}
+	return KB_OK;
+}
+
+/*
+ * Binary snapshots.
+ *
+ * A snapshot is the knowledge base laid out as it is in memory, so that
+ * loading it into an empty knowledge base needs no parsing at all: the file is
+ * mapped copy-on-write and the slabs, hash indexes and string pools point
+ * straight into the mapping. The file holds, after the header:
+ *
+ *   - the entities, indexed by id (id 0 is a zeroed placeholder); each
+ *     intent's entities have consecutive ids in insertion order, and their
+ *     key and response offsets are relative to the key and text sections
+ *   - the index of each intent, in INTENT order: its ids[] and links[]
+ *     (count entries each) and its buckets
+ *   - the key section: every entity folded to lower case, packed without
+ *     terminators
+ *   - the name section: every entity as it was given, packed the same way
+ *   - the text section: every response, packed without terminators
+ *
+ * The header also records the sequence number of the last change journalled
+ * (see journal.c) when the snapshot was written, so that the journal can be
+ * replayed over it from the next change on.
+ *
+ * The checksum covers everything after the header. A snapshot is only valid
+ * for a build with the same ENTITY layout and byte order, which the version,
+ * entity_size and magic fields guard against.
+ */
+#define KB_SNAPSHOT_MAGIC   "C1002KB"
+#define KB_SNAPSHOT_VERSION 4
+
+typedef struct kb_snapshot_intent {
+	uint32_t head;               /* first entity id, in insertion order */
+	uint32_t count;              /* number of entities (ids head to head + count - 1) */
+	uint32_t nbuckets;           /* number of hash buckets */
+	uint32_t reserved;
+} KB_SNAPSHOT_INTENT;
+
+typedef struct kb_snapshot_header {
+	char magic[8];               /* KB_SNAPSHOT_MAGIC */
+	uint32_t version;            /* KB_SNAPSHOT_VERSION */
+	uint32_t entity_size;        /* sizeof(ENTITY) */
+	uint64_t size;               /* size of the whole file */
+	uint64_t checksum;           /* kb_checksum() of everything after the header */
+	uint32_t nentities;          /* number of entities, not counting id 0 */
+	uint32_t norder;             /* number of entries in order[] */
+	uint32_t order[KB_INTENTS];  /* the intents in the order knowledge_write() emits them */
+	KB_SNAPSHOT_INTENT intents[KB_INTENTS];
+	uint64_t index;              /* file offset of the indexes */
+	uint64_t keys;               /* file offset and length of the key section */
+	uint64_t keys_len;
+	uint64_t names;              /* file offset of the name section, which is keys_len long */
+	uint64_t text;               /* file offset and length of the text section */
+	uint64_t text_len;
+	uint64_t journal;            /* the journal sequence number of the last change the snapshot includes */
+} KB_SNAPSHOT_HEADER;
+
+/* the journal sequence number of the last snapshot read, for knowledge_sequence() */
+static uint64_t kb_sequence = 0;
+
+/* running state of kb_checksum(), which mixes the data in 8-byte words */
+typedef struct kb_checksum {
+	uint64_t h;
+	unsigned char tail[8];
+	int ntail;
+} KB_CHECKSUM;
+
+/*
+ * Mix one 8-byte word into a checksum.
+ */
+static uint64_t kb_checksum_word(uint64_t h, uint64_t w)
+{
+	h ^= w;
+	h *= 0x9E3779B97F4A7C15ULL;
+	return h ^ (h >> 29);
+}
+
+/*
+ * Add bytes to a running checksum.
+ */
+static void kb_checksum(KB_CHECKSUM *c, const void *data, size_t len)
+{
+	const unsigned char *p = (const unsigned char *)data;
+	uint64_t w;
+
+	while (c->ntail > 0 && c->ntail < 8 && len > 0) {
+		c->tail[c->ntail++] = *p++;
+		len--;
+	}
+	if (c->ntail == 8) {
+		memcpy(&w, c->tail, 8);
+		c->h = kb_checksum_word(c->h, w);
+		c->ntail = 0;
+	}
+	for (; len >= 8; p += 8, len -= 8) {
+		memcpy(&w, p, 8);
+		c->h = kb_checksum_word(c->h, w);
+	}
+	while (len > 0) {
+		c->tail[c->ntail++] = *p++;
+		len--;
+	}
+}
+
+/*
+ * Finish a running checksum.
+ *
+ * Returns: the checksum
+ */
+static uint64_t kb_checksum_end(KB_CHECKSUM *c)
+{
+	uint64_t w = 0;
+	memcpy(&w, c->tail, c->ntail);
+	return kb_checksum_word(c->h ^ (uint64_t)c->ntail, w);
+}
+
+/*
+ * Write bytes to a snapshot and add them to its checksum.
+ *
+ * Returns: 1 if the write succeeded, 0 otherwise
+ */
+static int kb_snapshot_out(FILE *f, KB_CHECKSUM *c, const void *data, size_t len)
+{
+	kb_checksum(c, data, len);
+	return fwrite(data, 1, len, f) == len;
+}
+
+/*
+ * A copy of where each entity of the knowledge base is, taken with every lock
+ * held, so that a save can write the knowledge base out as it stood without
+ * holding the locks, which would keep every knowledge_put() waiting. Entities
+ * and strings never change once added, and the store they are in is kept
+ * until kb_thaw() even if a reset replaces it meanwhile. The copy does not
+ * refer to the index arrays, which growing an index frees.
+ */
+typedef struct kb_frozen {
+	KB_STORE *store;             /* the store the ids refer to */
+	uint32_t *ids[KB_INTENTS];   /* each intent's ids[] */
+	unsigned long count[KB_INTENTS];
+	unsigned long nbuckets[KB_INTENTS];
+	int order[KB_INTENTS];       /* kb_order[] */
+	int norder;
+	uint64_t journal;            /* journal_sequence() when the copy was taken */
+} KB_FROZEN;
+
+/*
+ * Take a copy of the knowledge base's positions to write it out from. Every
+ * kb_freeze() that succeeds must be followed by a kb_thaw().
+ *
+ * Returns: KB_OK, or KB_NOMEM if the copy could not be allocated
+ */
+static int kb_freeze(KB_FROZEN *frozen)
+{
+	memset(frozen, 0, sizeof(*frozen));
+	const KB_VERSION *version = kb_lock();
+	if (version == NULL)
+		return KB_NOMEM;
+	for (int i = 0; i < KB_INTENTS; i++) {
+		const KB_INDEX *index = &version->index[i];
+		frozen->count[i] = index->count;
+		frozen->nbuckets[i] = index->nbuckets;
+		if (index->count == 0)
+			continue;
+		frozen->ids[i] = (uint32_t *)malloc(index->count * sizeof(uint32_t));
+		if (frozen->ids[i] == NULL) {
+			kb_unlock();
+			for (int k = 0; k < i; k++)
+				free(frozen->ids[k]);
+			return KB_NOMEM;
+		}
+		memcpy(frozen->ids[i], index->ids, index->count * sizeof(uint32_t));
+	}
+	memcpy(frozen->order, kb_order, sizeof(kb_order));
+	frozen->norder = kb_norder;
+	frozen->journal = journal_sequence();
+	frozen->store = version->store;
+	frozen->store->saving++;
+	kb_unlock();
+	return KB_OK;
+}
+
+/*
+ * Free a copy taken by kb_freeze(), and the store it refers to if a reset
+ * replaced it meanwhile; otherwise drop the pages of responses the write read
+ * (see kb_release()).
+ */
+static void kb_thaw(KB_FROZEN *frozen)
+{
+	for (int i = 0; i < KB_INTENTS; i++)
+		free(frozen->ids[i]);
+
+	KB_STORE *store = frozen->store;
+	kb_lock_all();
+	store->saving--;
+	if (!store->retired)
+		kb_release(store);
+	else if (store->saving == 0)
+		kb_store_free(store);
+	kb_unlock();
+}
+
+/*
+ * Save the knowledge base in memory as a binary snapshot, for
+ * knowledge_write_binary(). The knowledge base can change while the snapshot
+ * is written, which shows it as it stood when it started (see kb_freeze()).
+ */
+static int kb_memory_write_binary(FILE *f)
+{
+	KB_SNAPSHOT_HEADER header;
+	KB_CHECKSUM c = {0x1002, {0}, 0};
+	uint32_t *links[KB_INTENTS] = {NULL};
+	uint32_t *buckets[KB_INTENTS] = {NULL};
+	uint32_t *ids = NULL;
+	unsigned long most = 0;
+	int result = KB_INVALID;
+	uint64_t start = stats_now();
+
+	KB_FROZEN frozen;
+	if (kb_freeze(&frozen) != KB_OK)
+		return KB_NOMEM;
+	const KB_STORE *store = frozen.store;
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, KB_SNAPSHOT_MAGIC, sizeof(KB_SNAPSHOT_MAGIC));
+	header.version = KB_SNAPSHOT_VERSION;
+	header.entity_size = sizeof(ENTITY);
+	header.norder = frozen.norder;
+	header.journal = frozen.journal;
+
+	/* give each intent a run of consecutive ids and rebuild its hash chains for the new ids */
+	uint32_t id = 1;
+	for (int k = 0; k < frozen.norder; k++) {
+		int i = frozen.order[k];
+		header.order[k] = i;
+		header.intents[i].head = id;
+		header.intents[i].count = frozen.count[i];
+		header.intents[i].nbuckets = frozen.nbuckets[i];
+		id += frozen.count[i];
+		if (frozen.count[i] > most)
+			most = frozen.count[i];
+	}
+	header.nentities = id - 1;
+
+	ids = (uint32_t *)malloc((most + 1) * sizeof(uint32_t));
+	if (ids == NULL) {
+		result = KB_NOMEM;
+		goto done;
+	}
+	for (int i = 0; i < KB_INTENTS; i++) {
+		if (header.intents[i].count == 0)
+			continue;
+		links[i] = (uint32_t *)malloc(frozen.count[i] * sizeof(uint32_t));
+		buckets[i] = (uint32_t *)calloc(frozen.nbuckets[i], sizeof(uint32_t));
+		if (links[i] == NULL || buckets[i] == NULL) {
+			result = KB_NOMEM;
+			goto done;
+		}
+		for (unsigned long pos = 0; pos < frozen.count[i]; pos++) {
+			uint32_t b = kb_entity(store, frozen.ids[i][pos])->hash & (frozen.nbuckets[i] - 1);
+			links[i][pos] = buckets[i][b];
+			buckets[i][b] = header.intents[i].head + (uint32_t)pos;
+		}
+	}
+
+	/* the sections follow the header in the order described above */
+	header.index = sizeof(header) + (uint64_t)id * sizeof(ENTITY);
+	header.keys = header.index;
+	for (int i = 0; i < KB_INTENTS; i++)
+		header.keys += (2 * (uint64_t)header.intents[i].count + header.intents[i].nbuckets) * sizeof(uint32_t);
+	for (int i = 0; i < KB_INTENTS; i++) {
+		for (unsigned long pos = 0; pos < header.intents[i].count; pos++) {
+			const ENTITY *o = kb_entity(store, frozen.ids[i][pos]);
+			header.keys_len += o->key_len;
+			header.text_len += o->response_len;
+		}
+	}
+	header.names = header.keys + header.keys_len;
+	header.text = header.names + header.keys_len;
+	header.size = header.text + header.text_len;
+
+	/* write a placeholder header, then the sections, then the real header with the checksum */
+	if (fwrite(&header, sizeof(header), 1, f) != 1)
+		goto done;
+
+	ENTITY e;
+	memset(&e, 0, sizeof(e));
+	if (!kb_snapshot_out(f, &c, &e, sizeof(e)))
+		goto done;
+	uint64_t key_off = 0, text_off = 0;
+	for (int k = 0; k < frozen.norder; k++) {
+		int i = frozen.order[k];
+		for (unsigned long pos = 0; pos < frozen.count[i]; pos++) {
+			e = *kb_entity(store, frozen.ids[i][pos]);
+			e.pos = (uint32_t)pos;
+			e.key = (uint32_t)key_off;
+			e.response = text_off;
+			key_off += e.key_len;
+			text_off += e.response_len;
+			if (!kb_snapshot_out(f, &c, &e, sizeof(e)))
+				goto done;
+		}
+	}
+	for (int i = 0; i < KB_INTENTS; i++) {
+		unsigned long count = header.intents[i].count;
+		if (count == 0)
+			continue;
+		for (unsigned long pos = 0; pos < count; pos++)
+			ids[pos] = header.intents[i].head + (uint32_t)pos;
+		if (!kb_snapshot_out(f, &c, ids, count * sizeof(uint32_t))
+				|| !kb_snapshot_out(f, &c, links[i], count * sizeof(uint32_t))
+				|| !kb_snapshot_out(f, &c, buckets[i], frozen.nbuckets[i] * sizeof(uint32_t)))
+			goto done;
+	}
+	for (int k = 0; k < frozen.norder; k++) {
+		int i = frozen.order[k];
+		for (unsigned long pos = 0; pos < frozen.count[i]; pos++) {
+			const ENTITY *o = kb_entity(store, frozen.ids[i][pos]);
+			if (!kb_snapshot_out(f, &c, kb_pool_get(&store->keys, o->key), o->key_len))
+				goto done;
+		}
+	}
+	for (int k = 0; k < frozen.norder; k++) {
+		int i = frozen.order[k];
+		for (unsigned long pos = 0; pos < frozen.count[i]; pos++) {
+			const ENTITY *o = kb_entity(store, frozen.ids[i][pos]);
+			if (!kb_snapshot_out(f, &c, kb_pool_get(&store->names, o->key), o->key_len))
+				goto done;
+		}
+	}
+	for (int k = 0; k < frozen.norder; k++) {
+		int i = frozen.order[k];
+		for (unsigned long pos = 0; pos < frozen.count[i]; pos++) {
+			const ENTITY *o = kb_entity(store, frozen.ids[i][pos]);
+			if (!kb_snapshot_out(f, &c, kb_pool_get(&store->text, o->response), o->response_len))
+				goto done;
+		}
+	}
+
+	header.checksum = kb_checksum_end(&c);
+	if (fseek(f, 0, SEEK_SET) == 0 && fwrite(&header, sizeof(header), 1, f) == 1 && fflush(f) == 0)
+		result = KB_OK;
+
+done:
+	kb_thaw(&frozen);
+	for (int i = 0; i < KB_INTENTS; i++) {
+		free(links[i]);
+		free(buckets[i]);
+	}
+	free(ids);
+	stats_time(STATS_KB_WRITE, start);
+	return result;
+}
+
+/*
+ * Save the knowledge base as a binary snapshot, which knowledge_read() can
+ * load much faster than the text format. Entities are renumbered so that each
+ * intent's entities are consecutive, and the key and text sections hold only
+ * the current strings, so a snapshot never carries overwritten responses.
+ *
+ * Input:
+ *   f - the file, which must be opened in binary mode and be seekable
+ *
+ * Returns: KB_OK if successful, KB_NOMEM if there was a memory allocation
+ *   failure, or KB_INVALID if the file could not be written or the knowledge
+ *   base is kept in a disk store, which is a file of its own already
+ */
+int knowledge_write_binary(FILE *f)
+{
+	if (kb_storage->write_binary == NULL) {
+		errno = ENOTSUP;
+		return KB_INVALID;
+	}
+	return kb_storage->write_binary(f);
+}
+
+/*
+ * Check whether a mapped file starts with a snapshot header.
+ *
+ * Returns: 1 if it does, 0 otherwise
+ */
+static int kb_is_snapshot(const char *map, size_t len)
+{
+	return len >= sizeof(KB_SNAPSHOT_HEADER) && memcmp(map, KB_SNAPSHOT_MAGIC, sizeof(KB_SNAPSHOT_MAGIC)) == 0;
+}
+
+/* the entities or index words kb_snapshot_valid() checks at a time, while they are still in cache from the checksum */
+#define KB_SNAPSHOT_CHUNK 4096
+
+/*
+ * Check the entities of a snapshot, which must each lie in the run of ids of
+ * their intent, at their position in it, with their strings inside the key
+ * and text sections.
+ *
+ * Returns: 1 if they are valid, 0 otherwise
+ */
+static int kb_snapshot_entities_valid(const KB_SNAPSHOT_HEADER *header, const ENTITY *entities, uint32_t first, uint32_t end)
+{
+	for (uint32_t id = first; id < end; id++) {
+		const ENTITY *e = &entities[id];
+		if (e->intent >= KB_INTENTS)
+			return 0;
+		const KB_SNAPSHOT_INTENT *si = &header->intents[e->intent];
+		if (id < si->head || id - si->head >= si->count || e->pos != id - si->head)
+			return 0;
+		if (e->key_len == 0 || e->key_len >= MAX_ENTITY || (uint64_t)e->key + e->key_len > header->keys_len)
+			return 0;
+		if (e->response_len >= MAX_RESPONSE || e->response > header->text_len || e->response_len > header->text_len - e->response)
+			return 0;
+	}
+	return 1;
+}
+
+/*
+ * Check the ids in an intent's part of a snapshot's index, whose entities have
+ * been checked already: its ids[], which must give each position its own
+ * entity; its links[], each 0 or the id of an entity at an earlier position in
+ * the same bucket, so that no chain can loop back on itself; and its buckets,
+ * each 0 or the id of an entity that hashes to that bucket. Every entity
+ * reached through a bucket therefore hashes to it.
+ *
+ * Returns: 1 if they are valid, 0 otherwise
+ */
+static int kb_snapshot_ids_valid(const KB_SNAPSHOT_INTENT *si, const ENTITY *entities, const uint32_t *words, uint64_t first, uint64_t end)
+{
+	uint32_t mask = si->nbuckets - 1;
+	for (uint64_t w = first; w < end; w++) {
+		uint32_t id = words[w];
+		if (w < si->count) {
+			if (id != si->head + w)
+				return 0;
+		} else if (w < 2 * (uint64_t)si->count) {
+			uint64_t pos = w - si->count;
+			if (id != 0 && (id < si->head || id - si->head >= pos
+					|| (entities[id].hash & mask) != (entities[si->head + pos].hash & mask)))
+				return 0;
+		} else if (id != 0 && (id < si->head || id - si->head >= si->count
+				|| (entities[id].hash & mask) != w - 2 * (uint64_t)si->count)) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/*
+ * Check that a snapshot's header is consistent with its size and that its
+ * checksum matches, and check everything the knowledge base will use without
+ * checking again: the intents in its order, the entities (see
+ * kb_snapshot_entities_valid()) and the ids in its index (see
+ * kb_snapshot_ids_valid()). These are checked as the checksum passes over
+ * them, a chunk at a time.
+ *
+ * Returns: 1 if the snapshot can be used, 0 otherwise
+ */
+static int kb_snapshot_valid(const KB_SNAPSHOT_HEADER *header, const char *map, size_t len)
+{
+	if (header->version != KB_SNAPSHOT_VERSION || header->entity_size != sizeof(ENTITY) || header->size != len)
+		return 0;
+	if (header->norder > KB_INTENTS)
+		return 0;
+
+	/* each intent at most once in the order, and every intent with entities in it */
+	int listed[KB_INTENTS] = {0};
+	for (uint32_t k = 0; k < header->norder; k++) {
+		if (header->order[k] >= KB_INTENTS || listed[header->order[k]]++)
+			return 0;
+	}
+
+	uint64_t words = 0, entities = 0;
+	for (int i = 0; i < KB_INTENTS; i++) {
+		const KB_SNAPSHOT_INTENT *si = &header->intents[i];
+		if (si->nbuckets & (si->nbuckets - 1))
+			return 0;
+		if (si->count > 0 && (si->head == 0 || (uint64_t)si->head + si->count - 1 > header->nentities || si->nbuckets == 0 || !listed[i]))
+			return 0;
+		words += 2 * (uint64_t)si->count + si->nbuckets;
+		entities += si->count;
+	}
+	if (entities != header->nentities)
+		return 0;
+	if (header->index != sizeof(KB_SNAPSHOT_HEADER) + ((uint64_t)header->nentities + 1) * sizeof(ENTITY)
+			|| header->keys != header->index + words * sizeof(uint32_t)
+			|| header->names != header->keys + header->keys_len
+			|| header->text != header->names + header->keys_len
+			|| header->text + header->text_len != len)
+		return 0;
+
+	KB_CHECKSUM c = {0x1002, {0}, 0};
+	const ENTITY *all = (const ENTITY *)(map + sizeof(KB_SNAPSHOT_HEADER));
+	kb_checksum(&c, &all[0], sizeof(ENTITY));
+	for (uint32_t id = 1; id <= header->nentities; id += KB_SNAPSHOT_CHUNK) {
+		uint32_t end = header->nentities - id + 1 < KB_SNAPSHOT_CHUNK ? header->nentities + 1 : id + KB_SNAPSHOT_CHUNK;
+		kb_checksum(&c, &all[id], (end - id) * sizeof(ENTITY));
+		if (!kb_snapshot_entities_valid(header, all, id, end))
+			return 0;
+	}
+	const uint32_t *index = (const uint32_t *)(map + header->index);
+	for (int i = 0; i < KB_INTENTS; i++) {
+		const KB_SNAPSHOT_INTENT *si = &header->intents[i];
+		uint64_t count = 2 * (uint64_t)si->count + si->nbuckets;
+		for (uint64_t w = 0; w < count; w += KB_SNAPSHOT_CHUNK) {
+			uint64_t end = count - w < KB_SNAPSHOT_CHUNK ? count : w + KB_SNAPSHOT_CHUNK;
+			kb_checksum(&c, index + w, (end - w) * sizeof(uint32_t));
+			if (!kb_snapshot_ids_valid(si, all, index, w, end))
+				return 0;
+		}
+		index += count;
+	}
+	kb_checksum(&c, map + header->keys, len - header->keys);
+	return kb_checksum_end(&c) == header->checksum;
+}
+
+/*
+ * Load a mapped snapshot, taking ownership of the mapping and of fd, a
+ * descriptor of it to keep if it is loaded lazily (or -1).
+ *
+ * If the knowledge base is empty, it adopts the snapshot as it is: the slabs,
+ * indexes and string pools point into the mapping, which is remapped
+ * copy-on-write so that later puts can update it, and the result is published
+ * as a new version. The slab holding the last snapshot entity is not filled
+ * any further; new entities start in the next slab. Otherwise, and always
+ * into a disk store, the snapshot's entries are merged through a batch, like a
+ * text file, with the responses referenced inside the mapping.
+ *
+ * Returns: the number of entities loaded, KB_NOMEM if there was a memory
+ *   allocation failure, or KB_INVALID if the snapshot is not valid
+ */
+static int kb_read_snapshot(char *map, size_t len, int fd)
+{
+	KB_SNAPSHOT_HEADER header;
+	memcpy(&header, map, sizeof(header));
+	if (!kb_snapshot_valid(&header, map, len)) {
+		kb_unmap(map, len, fd);
+		return KB_INVALID;
+	}
+	ENTITY *entities = (ENTITY *)(map + sizeof(header));
+	kb_sequence = header.journal;
+
+	KB_VERSION *current = kb_lock();
+	if (current == NULL) {
+		kb_unmap(map, len, fd);
+		return KB_NOMEM;
+	}
+	KB_STORE *store = current->store;
+	int empty = store->next_id == 1 && store->keys.nchunks == 0 && store->names.nchunks == 0 && store->text.nchunks == 0;
+	if (!empty || header.nentities == 0 || !kb_storage->adopts_snapshots) {
+		kb_unlock();
+		KB_BATCH batch;
+		knowledge_batch_init(&batch);
+		batch.map = map;
+		batch.map_len = len;
+		batch.map_fd = fd;
+		for (int k = 0; k < (int)header.norder; k++) {
+			const KB_SNAPSHOT_INTENT *si = &header.intents[header.order[k]];
+			for (uint32_t id = si->head; id < si->head + si->count; id++) {
+				const ENTITY *e = &entities[id];
+				if (knowledge_batch_add_ref(&batch, (INTENT)e->intent, map + header.names + e->key, e->key_len,
+						map + header.text + e->response, e->response_len) == KB_NOMEM) {
+					knowledge_batch_free(&batch);
+					return KB_NOMEM;
+				}
+			}
+		}
+		int result = knowledge_batch_commit(&batch);
+		knowledge_batch_free(&batch);
+		return result;
+	}
+
+	KB_VERSION *version = (KB_VERSION *)malloc(sizeof(KB_VERSION));
+	if (version == NULL || mprotect(map, len, PROT_READ | PROT_WRITE) != 0 || kb_keep_map(store, map, len, header.text, fd) != KB_OK) {
+		kb_unlock();
+		free(version);
+		kb_unmap(map, len, fd);
+		return KB_NOMEM;
+	}
+	*version = *current;
+
+	/* nothing can reach the store's slabs and pools yet, so they can be filled in place */
+	if (header.keys_len > 0) {
+		kb_pool_map(&store->keys, map + header.keys, header.keys_len);
+		kb_pool_map(&store->names, map + header.names, header.keys_len);
+	}
+	if (header.text_len > 0)
+		kb_pool_map(&store->text, map + header.text, header.text_len);
+	store->keys.bytes = header.keys_len;
+	store->names.bytes = header.keys_len;
+	store->text.bytes = header.text_len;
+	store->text.cold = fd >= 0 ? header.text_len : 0;
+
+	/* point each slab at its part of the entity array, and continue after the last one */
+	unsigned long slot = (unsigned long)header.nentities + KB_MIN_SLAB;
+	int last = 63 - __builtin_clzll(slot) - KB_MIN_SLAB_SHIFT;
+	for (int k = 0; k <= last; k++) {
+		store->slabs[k] = entities + KB_MIN_SLAB * ((1UL << k) - 1);
+		store->mapped_slabs |= 1U << k;
+	}
+	store->mapped_ids = header.nentities;
+	store->next_id = (uint32_t)(KB_MIN_SLAB * ((1UL << (last + 1)) - 1));
+
+	uint32_t *words = (uint32_t *)(map + header.index);
+	for (int i = 0; i < KB_INTENTS; i++) {
+		const KB_SNAPSHOT_INTENT *si = &header.intents[i];
+		KB_INDEX *index = &version->index[i];
+		index->ids = si->count > 0 ? words : NULL;
+		index->links = si->count > 0 ? words + si->count : NULL;
+		index->buckets = si->nbuckets > 0 ? words + 2 * si->count : NULL;
+		index->count = si->count;
+		index->capacity = si->count;
+		index->nbuckets = si->nbuckets;
+		index->mapped = 1;
+		words += 2 * si->count + si->nbuckets;
+	}
+	for (int k = 0; k < (int)header.norder; k++)
+		kb_order[k] = header.order[k];
+	kb_norder = header.norder;
+
+	kb_publish(version);
+	kb_release(store);
+	kb_unlock();
+	return (int)header.nentities;
+}
+
+/*
+ * Read a knowledge base from a file.
+ *
+ * The file consists of "[intent]" lines, each followed by "entity=response"
+ * lines for that intent. The entries are collected into a batch and inserted
+ * with knowledge_batch_commit(), so later lines for the same intent and entity
+ * overwrite earlier ones just as repeated knowledge_put() calls would. Entries
+ * that are too long for MAX_ENTITY or MAX_RESPONSE are skipped.
+ *
+ * A regular file is memory-mapped and parsed in place, and the knowledge base
+ * keeps referring to the responses inside the mapping rather than copying
+ * them; the mapping lives until the next knowledge_reset(). The file must
+ * therefore not be truncated or rewritten in place while it is loaded. In
+ * lazy mode the responses are then left on disk (see knowledge_set_lazy()).
+ * Other files are read with fgets().
+ *
+ * A file written by knowledge_write_binary() is recognised by its header and
+ * loaded as a snapshot instead (see kb_read_snapshot()).
+ *
+ * Input:
+ *   f - the file
+ *
+ * Returns: the number of entity/response pairs successful read from the file,
+ *   KB_NOMEM if there was a memory allocation failure, or KB_INVALID if the
+ *   file is a snapshot that fails its version or checksum test
+ */
+int knowledge_read(FILE *f)
+{
+	KB_BATCH batch;
+	struct stat st;
+	int result;
+	uint64_t start = stats_now();
+
+	knowledge_batch_init(&batch);
+	kb_sequence = 0;
+	void *map = MAP_FAILED;
+	if (fstat(fileno(f), &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0)
+		map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fileno(f), 0);
+
+	if (map != MAP_FAILED && kb_is_snapshot((const char *)map, (size_t)st.st_size)) {
+		result = kb_read_snapshot((char *)map, (size_t)st.st_size, kb_lazy_fd(f));
+		stats_time(STATS_KB_READ, start);
+		return result;
+	}
+
+	if (map != MAP_FAILED) {
+		posix_madvise(map, (size_t)st.st_size, POSIX_MADV_SEQUENTIAL);
+		batch.map = (const char *)map;
+		batch.map_len = (size_t)st.st_size;
+		batch.map_fd = kb_lazy_fd(f);
+		result = kb_parse(&batch, INTENT_NONE, batch.map, batch.map + batch.map_len);
+	} else {
+		result = kb_read_stream(&batch, f);
+	}
+
+	if (result == KB_OK)
+		result = knowledge_batch_commit(&batch);
+	knowledge_batch_free(&batch);
+	stats_time(STATS_KB_READ, start);
+	return result;
+}
+
+/*
+ * Get the journal sequence number recorded in the snapshot last read by
+ * knowledge_read(), from which the journal is to be replayed over it.
+ *
+ * Returns: the sequence number, or 0 if the file last read was not a snapshot
+ */
+uint64_t knowledge_sequence()
+{
+	return kb_sequence;
+}
+
+/* the size of the pieces knowledge_read_files() splits large text files into */
+#define KB_READ_CHUNK (8UL << 20)
+
+/* a file being read by knowledge_read_files() */
+typedef struct kb_read_file {
+	FILE *f;                     /* the file, if it could not be mapped */
+	char *map;                   /* the file, if it could */
+	size_t len;
+	int fd;                      /* a descriptor of the mapped file to keep in lazy mode, or -1 */
+	int snapshot;                /* 1 if the mapped file is a snapshot, which is not parsed */
+	int first;                   /* the first of its jobs */
+	int njobs;
+} KB_READ_FILE;
+
+/* a piece of a file, parsed into a batch of its own by one of the workers */
+typedef struct kb_read_job {
+	FILE *f;                     /* the whole file, if it is read as a stream */
+	const char *p, *end;         /* the piece, if it is mapped */
+	INTENT intent;               /* the section the piece starts in */
+	KB_BATCH batch;
+	int result;
+	uint64_t ns;                 /* time spent parsing it */
+} KB_READ_JOB;
+
+/* the jobs of one knowledge_read_files(), which its workers take in turn */
+typedef struct kb_read_jobs {
+	KB_READ_JOB *jobs;
+	int count;
+	int next;
+} KB_READ_JOBS;
+
+/*
+ * Split a mapped text file into jobs of at least KB_READ_CHUNK bytes each
+ * (except the last), cut at the ends of lines. Each job notes the section it
+ * starts in, which is found by looking for the "[intent]" lines of the job
+ * before it, so the whole file is only scanned once more, at memchr() speed.
+ *
+ * Returns: the number of jobs, at most len / KB_READ_CHUNK + 1
+ */
+static int kb_split(const char *map, size_t len, KB_READ_JOB jobs[])
+{
+	const char *p = map, *end = map + len;
+	INTENT intent = INTENT_NONE;
+	int n = 0;
+
+	while (p < end) {
+		const char *cut = end;
+		if ((size_t)(end - p) > KB_READ_CHUNK) {
+			cut = (const char *)memchr(p + KB_READ_CHUNK, '\n', end - p - KB_READ_CHUNK);
+			cut = cut != NULL ? cut + 1 : end;
+		}
+		jobs[n].p = p;
+		jobs[n].end = cut;
+		jobs[n].intent = intent;
+		n++;
+
+		/* the last section header in this job is the one the next job starts in */
+		for (const char *h = p; cut < end && (h = (const char *)memchr(h, '[', cut - h)) != NULL; h++) {
+			if (h > map && h[-1] != '\n')
+				continue;
+			const char *line_end = (const char *)memchr(h, '\n', cut - h);
+			if (line_end == NULL)
+				line_end = cut;
+			if (line_end > h && line_end[-1] == '\r')
+				line_end--;
+			intent = kb_section(h, line_end);
+		}
+		p = cut;
+	}
+	return n;
+}
+
+/*
+ * Parse jobs until there are none left; the body of each worker thread of
+ * knowledge_read_files().
+ */
+static void *kb_read_worker(void *arg)
+{
+	KB_READ_JOBS *jobs = (KB_READ_JOBS *)arg;
+	int k;
+
+	while ((k = __atomic_fetch_add(&jobs->next, 1, __ATOMIC_RELAXED)) < jobs->count) {
+		KB_READ_JOB *job = &jobs->jobs[k];
+		uint64_t start = stats_now();
+		if (job->f != NULL)
+			job->result = kb_read_stream(&job->batch, job->f);
+		else
+			job->result = kb_parse(&job->batch, job->intent, job->p, job->end);
+		job->ns = stats_now() - start;
+	}
+	return NULL;
+}
+
+/*
+ * Move the entries of one batch onto the end of another. The entries must
+ * not refer to the text blocks of the batch they are moved from.
+ *
+ * Returns: KB_OK, or KB_NOMEM if the batch could not grow
+ */
+static int kb_batch_append(KB_BATCH *batch, KB_BATCH *more)
+{
+	if (batch->count + more->count > batch->size) {
+		int size = batch->count + more->count;
+		KB_BATCH_ENTRY *grown = (KB_BATCH_ENTRY *)realloc(batch->entries, size * sizeof(KB_BATCH_ENTRY));
+		if (grown == NULL)
+			return KB_NOMEM;
+		batch->entries = grown;
+		batch->size = size;
+	}
+	if (more->count > 0)
+		memcpy(batch->entries + batch->count, more->entries, more->count * sizeof(KB_BATCH_ENTRY));
+	batch->count += more->count;
+	more->count = 0;
+	return KB_OK;
+}
+
+/*
+ * Read several knowledge files at once.
+ *
+ * Every file is mapped (or, if it cannot be, read as a stream), and text files
+ * larger than KB_READ_CHUNK are split into pieces at the ends of lines. The
+ * files and pieces are parsed into batches of their own by a pool of threads,
+ * one per processor, and the batches are then committed one file at a time,
+ * in the order of the files and of the pieces within each file. The result is
+ * therefore the same as reading the files one after another with
+ * knowledge_read(): where several lines give the same intent and entity, the
+ * last one in the last file wins. Snapshots are loaded in their place in the
+ * order, as knowledge_read() would load them.
+ *
+ * Input:
+ *   files - the files; only 'path' needs to be filled in
+ *   count - the number of files
+ *
+ * Output:
+ *   files - 'result' receives the number of entries read from each file,
+ *     KB_NOTFOUND if it could not be opened, KB_NOMEM or KB_INVALID, and 'ns'
+ *     the time spent parsing and inserting them
+ *
+ * Returns: the number of entries read from all of the files, or the first
+ *   error any of them had
+ */
+int knowledge_read_files(KB_FILE files[], int count)
+{
+	uint64_t start = stats_now();
+	int total = 0;
+
+	KB_READ_FILE *read = (KB_READ_FILE *)calloc(count > 0 ? count : 1, sizeof(KB_READ_FILE));
+	if (read == NULL)
+		return KB_NOMEM;
+	kb_sequence = 0;
+
+	/* open everything first, to know how many jobs there will be */
+	int njobs = 0;
+	for (int i = 0; i < count; i++) {
+		struct stat st;
+		files[i].result = KB_OK;
+		files[i].ns = 0;
+		read[i].fd = -1;
+		FILE *f = fopen(files[i].path, "r");
+		if (f == NULL || fstat(fileno(f), &st) != 0 || S_ISDIR(st.st_mode)) {
+			if (f != NULL)
+				fclose(f);
+			files[i].result = KB_NOTFOUND;
+			continue;
+		}
+		void *map = MAP_FAILED;
+		if (S_ISREG(st.st_mode) && st.st_size > 0)
+			map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fileno(f), 0);
+		if (map == MAP_FAILED) {
+			read[i].f = f;
+			read[i].njobs = 1;
+		} else {
+			read[i].fd = kb_lazy_fd(f);
+			fclose(f);
+			read[i].map = (char *)map;
+			read[i].len = (size_t)st.st_size;
+			read[i].snapshot = kb_is_snapshot(read[i].map, read[i].len);
+			if (!read[i].snapshot) {
+				posix_madvise(map, read[i].len, POSIX_MADV_SEQUENTIAL);
+				read[i].njobs = (int)(read[i].len / KB_READ_CHUNK) + 1;
+			}
+		}
+		njobs += read[i].njobs;
+	}
+
+	KB_READ_JOBS jobs = {(KB_READ_JOB *)calloc(njobs > 0 ? njobs : 1, sizeof(KB_READ_JOB)), 0, 0};
+	if (jobs.jobs == NULL) {
+		for (int i = 0; i < count; i++) {
+			if (read[i].f != NULL)
+				fclose(read[i].f);
+			if (read[i].map != NULL)
+				kb_unmap(read[i].map, read[i].len, read[i].fd);
+		}
+		free(read);
+		return KB_NOMEM;
+	}
+	for (int i = 0; i < count; i++) {
+		read[i].first = jobs.count;
+		if (read[i].f != NULL)
+			jobs.jobs[jobs.count].f = read[i].f;
+		else if (read[i].njobs > 0)
+			read[i].njobs = kb_split(read[i].map, read[i].len, jobs.jobs + jobs.count);
+		jobs.count += read[i].njobs;
+	}
+
+	/* parse everything; the calling thread is one of the workers */
+	long nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (nthreads > jobs.count)
+		nthreads = jobs.count;
+	pthread_t *threads = nthreads > 1 ? (pthread_t *)malloc((nthreads - 1) * sizeof(pthread_t)) : NULL;
+	int started = 0;
+	while (threads != NULL && started < nthreads - 1 && pthread_create(&threads[started], NULL, kb_read_worker, &jobs) == 0)
+		started++;
+	kb_read_worker(&jobs);
+	for (int t = 0; t < started; t++)
+		pthread_join(threads[t], NULL);
+	free(threads);
+
+	/* commit the files in order, each file's pieces in order */
+	for (int i = 0; i < count; i++) {
+		uint64_t commit = stats_now();
+		KB_READ_JOB *job = &jobs.jobs[read[i].first];
+		if (files[i].result == KB_NOTFOUND) {
+			/* it was never opened */
+		} else if (read[i].snapshot) {
+			files[i].result = kb_read_snapshot(read[i].map, read[i].len, read[i].fd);
+		} else {
+			/* the first piece's batch takes the others' entries, and the mapping */
+			job->batch.map = read[i].map;
+			job->batch.map_len = read[i].len;
+			job->batch.map_fd = read[i].fd;
+			for (int k = 0; k < read[i].njobs; k++) {
+				files[i].ns += job[k].ns;
+				if (job[k].result != KB_OK)
+					files[i].result = job[k].result;
+				else if (k > 0 && files[i].result == KB_OK)
+					files[i].result = kb_batch_append(&job->batch, &job[k].batch);
+			}
+			if (files[i].result == KB_OK)
+				files[i].result = knowledge_batch_commit(&job->batch);
+			for (int k = 0; k < read[i].njobs; k++)
+				knowledge_batch_free(&job[k].batch);
+			if (read[i].f != NULL)
+				fclose(read[i].f);
+		}
+		files[i].ns += stats_now() - commit;
+		if (files[i].result < 0 && total >= 0)
+			total = files[i].result;
+		else if (total >= 0)
+			total += files[i].result;
+	}
+
+	free(jobs.jobs);
+	free(read);
+	stats_time(STATS_KB_READ, start);
+	return total;
+}
+
+/*
+ * Compare two file names, for sorting the files of a directory.
+ */
+static int kb_compare_files(const void *a, const void *b)
+{
+	return strcmp(((const KB_FILE *)a)->path, ((const KB_FILE *)b)->path);
+}
+
+/*
+ * Make the list of files for knowledge_read_files() from a list of names:
+ * a directory stands for the files in it (but not its subdirectories or the
+ * files whose names start with '.'), in order of their names, and anything
+ * else stands for itself.
+ *
+ * Input:
+ *   names - the names
+ *   count - the number of names
+ *
+ * Output:
+ *   files - receives the list, which must be freed with knowledge_free_files()
+ *
+ * Returns: the number of files in the list, or KB_NOMEM if there was a memory
+ *   allocation failure
+ */
+int knowledge_list_files(char *names[], int count, KB_FILE **files)
+{
+	KB_FILE *list = NULL;
+	int n = 0, size = 0;
+
+	for (int i = 0; i < count; i++) {
+		struct stat st;
+		DIR *dir = stat(names[i], &st) == 0 && S_ISDIR(st.st_mode) ? opendir(names[i]) : NULL;
+		int from = n;
+		struct dirent *d = NULL;
+		do {
+			if (dir != NULL) {
+				d = readdir(dir);
+				if (d == NULL)
+					break;
+				if (d->d_name[0] == '.')
+					continue;
+			}
+			if (n == size) {
+				size = size == 0 ? 16 : size * 2;
+				KB_FILE *grown = (KB_FILE *)realloc(list, size * sizeof(KB_FILE));
+				if (grown == NULL)
+					goto nomem;
+				list = grown;
+			}
+			if (dir == NULL) {
+				list[n].path = strdup(names[i]);
+			} else {
+				size_t len = strlen(names[i]);
+				list[n].path = (char *)malloc(len + strlen(d->d_name) + 2);
+				if (list[n].path != NULL)
+					sprintf(list[n].path, "%s%s%s", names[i], len > 0 && names[i][len - 1] == '/' ? "" : "/", d->d_name);
+			}
+			if (list[n].path == NULL)
+				goto nomem;
+			if (dir != NULL && (stat(list[n].path, &st) != 0 || !S_ISREG(st.st_mode))) {
+				free(list[n].path);
+				continue;
+			}
+			n++;
+		} while (dir != NULL);
+		if (dir != NULL) {
+			closedir(dir);
+			qsort(list + from, n - from, sizeof(KB_FILE), kb_compare_files);
+		}
+		continue;
+
+	nomem:
+		if (dir != NULL)
+			closedir(dir);
+		knowledge_free_files(list, n);
+		return KB_NOMEM;
+	}
+
+	*files = list;
+	return n;
+}
+
+/*
+ * Free a list of files made by knowledge_list_files().
+ *
+ * Input:
+ *   files - the list
+ *   count - the number of files in it
+ */
+void knowledge_free_files(KB_FILE *files, int count)
+{
+	for (int i = 0; i < count; i++)
+		free(files[i].path);
+	free(files);
+}
+
+/*
+ * Initialise an empty batch.
+ *
+ * Input:
+ *   batch - the batch
+ */
+void knowledge_batch_init(KB_BATCH *batch)
+{
+	memset(batch, 0, sizeof(KB_BATCH));
+	batch->map_fd = -1;
+}
+
+/* how many entries ahead knowledge_batch_commit() prefetches hash buckets */
+#define KB_PREFETCH 16
+
+/* size of the text blocks a batch copies strings into */
+#define KB_BATCH_BLOCK 65536
+
+/*
+ * Copy a string into the text blocks of a batch. The blocks never move, so
+ * the copy stays where it is until the batch is freed.
+ *
+ * Returns: the copy, or NULL on allocation failure
+ */
+static const char *kb_batch_text(KB_BATCH *batch, const char *text, size_t len)
+{
+	if (batch->nblocks == 0 || batch->block_used + len > KB_BATCH_BLOCK) {
+		char **blocks = (char **)realloc(batch->blocks, (batch->nblocks + 1) * sizeof(char *));
+		if (blocks == NULL)
+			return NULL;
+		batch->blocks = blocks;
+		batch->blocks[batch->nblocks] = (char *)malloc(KB_BATCH_BLOCK);
+		if (batch->blocks[batch->nblocks] == NULL)
+			return NULL;
+		batch->nblocks++;
+		batch->block_used = 0;
+	}
+	char *copy = batch->blocks[batch->nblocks - 1] + batch->block_used;
+	memcpy(copy, text, len);
+	batch->block_used += len;
+	return copy;
+}
 
-// INTENT_PTR head = NULL;
-ENTITY_PTR head = NULL;
-ENTITY_PTR end = NULL;
 /*
- * Get the response to a question.
+ * Add an entry to a batch. Nothing is inserted into the knowledge base until
+ * the batch is committed.
  *
  * Input:
+ *   batch    - the batch
  *   intent   - the question word
  *   entity   - the entity
- *   response - a buffer to receive the response
- *   n        - the maximum number of characters to write to the response buffer
+ *   response - the response for this question and entity
  *
  * Returns:
- *   KB_OK, if a response was found for the intent and entity (the response is copied to the response buffer)
- *   KB_NOTFOUND, if no response could be found
- *   KB_INVALID, if 'intent' is not a recognised question word
+ *   KB_OK, if successful
+ *   KB_NOMEM, if there was a memory allocation failure
+ *   KB_INVALID, if the intent is not a valid question word, or the entity or
+ *     response is empty or too long (the entry is not added)
  */
-int knowledge_get(const char *intent, const char *entity, char *response, int n)
+int knowledge_batch_add(KB_BATCH *batch, const char *intent, const char *entity, const char *response)
 {
+	INTENT i = knowledge_intent(intent);
+	if (i == INTENT_NONE)
+		return KB_INVALID;
+	size_t entity_len = strlen(entity);
+	size_t response_len = strlen(response);
+	if (!kb_valid(entity_len, response_len))
+		return KB_INVALID;
+
+	const char *entity_copy = kb_batch_text(batch, entity, entity_len);
+	const char *response_copy = kb_batch_text(batch, response, response_len);
+	if (entity_copy == NULL || response_copy == NULL)
+		return KB_NOMEM;
+	return knowledge_batch_add_ref(batch, i, entity_copy, entity_len, response_copy, response_len);
+}
 
-	if (chatbot_is_question(intent) == 0)
-	{
+/*
+ * Add an entry to a batch without copying its strings, which must stay valid
+ * until the batch is committed.
+ *
+ * Input:
+ *   batch        - the batch
+ *   intent       - the intent
+ *   entity       - the entity (not necessarily null-terminated)
+ *   entity_len   - the length of the entity
+ *   response     - the response (not necessarily null-terminated)
+ *   response_len - the length of the response
+ *
+ * Returns:
+ *   KB_OK, if successful
+ *   KB_NOMEM, if there was a memory allocation failure
+ *   KB_INVALID, if the entity or response is empty or too long (the entry is not added)
+ */
+int knowledge_batch_add_ref(KB_BATCH *batch, INTENT intent, const char *entity, size_t entity_len, const char *response, size_t response_len)
+{
+	if (!kb_valid(entity_len, response_len))
 		return KB_INVALID;
+
+	if (batch->count == batch->size) {
+		int size = batch->size == 0 ? 256 : batch->size * 2;
+		KB_BATCH_ENTRY *grown = (KB_BATCH_ENTRY *)realloc(batch->entries, size * sizeof(KB_BATCH_ENTRY));
+		if (grown == NULL)
+			return KB_NOMEM;
+		batch->entries = grown;
+		batch->size = size;
 	}
-	ENTITY_PTR current = NULL;
-	current = head;
-	if (current == NULL) {
-		return KB_NOTFOUND;
+
+	KB_BATCH_ENTRY *entry = &batch->entries[batch->count++];
+	entry->intent = intent;
+	entry->entity = entity;
+	entry->entity_len = (uint32_t)entity_len;
+	entry->response = response;
+	entry->response_len = (uint32_t)response_len;
+	return KB_OK;
+}
+
+/* an entry of a batch being put into a disk store, by kb_disk_commit() */
+typedef struct kb_disk_entry {
+	INTENT intent;
+	const char *key;             /* the entity folded by fold_hash(), and null-terminated */
+	uint32_t h;                  /* its hash */
+	int k;                       /* its place in the batch */
+} KB_DISK_ENTRY;
+
+/*
+ * Order the entries of a batch by intent and folded entity, and then by their
+ * place in the batch.
+ */
+static int kb_disk_compare(const void *a, const void *b)
+{
+	const KB_DISK_ENTRY *x = (const KB_DISK_ENTRY *)a, *y = (const KB_DISK_ENTRY *)b;
+	if (x->intent != y->intent)
+		return (x->intent > y->intent) - (x->intent < y->intent);
+	int c = strcmp(x->key, y->key);
+	return c != 0 ? c : (x->k > y->k) - (x->k < y->k);
+}
+
+/*
+ * Put every entry of a batch into the disk store, for knowledge_batch_commit().
+ * The entries are put in key order, so that each leaf is visited once for all
+ * of its entries, and the pages they change are written out together at the
+ * end. Entries with the same key are still put in their order in the batch,
+ * so the last response wins.
+ *
+ * Returns: the number of entries in the batch, or KB_NOMEM if there was a
+ *   memory allocation failure or the store could not be written
+ */
+static int kb_disk_commit(KB_BATCH *batch)
+{
+	KB_DISK_ENTRY *order = (KB_DISK_ENTRY *)malloc(batch->count * sizeof(KB_DISK_ENTRY));
+	char *keys = (char *)malloc(batch->count * (size_t)MAX_ENTITY);
+	if (order == NULL || keys == NULL) {
+		free(order);
+		free(keys);
+		return KB_NOMEM;
 	}
-	while (current != NULL)
-	{
-		if (compare_token(current->intent, intent) == 0)
-		{
-			if (compare_token(current->entity, entity) == 0)
-			{
-				snprintf(response, n, "%s", current->response); // Response var will be set to the entity found
-				return KB_OK;
-			}
+	for (int k = 0; k < batch->count; k++) {
+		const KB_BATCH_ENTRY *entry = &batch->entries[k];
+		char *key = keys + (size_t)k * MAX_ENTITY;
+		order[k].h = fold_hash(key, entry->entity, entry->entity_len);
+		key[entry->entity_len] = '\0';
+		order[k].intent = entry->intent;
+		order[k].key = key;
+		order[k].k = k;
+	}
+	qsort(order, batch->count, sizeof(KB_DISK_ENTRY), kb_disk_compare);
+
+	int result = batch->count;
+	for (int k = 0; k < batch->count && result >= 0; k++) {
+		const KB_BATCH_ENTRY *entry = &batch->entries[order[k].k];
+		if (disk_put(entry->intent, order[k].key, entry->entity, entry->entity_len, entry->response, entry->response_len) != KB_OK)
+			result = KB_NOMEM;
+		cache_invalidate(entry->intent, order[k].key, entry->entity_len, order[k].h);
+	}
+	if (disk_flush(1) != KB_OK)
+		result = KB_NOMEM;
+	free(order);
+	free(keys);
+	return result;
+}
+
+/*
+ * Insert every entry of a batch into memory, for knowledge_batch_commit().
+ */
+static int kb_memory_commit(KB_BATCH *batch)
+{
+	/* fold and hash everything first, so the insert loop can prefetch the buckets it is about to visit */
+	size_t total = 0;
+	for (int k = 0; k < batch->count; k++)
+		total += batch->entries[k].entity_len;
+	uint32_t *hashes = (uint32_t *)malloc(batch->count * sizeof(uint32_t));
+	char *keys = (char *)malloc(total);
+	if (hashes == NULL || keys == NULL) {
+		free(hashes);
+		free(keys);
+		return KB_NOMEM;
+	}
+	unsigned long want[KB_INTENTS] = {0};
+	char *key = keys;
+	for (int k = 0; k < batch->count; k++) {
+		hashes[k] = fold_hash(key, batch->entries[k].entity, batch->entries[k].entity_len);
+		key += batch->entries[k].entity_len;
+		want[batch->entries[k].intent]++;
+	}
+
+	if (kb_lock() == NULL) {
+		free(hashes);
+		free(keys);
+		return KB_NOMEM;
+	}
+	for (int i = 0; i < KB_INTENTS; i++) {
+		if (want[i] > 0)
+			want[i] += kb_current->index[i].count;
+	}
+	if (kb_reserve(want) != KB_OK) {
+		kb_unlock();
+		free(hashes);
+		free(keys);
+		return KB_NOMEM;
+	}
+	KB_STORE *store = kb_current->store;
+
+	const char *map = batch->map;
+	int lazy = batch->map_fd >= 0;
+	uint64_t map_base = (uint64_t)-1;
+	if (map != NULL && kb_keep_map(store, map, batch->map_len, 0, batch->map_fd) == KB_OK) {
+		batch->map = NULL;   /* the knowledge base owns it now */
+		batch->map_fd = -1;
+		map_base = kb_pool_map(&store->text, map, batch->map_len);
+	}
+
+	int result = batch->count;
+	key = keys;
+	for (int k = 0; k < batch->count; k++) {
+		if (k + KB_PREFETCH < batch->count) {
+			const KB_INDEX *ahead = &kb_current->index[batch->entries[k + KB_PREFETCH].intent];
+			__builtin_prefetch(&ahead->buckets[hashes[k + KB_PREFETCH] & (ahead->nbuckets - 1)]);
 		}
-		if (current->next != NULL) { 
-			current = current->next;
+
+		const KB_BATCH_ENTRY *entry = &batch->entries[k];
+		uint64_t text;
+		if (map_base != (uint64_t)-1 && entry->response >= map && entry->response < map + batch->map_len) {
+			text = map_base + (uint64_t)(entry->response - map);
+			store->text.bytes += entry->response_len;
+			if (lazy)
+				store->text.cold += entry->response_len;
 		} else {
+			text = kb_pool_add(&store->text, kb_shard(entry->intent, hashes[k]), entry->response, entry->response_len);
+			if (text == (uint64_t)-1) {
+				result = KB_NOMEM;
+				break;
+			}
+		}
+		if (kb_insert(entry->intent, key, entry->entity, entry->entity_len, hashes[k], text, entry->response_len) != KB_OK) {
+			result = KB_NOMEM;
 			break;
 		}
+		key += entry->entity_len;
 	}
+	if (map_base != (uint64_t)-1)
+		kb_release(store);
+	kb_unlock();
+	free(hashes);
+	free(keys);
+	kb_wake_indexer();
+	return result;
+}
 
-	return KB_NOTFOUND;
+/*
+ * Insert every entry of a batch into the knowledge base in one pass.
+ *
+ * The hash index of each intent is sized for the whole batch up front, so no
+ * rehashing happens during the insert and the batch costs O(N) overall.
+ * Entries are applied in the order they were added, so when the batch (or the
+ * knowledge base) holds the same intent and entity more than once, the last
+ * response wins. Readers see each entry as soon as it is inserted.
+ *
+ * If the batch has a mapped file, the knowledge base takes it over and the
+ * responses inside it are referenced rather than copied; in lazy mode they are
+ * then left on disk (see knowledge_set_lazy()). A disk store copies them into
+ * its file instead (see kb_disk_commit()).
+ *
+ * Input:
+ *   batch - the batch; it must still be freed
+ *
+ * Returns: the number of entries in the batch, or KB_NOMEM if there was a memory allocation failure
+ */
+int knowledge_batch_commit(KB_BATCH *batch)
+{
+	if (batch->count == 0)
+		return 0;
+	return kb_storage->commit(batch);
 }
 
 /*
- * Insert a new response to a question. If a response already exists for the
- * given intent and entity, it will be overwritten. Otherwise, it will be added
- * to the knowledge base.
+ * Free the memory held by a batch.
  *
  * Input:
- *   intent    - the question word
- *   entity    - the entity
- *   response  - the response for this question and entity
+ *   batch - the batch
+ */
+void knowledge_batch_free(KB_BATCH *batch)
+{
+	free(batch->entries);
+	for (int k = 0; k < batch->nblocks; k++)
+		free(batch->blocks[k]);
+	free(batch->blocks);
+	if (batch->map != NULL)
+		kb_unmap(batch->map, batch->map_len, batch->map_fd);
+	knowledge_batch_init(batch);
+}
+
+/*
+ * Empty the knowledge base in memory, for knowledge_reset().
+ */
+static void kb_memory_reset()
+{
+	KB_VERSION *version = (KB_VERSION *)calloc(1, sizeof(KB_VERSION));
+	KB_STORE *store = kb_store_new();
+	if (version == NULL || store == NULL) {
+		free(version);
+		free(store);
+		return;
+	}
+	version->store = store;
+
+	kb_lock_all();
+	kb_norder = 0;
+
+	/* emptied first, so that no reader of the new version finds an entity of the old one */
+	search_reset();
+	trie_reset();
+	kb_publish(version);
+	cache_clear();
+	fuzzy_reset();
+	uint64_t sequence = journal_reset();
+	kb_unlock();
+	journal_wait(sequence);
+}
+
+/*
+ * Empty the disk store, for knowledge_reset().
+ */
+static void kb_disk_reset()
+{
+	if (disk_reset() != KB_OK)
+		fprintf(stderr, "%s: cannot write the disk store\n", chatbot_botname());
+	cache_clear();
+}
+
+/*
+ * Reset the knowledge base, removing all know entitities from all intents.
+ * The old entities are freed once no reader is using them. If the new, empty
+ * knowledge base cannot be allocated, the old one is kept.
+ */
+void knowledge_reset()
+{
+	kb_storage->reset();
+}
+
+/*
+ * Choose whether to leave the responses of loaded files on disk.
  *
- * Returns:
- *   KB_FOUND, if successful
- *   KB_NOMEM, if there was a memory allocation failure
- *   KB_INVALID, if the intent is not a valid question word
+ * Normally a knowledge file stays mapped once it is loaded, and the responses
+ * inside it are read through the mapping, but loading it has read every page,
+ * and they stay resident while the memory is there. In lazy mode only the
+ * entities, each with the offset and length of its response in the file, and
+ * the indexes stay in memory: the pages of responses are dropped once a file
+ * has been loaded or the knowledge base saved, and knowledge_get() reads each
+ * response from the file when it is asked for, leaving the answer cache (see
+ * cache.c) to keep the popular ones at hand. The keyword index then only
+ * holds the words of the entities, as the words of every response would take
+ * as much memory again.
+ *
+ * Responses that do not come from a mapped file, such as those put by the
+ * user or read from a pipe, are kept in memory either way. The mode applies to
+ * the files loaded after it is chosen, and is meant to be chosen at startup,
+ * as the keyword index is not rebuilt when it changes.
+ *
+ * Input:
+ *   lazy - 1 to leave the responses on disk, 0 to keep them in memory
  */
-int knowledge_put(char *intent, char *entity, char *response)
+void knowledge_set_lazy(int lazy)
 {
-	if (chatbot_is_question(intent) == KB_INVALID) {
-		return KB_INVALID;
+	kb_lazy = lazy;
+}
+
+/*
+ * Measure the memory held by the knowledge base.
+ *
+ * Output:
+ *   entries - the number of entities in the knowledge base
+ *   bytes   - the number of bytes in use for them: the entities, the hash
+ *             indexes and the text in the string pools, less the responses
+ *             left on disk in lazy mode (see knowledge_set_lazy()); or, for
+ *             a disk store, the pages of it in its buffer pool
+ */
+void knowledge_usage(unsigned long *entries, unsigned long *bytes)
+{
+	kb_storage->usage(entries, bytes);
+}
+
+/*
+ * Measure the knowledge base in memory, for knowledge_usage().
+ */
+static void kb_memory_usage(unsigned long *entries, unsigned long *bytes)
+{
+	*entries = 0;
+	*bytes = 0;
+	const KB_VERSION *version = kb_lock();
+	if (version == NULL)
+		return;
+	for (int i = 0; i < KB_INTENTS; i++) {
+		const KB_INDEX *index = &version->index[i];
+		*entries += index->count;
+		*bytes += index->count * (sizeof(ENTITY) + 2 * sizeof(uint32_t)) + index->nbuckets * sizeof(uint32_t);
 	}
-	int exist = 0;
-	// Pointer for finding if intent and entity exists
-	ENTITY_PTR find = (ENTITY_PTR)malloc(sizeof(ENTITY));
-	// Pointer for iterating through linked list
-	ENTITY_PTR current = (ENTITY_PTR)malloc(sizeof(ENTITY));
-	// Pointer to a node, which holds the intent, entity and response
-	ENTITY_PTR insert = (ENTITY_PTR)malloc(sizeof(ENTITY));
-	find = head;
-	current = head;
-	// Assigning the variables into the node
-	if (insert != NULL) {
-		strcpy(insert->intent, intent);
-		strcpy(insert->entity, entity);
-		strcpy(insert->response, response);
-	} else {
-		// If the new node could not be allocated with memory, this will run
-		return KB_NOMEM;
+	*bytes += version->store->keys.bytes + version->store->names.bytes + version->store->text.bytes;
+	*bytes -= version->store->text.cold;
+	kb_unlock();
+}
+
+/*
+ * Measure the disk store, for knowledge_usage().
+ */
+static void kb_disk_usage(unsigned long *entries, unsigned long *bytes)
+{
+	unsigned long reads, writes;
+	disk_usage(entries, bytes, &reads, &writes);
+}
+
+/*
+ * Make room for one more line in knowledge_write()'s buffer, writing out what
+ * it holds if the line might not fit.
+ *
+ * Returns: 1 if successful, 0 if the file could not be written
+ */
+static int kb_write_room(FILE *f, char *buffer, size_t *used)
+{
+	if (*used <= KB_WRITE_BUFFER - KB_WRITE_LINE)
+		return 1;
+	if (fwrite(buffer, 1, *used, f) != *used)
+		return 0;
+	*used = 0;
+	return 1;
+}
+
+/* where knowledge_write() is writing the entries of a disk store */
+typedef struct kb_write {
+	FILE *f;
+	char *buffer;
+	size_t used;
+	int result;                  /* KB_OK, or KB_INVALID once the file could not be written */
+} KB_WRITE;
+
+/*
+ * Format an entry of a disk store into knowledge_write()'s buffer.
+ *
+ * Returns: 0 if successful, 1 if the file could not be written
+ */
+static int kb_write_visit(void *arg, const char *entity, size_t entity_len, const char *response, size_t response_len)
+{
+	KB_WRITE *w = (KB_WRITE *)arg;
+	if (!kb_write_room(w->f, w->buffer, &w->used)) {
+		w->result = KB_INVALID;
+		return 1;
 	}
-	/*
-	 * Check if there is an existing linked list.
-	 * If there isn't, we will set the head to point to the new node that we just created.
-	 * If there is, we will set the current ptr to the start of the list
-	 */
-	if (head == NULL) {
-		head = insert;
-	} else {
-		current = head;
-		find = head;
-	}
-	/* 
-	 * First, we will try to find if the intent and entity exists in the linked list.
-	 * We traverse throught the linked list using the "find" ptr.
-	 * Then we will check if the current node's intent and entity matches the one the user has input.
-	 * If it is, then we will check if the responses are the same, if they are we break out of the loop. 
-	 * If they aren't, we will update it with the latest one in the knowledge file.
-	 * Lastly, a variable will be set to "1" we find a matching node.
-	 */
-	while (find != NULL) {
-		if (compare_token(find->intent, intent) == 0 && compare_token(find->entity, entity) == 0) {
-			if (compare_token(find->response, response) == 0) {
-				exist = 1;
-				break;
-			} else {
-				strcpy(current->response, response);
-				exist = 1;
-				break;
-			}
+	memcpy(w->buffer + w->used, entity, entity_len);
+	w->used += entity_len;
+	w->buffer[w->used++] = '=';
+	memcpy(w->buffer + w->used, response, response_len);
+	w->used += response_len;
+	w->buffer[w->used++] = '\n';
+	return 0;
+}
+
+/*
+ * Write the entries of the disk store for knowledge_write(), an intent at a
+ * time, through its buffer.
+ *
+ * Returns: KB_OK if successful, KB_NOMEM if the store could not be read, or
+ *   KB_INVALID if the file could not be written
+ */
+static int kb_disk_write(FILE *f, char *buffer)
+{
+	int order[KB_INTENTS];
+	int norder = disk_intents(order);
+	KB_WRITE w = {f, buffer, 0, KB_OK};
+	for (int k = 0; k < norder; k++) {
+		if (!kb_write_room(f, buffer, &w.used))
+			return KB_INVALID;
+		w.used += (size_t)sprintf(buffer + w.used, "%s[%s]\n", k > 0 ? "\n" : "", kb_intent_names[order[k]]);
+		int result = disk_scan((INTENT)order[k], "", 0, kb_write_visit, &w);
+		if (result != KB_OK || w.result != KB_OK)
+			return result != KB_OK ? result : w.result;
+	}
+	if (w.used > 0 && fwrite(buffer, 1, w.used, f) != w.used)
+		return KB_INVALID;
+	return KB_OK;
+}
+
+/*
+ * Write the entries in memory for knowledge_write(), in the order they were
+ * added, through its buffer. The knowledge base can change meanwhile; the
+ * file shows it as it stood when the write started (see kb_freeze()).
+ *
+ * Returns: KB_OK if successful, KB_NOMEM if there was a memory allocation
+ *   failure, or KB_INVALID if the file could not be written
+ */
+static int kb_memory_write(FILE *f, char *buffer)
+{
+	KB_FROZEN frozen;
+	if (kb_freeze(&frozen) != KB_OK)
+		return KB_NOMEM;
+	const KB_STORE *store = frozen.store;
+	size_t used = 0;
+	int result = KB_OK;
+
+	/* one section per intent, separated by blank lines */
+	for (int k = 0; k < frozen.norder && result == KB_OK; k++) {
+		int i = frozen.order[k];
+		if (!kb_write_room(f, buffer, &used)) {
+			result = KB_INVALID;
+			break;
 		}
-		find = find->next;
-	}
-	/* 
-	 * If the incoming intent and entity pair exists in the linked list, we will not run this code.
-	 * If it doesn't exist, we will traverse through the linked list again.
-	 */
-	if (exist == 0) {
-		while (current != NULL) {
-			/* 
-			 * Here, we are trying to see if there is a next node to point to, 
-			 * if it doesn't it will add the new node at the end of the list (see ELSE).
-			 * If there is a next node, we will check if the current node's intent is the same as the incoming one,
-			 * if they are, we will also check if the next node's intent is not the same.
-			 * When these two criterias are fulfilled, we will add the new node in between the current and next node.
-			 */
-			if (current->next != NULL) {
-				if (compare_token(current->intent, intent) == 0 && compare_token(current->next->intent, intent) != 0) {
-					insert->next = current->next;
-					current->next = insert;
-					break;
-				} 
-			} else {
-				current->next = insert;
+		used += (size_t)sprintf(buffer + used, "%s[%s]\n", k > 0 ? "\n" : "", kb_intent_names[i]);
+		for (unsigned long pos = 0; pos < frozen.count[i]; pos++) {
+			if (!kb_write_room(f, buffer, &used)) {
+				result = KB_INVALID;
 				break;
 			}
-			current = current->next;
+			const ENTITY *e = kb_entity(store, frozen.ids[i][pos]);
+			memcpy(buffer + used, kb_pool_get(&store->names, e->key), e->key_len);
+			used += e->key_len;
+			buffer[used++] = '=';
+			memcpy(buffer + used, kb_pool_get(&store->text, e->response), e->response_len);
+			used += e->response_len;
+			buffer[used++] = '\n';
 		}
 	}
-	return KB_OK;
+	if (result == KB_OK && used > 0 && fwrite(buffer, 1, used, f) != used)
+		result = KB_INVALID;
+	kb_thaw(&frozen);
+	return result;
 }
 
 /*
- * Read a knowledge base from a file.
+ * Write the knowledge base to a file, in the text format knowledge_read()
+ * reads: one section per intent, in the order the intents were first added,
+ * with its entities in the order they were added (or, from a disk store, in
+ * alphabetical order). The lines are formatted into a large buffer, which is
+ * written out whenever it fills, so the file gets a few large writes however
+ * many entries there are.
  *
  * Input:
  *   f - the file
  *
- * Returns: the number of entity/response pairs successful read from the file
+ * Returns: KB_OK if successful, KB_NOMEM if there was a memory allocation
+ *   failure, or KB_INVALID if the file could not be written
  */
-int knowledge_read(FILE *f)
+int knowledge_write(FILE *f)
 {
-	char readline[MAX_RESPONSE + MAX_ENTITY];
-	char *entity;
-	char *reply;
-	int readIntent;
-	char intent;
-
-	while (fgets(readline, MAX_INPUT, f))
-	{
-		//To remove additional newLine on the specific line that is being read.
-		readline[strcspn(readline, "\n")] = 0;
-		int lineLength = strlen(readline);
-		for (int i = 0; i < lineLength; i++)
-		{
-			/*
-			 * If the Read Line is an intent, it will contain a non-alphabet at the first character.
-			 * It will also check if the line has no "="
-			 */
-			if (!isalpha(readline[i]) && !strstr(readline, "="))
-			{
-				/* Removes "[" and "]" to get the intent that is being read */
-				char *linePtr = strtok(readline, "[");
-				char *endLinePtr = strtok(linePtr, "]");
-
-				if (compare_token(endLinePtr, WHO) == 0)
-					readIntent = 0;
-				else if (compare_token(endLinePtr, WHAT) == 0)
-					readIntent = 1;
-				else if (compare_token(endLinePtr, WHERE) == 0)
-					readIntent = 2;
-				else if (compare_token(endLinePtr, WHEN) == 0)
-					readIntent = 3;
-				else if (compare_token(endLinePtr, WHY) == 0)
-					readIntent = 4;
-				else if (compare_token(endLinePtr, HOW) == 0)
-					readIntent = 5;
-			} 
-			/* Once intent is being read, next in line will be entity and reply.
-			This will search for "=". If it contains "=", then it is entity and reply */
-			else if (strrchr(readline, '='))
-			{
-				/* A pointer to point at the entity and the reply */
-				char *entity = strtok(readline, "=");
-				char *reply = strtok(NULL, "=");
-
-				/* Switch function is used to put each intent, followed by its entity and reply */
-				switch (readIntent)
-				{
-				case 0: knowledge_put(WHO, entity, reply);
-					break;
-				case 1: knowledge_put(WHAT, entity, reply);
-					break;
-				case 2: knowledge_put(WHERE, entity, reply);
-					break;
-				case 3: knowledge_put(WHEN, entity, reply);
-					break;
-				case 4: knowledge_put(WHY, entity, reply);
-					break;
-				case 5: knowledge_put(HOW, entity, reply);
-					break;
-				default:
-					break;
-				}
-			}
-		}
-	}
-	if (readIntent >= 0 && readIntent <= 10)
-	{
-		return KB_OK;
-	}
-	else
-	{
-		return KB_NOTFOUND;
+	uint64_t start = stats_now();
+	char *buffer = (char *)malloc(KB_WRITE_BUFFER);
+	if (buffer == NULL)
+		return KB_NOMEM;
+	int result = kb_storage->write(f, buffer);
+	free(buffer);
+	stats_time(STATS_KB_WRITE, start);
+	return result;
+}
+
+/*
+ * Sync the directory a file is in, so that creating or renaming the file
+ * survives a crash.
+ *
+ * Input:
+ *   path - the file
+ *
+ * Returns: 1 if successful, 0 otherwise
+ */
+int knowledge_sync_dir(const char *path)
+{
+	const char *slash = strrchr(path, '/');
+	char dir[4096];
+	if (slash == NULL)
+		snprintf(dir, sizeof(dir), ".");
+	else if ((size_t)snprintf(dir, sizeof(dir), "%.*s", slash == path ? 1 : (int)(slash - path), path) >= sizeof(dir)) {
+		errno = ENAMETOOLONG;
+		return 0;
 	}
+	int fd = open(dir, O_RDONLY);
+	if (fd < 0)
+		return 0;
+	int ok = fsync(fd) == 0 || errno == EINVAL;
+	close(fd);
+	return ok;
 }
 
 /*
- * Reset the knowledge base, removing all know entitities from all intents.
+ * Save the knowledge base in a file, replacing it atomically: the knowledge
+ * base is written to a new file next to it, which is synced to disk and then
+ * renamed over it, so that whenever the process or the machine stops, the file
+ * holds either everything it held before or everything it holds after. The
+ * knowledge base may still be reading responses from a mapping of the old
+ * file, which renaming leaves alone. A file that is replaced keeps its mode;
+ * a new one gets the usual mode for the umask.
+ *
+ * Input:
+ *   path   - the file
+ *   binary - 1 to write a binary snapshot (knowledge_write_binary()), 0 to
+ *            write the text format (knowledge_write())
+ *
+ * Returns: KB_OK if successful, KB_NOMEM if there was a memory allocation
+ *   failure, or KB_INVALID if the file could not be written. On failure errno
+ *   is ENOMEM for KB_NOMEM; for KB_INVALID it is that of the system call that
+ *   failed, or 0 if none did (a disk store cannot be written as a snapshot)
  */
-void knowledge_reset() {
-  ENTITY_PTR tmp = NULL;
+int knowledge_save(const char *path, int binary)
+{
+	static unsigned long saves = 0;
+	char *tmp = (char *)malloc(strlen(path) + 48);
+	if (tmp == NULL) {
+		errno = ENOMEM;
+		return KB_NOMEM;
+	}
+
+	/* created as the file would be, with the umask applied; a file being replaced keeps its own mode */
+	struct stat st;
+	int fd = -1;
+	for (int tries = 0; fd < 0 && tries < 100; tries++) {
+		sprintf(tmp, "%s.%ld.%lu", path, (long)getpid(), __atomic_fetch_add(&saves, 1, __ATOMIC_RELAXED));
+		fd = open(tmp, O_WRONLY | O_CREAT | O_EXCL, 0666);
+		if (fd < 0 && errno != EEXIST)
+			break;
+	}
+	FILE *f = fd >= 0 ? fdopen(fd, "wb") : NULL;
+	if (f != NULL && stat(path, &st) == 0 && fchmod(fd, st.st_mode & 07777) != 0) {
+		fclose(f);
+		f = NULL;
+		fd = -1;
+	}
+	if (f == NULL) {
+		int saved = errno;
+		if (fd >= 0)
+			close(fd);
+		unlink(tmp);
+		free(tmp);
+		errno = saved;
+		return KB_INVALID;
+	}
 
-  while (head != NULL) {
-  tmp = head->next;
-  memset(head, 0, sizeof(ENTITY));
-  free(head);
-  head = tmp;
-  }
-  head = NULL;
+	/* a write that failed in stdio leaves the error indicator set and errno from the system call */
+	int result = binary ? knowledge_write_binary(f) : knowledge_write(f);
+	int saved = result == KB_NOMEM ? ENOMEM : result != KB_OK && ferror(f) ? errno : 0;
+	if (result == KB_OK && (fflush(f) != 0 || fsync(fd) != 0)) {
+		saved = errno;
+		result = KB_INVALID;
+	}
+	if (fclose(f) != 0 && result == KB_OK) {
+		saved = errno;
+		result = KB_INVALID;
+	}
+	if (result == KB_OK && (rename(tmp, path) != 0 || !knowledge_sync_dir(path))) {
+		saved = errno;
+		result = KB_INVALID;
+	}
+	if (result != KB_OK) {
+		unlink(tmp);
+		errno = saved;
+	}
+	free(tmp);
+	return result;
 }
 
+static const KB_STORAGE kb_memory = {
+	.get = kb_memory_get,
+	.get_similar = kb_memory_get_similar,
+	.search = kb_memory_search,
+	.complete = kb_memory_complete,
+	.put = kb_memory_put,
+	.commit = kb_memory_commit,
+	.reset = kb_memory_reset,
+	.usage = kb_memory_usage,
+	.write = kb_memory_write,
+	.write_binary = kb_memory_write_binary,
+	.adopts_snapshots = 1
+};
+
+static const KB_STORAGE kb_disk = {
+	.get = kb_disk_get,
+	.get_similar = NULL,
+	.search = NULL,
+	.complete = kb_disk_complete,
+	.put = kb_disk_put,
+	.commit = kb_disk_commit,
+	.reset = kb_disk_reset,
+	.usage = kb_disk_usage,
+	.write = kb_disk_write,
+	.write_binary = NULL,
+	.adopts_snapshots = 0
+};
+
 /*
- * Write the knowledge base to a file.
+ * Keep the knowledge base in a disk store from now on, rather than in memory
+ * (see disk.c). This is meant to be called at startup, before anything has
+ * been loaded or any other thread uses the knowledge base.
  *
  * Input:
- *   f - the file
+ *   path - the file of the store, which is created if it does not exist
+ *
+ * Returns: the number of entities in the store, or as disk_open() if it could
+ *   not be opened (the knowledge base then stays in memory)
  */
-void knowledge_write(FILE *f)
-{
-	int occurence = 0;
-	ENTITY_PTR current = head;
-	while (current != NULL) {
-		/*
-		 * Traverse through the linked list.
-		 * Set the occurence to 0 means the intent has not appeared before.
-		 * If the intent has occured already, we will not print the intent again. 
-		 */
-		if (occurence == 0) {
-			fprintf(f, "[%s]\n", current->intent);
-		}
-		/* Add the entity and response into the file */
-		fprintf(f, "%s%s%s\n", current->entity, "=", current->response);
-		if (current->next != NULL) {
-			/*
-		   * If the next intent is not the same as the current one, set the occurence to 0. 
-			 * This is for the printing of the intent into the file
-		   */
-			if (compare_token(current->intent, current->next->intent) != 0) {
-				fprintf(f, "\n");
-				occurence = 0;
-			} else {
-				occurence++;
-			}
-		}
-		current = current->next;
+long knowledge_open(const char *path)
+{
+	long result = disk_open(path);
+	if (result >= 0)
+		kb_storage = &kb_disk;
+	return result;
+}
+
+/*
+ * Close the disk store, if the knowledge base is kept in one, writing out every
+ * change. The knowledge base is then kept in memory again, and is empty.
+ */
+void knowledge_close()
+{
+	if (kb_storage == &kb_disk) {
+		kb_storage = &kb_memory;
+		disk_close();
 	}
-	// fclose(f);
 }
\ No newline at end of file
@@ -1,39 +1,286 @@
 /*
  * ICT1002 (C Language) Group Project.
  *
- * This file implements the main loop, including dividing input into words.
+ * This file implements the main loop, including dividing input into words,
+ * and the command line.
  *
- * You should not need to modify this file. You may invoke its functions if you like, however.
+ * You may invoke its functions if you like.
  */
 
+#define _POSIX_C_SOURCE 200809L
+
 #include <ctype.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 #include "chat1002.h"
 
-/* word delimiters */
-const char *delimiters = " ?\t\n";
+/* word delimiters: space, question mark, tab and newline */
+static const unsigned char word_delimiter[256] = {[' '] = 1, ['?'] = 1, ['\t'] = 1, ['\n'] = 1};
+
+/* the fallback answer to unknown questions in batch mode, unless --fallback gives another */
+#define BATCH_FALLBACK "I don't know."
+
+
+/*
+ * Find the next word of a line of input. Words are separated by delimiters,
+ * and trailing punctuation is not part of a word. The line is not changed.
+ *
+ * Input:
+ *   p     - where to start looking
+ *
+ * Output:
+ *   token - receives the word
+ *
+ * Returns: where to look for the word after it (just past the delimiter that
+ *   ended it, so that the caller may overwrite that delimiter), or NULL if
+ *   there are no more words
+ */
+const char *next_token(const char *p, TOKEN *token) {
+
+	const unsigned char *at = (const unsigned char *)p;
+	while (word_delimiter[*at])
+		at++;
+	if (*at == '\0')
+		return NULL;
+
+	const unsigned char *start = at;
+	while (*at != '\0' && !word_delimiter[*at])
+		at++;
+	const unsigned char *end = at;
+	while (end > start && ispunct(end[-1]))
+		end--;
+
+	token->start = (const char *)start;
+	token->len = (size_t)(end - start);
+	return (const char *)(*at == '\0' ? at : at + 1);
+}
+
+
+/*
+ * Split a line of input into words in one pass, without copying or changing
+ * it.
+ *
+ * Input:
+ *   line   - the line
+ *   tokens - an array to receive the words
+ *   max    - the size of tokens; words beyond max are ignored
+ *
+ * Returns: the number of words
+ */
+int tokenize(const char *line, TOKEN tokens[], int max) {
+
+	int count = 0;
+	while (count < max && (line = next_token(line, &tokens[count])) != NULL)
+		count++;
+	return count;
+}
+
+
+/*
+ * Split a line of input into null-terminated words, removing trailing
+ * punctuation from each. Each word is terminated in place, so nothing is
+ * copied.
+ *
+ * Input:
+ *   input - the line; it is modified in place
+ *   inv   - an array to receive pointers to the beginning of each word
+ *   max   - the size of inv; words beyond max - 1 are ignored
+ *
+ * Returns: the number of words
+ */
+int split_words(char *input, char *inv[], int max) {
+
+	int inc = 0;
+	TOKEN token;
+	const char *p = input;
+	while (inc < max - 1 && (p = next_token(p, &token)) != NULL) {
+		inv[inc] = input + (token.start - input);
+		inv[inc][token.len] = '\0';
+		inc++;
+	}
+	inv[inc] = NULL;
+
+	return inc;
+}
+
+
+/*
+ * Load a knowledge file, or the files in a directory, given on the command line.
+ *
+ * Returns: 1 if every file was loaded, 0 otherwise (a message is printed to stderr)
+ */
+static int load_file(char *name) {
+
+	KB_FILE *files;
+	int count = knowledge_list_files(&name, 1, &files);
+	if (count < 0) {
+		fprintf(stderr, "%s: cannot load %s\n", chatbot_botname(), name);
+		return 0;
+	}
+	knowledge_read_files(files, count);
+	int loaded = 1;
+	for (int i = 0; i < count; i++) {
+		if (files[i].result == KB_NOTFOUND) {
+			fprintf(stderr, "%s: cannot open %s\n", chatbot_botname(), files[i].path);
+			loaded = 0;
+		} else if (files[i].result < 0) {
+			fprintf(stderr, "%s: cannot load %s\n", chatbot_botname(), files[i].path);
+			loaded = 0;
+		}
+	}
+	knowledge_free_files(files, count);
+	return loaded;
+}
 
 
 /*
  * Main loop.
+ *
+ * Usage: main [-L] [--pool megabytes] [-D file] [-k file]... [-J file] [-b [file]] [-f answer] [-j threads] [-s socket] [-c entries] [-z score[,edits]] [--stats seconds]
+ *        main --bench [name]... [option]...
+ *        main --generate entries [option]...
+ *   -L, --lazy           leave the responses of the knowledge files loaded after it on disk, reading each
+ *                        when it is asked for, so that only the entities are kept in memory
+ *   --pool megabytes     the memory for pages of the disk store opened after it (default: 16)
+ *   -D, --disk file      keep the knowledge base in a B+tree in file, creating it if need be, instead of in
+ *                        memory, for knowledge bases larger than memory (see disk.c); files loaded with -k
+ *                        are added to it, and it cannot be used with -J
+ *   -k, --kb file        load a knowledge file, or the files in a directory, before starting (may be repeated)
+ *   -J, --journal file   keep the knowledge base in a snapshot, file, and a journal of changes, file.journal,
+ *                        loading both before starting (see journal.c); files loaded with -k are added to it
+ *   -b, --batch [file]   answer the questions in file (or standard input) one per line, without prompts
+ *   -f, --fallback text  the answer to unknown questions in batch mode (default: "I don't know.")
+ *   -j, --threads n      the number of worker threads in batch mode (default: one per processor)
+ *   -s, --server socket  serve many users at once on a Unix domain socket, one question or answer per line
+ *   -c, --cache entries  the number of answers to cache (default: 8192; 0 turns the cache off)
+ *   -z, --fuzzy score[,edits]
+ *                        answer the closest question scoring at least this similarity, from 0 to 1, and
+ *                        at most this many edits away, to one that is not known (default: 0.8,2; a score
+ *                        of 1 turns this off)
+ *   --stats seconds      write the statistics (see stats.c) to standard error every so many seconds
+ *   --bench [name]...    run the named benchmarks (all of them by default) and exit
+ *   --generate entries   write a synthetic knowledge file with that many entries to standard output and exit
+ *   (see bench.c for the options of --bench and --generate)
  */
 int main(int argc, char *argv[]) {
 
-	char input[MAX_INPUT];      /* buffer for holding the user input */
+	char *input = NULL;         /* buffer for holding the user input, grown by getline() as needed */
+	size_t size = 0;            /* the size of the input buffer */
 	int inc;                    /* the number of words in the user input */
 	char *inv[MAX_INPUT];       /* pointers to the beginning of each word of input */
 	char output[MAX_RESPONSE];  /* the chatbot's output */
-	int len;                    /* length of a word */
 	int done = 0;               /* set to 1 to end the main loop */
+	int batch = 0;              /* set to 1 for batch mode */
+	const char *batch_file = NULL;
+	const char *server_path = NULL;
+	const char *fallback = BATCH_FALLBACK;
+	int loaded = 0;             /* set to 1 once a file has been loaded with -k */
+	int journaled = 0;          /* set to 1 once a journal has been opened with -J */
+	long threads = sysconf(_SC_NPROCESSORS_ONLN);
 
 	/* initialise the chatbot */
 	inv[0] = "reset";
 	inv[1] = NULL;
 	chatbot_do_reset(1, inv, output, MAX_RESPONSE);
 
+	/* process the command line */
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "-L") == 0 || strcmp(argv[i], "--lazy") == 0) {
+			knowledge_set_lazy(1);
+		} else if ((strcmp(argv[i], "-k") == 0 || strcmp(argv[i], "--kb") == 0) && i + 1 < argc) {
+			if (!load_file(argv[++i]))
+				return 1;
+			loaded = 1;
+		} else if (strcmp(argv[i], "--pool") == 0 && i + 1 < argc) {
+			if (disk_active()) {
+				fprintf(stderr, "%s: --pool must come before -D\n", chatbot_botname());
+				return 1;
+			}
+			disk_set_pool(strtoul(argv[++i], NULL, 10));
+		} else if ((strcmp(argv[i], "-D") == 0 || strcmp(argv[i], "--disk") == 0) && i + 1 < argc) {
+			if (journaled || disk_active()) {
+				fprintf(stderr, "%s: -D cannot be used with -J, or twice\n", chatbot_botname());
+				return 1;
+			}
+			/* the files already loaded are in memory, where the disk store would not see them */
+			if (loaded) {
+				fprintf(stderr, "%s: -D must come before -k\n", chatbot_botname());
+				return 1;
+			}
+			if (knowledge_open(argv[++i]) < 0)
+				return 1;
+		} else if ((strcmp(argv[i], "-J") == 0 || strcmp(argv[i], "--journal") == 0) && i + 1 < argc) {
+			if (disk_active()) {
+				fprintf(stderr, "%s: -J cannot be used with -D\n", chatbot_botname());
+				return 1;
+			}
+			if (journal_open(argv[++i]) < 0)
+				return 1;
+			journaled = 1;
+		} else if (strcmp(argv[i], "-b") == 0 || strcmp(argv[i], "--batch") == 0) {
+			batch = 1;
+			if (i + 1 < argc && argv[i + 1][0] != '-')
+				batch_file = argv[++i];
+		} else if ((strcmp(argv[i], "-f") == 0 || strcmp(argv[i], "--fallback") == 0) && i + 1 < argc) {
+			fallback = argv[++i];
+		} else if ((strcmp(argv[i], "-j") == 0 || strcmp(argv[i], "--threads") == 0) && i + 1 < argc) {
+			threads = strtol(argv[++i], NULL, 10);
+		} else if ((strcmp(argv[i], "-s") == 0 || strcmp(argv[i], "--server") == 0) && i + 1 < argc) {
+			server_path = argv[++i];
+		} else if ((strcmp(argv[i], "-c") == 0 || strcmp(argv[i], "--cache") == 0) && i + 1 < argc) {
+			cache_set_size(strtoul(argv[++i], NULL, 10));
+		} else if ((strcmp(argv[i], "-z") == 0 || strcmp(argv[i], "--fuzzy") == 0) && i + 1 < argc) {
+			char *end;
+			double score = strtod(argv[++i], &end);
+			fuzzy_set_cutoff(score, *end == ',' ? (int)strtol(end + 1, NULL, 10) : 2);
+		} else if (strcmp(argv[i], "--stats") == 0 && i + 1 < argc) {
+			if (stats_start(stderr, (unsigned)strtoul(argv[++i], NULL, 10)) != 0) {
+				fprintf(stderr, "%s: cannot start the statistics thread\n", chatbot_botname());
+				return 1;
+			}
+		} else if (strcmp(argv[i], "--bench") == 0) {
+			return bench_main(argc - i - 1, argv + i + 1);
+		} else if (strcmp(argv[i], "--generate") == 0) {
+			return bench_generate_main(argc - i - 1, argv + i + 1);
+		} else {
+			fprintf(stderr, "Usage: %s [-L] [--pool megabytes] [-D file] [-k file]... [-J file] [-b [file]] [-f answer] [-j threads] [-s socket] [-c entries] [-z score[,edits]] [--stats seconds]\n", argv[0]);
+			fprintf(stderr, "       %s --bench [name]... [option]...\n", argv[0]);
+			fprintf(stderr, "       %s --generate entries [option]...\n", argv[0]);
+			return 1;
+		}
+	}
+
+	/* files loaded with -k are not in the journal, so they go into a new snapshot */
+	if (loaded)
+		journal_compact();
+
+	if (batch) {
+		FILE *in = batch_file != NULL ? fopen(batch_file, "r") : stdin;
+		if (in == NULL) {
+			fprintf(stderr, "%s: cannot open %s\n", chatbot_botname(), batch_file);
+			return 1;
+		}
+		chatbot_set_fallback(fallback);
+		int failed = batch_run(in, stdout, threads < 1 ? 1 : (int)threads);
+		if (in != stdin)
+			fclose(in);
+		if (failed)
+			fprintf(stderr, "%s: batch mode failed\n", chatbot_botname());
+		journal_close();
+		knowledge_close();
+		return failed;
+	}
+
+	if (server_path != NULL) {
+		int failed = server_run(server_path);
+		journal_close();
+		knowledge_close();
+		return failed;
+	}
+
 	/* print a welcome message */
 	printf("%s: Hello, I'm %s.\n", chatbot_botname(), chatbot_botname());
 
@@ -41,26 +288,17 @@ int main(int argc, char *argv[]) {
 	do {
 
 		do {
-			/* read the line */
+			/* read the line, however long it is */
 			printf("%s: ", chatbot_username());
-			fgets(input, MAX_INPUT, stdin);
+			if (getline(&input, &size, stdin) == -1) {
+				free(input);
+				journal_close();
+				knowledge_close();
+				return 0;
+			}
 
 			/* split it into words */
-			inc = 0;
-			inv[inc] = strtok(input, delimiters);								// Tokenise the words based on the delimiters
-			while (inv[inc] != NULL) {
-
-				/* remove trailing punctuation */
-				len = strlen(inv[inc]);														// Variable len is the length of the words iterated 
-				while (len > 0 && ispunct(inv[inc][len - 1])) {		// Last letter of the word is a punctuation
-					inv[inc][len - 1] = '\0';
-					len--;
-				}
-
-				/* go to the next word */
-				inc++;
-				inv[inc] = strtok(NULL, delimiters);
-			}
+			inc = split_words(input, inv, MAX_INPUT);
 		} while (inc < 1);
 
 		/* invoke the chatbot */
@@ -69,6 +307,9 @@ int main(int argc, char *argv[]) {
 		
 	} while (!done);
 
+	free(input);
+	journal_close();
+	knowledge_close();
 	return 0;
 }
 
@@ -85,21 +326,7 @@ int main(int argc, char *argv[]) {
  */
 int compare_token(const char *token1, const char *token2) {
 
-	int i = 0;
-	while (token1[i] != '\0' && token2[i] != '\0') {
-		if (toupper(token1[i]) < toupper(token2[i]))
-			return -1;
-		else if (toupper(token1[i]) > toupper(token2[i]))
-			return 1;
-		i++;
-	}
-
-	if (token1[i] == '\0' && token2[i] == '\0')
-		return 0;
-	else if (token1[i] == '\0')
-		return -1;
-	else
-		return 1;
+	return fold_compare(token1, token2);
 
 }
 
@@ -124,9 +351,17 @@ void prompt_user(char *buf, int n, const char *format, ...) {
 	va_end(args);
 	printf("\n%s: ", chatbot_username());
 
-	/* get the response from the user */
-	fgets(buf, n, stdin);
+	/* get the response from the user, discarding whatever does not fit */
+	if (fgets(buf, n, stdin) == NULL) {
+		buf[0] = '\0';
+		return;
+	}
 	char *nl = strchr(buf, '\n');
-	if (nl != NULL)
+	if (nl != NULL) {
 		*nl = '\0';
+	} else {
+		int c;
+		while ((c = getchar()) != EOF && c != '\n')
+			;
+	}
 }
\ No newline at end of file
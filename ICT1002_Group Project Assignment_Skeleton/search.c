@@ -0,0 +1,748 @@
+/*
+ * ICT1002 (C Language) Group Project.
+ *
+ * This file implements the keyword index that finds the entry whose words
+ * best match a question that is not in the knowledge base at all, such as
+ * "what teaches programming fundamentals", by looking in the responses as
+ * well as the entities (only the entities, if the responses are left on disk;
+ * see knowledge_set_lazy()).
+ *
+ * Each entry is a document: the words (runs of letters and digits, folded to
+ * lower case) of its entity and response. For every word the index keeps a
+ * posting list of the documents containing it and how often, in order of
+ * document. Documents are numbered by entity id, which only ever grows until
+ * a reset, so a document is always added at the end of its lists and the
+ * lists are stored as the gaps between documents in a variable-length byte
+ * code: seven bits a byte, most of them one byte. Every SEARCH_BLOCK postings
+ * the list notes where it is, so that a search can skip over the documents it
+ * is not interested in without decoding them.
+ *
+ * search_find() ranks the documents containing more than half of the
+ * question's words by BM25. A document with that many of the n words has at
+ * least one of any n - need + 1 of them (need being the number required), so
+ * only the rarest lists are read; the documents found there are looked up in
+ * the others, which are skipped through rather than read.
+ *
+ * An entry whose response changes becomes a new document, and the old one is
+ * marked as gone (see search_remove()); its postings stay behind and are
+ * passed over.
+ *
+ * Documents must go into the lists in order of id, but entities of different
+ * shards of the knowledge base are added at once, so their ids are handed out
+ * in one order and filled in in another. The index therefore does not follow
+ * every insert: the knowledge base brings it up to date with search_update(),
+ * going through the ids in order a chunk at a time, in the background and
+ * before a search. A
+ * read-write lock lets any number of threads search at once.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include "chat1002.h"
+
+/* longer words are cut to this many characters */
+#define SEARCH_MAX_WORD 32
+
+/* the most distinct words of a question that are searched for */
+#define SEARCH_MAX_TERMS 16
+
+/* the most distinct words a document can have: one for every two characters */
+#define SEARCH_MAX_DOC_WORDS ((MAX_ENTITY + MAX_RESPONSE) / 2)
+
+/* the number of postings between skip entries */
+#define SEARCH_BLOCK 64
+
+/* the number of bytes of postings kept in the term itself, before any are allocated */
+#define SEARCH_INLINE 8
+
+/* the BM25 parameters: how quickly repeats of a word stop counting, and how much document length matters */
+#define SEARCH_K1 1.2
+#define SEARCH_B  0.75
+
+/* where a block of SEARCH_BLOCK postings starts: the document before it, and its offset in the list */
+typedef struct search_skip {
+	uint32_t doc;
+	uint32_t offset;
+} SEARCH_SKIP;
+
+/*
+ * A word and its posting list. Lists of up to SEARCH_INLINE bytes, which are
+ * most of them, are kept in the term rather than allocated.
+ */
+typedef struct search_term {
+	uint32_t text;               /* offset of the word, null-terminated, in search_text */
+	uint32_t df;                 /* the number of documents containing the word that are not gone */
+	uint32_t count;              /* the number of postings, including those of documents that are gone */
+	uint32_t last;               /* the last document in the list */
+	uint32_t used;               /* the number of bytes of postings */
+	uint32_t size;               /* the number of bytes allocated, or 0 while they are kept inline */
+	union {
+		uint8_t *heap;
+		uint8_t inline_bytes[SEARCH_INLINE];
+	} bytes;
+	SEARCH_SKIP *skips;          /* one per full block, or NULL */
+} SEARCH_TERM;
+
+/*
+ * A slot in the hash table of terms. The hash is kept alongside, so that
+ * looking for a new word, which most words in a big knowledge base are, does
+ * not have to visit the terms it collides with.
+ */
+typedef struct search_slot {
+	uint32_t hash;
+	uint32_t term;               /* 1 + the index of the term, or 0 if the slot is empty */
+} SEARCH_SLOT;
+
+static SEARCH_TERM *search_terms = NULL;
+static uint32_t search_nterms = 0;
+static uint32_t search_sterms = 0;      /* the number of terms search_terms has room for */
+static SEARCH_SLOT *search_slots = NULL;
+static uint32_t search_nslots = 0;      /* a power of two, at least twice search_nterms */
+static char *search_text = NULL;
+static size_t search_text_used = 0;
+static size_t search_text_size = 0;
+
+/* the number of words in each document, or 0 if it is not in the index (or gone) */
+static uint16_t *search_lengths = NULL;
+static uint32_t search_nlengths = 0;
+static uint32_t search_next = 1;        /* the first document not yet considered by search_update() */
+static unsigned long search_ndocs = 0;  /* the number of documents not gone */
+static unsigned long search_total = 0;  /* the number of words in them */
+
+static pthread_rwlock_t search_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+/* a reader of a posting list */
+typedef struct search_cursor {
+	const uint8_t *start;
+	const uint8_t *p;
+	const uint8_t *end;
+	const SEARCH_SKIP *skips;
+	uint32_t nskips;
+	uint32_t skip;               /* the next skip entry to consider */
+	uint32_t doc;                /* the current document, or UINT32_MAX at the end of the list */
+	uint32_t tf;                 /* the number of times the word is in it */
+	double idf;
+} SEARCH_CURSOR;
+
+/*
+ * Determine whether a character is an ASCII letter or digit.
+ */
+static int search_is_letter(unsigned char c)
+{
+	return (unsigned)((c | 0x20) - 'a') < 26 || (unsigned)(c - '0') < 10;
+}
+
+/*
+ * Get the next word from a string, folded to lower case and cut to
+ * SEARCH_MAX_WORD characters.
+ *
+ * Input:
+ *   p   - where to start; moved past the word
+ *   end - the end of the string
+ *
+ * Output:
+ *   word - receives the word, which is not null-terminated
+ *
+ * Returns: the length of the word, or 0 if there are no more
+ */
+static size_t search_next_word(const char **p, const char *end, char word[SEARCH_MAX_WORD])
+{
+	const unsigned char *s = (const unsigned char *)*p;
+	while (s < (const unsigned char *)end && !search_is_letter(*s))
+		s++;
+	size_t len = 0;
+	for (; s < (const unsigned char *)end && search_is_letter(*s); s++) {
+		if (len < SEARCH_MAX_WORD)
+			word[len++] = (char)(*s <= '9' ? *s : *s | 0x20);
+	}
+	*p = (const char *)s;
+	return len;
+}
+
+/*
+ * Hash a word (FNV-1a).
+ */
+static uint32_t search_hash(const char *word, size_t len)
+{
+	uint32_t h = 2166136261U;
+	for (size_t k = 0; k < len; k++) {
+		h ^= (unsigned char)word[k];
+		h *= 16777619U;
+	}
+	return h;
+}
+
+/*
+ * Find a word in the hash table.
+ *
+ * Returns: the slot holding it, or the empty slot it would go in
+ */
+static SEARCH_SLOT *search_slot(const char *word, size_t len, uint32_t h)
+{
+	uint32_t mask = search_nslots - 1;
+	for (uint32_t s = h & mask;; s = (s + 1) & mask) {
+		SEARCH_SLOT *slot = &search_slots[s];
+		if (slot->term == 0)
+			return slot;
+		if (slot->hash == h) {
+			const char *text = search_text + search_terms[slot->term - 1].text;
+			if (memcmp(text, word, len) == 0 && text[len] == '\0')
+				return slot;
+		}
+	}
+}
+
+/*
+ * Find a word in the index.
+ *
+ * Returns: the term, or NULL if no document has ever contained it
+ */
+static SEARCH_TERM *search_term(const char *word, size_t len)
+{
+	if (search_nslots == 0)
+		return NULL;
+	uint32_t t = search_slot(word, len, search_hash(word, len))->term;
+	return t == 0 ? NULL : &search_terms[t - 1];
+}
+
+/*
+ * Find a word, hashed by search_hash(), in the index, adding it if it is not
+ * there. The write lock must be held.
+ *
+ * Returns: the index of the term, or UINT32_MAX on allocation failure
+ */
+static uint32_t search_add_term(const char *word, size_t len, uint32_t h)
+{
+	if (search_nslots > 0) {
+		uint32_t t = search_slot(word, len, h)->term;
+		if (t != 0)
+			return t - 1;
+	}
+
+	/* keep the table at most half full */
+	if (search_nterms + 1 > search_nslots / 2) {
+		uint32_t nslots = search_nslots == 0 ? 1024 : search_nslots * 2;
+		SEARCH_SLOT *slots = (SEARCH_SLOT *)calloc(nslots, sizeof(SEARCH_SLOT));
+		if (slots == NULL)
+			return UINT32_MAX;
+		for (uint32_t old = 0; old < search_nslots; old++) {
+			if (search_slots[old].term == 0)
+				continue;
+			uint32_t s = search_slots[old].hash & (nslots - 1);
+			while (slots[s].term != 0)
+				s = (s + 1) & (nslots - 1);
+			slots[s] = search_slots[old];
+		}
+		free(search_slots);
+		search_slots = slots;
+		search_nslots = nslots;
+	}
+
+	if (search_nterms == search_sterms) {
+		uint32_t size = search_sterms == 0 ? 1024 : search_sterms * 2;
+		SEARCH_TERM *terms = (SEARCH_TERM *)realloc(search_terms, size * sizeof(SEARCH_TERM));
+		if (terms == NULL)
+			return UINT32_MAX;
+		search_terms = terms;
+		search_sterms = size;
+	}
+	if (search_text_used + len + 1 > search_text_size) {
+		size_t size = search_text_size == 0 ? 65536 : search_text_size * 2;
+		/* with room for a whole word after the end, which search_slot() may compare against */
+		char *text = (char *)realloc(search_text, size + SEARCH_MAX_WORD);
+		if (text == NULL || size > UINT32_MAX) {
+			if (text != NULL)
+				search_text = text;
+			return UINT32_MAX;
+		}
+		search_text = text;
+		search_text_size = size;
+	}
+
+	SEARCH_TERM *term = &search_terms[search_nterms];
+	memset(term, 0, sizeof(*term));
+	term->text = (uint32_t)search_text_used;
+	memcpy(search_text + search_text_used, word, len);
+	search_text[search_text_used + len] = '\0';
+	search_text_used += len + 1;
+	SEARCH_SLOT *slot = search_slot(word, len, h);
+	slot->hash = h;
+	slot->term = ++search_nterms;
+	return search_nterms - 1;
+}
+
+/*
+ * Get the postings of a term.
+ */
+static uint8_t *search_bytes(SEARCH_TERM *term)
+{
+	return term->size == 0 ? term->bytes.inline_bytes : term->bytes.heap;
+}
+
+/*
+ * Get the number of bytes a number takes in a posting list.
+ */
+static uint32_t search_varint_len(uint64_t v)
+{
+	uint32_t len = 1;
+	while (v >= 0x80) {
+		v >>= 7;
+		len++;
+	}
+	return len;
+}
+
+/*
+ * Append a document to the posting list of a term: the gap from the last
+ * document, shifted left one bit with the low bit set if the word is there
+ * more than once, and then the number of times if so.
+ *
+ * Returns: KB_OK, or KB_NOMEM if the list could not grow
+ */
+static int search_post(SEARCH_TERM *term, uint32_t doc, uint32_t tf)
+{
+	/* note where each block starts */
+	if (term->count > 0 && term->count % SEARCH_BLOCK == 0) {
+		uint32_t k = term->count / SEARCH_BLOCK - 1;
+		if ((k & (k - 1)) == 0) {
+			SEARCH_SKIP *skips = (SEARCH_SKIP *)realloc(term->skips, (k == 0 ? 1 : 2 * k) * sizeof(SEARCH_SKIP));
+			if (skips == NULL)
+				return KB_NOMEM;
+			term->skips = skips;
+		}
+		term->skips[k].doc = term->last;
+		term->skips[k].offset = term->used;
+	}
+
+	/* the gap and, if the word is there more than once, the number of times, seven bits to a byte */
+	uint64_t gap = (uint64_t)(doc - term->last) << 1 | (tf > 1);
+	uint32_t need = search_varint_len(gap) + (tf > 1 ? search_varint_len(tf) : 0);
+	uint32_t size = term->size == 0 ? SEARCH_INLINE : term->size;
+	if (term->used + need > size) {
+		while (term->used + need > size)
+			size *= 2;
+		uint8_t *bytes = (uint8_t *)malloc(size);
+		if (bytes == NULL)
+			return KB_NOMEM;
+		memcpy(bytes, search_bytes(term), term->used);
+		if (term->size != 0)
+			free(term->bytes.heap);
+		term->bytes.heap = bytes;
+		term->size = size;
+	}
+
+	uint8_t *out = search_bytes(term) + term->used;
+	uint64_t v = gap;
+	for (int number = 0; number < 2; number++) {
+		while (v >= 0x80) {
+			*out++ = (uint8_t)(v | 0x80);
+			v >>= 7;
+		}
+		*out++ = (uint8_t)v;
+		if (tf <= 1)
+			break;
+		v = tf;
+		tf = 0;
+	}
+	term->used = (uint32_t)(out - search_bytes(term));
+	term->last = doc;
+	term->count++;
+	return KB_OK;
+}
+
+/*
+ * Collect the distinct words of an entry, with the number of times each is
+ * there.
+ *
+ * Output:
+ *   words  - receives the index of each term; SEARCH_MAX_DOC_WORDS long
+ *   counts - receives the number of times each is there
+ *
+ * Returns: the number of distinct words, or -1 on allocation failure; the
+ *   total number of words is added to *total
+ */
+static int search_words(const char *entity, size_t entity_len, const char *response, size_t response_len, uint32_t words[],
+	uint32_t counts[], unsigned long *total)
+{
+	/* split the entry first, so that the hash slots of all of its words can be fetched at once */
+	char text[SEARCH_MAX_DOC_WORDS][SEARCH_MAX_WORD];
+	size_t lens[SEARCH_MAX_DOC_WORDS];
+	uint32_t hashes[SEARCH_MAX_DOC_WORDS];
+	int nwords = 0;
+	for (int part = 0; part < 2; part++) {
+		const char *p = part == 0 ? entity : response;
+		const char *end = p + (part == 0 ? entity_len : response_len);
+		while (nwords < SEARCH_MAX_DOC_WORDS && (lens[nwords] = search_next_word(&p, end, text[nwords])) > 0) {
+			hashes[nwords] = search_hash(text[nwords], lens[nwords]);
+			if (search_nslots > 0)
+				__builtin_prefetch(&search_slots[hashes[nwords] & (search_nslots - 1)]);
+			nwords++;
+		}
+	}
+
+	int n = 0;
+	for (int w = 0; w < nwords; w++) {
+		uint32_t t = search_add_term(text[w], lens[w], hashes[w]);
+		if (t == UINT32_MAX)
+			return -1;
+		int k = 0;
+		while (k < n && words[k] != t)
+			k++;
+		if (k == n) {
+			words[n] = t;
+			counts[n++] = 0;
+		}
+		counts[k]++;
+	}
+	*total += nwords;
+	return n;
+}
+
+/*
+ * Add an entry to the index. Documents must be added in increasing order.
+ * The caller must hold the write lock.
+ *
+ * Input:
+ *   doc      - the entity id
+ *   entity   - the entity
+ *   response - the response
+ *
+ * Returns: KB_OK, or KB_NOMEM if the index could not grow (the document may
+ *   then be in some of its lists, but is never found)
+ */
+static int search_add(uint32_t doc, const char *entity, size_t entity_len, const char *response, size_t response_len)
+{
+	uint32_t words[SEARCH_MAX_DOC_WORDS];
+	uint32_t counts[SEARCH_MAX_DOC_WORDS];
+	unsigned long total = 0;
+	int result = KB_OK;
+
+	if (doc >= search_nlengths) {
+		uint32_t size = search_nlengths == 0 ? 1024 : search_nlengths;
+		while (size <= doc)
+			size *= 2;
+		uint16_t *lengths = (uint16_t *)realloc(search_lengths, size * sizeof(uint16_t));
+		if (lengths == NULL)
+			return KB_NOMEM;
+		memset(lengths + search_nlengths, 0, (size - search_nlengths) * sizeof(uint16_t));
+		search_lengths = lengths;
+		search_nlengths = size;
+	}
+
+	int n = search_words(entity, entity_len, response, response_len, words, counts, &total);
+	if (n < 0)
+		result = KB_NOMEM;
+	for (int k = 0; k < n && result == KB_OK; k++) {
+		SEARCH_TERM *term = &search_terms[words[k]];
+		if (term->count > 0 && doc <= term->last)
+			continue;
+		result = search_post(term, doc, counts[k]);
+		if (result == KB_OK)
+			term->df++;
+	}
+	if (result == KB_OK && n > 0) {
+		search_lengths[doc] = (uint16_t)total;
+		search_ndocs++;
+		search_total += total;
+	} else {
+		/* take back the document frequencies of what did get in */
+		for (int k = 0; k < n; k++) {
+			SEARCH_TERM *term = &search_terms[words[k]];
+			if (term->count > 0 && term->last == doc && term->df > 0)
+				term->df--;
+		}
+	}
+	return result;
+}
+
+/*
+ * Get the first document search_update() has not considered yet.
+ */
+uint32_t search_indexed()
+{
+	return __atomic_load_n(&search_next, __ATOMIC_ACQUIRE);
+}
+
+/*
+ * Bring the index up to date, adding the documents from the first one not yet
+ * considered up to (but not including) 'end' that doc_of says are still in the
+ * knowledge base. The caller must hold every lock of the knowledge base, so
+ * that no entity is being added meanwhile.
+ *
+ * Input:
+ *   end    - the first entity id not yet handed out
+ *   doc_of - gets the entity and response of an id, returning 0 if the id
+ *            is not an entity in the knowledge base, or has been replaced
+ *   arg    - passed to doc_of
+ *
+ * Returns: KB_OK, or KB_NOMEM if the index could not grow (the documents
+ *   that did not fit are never found)
+ */
+int search_update(uint32_t end, int (*doc_of)(void *arg, uint32_t doc, const char **entity, size_t *entity_len,
+	const char **response, size_t *response_len), void *arg)
+{
+	int result = KB_OK;
+	pthread_rwlock_wrlock(&search_lock);
+	for (uint32_t doc = search_next; doc < end; doc++) {
+		const char *entity, *response;
+		size_t entity_len, response_len;
+		if (doc_of(arg, doc, &entity, &entity_len, &response, &response_len)
+				&& search_add(doc, entity, entity_len, response, response_len) != KB_OK)
+			result = KB_NOMEM;
+	}
+	if (end > search_next)
+		__atomic_store_n(&search_next, end, __ATOMIC_RELEASE);
+	pthread_rwlock_unlock(&search_lock);
+	return result;
+}
+
+/*
+ * Mark an entry as gone, when its response has been replaced. The caller
+ * must hold the lock of the entity's shard of the knowledge base, which keeps
+ * search_update() out; a document it has not reached yet is left to it.
+ *
+ * Input:
+ *   doc      - the entity id
+ *   entity   - the entity, as it was added
+ *   response - the response, as it was added
+ */
+void search_remove(uint32_t doc, const char *entity, size_t entity_len, const char *response, size_t response_len)
+{
+	uint32_t words[SEARCH_MAX_DOC_WORDS];
+	uint32_t counts[SEARCH_MAX_DOC_WORDS];
+	unsigned long total = 0;
+
+	if (doc >= search_indexed())
+		return;
+	pthread_rwlock_wrlock(&search_lock);
+	if (doc < search_nlengths && search_lengths[doc] > 0) {
+		/* every word is already a term, so this cannot fail */
+		int n = search_words(entity, entity_len, response, response_len, words, counts, &total);
+		for (int k = 0; k < n; k++)
+			search_terms[words[k]].df--;
+		search_ndocs--;
+		search_total -= search_lengths[doc];
+		search_lengths[doc] = 0;
+	}
+	pthread_rwlock_unlock(&search_lock);
+}
+
+/*
+ * Empty the index, before the knowledge base is reset.
+ */
+void search_reset()
+{
+	pthread_rwlock_wrlock(&search_lock);
+	for (uint32_t t = 0; t < search_nterms; t++) {
+		if (search_terms[t].size != 0)
+			free(search_terms[t].bytes.heap);
+		free(search_terms[t].skips);
+	}
+	free(search_terms);
+	free(search_slots);
+	free(search_text);
+	free(search_lengths);
+	search_terms = NULL;
+	search_nterms = search_sterms = 0;
+	search_slots = NULL;
+	search_nslots = 0;
+	search_text = NULL;
+	search_text_used = search_text_size = 0;
+	search_lengths = NULL;
+	search_nlengths = 0;
+	search_ndocs = search_total = 0;
+	__atomic_store_n(&search_next, 1, __ATOMIC_RELEASE);
+	pthread_rwlock_unlock(&search_lock);
+}
+
+/*
+ * Measure the memory held by the index.
+ *
+ * Output:
+ *   terms - the number of distinct words
+ *   bytes - the number of bytes allocated for them and their postings
+ */
+void search_usage(unsigned long *terms, unsigned long *bytes)
+{
+	pthread_rwlock_rdlock(&search_lock);
+	*terms = search_nterms;
+	*bytes = search_sterms * sizeof(SEARCH_TERM) + search_nslots * sizeof(SEARCH_SLOT) + search_text_size
+		+ search_nlengths * sizeof(uint16_t);
+	for (uint32_t t = 0; t < search_nterms; t++) {
+		const SEARCH_TERM *term = &search_terms[t];
+		*bytes += term->size;
+		if (term->skips != NULL) {
+			uint32_t size = 1;
+			while (size < (term->count - 1) / SEARCH_BLOCK)
+				size *= 2;
+			*bytes += size * sizeof(SEARCH_SKIP);
+		}
+	}
+	pthread_rwlock_unlock(&search_lock);
+}
+
+/*
+ * Compute the natural logarithm of a number of at least 1, for the inverse
+ * document frequency, without needing the maths library: halve it into
+ * [1, 2) and sum the series of 2 atanh((x - 1) / (x + 1)).
+ */
+static double search_log(double x)
+{
+	int halvings = 0;
+	while (x >= 2) {
+		x /= 2;
+		halvings++;
+	}
+	double y = (x - 1) / (x + 1), power = y, sum = 0;
+	for (int k = 1; k < 20; k += 2) {
+		sum += power / k;
+		power *= y * y;
+	}
+	return halvings * 0.69314718055994531 + 2 * sum;
+}
+
+/*
+ * Decode the next posting of a cursor.
+ */
+static void search_advance(SEARCH_CURSOR *c)
+{
+	if (c->p >= c->end) {
+		c->doc = UINT32_MAX;
+		return;
+	}
+	uint32_t v = 0;
+	for (int shift = 0;; shift += 7) {
+		uint8_t byte = *c->p++;
+		v |= (uint32_t)(byte & 0x7F) << shift;
+		if (byte < 0x80)
+			break;
+	}
+	c->doc += v >> 1;
+	c->tf = 1;
+	if (v & 1) {
+		c->tf = 0;
+		for (int shift = 0;; shift += 7) {
+			uint8_t byte = *c->p++;
+			c->tf |= (uint32_t)(byte & 0x7F) << shift;
+			if (byte < 0x80)
+				break;
+		}
+	}
+}
+
+/*
+ * Move a cursor to the first document at or after a target, jumping over
+ * whole blocks where it can.
+ */
+static void search_skip_to(SEARCH_CURSOR *c, uint32_t target)
+{
+	if (c->doc >= target)
+		return;
+	while (c->skip < c->nskips && c->skips[c->skip].doc < target) {
+		if (c->start + c->skips[c->skip].offset > c->p) {
+			c->p = c->start + c->skips[c->skip].offset;
+			c->doc = c->skips[c->skip].doc;
+		}
+		c->skip++;
+	}
+	while (c->doc < target)
+		search_advance(c);
+}
+
+/*
+ * Find the entry that best matches the words of a question: of the entries
+ * containing more than half of its distinct words, the one ranked highest by
+ * BM25.
+ *
+ * Input:
+ *   words - the words of the question
+ *   count - the number of words
+ *
+ * Returns: the entity id of the entry (the first added if several score
+ *   the same), or 0 if none has enough of the words
+ */
+uint32_t search_find(char *words[], int count)
+{
+	/* the distinct words of the question */
+	char terms[SEARCH_MAX_TERMS][SEARCH_MAX_WORD];
+	size_t lens[SEARCH_MAX_TERMS];
+	int n = 0;
+	for (int k = 0; k < count && n < SEARCH_MAX_TERMS; k++) {
+		const char *p = words[k], *end = words[k] + strlen(words[k]);
+		while (n < SEARCH_MAX_TERMS && (lens[n] = search_next_word(&p, end, terms[n])) > 0) {
+			int j = 0;
+			while (j < n && !(lens[j] == lens[n] && memcmp(terms[j], terms[n], lens[n]) == 0))
+				j++;
+			if (j == n)
+				n++;
+		}
+	}
+	int need = n / 2 + 1;
+	uint32_t best = 0;
+
+	pthread_rwlock_rdlock(&search_lock);
+
+	/* the words some document has, rarest first */
+	SEARCH_CURSOR cursors[SEARCH_MAX_TERMS];
+	int m = 0;
+	for (int k = 0; k < n; k++) {
+		SEARCH_TERM *term = search_term(terms[k], lens[k]);
+		if (term == NULL || term->df == 0)
+			continue;
+		SEARCH_CURSOR c;
+		c.start = c.p = search_bytes(term);
+		c.end = c.start + term->used;
+		c.skips = term->skips;
+		c.nskips = (term->count - 1) / SEARCH_BLOCK;
+		c.skip = 0;
+		c.doc = 0;
+		c.idf = search_log(1 + (search_ndocs - term->df + 0.5) / (term->df + 0.5));
+		search_advance(&c);
+		int j = m++;
+		for (; j > 0 && cursors[j - 1].idf < c.idf; j--)
+			cursors[j] = cursors[j - 1];
+		cursors[j] = c;
+	}
+
+	if (m >= need && n > 0) {
+		double average = (double)search_total / search_ndocs;
+		double best_score = 0;
+		int scan = m - need + 1;
+		for (;;) {
+			/* the next document in any of the rarest lists */
+			uint32_t doc = UINT32_MAX;
+			for (int k = 0; k < scan; k++) {
+				if (cursors[k].doc < doc)
+					doc = cursors[k].doc;
+			}
+			if (doc == UINT32_MAX)
+				break;
+
+			int matched = 0;
+			double score = 0;
+			double norm = doc < search_nlengths ? SEARCH_K1 * (1 - SEARCH_B + SEARCH_B * search_lengths[doc] / average) : 0;
+			for (int k = 0; k < m; k++) {
+				SEARCH_CURSOR *c = &cursors[k];
+				if (k >= scan)
+					search_skip_to(c, doc);
+				if (c->doc != doc)
+					continue;
+				matched++;
+				score += c->idf * c->tf * (SEARCH_K1 + 1) / (c->tf + norm);
+				if (k < scan)
+					search_advance(c);
+			}
+
+			/* a document that is gone has no length */
+			if (matched >= need && search_lengths[doc] > 0 && score > best_score) {
+				best = doc;
+				best_score = score;
+			}
+		}
+	}
+	pthread_rwlock_unlock(&search_lock);
+	return best;
+}
@@ -0,0 +1,751 @@
+/*
+ * ICT1002 (C Language) Group Project.
+ *
+ * This file implements server mode: chatting with many users at once over a
+ * Unix domain socket.
+ *
+ * The protocol is the same as the main loop without the prompts: the client
+ * sends one line per question, and the server sends one line per answer. When
+ * a question is not in the knowledge base, the server asks for the answer and
+ * the client's next line is taken as the answer.
+ *
+ * A single thread serves every connection from an event loop (epoll on Linux,
+ * poll() elsewhere). Each connection has its own input and output buffers and
+ * CHATBOT_SESSION, and nothing blocks on a single user: a user who is slow to
+ * answer a question simply has a session waiting for its next line.
+ *
+ * Lines that may keep the loop waiting (an answer to learn, which waits for
+ * the journal to reach the disk, and load, save and reset) are handed to a
+ * pool of SERVER_WORKERS threads instead. Their connection is not read until
+ * the answer is queued, so each user's lines are still answered in order, and
+ * other users' questions are answered meanwhile from the knowledge base as it
+ * stands. Loads, saves and resets run one at a time, as in batch mode, while
+ * answers from several users are learnt together.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#else
+#include <poll.h>
+#endif
+#include "chat1002.h"
+
+/* the longest line accepted from a client; longer lines are dropped with one reply */
+#define SERVER_MAX_LINE   4096
+
+/* stop reading from a client whose unsent answers exceed this many bytes */
+#define SERVER_MAX_OUTPUT (1 << 20)
+
+/* the number of bytes read from a socket at once */
+#define SERVER_READ       16384
+
+/* the number of events handled per call to the event loop */
+#define SERVER_EVENTS     64
+
+/* the number of threads answering lines that may block (see server_blocks()) */
+#define SERVER_WORKERS    4
+
+/* the state of a connection */
+typedef struct server_client {
+	int fd;
+	CHATBOT_SESSION session;
+	char in[SERVER_MAX_LINE];    /* the start of a line whose newline has not arrived yet */
+	int in_len;
+	int discarding;              /* 1 while the rest of a line too long for 'in' is dropped */
+	char *out;                   /* answers waiting to be sent */
+	size_t out_len, out_pos, out_size;
+	int reading;                 /* 1 if the connection is watched for input */
+	int writing;                 /* 1 if the connection is watched for output */
+	int closing;                 /* 1 to close the connection once the output is sent */
+	char *inv[MAX_INPUT];        /* the words of the line being answered, in 'in' */
+	int inc;
+	char reply[MAX_RESPONSE];    /* the answer to the line being answered */
+	int stop;                    /* 1 if the chatbot stops chatting after that line */
+	int busy;                    /* 1 while a worker answers the line; the connection is not read meanwhile */
+	int closed;                  /* 1 if the connection was closed while busy; it is freed once answered */
+	char *held;                  /* bytes read after the line a worker is answering */
+	size_t held_len, held_pos;
+	struct server_client *next;  /* the next connection in the work or answered queue */
+} SERVER_CLIENT;
+
+/* connections, indexed by file descriptor */
+static SERVER_CLIENT **server_clients = NULL;
+static int server_nclients = 0;
+
+/* set by SIGINT and SIGTERM to stop the server */
+static volatile sig_atomic_t server_stop = 0;
+
+/* connections with a line for the workers, and connections whose line they answered */
+static pthread_mutex_t server_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t server_work = PTHREAD_COND_INITIALIZER;
+static SERVER_CLIENT *server_queue_head = NULL;
+static SERVER_CLIENT *server_queue_tail = NULL;
+static SERVER_CLIENT *server_done = NULL;
+static int server_stopping = 0;   /* the workers finish the queue and exit */
+
+/* held by a worker answering a load, save or reset, which run one at a time */
+static pthread_mutex_t server_files = PTHREAD_MUTEX_INITIALIZER;
+
+/* the pipe through which a worker wakes the event loop when it has answered a line */
+static int server_wake[2] = {-1, -1};
+
+#ifdef __linux__
+static int server_epoll = -1;
+#else
+static struct pollfd *server_polls = NULL;
+static int server_npolls = 0;
+static int server_polls_size = 0;
+#endif
+
+
+/*
+ * Signal handler for stopping the server.
+ */
+static void server_signal(int sig)
+{
+	(void)sig;
+	server_stop = 1;
+}
+
+/*
+ * Watch a file descriptor for input and/or output, or stop watching it if
+ * both are 0.
+ *
+ * Returns: 0 if successful, -1 otherwise
+ */
+static int server_watch(int fd, int in, int out, int added)
+{
+#ifdef __linux__
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = (in ? EPOLLIN : 0) | (out ? EPOLLOUT : 0);
+	ev.data.fd = fd;
+	if (!added)
+		return epoll_ctl(server_epoll, EPOLL_CTL_ADD, fd, &ev);
+	if (!in && !out)
+		return epoll_ctl(server_epoll, EPOLL_CTL_DEL, fd, &ev);
+	return epoll_ctl(server_epoll, EPOLL_CTL_MOD, fd, &ev);
+#else
+	short events = (in ? POLLIN : 0) | (out ? POLLOUT : 0);
+	for (int i = 0; added && i < server_npolls; i++) {
+		if (server_polls[i].fd == fd) {
+			if (events == 0)
+				server_polls[i] = server_polls[--server_npolls];
+			else
+				server_polls[i].events = events;
+			return 0;
+		}
+	}
+	if (server_npolls == server_polls_size) {
+		int size = server_polls_size == 0 ? 64 : server_polls_size * 2;
+		struct pollfd *grown = (struct pollfd *)realloc(server_polls, size * sizeof(struct pollfd));
+		if (grown == NULL)
+			return -1;
+		server_polls = grown;
+		server_polls_size = size;
+	}
+	server_polls[server_npolls].fd = fd;
+	server_polls[server_npolls].events = events;
+	server_polls[server_npolls].revents = 0;
+	server_npolls++;
+	return 0;
+#endif
+}
+
+/*
+ * Wait for events.
+ *
+ * Input:
+ *   fds    - an array to receive the file descriptors that are ready
+ *   ready  - an array to receive 1 for each descriptor that has input (or was
+ *            closed) and 0 for one that can only take output
+ *   max    - the size of the arrays
+ *
+ * Returns: the number of file descriptors that are ready, or -1 on error
+ */
+static int server_wait(int fds[], int ready[], int max)
+{
+#ifdef __linux__
+	struct epoll_event evs[SERVER_EVENTS];
+	int count = epoll_wait(server_epoll, evs, max < SERVER_EVENTS ? max : SERVER_EVENTS, -1);
+	for (int i = 0; i < count; i++) {
+		fds[i] = evs[i].data.fd;
+		ready[i] = (evs[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) != 0;
+	}
+	return count;
+#else
+	if (poll(server_polls, server_npolls, -1) < 0)
+		return -1;
+	int count = 0;
+	for (int i = 0; i < server_npolls && count < max; i++) {
+		if (server_polls[i].revents != 0) {
+			fds[count] = server_polls[i].fd;
+			ready[count] = (server_polls[i].revents & (POLLIN | POLLHUP | POLLERR)) != 0;
+			count++;
+		}
+	}
+	return count;
+#endif
+}
+
+/*
+ * Free the state of a connection.
+ */
+static void server_free(SERVER_CLIENT *c)
+{
+	free(c->out);
+	free(c->held);
+	free(c);
+}
+
+/*
+ * Close a connection and forget its state. If a worker is answering a line
+ * from it, its state is freed once the worker is done.
+ */
+static void server_close(SERVER_CLIENT *c)
+{
+	if (c->reading || c->writing)
+		server_watch(c->fd, 0, 0, 1);
+	c->reading = c->writing = 0;
+	server_clients[c->fd] = NULL;
+	close(c->fd);
+	if (c->busy)
+		c->closed = 1;
+	else
+		server_free(c);
+}
+
+/*
+ * Update the events a connection is watched for: output while there are
+ * answers waiting to be sent, and input unless too many are waiting, a worker
+ * is answering a line from it or the connection is closing.
+ *
+ * Returns: 0 if successful, -1 otherwise
+ */
+static int server_update(SERVER_CLIENT *c)
+{
+	int reading = !c->closing && !c->busy && c->held == NULL && c->out_len - c->out_pos < SERVER_MAX_OUTPUT;
+	int writing = c->out_pos < c->out_len;
+	if (reading == c->reading && writing == c->writing)
+		return 0;
+	if (server_watch(c->fd, reading, writing, c->reading || c->writing) != 0)
+		return -1;
+	c->reading = reading;
+	c->writing = writing;
+	return 0;
+}
+
+/*
+ * Send as much waiting output as the socket will take.
+ *
+ * Returns: 0 if successful, -1 if the connection failed
+ */
+static int server_flush(SERVER_CLIENT *c)
+{
+	while (c->out_pos < c->out_len) {
+		ssize_t sent = write(c->fd, c->out + c->out_pos, c->out_len - c->out_pos);
+		if (sent < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			return -1;
+		}
+		c->out_pos += sent;
+	}
+	if (c->out_pos == c->out_len)
+		c->out_pos = c->out_len = 0;
+	return 0;
+}
+
+/*
+ * Queue a line of output for a connection.
+ *
+ * Returns: 0 if successful, -1 on allocation failure
+ */
+static int server_send(SERVER_CLIENT *c, const char *line)
+{
+	size_t len = strlen(line);
+	if (c->out_len + len + 1 > c->out_size) {
+		if (c->out_pos > 0) {
+			memmove(c->out, c->out + c->out_pos, c->out_len - c->out_pos);
+			c->out_len -= c->out_pos;
+			c->out_pos = 0;
+		}
+		size_t size = c->out_size == 0 ? 4096 : c->out_size;
+		while (c->out_len + len + 1 > size)
+			size *= 2;
+		if (size != c->out_size) {
+			char *grown = (char *)realloc(c->out, size);
+			if (grown == NULL)
+				return -1;
+			c->out = grown;
+			c->out_size = size;
+		}
+	}
+	memcpy(c->out + c->out_len, line, len);
+	c->out[c->out_len + len] = '\n';
+	c->out_len += len + 1;
+	return 0;
+}
+
+/*
+ * Answer the line in a connection's input buffer (split into c->inv unless it
+ * answers a question), putting the answer in c->reply. This runs on the event
+ * loop, or on a worker for a line that may block.
+ */
+static void server_answer(SERVER_CLIENT *c)
+{
+	c->reply[0] = '\0';
+	if (c->session.learning) {
+		c->session.learning = 0;
+		chatbot_learn(c->session.intent, c->session.entity, c->in, c->reply, MAX_RESPONSE);
+	} else {
+		chatbot_set_session(&c->session);
+		c->stop = chatbot_main(c->inc, c->inv, c->reply, MAX_RESPONSE);
+		chatbot_set_session(NULL);
+	}
+}
+
+/*
+ * Determine whether answering a connection's line may block: learning an
+ * answer waits for the journal, and load, save and reset go through files.
+ *
+ * Returns: 1 if the line should go to a worker, 0 if not
+ */
+static int server_blocks(const SERVER_CLIENT *c)
+{
+	if (c->session.learning)
+		return 1;
+	return c->inc > 0 && (chatbot_is_load(c->inv[0]) || chatbot_is_save(c->inv[0]) || chatbot_is_reset(c->inv[0]));
+}
+
+/*
+ * Hand a connection's line to the workers. The connection is busy until the
+ * event loop takes the answer back in server_answered().
+ */
+static void server_submit(SERVER_CLIENT *c)
+{
+	c->busy = 1;
+	c->next = NULL;
+	pthread_mutex_lock(&server_lock);
+	if (server_queue_tail == NULL)
+		server_queue_head = c;
+	else
+		server_queue_tail->next = c;
+	server_queue_tail = c;
+	pthread_cond_signal(&server_work);
+	pthread_mutex_unlock(&server_lock);
+}
+
+/*
+ * Worker: answer each queued line, and wake the event loop to send the answer.
+ */
+static void *server_worker(void *arg)
+{
+	(void)arg;
+
+	for (;;) {
+		pthread_mutex_lock(&server_lock);
+		while (server_queue_head == NULL && !server_stopping)
+			pthread_cond_wait(&server_work, &server_lock);
+		SERVER_CLIENT *c = server_queue_head;
+		if (c == NULL) {
+			pthread_mutex_unlock(&server_lock);
+			return NULL;
+		}
+		server_queue_head = c->next;
+		if (server_queue_head == NULL)
+			server_queue_tail = NULL;
+		pthread_mutex_unlock(&server_lock);
+
+		int alone = !c->session.learning;
+		if (alone)
+			pthread_mutex_lock(&server_files);
+		server_answer(c);
+		if (alone)
+			pthread_mutex_unlock(&server_files);
+
+		pthread_mutex_lock(&server_lock);
+		c->next = server_done;
+		server_done = c;
+		pthread_mutex_unlock(&server_lock);
+
+		/* a full pipe already has the event loop on its way */
+		char wake = 0;
+		ssize_t ignored = write(server_wake[1], &wake, 1);
+		(void)ignored;
+	}
+}
+
+/*
+ * Answer the line in a connection's input buffer, or hand it to the workers
+ * if it may block.
+ *
+ * Returns: 0 if successful, -1 on allocation failure
+ */
+static int server_line(SERVER_CLIENT *c)
+{
+	if (c->session.learning) {
+		/* the line answers the question the chatbot asked */
+		char *nl = strchr(c->in, '\r');
+		if (nl != NULL)
+			*nl = '\0';
+		c->inc = 0;
+	} else {
+		c->inc = split_words(c->in, c->inv, MAX_INPUT);
+	}
+	if (server_blocks(c)) {
+		server_submit(c);
+		return 0;
+	}
+	server_answer(c);
+	if (c->stop)
+		c->closing = 1;
+	return server_send(c, c->reply);
+}
+
+/*
+ * Answer a line that was too long to read, now that its end has arrived. The
+ * line is dropped, and if it answered a question the answer is not learnt.
+ *
+ * Returns: 0 if successful, -1 on allocation failure
+ */
+static int server_too_long(SERVER_CLIENT *c)
+{
+	c->discarding = 0;
+	c->in_len = 0;
+	c->session.learning = 0;
+	return server_send(c, "Sorry, that is too long for me to read.");
+}
+
+/*
+ * Answer every complete line in bytes a connection has sent, stopping after a
+ * line handed to the workers.
+ *
+ * Returns: the number of bytes used, or -1 on allocation failure
+ */
+static ssize_t server_input(SERVER_CLIENT *c, const char *buf, size_t len)
+{
+	size_t i = 0;
+	while (i < len && !c->closing && !c->busy) {
+		char ch = buf[i++];
+		if (ch != '\n') {
+			/* a line that does not fit is dropped up to its newline, and answered once */
+			if (c->in_len < SERVER_MAX_LINE - 1)
+				c->in[c->in_len++] = ch;
+			else
+				c->discarding = 1;
+			continue;
+		}
+		if (c->discarding) {
+			if (server_too_long(c) != 0)
+				return -1;
+			continue;
+		}
+		c->in[c->in_len] = '\0';
+		c->in_len = 0;
+		if (server_line(c) != 0)
+			return -1;
+	}
+	return (ssize_t)i;
+}
+
+/*
+ * Read what a connection has sent and answer every complete line. The
+ * connection is marked as closing when the client has nothing more to send.
+ * Once a line is handed to the workers, the bytes read after it are held
+ * until it is answered.
+ *
+ * Returns: 0 if successful, -1 if the connection should be closed at once
+ */
+static int server_read(SERVER_CLIENT *c)
+{
+	char buf[SERVER_READ];
+
+	while (!c->closing && !c->busy && c->held == NULL) {
+		ssize_t got = read(c->fd, buf, sizeof(buf));
+		if (got == 0) {
+			/* answer a last line without a newline, then close once the answers are sent */
+			c->closing = 1;
+			if (c->discarding)
+				return server_too_long(c);
+			if (c->in_len > 0) {
+				c->in[c->in_len] = '\0';
+				c->in_len = 0;
+				return server_line(c);
+			}
+			return 0;
+		}
+		if (got < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return 0;
+			return -1;
+		}
+
+		ssize_t used = server_input(c, buf, (size_t)got);
+		if (used < 0)
+			return -1;
+		if (used < got && c->busy) {
+			c->held = (char *)malloc(got - used);
+			if (c->held == NULL)
+				return -1;
+			memcpy(c->held, buf + used, got - used);
+			c->held_len = got - used;
+			c->held_pos = 0;
+			return 0;
+		}
+
+		/* leave the rest in the socket until the client reads its answers */
+		if (c->out_len - c->out_pos >= SERVER_MAX_OUTPUT)
+			return 0;
+	}
+	return 0;
+}
+
+/*
+ * Answer the bytes a connection sent after a line a worker answered.
+ *
+ * Returns: 0 if successful, -1 on allocation failure
+ */
+static int server_resume(SERVER_CLIENT *c)
+{
+	if (c->held == NULL)
+		return 0;
+	ssize_t used = server_input(c, c->held + c->held_pos, c->held_len - c->held_pos);
+	if (used < 0)
+		return -1;
+	c->held_pos += used;
+	if (c->held_pos == c->held_len || c->closing) {
+		free(c->held);
+		c->held = NULL;
+		c->held_len = c->held_pos = 0;
+	}
+	return 0;
+}
+
+/*
+ * Read from a connection if it has input, send what it can take, and close it
+ * once it is done or if it failed.
+ */
+static void server_serve(SERVER_CLIENT *c, int readable)
+{
+	if ((readable && server_read(c) != 0) || server_flush(c) != 0
+			|| (c->closing && !c->busy && c->out_len == 0) || server_update(c) != 0)
+		server_close(c);
+}
+
+/*
+ * Send the answers the workers have finished, and go on with the input their
+ * connections sent meanwhile.
+ */
+static void server_answered()
+{
+	char drain[64];
+	while (read(server_wake[0], drain, sizeof(drain)) > 0)
+		;
+
+	pthread_mutex_lock(&server_lock);
+	SERVER_CLIENT *c = server_done;
+	server_done = NULL;
+	pthread_mutex_unlock(&server_lock);
+
+	while (c != NULL) {
+		SERVER_CLIENT *next = c->next;
+		c->busy = 0;
+		if (c->closed) {
+			server_free(c);
+		} else {
+			if (c->stop)
+				c->closing = 1;
+			if (server_send(c, c->reply) != 0 || server_resume(c) != 0)
+				server_close(c);
+			else
+				server_serve(c, 0);
+		}
+		c = next;
+	}
+}
+
+/*
+ * Accept waiting connections.
+ */
+static void server_accept(int listener)
+{
+	for (;;) {
+		int fd = accept(listener, NULL, NULL);
+		if (fd < 0) {
+			if (errno == EINTR)
+				continue;
+			return;
+		}
+		fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+		if (fd >= server_nclients) {
+			int size = server_nclients == 0 ? 64 : server_nclients;
+			while (size <= fd)
+				size *= 2;
+			SERVER_CLIENT **grown = (SERVER_CLIENT **)realloc(server_clients, size * sizeof(SERVER_CLIENT *));
+			if (grown == NULL) {
+				close(fd);
+				continue;
+			}
+			memset(grown + server_nclients, 0, (size - server_nclients) * sizeof(SERVER_CLIENT *));
+			server_clients = grown;
+			server_nclients = size;
+		}
+
+		SERVER_CLIENT *c = (SERVER_CLIENT *)calloc(1, sizeof(SERVER_CLIENT));
+		if (c == NULL) {
+			close(fd);
+			continue;
+		}
+		c->fd = fd;
+		server_clients[fd] = c;
+		if (server_update(c) != 0)
+			server_close(c);
+	}
+}
+
+/*
+ * Serve users on a Unix domain socket until SIGINT or SIGTERM is received.
+ * The chatbot learns from every user into the same knowledge base.
+ *
+ * Input:
+ *   path - the path of the socket; an existing file at this path is replaced
+ *
+ * Returns: 0 if the server stopped normally, 1 if it could not be started
+ */
+int server_run(const char *path)
+{
+	struct sockaddr_un addr;
+	struct sigaction sa;
+	int fds[SERVER_EVENTS], ready[SERVER_EVENTS];
+	pthread_t workers[SERVER_WORKERS];
+	int nworkers = 0;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "%s: socket path too long: %s\n", chatbot_botname(), path);
+		return 1;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+
+	int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (listener < 0) {
+		perror("socket");
+		return 1;
+	}
+	unlink(path);
+	if (bind(listener, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(listener, SOMAXCONN) != 0) {
+		perror(path);
+		close(listener);
+		return 1;
+	}
+	fcntl(listener, F_SETFL, fcntl(listener, F_GETFL) | O_NONBLOCK);
+
+#ifdef __linux__
+	server_epoll = epoll_create1(0);
+	if (server_epoll < 0) {
+		perror("epoll_create1");
+		close(listener);
+		unlink(path);
+		return 1;
+	}
+#endif
+	server_watch(listener, 1, 0, 0);
+
+	/* the workers, and the pipe they wake the event loop through */
+	server_stopping = 0;
+	if (pipe(server_wake) == 0) {
+		fcntl(server_wake[0], F_SETFL, fcntl(server_wake[0], F_GETFL) | O_NONBLOCK);
+		fcntl(server_wake[1], F_SETFL, fcntl(server_wake[1], F_GETFL) | O_NONBLOCK);
+		server_watch(server_wake[0], 1, 0, 0);
+		while (nworkers < SERVER_WORKERS && pthread_create(&workers[nworkers], NULL, server_worker, NULL) == 0)
+			nworkers++;
+	}
+	if (nworkers == 0) {
+		perror("workers");
+		server_stop = 1;
+	}
+
+	/* stop on SIGINT and SIGTERM; a client that goes away must not kill the server */
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = server_signal;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	signal(SIGPIPE, SIG_IGN);
+
+	while (!server_stop) {
+		int count = server_wait(fds, ready, SERVER_EVENTS);
+		if (count < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("wait");
+			break;
+		}
+		for (int i = 0; i < count; i++) {
+			if (fds[i] == listener) {
+				server_accept(listener);
+				continue;
+			}
+			if (fds[i] == server_wake[0]) {
+				server_answered();
+				continue;
+			}
+			SERVER_CLIENT *c = fds[i] < server_nclients ? server_clients[fds[i]] : NULL;
+			if (c == NULL)
+				continue;
+			server_serve(c, ready[i]);
+		}
+	}
+
+	/* let the workers finish the lines they were given */
+	pthread_mutex_lock(&server_lock);
+	server_stopping = 1;
+	pthread_cond_broadcast(&server_work);
+	pthread_mutex_unlock(&server_lock);
+	for (int k = 0; k < nworkers; k++)
+		pthread_join(workers[k], NULL);
+	if (server_wake[0] >= 0)
+		server_answered();
+
+	for (int fd = 0; fd < server_nclients; fd++) {
+		if (server_clients[fd] != NULL)
+			server_close(server_clients[fd]);
+	}
+	free(server_clients);
+	server_clients = NULL;
+	server_nclients = 0;
+#ifdef __linux__
+	close(server_epoll);
+#else
+	free(server_polls);
+	server_polls = NULL;
+	server_npolls = server_polls_size = 0;
+#endif
+	for (int k = 0; k < 2; k++) {
+		if (server_wake[k] >= 0)
+			close(server_wake[k]);
+		server_wake[k] = -1;
+	}
+	close(listener);
+	unlink(path);
+	return nworkers == 0;
+}
@@ -0,0 +1,308 @@
+/*
+ * ICT1002 (C Language) Group Project.
+ *
+ * This file implements the chatbot's runtime statistics: how many times each
+ * intent handler ran and how long it took, how often the knowledge base knew
+ * the answer to each question word, how often the answer cache had it, and
+ * how long loading and saving took.
+ *
+ * stats_time(), stats_lookup() and stats_cache() record events; they are called on every
+ * question, so they only ever touch counters belonging to the calling thread.
+ * As with the knowledge base's readers, threads are spread over STATS_SLOTS
+ * slots, each on cache lines of its own, and the slots are added up only when
+ * the statistics are read by stats_summary() or stats_write(). Durations are
+ * counted in histograms with a bucket per power of two of nanoseconds, so the
+ * percentiles reported are rounded up to a power of two. The time a question
+ * takes includes any time spent waiting for the user to teach the chatbot the
+ * answer.
+ *
+ * stats_start() writes the statistics to a file periodically, one
+ * "name value" pair per line, for monitoring.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "chat1002.h"
+
+/* the number of slots threads are spread over */
+#define STATS_SLOTS 32
+
+/* the number of histogram buckets; the last one counts everything from 2^(STATS_BUCKETS - 2) ns up */
+#define STATS_BUCKETS 40
+
+/* the names of the timers, indexed by STATS_TIMER */
+static const char *stats_timer_names[STATS_TIMERS] = {
+	"exit", "load", "save", "reset", "question", "smalltalk", "stats", "complete", "unknown", "kb_read", "kb_write"
+};
+
+/* the counters of the threads in one slot */
+typedef struct stats_slot {
+	unsigned long count[STATS_TIMERS];
+	unsigned long ns[STATS_TIMERS];
+	unsigned long buckets[STATS_TIMERS][STATS_BUCKETS];
+	unsigned long hits[KB_INTENTS];
+	unsigned long misses[KB_INTENTS];
+	unsigned long cache_hits;
+	unsigned long cache_misses;
+} __attribute__((aligned(64))) STATS_SLOT;
+
+static STATS_SLOT stats_slots[STATS_SLOTS];
+static unsigned long stats_nthreads = 0;
+static __thread STATS_SLOT *stats_self = NULL;
+
+/* the time the statistics started, from stats_now() */
+static uint64_t stats_started = 0;
+
+/*
+ * Get the slot of the calling thread. Several threads may share a slot, so
+ * the counters are only changed with atomic adds; as a thread mostly has its
+ * slot to itself, they stay cheap.
+ */
+static STATS_SLOT *stats_slot()
+{
+	if (stats_self == NULL)
+		stats_self = &stats_slots[__atomic_fetch_add(&stats_nthreads, 1, __ATOMIC_RELAXED) % STATS_SLOTS];
+	return stats_self;
+}
+
+/*
+ * Get the time in nanoseconds, for stats_time().
+ */
+uint64_t stats_now()
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	uint64_t now = (uint64_t)t.tv_sec * 1000000000U + (uint64_t)t.tv_nsec;
+	if (__atomic_load_n(&stats_started, __ATOMIC_RELAXED) == 0) {
+		uint64_t zero = 0;
+		__atomic_compare_exchange_n(&stats_started, &zero, now, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+	}
+	return now;
+}
+
+/*
+ * Record something that took from start until now.
+ *
+ * Input:
+ *   timer - what it was
+ *   start - when it started, from stats_now()
+ */
+void stats_time(STATS_TIMER timer, uint64_t start)
+{
+	uint64_t ns = stats_now() - start;
+	int bucket = ns == 0 ? 0 : 64 - __builtin_clzll(ns);
+	if (bucket >= STATS_BUCKETS)
+		bucket = STATS_BUCKETS - 1;
+
+	STATS_SLOT *slot = stats_slot();
+	__atomic_fetch_add(&slot->count[timer], 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&slot->ns[timer], (unsigned long)ns, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&slot->buckets[timer][bucket], 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Record a lookup in the knowledge base.
+ *
+ * Input:
+ *   intent - the question word
+ *   hit    - 1 if the knowledge base knew the answer, 0 if not
+ */
+void stats_lookup(INTENT intent, int hit)
+{
+	STATS_SLOT *slot = stats_slot();
+	__atomic_fetch_add(hit ? &slot->hits[intent] : &slot->misses[intent], 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Record a lookup in the answer cache.
+ *
+ * Input:
+ *   hit - 1 if the cache had the response, 0 if not
+ */
+void stats_cache(int hit)
+{
+	STATS_SLOT *slot = stats_slot();
+	__atomic_fetch_add(hit ? &slot->cache_hits : &slot->cache_misses, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Add up the slots. The total is not a snapshot of a single moment, as events
+ * may be recorded while it is taken, but every event is counted exactly once.
+ */
+static void stats_total(STATS_SLOT *total)
+{
+	memset(total, 0, sizeof(*total));
+	for (int s = 0; s < STATS_SLOTS; s++) {
+		const STATS_SLOT *slot = &stats_slots[s];
+		for (int t = 0; t < STATS_TIMERS; t++) {
+			total->count[t] += __atomic_load_n(&slot->count[t], __ATOMIC_RELAXED);
+			total->ns[t] += __atomic_load_n(&slot->ns[t], __ATOMIC_RELAXED);
+			for (int b = 0; b < STATS_BUCKETS; b++)
+				total->buckets[t][b] += __atomic_load_n(&slot->buckets[t][b], __ATOMIC_RELAXED);
+		}
+		for (int i = 0; i < KB_INTENTS; i++) {
+			total->hits[i] += __atomic_load_n(&slot->hits[i], __ATOMIC_RELAXED);
+			total->misses[i] += __atomic_load_n(&slot->misses[i], __ATOMIC_RELAXED);
+		}
+		total->cache_hits += __atomic_load_n(&slot->cache_hits, __ATOMIC_RELAXED);
+		total->cache_misses += __atomic_load_n(&slot->cache_misses, __ATOMIC_RELAXED);
+	}
+}
+
+/*
+ * Find a percentile of a timer in a total from stats_total().
+ *
+ * Returns: the upper bound of the bucket the percentile falls in, in
+ *   nanoseconds, or 0 if nothing has been timed
+ */
+static unsigned long stats_percentile(const STATS_SLOT *total, STATS_TIMER timer, int percent)
+{
+	/* the buckets may not quite add up to the count while events are being recorded */
+	unsigned long all = 0;
+	for (int b = 0; b < STATS_BUCKETS; b++)
+		all += total->buckets[timer][b];
+	if (all == 0)
+		return 0;
+	unsigned long rank = (all * percent + 99) / 100;
+	unsigned long seen = 0;
+	int b = 0;
+	while (b < STATS_BUCKETS - 1 && (seen += total->buckets[timer][b]) < rank)
+		b++;
+	return 1UL << b;
+}
+
+/*
+ * Summarise the statistics in a sentence, for the stats intent.
+ *
+ * Input:
+ *   response - a buffer to receive the summary
+ *   n        - the size of the buffer
+ */
+void stats_summary(char *response, int n)
+{
+	STATS_SLOT *total = (STATS_SLOT *)malloc(sizeof(STATS_SLOT));
+	if (total == NULL) {
+		snprintf(response, n, "I have lost count.");
+		return;
+	}
+	stats_total(total);
+
+	unsigned long hits = 0, misses = 0, others = 0;
+	for (int i = 0; i < KB_INTENTS; i++) {
+		hits += total->hits[i];
+		misses += total->misses[i];
+	}
+	for (int t = 0; t < STATS_TIMERS; t++) {
+		if (t != STATS_QUESTION && t != STATS_KB_READ && t != STATS_KB_WRITE)
+			others += total->count[t];
+	}
+	unsigned long entries, bytes;
+	knowledge_usage(&entries, &bytes);
+	unsigned long lookups = total->cache_hits + total->cache_misses;
+
+	/* a cache hit does not reach the knowledge base, so it is a known question too */
+	snprintf(response, n, "I have answered %lu questions (%lu known, %lu unknown, %lu%% from my cache; p50 %lu ns, p99 %lu ns) "
+		"and %lu other requests. I know %lu things in %lu KB.",
+		total->count[STATS_QUESTION], hits + total->cache_hits, misses, lookups > 0 ? total->cache_hits * 100 / lookups : 0,
+		stats_percentile(total, STATS_QUESTION, 50), stats_percentile(total, STATS_QUESTION, 99), others, entries,
+		(bytes + 1023) / 1024);
+	free(total);
+}
+
+/*
+ * Write the statistics to a file, one "name value" pair per line, followed by
+ * an empty line. Timers are written as name.count, name.total_ns, name.p50_ns
+ * and name.p99_ns; knowledge base lookups as kb.<intent>.hits and
+ * kb.<intent>.misses, which do not count questions answered from the cache.
+ *
+ * Input:
+ *   f - the file
+ */
+void stats_write(FILE *f)
+{
+	STATS_SLOT *total = (STATS_SLOT *)malloc(sizeof(STATS_SLOT));
+	if (total == NULL)
+		return;
+	stats_total(total);
+	unsigned long entries, bytes, cached, cache_bytes, terms, search_bytes, nodes, trie_bytes;
+	unsigned long records, syncs, journal_bytes, compactions;
+	knowledge_usage(&entries, &bytes);
+	cache_usage(&cached, &cache_bytes);
+	search_usage(&terms, &search_bytes);
+	trie_usage(&nodes, &trie_bytes);
+	journal_usage(&records, &syncs, &journal_bytes, &compactions);
+
+	fprintf(f, "time %ld\n", (long)time(NULL));
+	fprintf(f, "uptime_ns %llu\n", (unsigned long long)(stats_now() - stats_started));
+	for (int t = 0; t < STATS_TIMERS; t++) {
+		const char *name = stats_timer_names[t];
+		fprintf(f, "%s.count %lu\n", name, total->count[t]);
+		fprintf(f, "%s.total_ns %lu\n", name, total->ns[t]);
+		fprintf(f, "%s.p50_ns %lu\n", name, stats_percentile(total, (STATS_TIMER)t, 50));
+		fprintf(f, "%s.p99_ns %lu\n", name, stats_percentile(total, (STATS_TIMER)t, 99));
+	}
+	for (int i = 0; i < KB_INTENTS; i++) {
+		fprintf(f, "kb.%s.hits %lu\n", knowledge_intent_name((INTENT)i), total->hits[i]);
+		fprintf(f, "kb.%s.misses %lu\n", knowledge_intent_name((INTENT)i), total->misses[i]);
+	}
+	fprintf(f, "kb.entries %lu\n", entries);
+	fprintf(f, "kb.bytes %lu\n", bytes);
+	fprintf(f, "cache.hits %lu\n", total->cache_hits);
+	fprintf(f, "cache.misses %lu\n", total->cache_misses);
+	fprintf(f, "cache.entries %lu\n", cached);
+	fprintf(f, "cache.bytes %lu\n", cache_bytes);
+	fprintf(f, "search.terms %lu\n", terms);
+	fprintf(f, "search.bytes %lu\n", search_bytes);
+	fprintf(f, "trie.nodes %lu\n", nodes);
+	fprintf(f, "trie.bytes %lu\n", trie_bytes);
+	fprintf(f, "journal.records %lu\n", records);
+	fprintf(f, "journal.syncs %lu\n", syncs);
+	fprintf(f, "journal.bytes %lu\n", journal_bytes);
+	fprintf(f, "journal.compactions %lu\n\n", compactions);
+	fflush(f);
+	free(total);
+}
+
+/* where and how often stats_dump() writes */
+static FILE *stats_file;
+static unsigned stats_interval;
+
+/*
+ * Write the statistics every stats_interval seconds, for ever.
+ */
+static void *stats_dump(void *arg)
+{
+	struct timespec interval = {(time_t)stats_interval, 0};
+	for (;;) {
+		nanosleep(&interval, NULL);
+		stats_write(stats_file);
+	}
+	return arg;
+}
+
+/*
+ * Start writing the statistics to a file periodically, from a thread of its
+ * own. May be called once.
+ *
+ * Input:
+ *   f       - the file
+ *   seconds - the interval between writes
+ *
+ * Returns: 0 if successful, 1 if the thread could not be started
+ */
+int stats_start(FILE *f, unsigned seconds)
+{
+	pthread_t thread;
+	stats_file = f;
+	stats_interval = seconds > 0 ? seconds : 1;
+	stats_now();
+	if (pthread_create(&thread, NULL, stats_dump, NULL) != 0)
+		return 1;
+	pthread_detach(thread);
+	return 0;
+}
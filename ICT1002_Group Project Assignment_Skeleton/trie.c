@@ -0,0 +1,371 @@
+/*
+ * ICT1002 (C Language) Group Project.
+ *
+ * This file implements the prefix index that completes entities, so that a
+ * front end can offer "ICT1001" to "ICT1005" as the user types "what is
+ * ICT10", and list everything under a prefix.
+ *
+ * Each intent has a radix trie of its entities, folded to lower case: every
+ * edge is labelled with a string rather than a single character, and a node
+ * that neither ends an entity nor branches is merged into its child. The
+ * children of a node are kept in order of their first character, so
+ * trie_complete() lists completions in alphabetical order by walking the
+ * subtree under the prefix; since every node it passes either ends an entity
+ * or branches, that takes time proportional to the length of the prefix plus
+ * the number of completions.
+ *
+ * The children are also found by hashing the parent and the first character
+ * of the label, so that finding the way down a node with many children takes
+ * one probe rather than a walk along its siblings.
+ *
+ * Nodes refer to each other by index and their labels are slices of the
+ * entities, which are copied once into the trie's text; splitting an edge
+ * only changes lengths and offsets. A node ends in the position of its
+ * entity in the intent, which never changes, so the trie only grows as
+ * entities are added, and is emptied with trie_reset(). Like the fuzzy index,
+ * it does not follow every insert: the knowledge base brings it up to date
+ * with trie_update(), a chunk of positions at a time, in the background and
+ * before completing. A read-write lock lets any number of
+ * threads complete at once.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include "chat1002.h"
+
+/* a node of a trie, and the edge leading to it */
+typedef struct trie_node {
+	uint32_t label;              /* the offset of the edge's label in the trie's text */
+	uint32_t child;              /* the first child, or 0 if there is none */
+	uint32_t sibling;            /* the next child of the same parent, or 0 if there is none */
+	uint32_t value;              /* 1 + the position of the entity ending here, or 0 */
+	uint8_t len;                 /* the length of the label */
+	uint8_t first;               /* the first character of the label, which orders the siblings */
+} TRIE_NODE;
+
+/* an entry of the hash table of children */
+typedef struct trie_edge {
+	uint32_t parent;
+	uint32_t child;              /* 0 if the entry is empty */
+} TRIE_EDGE;
+
+/* the trie of one intent; node 0 is the root, which is never anyone's child */
+typedef struct trie {
+	TRIE_NODE *nodes;
+	uint32_t count;
+	uint32_t size;
+	TRIE_EDGE *edges;            /* a power of two, at least twice count */
+	uint32_t nedges;
+	char *text;
+	size_t used;
+	size_t text_size;
+	unsigned long indexed;       /* the number of positions in the trie */
+} TRIE;
+
+static TRIE trie_intents[KB_INTENTS];
+static pthread_rwlock_t trie_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+/*
+ * Find the child of a node whose label starts with a character in the hash
+ * table of children.
+ *
+ * Returns: the entry holding the child, or the empty entry it would go in
+ */
+static TRIE_EDGE *trie_edge(const TRIE *trie, uint32_t parent, uint8_t first)
+{
+	uint32_t mask = trie->nedges - 1;
+	for (uint32_t e = ((parent * 0x9E3779B1U) ^ (first * 0x85EBCA6BU)) * 0xC2B2AE35U >> 8 & mask;; e = (e + 1) & mask) {
+		TRIE_EDGE *edge = &trie->edges[e];
+		if (edge->child == 0 || (edge->parent == parent && trie->nodes[edge->child].first == first))
+			return edge;
+	}
+}
+
+/*
+ * Make sure a trie has room for two more nodes and len more characters of
+ * text, creating the root if it has none.
+ *
+ * Returns: KB_OK, or KB_NOMEM if the trie could not grow
+ */
+static int trie_reserve(TRIE *trie, size_t len)
+{
+	if (trie->count + 2 > trie->size) {
+		uint32_t size = trie->size == 0 ? 64 : trie->size * 2;
+		TRIE_NODE *nodes = (TRIE_NODE *)realloc(trie->nodes, size * sizeof(TRIE_NODE));
+		if (nodes == NULL)
+			return KB_NOMEM;
+		trie->nodes = nodes;
+		trie->size = size;
+	}
+	if (2 * (trie->count + 2) > trie->nedges) {
+		TRIE_EDGE *old = trie->edges;
+		uint32_t nold = trie->nedges;
+		uint32_t nedges = nold == 0 ? 128 : nold * 2;
+		TRIE_EDGE *edges = (TRIE_EDGE *)calloc(nedges, sizeof(TRIE_EDGE));
+		if (edges == NULL)
+			return KB_NOMEM;
+		trie->edges = edges;
+		trie->nedges = nedges;
+		for (uint32_t e = 0; e < nold; e++) {
+			if (old[e].child != 0)
+				*trie_edge(trie, old[e].parent, trie->nodes[old[e].child].first) = old[e];
+		}
+		free(old);
+	}
+	if (trie->used + len > trie->text_size) {
+		size_t size = trie->text_size == 0 ? 4096 : trie->text_size * 2;
+		while (trie->used + len > size)
+			size *= 2;
+		if (size > UINT32_MAX)
+			return KB_NOMEM;
+		char *text = (char *)realloc(trie->text, size);
+		if (text == NULL)
+			return KB_NOMEM;
+		trie->text = text;
+		trie->text_size = size;
+	}
+	if (trie->count == 0) {
+		memset(&trie->nodes[0], 0, sizeof(TRIE_NODE));
+		trie->count = 1;
+	}
+	return KB_OK;
+}
+
+/*
+ * Add a new node for the rest of an entity, under a parent, in order among
+ * its siblings. trie_reserve() must have made room for it.
+ *
+ * Returns: the new node
+ */
+static uint32_t trie_leaf(TRIE *trie, uint32_t parent, const char *rest, size_t len, uint32_t value)
+{
+	uint32_t leaf = trie->count++;
+	TRIE_NODE *node = &trie->nodes[leaf];
+	node->label = (uint32_t)trie->used;
+	node->len = (uint8_t)len;
+	node->first = (uint8_t)rest[0];
+	node->child = 0;
+	node->value = value;
+	memcpy(trie->text + trie->used, rest, len);
+	trie->used += len;
+	TRIE_EDGE *edge = trie_edge(trie, parent, node->first);
+	edge->parent = parent;
+	edge->child = leaf;
+
+	uint32_t *link = &trie->nodes[parent].child;
+	while (*link != 0 && trie->nodes[*link].first < node->first)
+		link = &trie->nodes[*link].sibling;
+	node->sibling = *link;
+	*link = leaf;
+	return leaf;
+}
+
+/*
+ * Add a new entity to a trie. The caller must hold the write lock.
+ *
+ * Input:
+ *   key - the entity, folded by fold_hash()
+ *   len - the length of the entity
+ *   pos - the position of the entity in the intent
+ *
+ * Returns: KB_OK, or KB_NOMEM if the trie could not grow
+ */
+static int trie_insert(TRIE *trie, const char *key, size_t len, uint32_t pos)
+{
+	if (trie_reserve(trie, len) != KB_OK)
+		return KB_NOMEM;
+
+	uint32_t at = 0;
+	size_t i = 0;
+	for (;;) {
+		if (i == len) {
+			trie->nodes[at].value = pos + 1;
+			break;
+		}
+
+		/* the child whose label starts with the next character, if any */
+		TRIE_EDGE *edge = trie_edge(trie, at, (uint8_t)key[i]);
+		if (edge->child == 0) {
+			trie_leaf(trie, at, key + i, len - i, pos + 1);
+			break;
+		}
+		uint32_t next = edge->child;
+		TRIE_NODE *node = &trie->nodes[next];
+		const char *label = trie->text + node->label;
+		size_t same = 1;
+		while (same < node->len && i + same < len && label[same] == key[i + same])
+			same++;
+		if (same == node->len) {
+			at = next;
+			i += same;
+			continue;
+		}
+
+		/* the entity leaves the label part of the way along: split the edge there */
+		uint32_t *link = &trie->nodes[at].child;
+		while (*link != next)
+			link = &trie->nodes[*link].sibling;
+		uint32_t split = trie->count++;
+		TRIE_NODE *middle = &trie->nodes[split];
+		middle->label = node->label;
+		middle->len = (uint8_t)same;
+		middle->first = node->first;
+		middle->child = next;
+		middle->sibling = node->sibling;
+		middle->value = 0;
+		node->label += (uint32_t)same;
+		node->len -= (uint8_t)same;
+		node->first = (uint8_t)trie->text[node->label];
+		node->sibling = 0;
+		*link = split;
+		edge->child = split;
+		edge = trie_edge(trie, split, node->first);
+		edge->parent = split;
+		edge->child = next;
+		i += same;
+		if (i == len)
+			middle->value = pos + 1;
+		else
+			trie_leaf(trie, split, key + i, len - i, pos + 1);
+		break;
+	}
+	return KB_OK;
+}
+
+/*
+ * Get the number of positions of an intent that are in its trie.
+ */
+unsigned long trie_indexed(INTENT intent)
+{
+	return __atomic_load_n(&trie_intents[intent].indexed, __ATOMIC_ACQUIRE);
+}
+
+/*
+ * Bring the trie of an intent up to date. The caller must hold every lock of
+ * the knowledge base, so that the entities cannot change meanwhile.
+ *
+ * Input:
+ *   intent - the intent
+ *   count  - the position to index up to (but not including)
+ *   key_of - gets the folded entity at a position, and its length
+ *   arg    - passed to key_of
+ *
+ * Returns: KB_OK, or KB_NOMEM if the trie could not grow (it stays as far as
+ *   it got)
+ */
+int trie_update(INTENT intent, unsigned long count, const char *(*key_of)(void *arg, unsigned long pos, size_t *len), void *arg)
+{
+	TRIE *trie = &trie_intents[intent];
+	int result = KB_OK;
+	pthread_rwlock_wrlock(&trie_lock);
+	unsigned long pos = trie->indexed;
+	for (; pos < count; pos++) {
+		size_t len;
+		const char *key = key_of(arg, pos, &len);
+		if (trie_insert(trie, key, len, (uint32_t)pos) != KB_OK) {
+			result = KB_NOMEM;
+			break;
+		}
+	}
+	__atomic_store_n(&trie->indexed, pos, __ATOMIC_RELEASE);
+	pthread_rwlock_unlock(&trie_lock);
+	return result;
+}
+
+/*
+ * Empty the tries, before the knowledge base is reset.
+ */
+void trie_reset()
+{
+	pthread_rwlock_wrlock(&trie_lock);
+	for (int i = 0; i < KB_INTENTS; i++) {
+		free(trie_intents[i].nodes);
+		free(trie_intents[i].edges);
+		free(trie_intents[i].text);
+		memset(&trie_intents[i], 0, sizeof(TRIE));
+	}
+	pthread_rwlock_unlock(&trie_lock);
+}
+
+/*
+ * Measure the memory held by the tries.
+ *
+ * Output:
+ *   nodes - the number of nodes
+ *   bytes - the number of bytes allocated for them and their labels
+ */
+void trie_usage(unsigned long *nodes, unsigned long *bytes)
+{
+	*nodes = 0;
+	*bytes = 0;
+	pthread_rwlock_rdlock(&trie_lock);
+	for (int i = 0; i < KB_INTENTS; i++) {
+		*nodes += trie_intents[i].count;
+		*bytes += trie_intents[i].size * sizeof(TRIE_NODE) + trie_intents[i].nedges * sizeof(TRIE_EDGE) + trie_intents[i].text_size;
+	}
+	pthread_rwlock_unlock(&trie_lock);
+}
+
+/*
+ * Find the entities of an intent that start with a prefix, in alphabetical
+ * order of their folded form.
+ *
+ * Input:
+ *   intent - the intent
+ *   prefix - the prefix, folded by fold_hash()
+ *   len    - the length of the prefix
+ *   k      - the most entities to find
+ *
+ * Output:
+ *   positions - receives the positions of the entities; k long
+ *
+ * Returns: the number of entities found
+ */
+int trie_complete(INTENT intent, const char *prefix, size_t len, uint32_t positions[], int k)
+{
+	const TRIE *trie = &trie_intents[intent];
+	int found = 0;
+	pthread_rwlock_rdlock(&trie_lock);
+	if (trie->count == 0 || k <= 0) {
+		pthread_rwlock_unlock(&trie_lock);
+		return 0;
+	}
+
+	/* the node at or below the end of the prefix */
+	uint32_t at = 0;
+	size_t i = 0;
+	while (i < len) {
+		uint32_t next = trie_edge(trie, at, (uint8_t)prefix[i])->child;
+		if (next == 0)
+			break;
+		const TRIE_NODE *node = &trie->nodes[next];
+		size_t same = 1;
+		while (same < node->len && i + same < len && trie->text[node->label + same] == prefix[i + same])
+			same++;
+		if (same < node->len && i + same < len)
+			break;
+		at = next;
+		i += same;
+	}
+
+	/* the subtree in order: each node's entity, then its children's subtrees, first child first */
+	if (i == len) {
+		uint32_t stack[MAX_ENTITY + 2];
+		int depth = 0;
+		stack[depth++] = at;
+		while (depth > 0 && found < k) {
+			const TRIE_NODE *node = &trie->nodes[stack[--depth]];
+			if (node->value != 0)
+				positions[found++] = node->value - 1;
+			if (node != &trie->nodes[at] && node->sibling != 0)
+				stack[depth++] = node->sibling;
+			if (node->child != 0)
+				stack[depth++] = node->child;
+		}
+	}
+	pthread_rwlock_unlock(&trie_lock);
+	return found;
+}